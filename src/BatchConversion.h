@@ -0,0 +1,137 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <boost/sort/sort.hpp>
+#include <omp.h>
+
+#include "EventToMDEventConversion.h"
+#include "MDBox.h"
+#include "MDEvent.h"
+#include "Merge.h"
+#include "TofEvent.h"
+
+#pragma once
+
+/**
+ * A run of an angular scan: its event data and the goniometer rotation of the
+ * sample during the run.
+ */
+struct BatchRun {
+  std::string filename;
+  Eigen::Matrix3f goniometer;
+};
+
+/**
+ * Converts a batch of runs measured on the same instrument (e.g. an angular
+ * scan) into a single sorted curve and builds its box structure.
+ *
+ * The per spectrum parameters are taken from a single conversion plan (created
+ * with the UB matrix shared by all runs), the plan of each run is obtained by
+ * applying the run's goniometer rotation to it (see rotate_conversion_plan()),
+ * so each run is converted using goniometer * UB.
+ *
+ * Up to maxConcurrentRuns runs are processed at once, each loaded, converted
+ * and sorted by its own worker with an equal share of the available threads.
+ * Loading is serialised (HDF5 is not thread safe unless built to be), but
+ * overlaps the conversion and sorting of other runs. The sorted curves of all
+ * runs are then combined using a single k-way merge, so each event is written
+ * once rather than once per pairwise merge.
+ *
+ * Peak memory is the converted events of all runs twice (run curves and merged
+ * curve) plus the TOF events of up to maxConcurrentRuns runs.
+ *
+ * @param curve Output curve, replaced with the merged curve of all runs
+ * @param runs Runs to convert
+ * @param loadRun Function loading the TOF events of a run, called as
+ *                loadRun(TofEventList &events, const std::string &filename)
+ * @param plan Conversion plan, created with the UB matrix of the sample
+ * @param space MD space
+ * @param maxConcurrentRuns Maximum number of runs processed at once
+ * @param splitThreshold Number of events at which a box will be split
+ * @param maxDepth Maximum box tree depth (including root box)
+ * @return Root box of the box structure over the merged curve
+ */
+template <typename IntT, typename MortonT, typename LoadFunction>
+MDBox<3, IntT, MortonT> convert_runs(
+    typename MDEvent<3, IntT, MortonT>::ZCurve &curve,
+    const std::vector<BatchRun> &runs, LoadFunction loadRun,
+    const ConversionPlan &plan, const MDSpaceBounds<3> &space,
+    const size_t maxConcurrentRuns, const size_t splitThreshold,
+    const size_t maxDepth) {
+  using Event = MDEvent<3, IntT, MortonT>;
+
+  const size_t workerCount =
+      std::max<size_t>(std::min(maxConcurrentRuns, runs.size()), 1);
+  const size_t threadsPerWorker =
+      std::max<size_t>(omp_get_max_threads() / workerCount, 1);
+
+  std::vector<typename Event::ZCurve> runCurves(runs.size());
+
+  std::atomic<size_t> nextRun(0);
+  std::mutex loadMutex;
+
+  auto worker = [&]() {
+    omp_set_num_threads(threadsPerWorker);
+
+    try {
+      for (size_t i = nextRun++; i < runs.size(); i = nextRun++) {
+        TofEventList tofEvents;
+        {
+          std::lock_guard<std::mutex> lock(loadMutex);
+          loadRun(tofEvents, runs[i].filename);
+        }
+
+        const auto runPlan = rotate_conversion_plan(plan, runs[i].goniometer);
+        convert_events(runCurves[i], tofEvents, runPlan, space);
+        TofEventList().swap(tofEvents);
+
+        boost::sort::block_indirect_sort(runCurves[i].begin(),
+                                         runCurves[i].end(), threadsPerWorker);
+      }
+    } catch (...) {
+      /* Stop other workers from starting further runs */
+      nextRun = runs.size();
+      throw;
+    }
+  };
+
+  std::vector<std::future<void>> workers;
+  for (size_t i = 0; i < workerCount; i++) {
+    workers.push_back(std::async(std::launch::async, worker));
+  }
+  for (auto &w : workers) {
+    w.get();
+  }
+
+  /* Merge all runs at once */
+  curve.clear();
+  merge_event_curves_k<Event>(curve, runCurves);
+  std::vector<typename Event::ZCurve>().swap(runCurves);
+
+  MDBox<3, IntT, MortonT> rootBox(curve.cbegin(), curve.cend());
+  rootBox.distributeEvents(splitThreshold, maxDepth);
+  return rootBox;
+}
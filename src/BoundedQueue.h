@@ -0,0 +1,129 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#pragma once
+
+/**
+ * @class BoundedQueue
+ *
+ * Thread safe FIFO queue holding at most a fixed number of items, used to
+ * connect the stages of a pipeline running on separate threads.
+ *
+ * push() blocks while the queue is full and pop() blocks while it is empty, so
+ * a fast producer can never get more than the queue capacity ahead of its
+ * consumer. Closing the queue wakes all waiting threads: no further items are
+ * accepted, items already queued can still be popped.
+ */
+template <typename T> class BoundedQueue {
+public:
+  /**
+   * @param capacity Maximum number of queued items (at least one)
+   */
+  BoundedQueue(const size_t capacity)
+      : m_capacity(capacity > 0 ? capacity : 1), m_closed(false) {}
+
+  /**
+   * Adds an item, waiting until there is space in the queue.
+   *
+   * @param item Item to add
+   * @return False if the queue was closed (the item is discarded)
+   */
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notFull.wait(
+        lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+    if (m_closed) {
+      return false;
+    }
+
+    m_items.push_back(std::move(item));
+    m_notEmpty.notify_one();
+    return true;
+  }
+
+  /**
+   * Removes the oldest item, waiting until one is available.
+   *
+   * @param item Storage for the removed item
+   * @return False if the queue is closed and empty
+   */
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+    if (m_items.empty()) {
+      return false;
+    }
+
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    m_notFull.notify_one();
+    return true;
+  }
+
+  /**
+   * Removes the oldest item, waiting until one is available or a deadline
+   * passes.
+   *
+   * @param item Storage for the removed item
+   * @param deadline Time at which to stop waiting
+   * @return False if no item was removed (the deadline passed, or the queue is
+   *         closed and empty)
+   */
+  template <typename Clock, typename Duration>
+  bool pop_until(T &item,
+                 const std::chrono::time_point<Clock, Duration> &deadline) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notEmpty.wait_until(lock, deadline,
+                          [this]() { return m_closed || !m_items.empty(); });
+    if (m_items.empty()) {
+      return false;
+    }
+
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    m_notFull.notify_one();
+    return true;
+  }
+
+  /**
+   * Stops accepting items and wakes all waiting threads.
+   */
+  void close() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_notFull.notify_all();
+    m_notEmpty.notify_all();
+  }
+
+  size_t capacity() const { return m_capacity; }
+
+private:
+  const size_t m_capacity;
+
+  std::mutex m_mutex;
+  std::condition_variable m_notFull;
+  std::condition_variable m_notEmpty;
+
+  std::deque<T> m_items;
+  bool m_closed;
+};
@@ -0,0 +1,228 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/sort/sort.hpp>
+#include <omp.h>
+
+#pragma once
+
+/**
+ * Generates a mask that truncates the given number of least significant bits
+ * of each axis of a Morton number.
+ *
+ * As bits are interleaved, this is equivalent to truncating the ND * bits least
+ * significant bits of the Morton number. Truncation preserves the ordering of a
+ * sorted curve.
+ *
+ * @param bitsPerAxis Number of bits to truncate per axis, at most the number
+ *                    of bits of the integer coordinates
+ * @return Mask to be applied to Morton numbers
+ */
+template <size_t ND, typename IntT, typename MortonT>
+MortonT morton_truncation_mask(const size_t bitsPerAxis) {
+  const size_t intBits = std::numeric_limits<IntT>::digits;
+  if (bitsPerAxis > intBits) {
+    throw std::runtime_error("Cannot truncate more bits per axis than the " +
+                             std::to_string(intBits) +
+                             " of the integer coordinates");
+  }
+
+  if (bitsPerAxis == 0) {
+    return ~MortonT(0);
+  }
+
+  /* Interleaved coordinates may fill MortonT, in which case truncating every
+   * bit leaves nothing (and shifting by the full width is undefined) */
+  if (ND * bitsPerAxis >= std::numeric_limits<MortonT>::digits) {
+    return MortonT(0);
+  }
+
+  return ~((MortonT(1) << (ND * bitsPerAxis)) - 1);
+}
+
+/**
+ * Collapses events with equal (masked) Morton numbers in a sorted range of
+ * events into a single event, summing signal and error squared.
+ *
+ * Collapsed events are written from the start of the range.
+ *
+ * @param begin Start of range
+ * @param end End of range
+ * @param mask Mask applied to Morton numbers before comparison
+ * @return End of the collapsed events
+ */
+template <typename EventT, typename Iterator, typename MortonT>
+Iterator compact_event_range(Iterator begin, Iterator end,
+                             const MortonT mask) {
+  if (begin == end) {
+    return end;
+  }
+
+  auto outIt = begin;
+
+  MortonT key = begin->mortonNumber() & mask;
+  float signal = begin->signal();
+  float errorSquared = begin->errorSquared();
+
+  for (auto it = begin + 1; it != end; ++it) {
+    const MortonT eventKey = it->mortonNumber() & mask;
+    if (eventKey == key) {
+      signal += it->signal();
+      errorSquared += it->errorSquared();
+    } else {
+      /* Output never overtakes input, so this does not overwrite unread
+       * events */
+      *(outIt++) = EventT(key, signal, errorSquared);
+
+      key = eventKey;
+      signal = it->signal();
+      errorSquared = it->errorSquared();
+    }
+  }
+  *(outIt++) = EventT(key, signal, errorSquared);
+
+  return outIt;
+}
+
+/**
+ * Collapses events with equal Morton numbers in a sorted curve into a single
+ * event, summing signal and error squared.
+ *
+ * The curve is split into one partition per thread (with partitions starting
+ * on a change of Morton number), each partition is compacted in parallel and
+ * the partitions then moved together.
+ *
+ * A lossy compaction may be performed by providing a mask from
+ * morton_truncation_mask(), in which case Morton numbers of the resulting
+ * events are also truncated.
+ *
+ * @param curve Sorted curve
+ * @param mask Mask applied to Morton numbers before comparison
+ * @param numThreads Number of threads (and partitions) to use
+ */
+template <typename EventT>
+void compact_event_curve(
+    typename EventT::ZCurve &curve,
+    const decltype(std::declval<EventT>().mortonNumber()) mask =
+        ~decltype(std::declval<EventT>().mortonNumber())(0),
+    const size_t numThreads = omp_get_max_threads()) {
+  const size_t numPartitions = std::max<size_t>(numThreads, 1);
+
+  /* Find partition boundaries, moving each boundary forward so that events
+   * with equal keys are not split between partitions */
+  std::vector<size_t> starts(numPartitions + 1, curve.size());
+  starts[0] = 0;
+  for (size_t p = 1; p < numPartitions; p++) {
+    size_t start = std::max(starts[p - 1], curve.size() * p / numPartitions);
+    while (start > 0 && start < curve.size() &&
+           (curve[start].mortonNumber() & mask) ==
+               (curve[start - 1].mortonNumber() & mask)) {
+      start++;
+    }
+    starts[p] = start;
+  }
+
+  /* Compact each partition */
+  std::vector<size_t> ends(numPartitions);
+#pragma omp parallel for num_threads(numThreads)
+  for (size_t p = 0; p < numPartitions; p++) {
+    const auto begin = curve.begin() + starts[p];
+    const auto end = compact_event_range<EventT>(
+        begin, curve.begin() + starts[p + 1], mask);
+    ends[p] = std::distance(curve.begin(), end);
+  }
+
+  /* Move partitions together */
+  auto outIt = curve.begin() + ends[0];
+  for (size_t p = 1; p < numPartitions; p++) {
+    outIt = std::move(curve.begin() + starts[p], curve.begin() + ends[p],
+                      outIt);
+  }
+
+  curve.resize(std::distance(curve.begin(), outIt));
+}
+
+/**
+ * Sorts a curve and collapses events with equal Morton numbers.
+ *
+ * The parallel sort does not expose its final pass, so compaction is performed
+ * as a parallel pass directly after sorting.
+ *
+ * @see compact_event_curve
+ *
+ * @param curve Curve to sort and compact
+ * @param mask Mask applied to Morton numbers before comparison
+ */
+template <typename EventT>
+void sort_and_compact_event_curve(
+    typename EventT::ZCurve &curve,
+    const decltype(std::declval<EventT>().mortonNumber()) mask =
+        ~decltype(std::declval<EventT>().mortonNumber())(0)) {
+  boost::sort::block_indirect_sort(curve.begin(), curve.end());
+  compact_event_curve<EventT>(curve, mask);
+}
+
+/**
+ * Merges two curves, collapsing events with equal Morton numbers as they are
+ * written to the output curve.
+ *
+ * @see compact_event_curve
+ *
+ * @param curve Output curve
+ * @param a First curve
+ * @param b Second curve
+ * @param mask Mask applied to Morton numbers before comparison
+ */
+template <typename EventT>
+void merge_event_curves_compacted(
+    typename EventT::ZCurve &curve, const typename EventT::ZCurve &a,
+    const typename EventT::ZCurve &b,
+    const decltype(std::declval<EventT>().mortonNumber()) mask =
+        ~decltype(std::declval<EventT>().mortonNumber())(0)) {
+  curve.reserve(curve.size() + a.size() + b.size());
+
+  const auto append = [&curve, mask](const EventT &event) {
+    const auto key = event.mortonNumber() & mask;
+    if (!curve.empty() && curve.back().mortonNumber() == key) {
+      const auto &last = curve.back();
+      curve.back() = EventT(key, last.signal() + event.signal(),
+                            last.errorSquared() + event.errorSquared());
+    } else {
+      curve.emplace_back(key, event.signal(), event.errorSquared());
+    }
+  };
+
+  auto aIt = a.cbegin();
+  auto bIt = b.cbegin();
+  while (aIt != a.cend() && bIt != b.cend()) {
+    if (*bIt < *aIt) {
+      append(*(bIt++));
+    } else {
+      append(*(aIt++));
+    }
+  }
+  std::for_each(aIt, a.cend(), append);
+  std::for_each(bIt, b.cend(), append);
+}
@@ -32,6 +32,15 @@ static constexpr double h_bar = h / (2 * M_PI);
  * <http://physics.nist.gov/cuu/Constants> on 30/10/2007. */
 static constexpr double NeutronMass = 1.674927211e-27;
 
+/** 1 meV in J. Taken from <http://physics.nist.gov/cuu/Constants> on
+ * 28/07/2008. */
+static constexpr double meV = 1.602176487e-22;
+
+/** Energy (in meV) of a neutron with a wavenumber of 1 Angstrom^-1, i.e.
+ * E = WavenumberSquaredToEnergy * k^2. */
+static constexpr double WavenumberSquaredToEnergy =
+    h_bar * h_bar * 1e20 / (2.0 * NeutronMass * meV);
+
 template <size_t ND, typename IntT, typename MortonT> class MortonMask {
 public:
   const static MortonT mask[];
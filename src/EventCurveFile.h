@@ -0,0 +1,355 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "MDEvent.h"
+
+#pragma once
+
+/**
+ * Header of a sorted event curve file.
+ *
+ * Sorted event curve files are a simple block structured format for storing
+ * event curves on disk, used for out of core merging.
+ *
+ * The file consists of this header followed by the events of the curve in
+ * Morton number order, stored in their native in memory representation (i.e.
+ * files are not portable between platforms or builds with a differing event
+ * layout). Events are grouped into blocks of a fixed number of events (the
+ * last block may be shorter), blocks are the unit of reading and writing.
+ */
+struct EventCurveFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t dimensions;
+  uint32_t intSize;
+  uint32_t mortonSize;
+  uint32_t eventSize;
+  uint64_t blockSize;
+  uint64_t eventCount;
+};
+
+constexpr char EventCurveFileMagic[4] = {'M', 'D', 'E', 'C'};
+constexpr uint32_t EventCurveFileVersion = 1;
+
+/**
+ * @class EventCurveFileReader
+ *
+ * Sequential reader for sorted event curve files.
+ *
+ * Blocks are read ahead asynchronously: while the events of one block are
+ * being consumed the next block is read into a second buffer, so at most two
+ * blocks are held in memory.
+ */
+template <size_t ND, typename IntT, typename MortonT>
+class EventCurveFileReader {
+public:
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+  /**
+   * Forward iterator over the events of a file.
+   *
+   * Events must be accessed in order, dereferencing an iterator may cause the
+   * next block of the file to be loaded.
+   */
+  class Iterator {
+  public:
+    Iterator(EventCurveFileReader *reader, size_t index)
+        : m_reader(reader), m_index(index) {}
+
+    const Event &operator*() const { return m_reader->event(m_index); }
+
+    Iterator &operator++() {
+      ++m_index;
+      return *this;
+    }
+
+    bool operator==(const Iterator &other) const {
+      return m_index == other.m_index;
+    }
+    bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+  private:
+    EventCurveFileReader *m_reader;
+    size_t m_index;
+  };
+
+public:
+  EventCurveFileReader(const std::string &filename)
+      : m_file(filename, std::ios::binary), m_frontStart(0),
+        m_nextReadStart(0) {
+    if (!m_file) {
+      throw std::runtime_error("Failed to open event curve file " + filename);
+    }
+
+    /* Read and validate header */
+    m_file.read(reinterpret_cast<char *>(&m_header), sizeof(m_header));
+    if (!m_file ||
+        std::memcmp(m_header.magic, EventCurveFileMagic, 4) != 0 ||
+        m_header.version != EventCurveFileVersion) {
+      throw std::runtime_error("Invalid event curve file " + filename);
+    }
+    if (m_header.dimensions != ND || m_header.intSize != sizeof(IntT) ||
+        m_header.mortonSize != sizeof(MortonT) ||
+        m_header.eventSize != sizeof(Event)) {
+      throw std::runtime_error("Event type mismatch in event curve file " +
+                               filename);
+    }
+
+    /* Load the first block and start reading the second */
+    startRead();
+    advance();
+  }
+
+  ~EventCurveFileReader() {
+    if (m_pending.valid()) {
+      m_pending.wait();
+    }
+  }
+
+  size_t eventCount() const { return m_header.eventCount; }
+  size_t blockSize() const { return m_header.blockSize; }
+
+  Iterator begin() { return Iterator(this, 0); }
+  Iterator end() { return Iterator(this, eventCount()); }
+
+  /**
+   * Gets an event by index.
+   *
+   * Indices must not decrease between calls and may be at most one block
+   * beyond the currently loaded block.
+   */
+  const Event &event(const size_t index) {
+    if (index >= m_frontStart + m_front.size()) {
+      advance();
+    }
+    return m_front[index - m_frontStart];
+  }
+
+private:
+  /**
+   * Starts an asynchronous read of the next block into the back buffer.
+   */
+  void startRead() {
+    if (m_nextReadStart >= eventCount()) {
+      return;
+    }
+
+    const size_t numEvents =
+        std::min<size_t>(blockSize(), eventCount() - m_nextReadStart);
+    m_nextReadStart += numEvents;
+
+    m_pending = std::async(std::launch::async, [this, numEvents]() {
+      m_back.resize(numEvents);
+      m_file.read(reinterpret_cast<char *>(m_back.data()),
+                  numEvents * sizeof(Event));
+      if (!m_file) {
+        throw std::runtime_error("Failed to read event curve file block");
+      }
+    });
+  }
+
+  /**
+   * Makes the block in the back buffer current and starts reading the next.
+   */
+  void advance() {
+    if (!m_pending.valid()) {
+      return;
+    }
+
+    m_pending.get();
+    m_frontStart += m_front.size();
+    std::swap(m_front, m_back);
+    startRead();
+  }
+
+private:
+  std::ifstream m_file;
+  EventCurveFileHeader m_header;
+
+  /* Block currently being consumed and index of its first event */
+  typename Event::ZCurve m_front;
+  size_t m_frontStart;
+
+  /* Block being read ahead and index of the first event it will hold */
+  typename Event::ZCurve m_back;
+  size_t m_nextReadStart;
+  std::future<void> m_pending;
+};
+
+/**
+ * @class EventCurveFileWriter
+ *
+ * Sequential writer for sorted event curve files.
+ *
+ * Events are collected into blocks, full blocks are written asynchronously
+ * while the next block is filled, so at most two blocks are held in memory.
+ * close() must be called to complete the file.
+ */
+template <size_t ND, typename IntT, typename MortonT>
+class EventCurveFileWriter {
+public:
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+public:
+  EventCurveFileWriter(const std::string &filename, const size_t blockSize)
+      : m_file(filename, std::ios::binary | std::ios::trunc),
+        m_blockSize(blockSize), m_eventCount(0) {
+    if (m_blockSize == 0) {
+      throw std::runtime_error("Event curve file block size must be non-zero");
+    }
+    if (!m_file) {
+      throw std::runtime_error("Failed to create event curve file " +
+                               filename);
+    }
+
+    /* Write placeholder header, completed on close */
+    writeHeader();
+
+    m_front.reserve(m_blockSize);
+    m_back.reserve(m_blockSize);
+  }
+
+  ~EventCurveFileWriter() {
+    if (m_pending.valid()) {
+      m_pending.wait();
+    }
+  }
+
+  /**
+   * Appends an event, events must be written in Morton number order.
+   */
+  void write(const Event &event) {
+    m_front.push_back(event);
+    if (m_front.size() == m_blockSize) {
+      flush();
+    }
+  }
+
+  /**
+   * Writes any remaining events and completes the file header.
+   */
+  void close() {
+    flush();
+    if (m_pending.valid()) {
+      m_pending.get();
+    }
+
+    m_file.seekp(0);
+    writeHeader();
+    m_file.close();
+  }
+
+  size_t eventCount() const { return m_eventCount + m_front.size(); }
+
+private:
+  void writeHeader() {
+    EventCurveFileHeader header;
+    std::memcpy(header.magic, EventCurveFileMagic, 4);
+    header.version = EventCurveFileVersion;
+    header.dimensions = ND;
+    header.intSize = sizeof(IntT);
+    header.mortonSize = sizeof(MortonT);
+    header.eventSize = sizeof(Event);
+    header.blockSize = m_blockSize;
+    header.eventCount = m_eventCount;
+
+    m_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+
+  /**
+   * Starts an asynchronous write of the current block.
+   */
+  void flush() {
+    if (m_front.empty()) {
+      return;
+    }
+
+    /* Wait for the previous block to be written before reusing its buffer */
+    if (m_pending.valid()) {
+      m_pending.get();
+    }
+
+    m_eventCount += m_front.size();
+    std::swap(m_front, m_back);
+    m_front.clear();
+
+    m_pending = std::async(std::launch::async, [this]() {
+      m_file.write(reinterpret_cast<const char *>(m_back.data()),
+                   m_back.size() * sizeof(Event));
+      if (!m_file) {
+        throw std::runtime_error("Failed to write event curve file block");
+      }
+    });
+  }
+
+private:
+  std::ofstream m_file;
+  const size_t m_blockSize;
+
+  /* Number of events written or being written */
+  size_t m_eventCount;
+
+  /* Block currently being filled */
+  typename Event::ZCurve m_front;
+
+  /* Block being written */
+  typename Event::ZCurve m_back;
+  std::future<void> m_pending;
+};
+
+/**
+ * Writes an event curve held in memory to a sorted event curve file.
+ *
+ * @param filename Output filename
+ * @param curve Sorted event curve
+ * @param blockSize Number of events per block
+ */
+template <size_t ND, typename IntT, typename MortonT>
+void write_event_curve_file(
+    const std::string &filename,
+    const typename MDEvent<ND, IntT, MortonT>::ZCurve &curve,
+    const size_t blockSize) {
+  EventCurveFileWriter<ND, IntT, MortonT> writer(filename, blockSize);
+  for (const auto &event : curve) {
+    writer.write(event);
+  }
+  writer.close();
+}
+
+/**
+ * Reads a sorted event curve file into memory.
+ *
+ * @param filename Input filename
+ * @param curve Output event curve
+ */
+template <size_t ND, typename IntT, typename MortonT>
+void read_event_curve_file(const std::string &filename,
+                           typename MDEvent<ND, IntT, MortonT>::ZCurve &curve) {
+  EventCurveFileReader<ND, IntT, MortonT> reader(filename);
+  curve.reserve(curve.size() + reader.eventCount());
+  for (auto it = reader.begin(); it != reader.end(); ++it) {
+    curve.push_back(*it);
+  }
+}
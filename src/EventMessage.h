@@ -0,0 +1,236 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "TofEvent.h"
+
+#pragma once
+
+/**
+ * Events of a single neutron pulse, carrying the fields of an ev42 event
+ * message as published by the ESS event formation units.
+ */
+struct EventMessage {
+  /* Name of the publishing data source */
+  std::string source_name;
+
+  /* Sequence number of the message within the stream */
+  uint64_t message_id;
+
+  /* Time of the pulse in ns */
+  uint64_t pulse_time;
+
+  /* Time of flight of each event in ns, relative to the pulse time */
+  std::vector<uint32_t> time_of_flight;
+
+  /* Detector (or, for ISIS data, spectrum) number of each event */
+  std::vector<uint32_t> detector_id;
+};
+
+/* Identifier at the start of each serialised message */
+constexpr char EventMessageIdentifier[] = "ev42";
+constexpr size_t EventMessageIdentifierSize = 4;
+
+/* Size of the length prefix of each framed message */
+constexpr size_t EventMessageLengthSize = sizeof(uint32_t);
+
+/* Largest accepted message, anything beyond is taken to be a corrupt stream */
+constexpr size_t EventMessageMaxSize = 1024 * 1024 * 1024;
+
+/**
+ * Appends the bytes of a field to a serialised message.
+ */
+template <typename T>
+void append_message_field(std::vector<char> &buffer, const T &value) {
+  const auto bytes = reinterpret_cast<const char *>(&value);
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+void append_message_field(std::vector<char> &buffer,
+                          const std::vector<T> &values) {
+  const auto bytes = reinterpret_cast<const char *>(values.data());
+  buffer.insert(buffer.end(), bytes, bytes + values.size() * sizeof(T));
+}
+
+/**
+ * Reads consecutive fields of a serialised message, checking that each lies
+ * within the message.
+ */
+class MessageFieldReader {
+public:
+  MessageFieldReader(const char *data, const size_t size)
+      : m_data(data), m_size(size), m_offset(0) {}
+
+  template <typename T> T read() {
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  template <typename T> void read(std::vector<T> &values, const size_t count) {
+    const char *field = take(count * sizeof(T));
+    values.resize(count);
+    if (count > 0) {
+      std::memcpy(values.data(), field, count * sizeof(T));
+    }
+  }
+
+  const char *take(const size_t size) {
+    if (size > m_size - m_offset) {
+      throw std::runtime_error("Truncated event message");
+    }
+    const char *field = m_data + m_offset;
+    m_offset += size;
+    return field;
+  }
+
+  size_t remaining() const { return m_size - m_offset; }
+
+private:
+  const char *m_data;
+  const size_t m_size;
+  size_t m_offset;
+};
+
+/**
+ * Serialises an event message, appending it to a buffer with a length prefix
+ * so consecutive messages can be written to a byte stream.
+ *
+ * The layout follows the fields of the ev42 schema, but is a flat record in
+ * host byte order rather than a FlatBuffers table:
+ *  - payload size (uint32, excluding this prefix)
+ *  - identifier "ev42"
+ *  - message ID and pulse time (uint64)
+ *  - source name length (uint32) and characters
+ *  - event count (uint32), times of flight then detector IDs (uint32 each)
+ *
+ * @param buffer Buffer the framed message is appended to
+ * @param message Message to serialise
+ */
+inline void serialize_event_message(std::vector<char> &buffer,
+                                    const EventMessage &message) {
+  const size_t eventCount = message.time_of_flight.size();
+  if (message.detector_id.size() != eventCount) {
+    throw std::runtime_error("Event message has differing numbers of times "
+                             "of flight and detector IDs");
+  }
+
+  const size_t payloadSize =
+      EventMessageIdentifierSize + 2 * sizeof(uint64_t) + sizeof(uint32_t) +
+      message.source_name.size() + sizeof(uint32_t) +
+      2 * eventCount * sizeof(uint32_t);
+  if (payloadSize > EventMessageMaxSize) {
+    throw std::runtime_error("Event message too large to serialise");
+  }
+
+  buffer.reserve(buffer.size() + EventMessageLengthSize + payloadSize);
+  append_message_field(buffer, static_cast<uint32_t>(payloadSize));
+  buffer.insert(buffer.end(), EventMessageIdentifier,
+                EventMessageIdentifier + EventMessageIdentifierSize);
+  append_message_field(buffer, message.message_id);
+  append_message_field(buffer, message.pulse_time);
+  append_message_field(buffer,
+                       static_cast<uint32_t>(message.source_name.size()));
+  buffer.insert(buffer.end(), message.source_name.cbegin(),
+                message.source_name.cend());
+  append_message_field(buffer, static_cast<uint32_t>(eventCount));
+  append_message_field(buffer, message.time_of_flight);
+  append_message_field(buffer, message.detector_id);
+}
+
+/**
+ * Deserialises the payload of an event message (the bytes following its
+ * length prefix).
+ *
+ * @param message Output message
+ * @param data Start of the payload
+ * @param size Size of the payload in bytes
+ */
+inline void deserialize_event_message(EventMessage &message, const char *data,
+                                      const size_t size) {
+  MessageFieldReader reader(data, size);
+
+  if (std::memcmp(reader.take(EventMessageIdentifierSize),
+                  EventMessageIdentifier, EventMessageIdentifierSize) != 0) {
+    throw std::runtime_error("Not an ev42 event message");
+  }
+
+  message.message_id = reader.read<uint64_t>();
+  message.pulse_time = reader.read<uint64_t>();
+
+  const auto nameLength = reader.read<uint32_t>();
+  const char *name = reader.take(nameLength);
+  message.source_name.assign(name, name + nameLength);
+
+  const auto eventCount = reader.read<uint32_t>();
+  reader.read(message.time_of_flight, eventCount);
+  reader.read(message.detector_id, eventCount);
+
+  if (reader.remaining() != 0) {
+    throw std::runtime_error("Unexpected data after event message");
+  }
+}
+
+/**
+ * Creates an event message from the TOF events of a single pulse.
+ *
+ * @param sourceName Name of the publishing data source
+ * @param messageId Sequence number of the message
+ * @param pulseTime Time of the pulse in ns
+ * @param events TOF events (TOF in us), IDs are used as detector IDs
+ * @return Event message
+ */
+inline EventMessage make_event_message(const std::string &sourceName,
+                                       const uint64_t messageId,
+                                       const uint64_t pulseTime,
+                                       const TofEventList &events) {
+  EventMessage message{sourceName, messageId, pulseTime, {}, {}};
+  message.time_of_flight.resize(events.size());
+  message.detector_id.resize(events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    message.time_of_flight[i] =
+        static_cast<uint32_t>(std::lround(events[i].tof * 1000.0f));
+    message.detector_id[i] = events[i].id;
+  }
+  return message;
+}
+
+/**
+ * Appends the events of a message to a list of TOF events, in the units used
+ * by the NeXus loaders (TOF in us, pulse time in s, unit weight).
+ *
+ * @param events TOF events, events of the message are appended
+ * @param message Event message
+ */
+inline void append_tof_events(TofEventList &events,
+                              const EventMessage &message) {
+  const double pulseTime = message.pulse_time * 1e-9;
+  const size_t offset = events.size();
+  events.resize(offset + message.time_of_flight.size());
+  for (size_t i = 0; i < message.time_of_flight.size(); i++) {
+    events[offset + i] = {message.detector_id[i],
+                          message.time_of_flight[i] * 1e-3f, pulseTime, 1.0f};
+  }
+}
@@ -0,0 +1,320 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "EventMessage.h"
+
+#pragma once
+
+/* Prefix of event stream sources that are TCP publishers */
+const std::string EventStreamTcpPrefix("tcp://");
+
+/**
+ * @class EventMessageReader
+ *
+ * Reads framed event messages (see serialize_event_message()) from a file
+ * descriptor: a replay file, a pipe or a connected socket.
+ */
+class EventMessageReader {
+public:
+  /**
+   * @param fd File descriptor to read from, closed by the reader
+   */
+  explicit EventMessageReader(const int fd) : m_fd(fd) {}
+
+  EventMessageReader(const EventMessageReader &) = delete;
+  EventMessageReader &operator=(const EventMessageReader &) = delete;
+
+  ~EventMessageReader() { ::close(m_fd); }
+
+  /**
+   * Reads the next message, waiting until it has been received in full.
+   *
+   * @param message Output message
+   * @return False if the stream ended (between messages)
+   */
+  bool next(EventMessage &message) {
+    uint32_t size;
+    if (!read(reinterpret_cast<char *>(&size), sizeof(size), true)) {
+      return false;
+    }
+    if (size > EventMessageMaxSize) {
+      throw std::runtime_error("Event message exceeds the maximum size");
+    }
+
+    m_buffer.resize(size);
+    read(m_buffer.data(), size, false);
+    deserialize_event_message(message, m_buffer.data(), size);
+    return true;
+  }
+
+  /**
+   * Stops receiving from a socket, waking a thread blocked in next() (which
+   * then sees the end of the stream). Has no effect on files and pipes.
+   */
+  void cancel() { ::shutdown(m_fd, SHUT_RD); }
+
+private:
+  /**
+   * Reads an exact number of bytes.
+   *
+   * @param data Output buffer
+   * @param size Number of bytes to read
+   * @param allowEnd If the stream may end before the first byte
+   * @return False if the stream ended before the first byte
+   */
+  bool read(char *data, const size_t size, const bool allowEnd) {
+    size_t done(0);
+    while (done < size) {
+      const ssize_t count = ::read(m_fd, data + done, size - done);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count < 0) {
+        throw std::runtime_error(std::string("Failed to read event stream: ") +
+                                 std::strerror(errno));
+      }
+      if (count == 0) {
+        if (done == 0 && allowEnd) {
+          return false;
+        }
+        throw std::runtime_error("Event stream ended within a message");
+      }
+      done += count;
+    }
+    return true;
+  }
+
+  const int m_fd;
+  std::vector<char> m_buffer;
+};
+
+/**
+ * @class EventMessageWriter
+ *
+ * Writes framed event messages to a file descriptor.
+ *
+ * Publishers writing to sockets or pipes should ignore SIGPIPE, so that a
+ * subscriber disconnecting is reported as a failed write.
+ */
+class EventMessageWriter {
+public:
+  /**
+   * @param fd File descriptor to write to, closed by the writer
+   */
+  explicit EventMessageWriter(const int fd) : m_fd(fd) {}
+
+  EventMessageWriter(const EventMessageWriter &) = delete;
+  EventMessageWriter &operator=(const EventMessageWriter &) = delete;
+
+  ~EventMessageWriter() { ::close(m_fd); }
+
+  /**
+   * Writes a message, waiting until it has been written in full.
+   *
+   * @param message Message to write
+   */
+  void write(const EventMessage &message) {
+    m_buffer.clear();
+    serialize_event_message(m_buffer, message);
+
+    size_t done(0);
+    while (done < m_buffer.size()) {
+      const ssize_t count =
+          ::write(m_fd, m_buffer.data() + done, m_buffer.size() - done);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count < 0) {
+        throw std::runtime_error(
+            std::string("Failed to write event stream: ") +
+            std::strerror(errno));
+      }
+      done += count;
+    }
+  }
+
+private:
+  const int m_fd;
+  std::vector<char> m_buffer;
+};
+
+/**
+ * Disables batching of small writes on a TCP socket, so each message is sent
+ * as soon as it is written.
+ */
+inline void set_tcp_no_delay(const int fd) {
+  const int enable(1);
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+/**
+ * Opens an event stream for reading.
+ *
+ * @param source Either tcp://<host>:<port> to connect to a publisher, or the
+ *               name of a replay file
+ * @return Reader for the stream
+ */
+inline std::unique_ptr<EventMessageReader>
+open_event_stream(const std::string &source) {
+  if (source.compare(0, EventStreamTcpPrefix.size(), EventStreamTcpPrefix) !=
+      0) {
+    const int fd = ::open(source.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open event stream " + source);
+    }
+    return std::unique_ptr<EventMessageReader>(new EventMessageReader(fd));
+  }
+
+  const std::string address(source.substr(EventStreamTcpPrefix.size()));
+  const auto separator = address.rfind(':');
+  if (separator == std::string::npos) {
+    throw std::runtime_error("Event stream address requires a port: " +
+                             source);
+  }
+  const std::string host(address.substr(0, separator));
+  const std::string port(address.substr(separator + 1));
+
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo *addresses;
+  if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+    throw std::runtime_error("Failed to resolve event stream " + source);
+  }
+
+  /* Use the first address that accepts a connection */
+  int fd(-1);
+  for (auto a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+    fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  ::freeaddrinfo(addresses);
+
+  if (fd < 0) {
+    throw std::runtime_error("Failed to connect to event stream " + source);
+  }
+  set_tcp_no_delay(fd);
+  return std::unique_ptr<EventMessageReader>(new EventMessageReader(fd));
+}
+
+/**
+ * Creates (or truncates) a replay file for writing.
+ *
+ * @param filename Name of the replay file
+ * @return Writer for the file
+ */
+inline std::unique_ptr<EventMessageWriter>
+create_event_file(const std::string &filename) {
+  const int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create event file " + filename);
+  }
+  return std::unique_ptr<EventMessageWriter>(new EventMessageWriter(fd));
+}
+
+/**
+ * @class EventStreamListener
+ *
+ * TCP port on which an event publisher waits for subscribers, each accepted
+ * subscriber is sent messages through its own writer.
+ */
+class EventStreamListener {
+public:
+  /**
+   * Listens on all local interfaces.
+   *
+   * @param port Port to listen on (0 to choose a free port)
+   */
+  explicit EventStreamListener(const uint16_t port) {
+    m_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (m_fd < 0) {
+      throw std::runtime_error("Failed to create event stream socket");
+    }
+
+    const int enable(1);
+    ::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    socklen_t length(sizeof(address));
+    if (::bind(m_fd, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+        ::listen(m_fd, 1) != 0 ||
+        ::getsockname(m_fd, reinterpret_cast<sockaddr *>(&address),
+                      &length) != 0) {
+      ::close(m_fd);
+      throw std::runtime_error("Failed to listen on port " +
+                               std::to_string(port));
+    }
+    m_port = ntohs(address.sin_port);
+  }
+
+  EventStreamListener(const EventStreamListener &) = delete;
+  EventStreamListener &operator=(const EventStreamListener &) = delete;
+
+  ~EventStreamListener() { ::close(m_fd); }
+
+  /**
+   * @return Port being listened on
+   */
+  uint16_t port() const { return m_port; }
+
+  /**
+   * Waits for a subscriber to connect.
+   *
+   * @return Writer sending messages to the subscriber
+   */
+  std::unique_ptr<EventMessageWriter> accept() {
+    int fd;
+    do {
+      fd = ::accept(m_fd, nullptr, nullptr);
+    } while (fd < 0 && errno == EINTR);
+
+    if (fd < 0) {
+      throw std::runtime_error("Failed to accept event stream subscriber");
+    }
+    set_tcp_no_delay(fd);
+    return std::unique_ptr<EventMessageWriter>(new EventMessageWriter(fd));
+  }
+
+private:
+  int m_fd;
+  uint16_t m_port;
+};
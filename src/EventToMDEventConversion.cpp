@@ -18,15 +18,475 @@
 
 #include "EventToMDEventConversion.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+
 #include <boost/sort/sort.hpp>
 
+constexpr size_t ConversionPlan::NoSpectrum;
+constexpr size_t VectorisedSpectrumConverter::BatchSize;
+
+static const char ConversionPlanMagic[4] = {'M', 'D', 'C', 'P'};
+static const uint32_t ConversionPlanVersion = 3;
+
+template <typename T>
+static void write_binary(std::ofstream &file, const T &value) {
+  file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static void read_binary(std::ifstream &file, T &value) {
+  file.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static void write_binary_vector(std::ofstream &file,
+                                const std::vector<T> &values) {
+  write_binary(file, static_cast<uint64_t>(values.size()));
+  file.write(reinterpret_cast<const char *>(values.data()),
+             values.size() * sizeof(T));
+}
+
+template <typename T>
+static void read_binary_vector(std::ifstream &file, std::vector<T> &values) {
+  uint64_t size;
+  read_binary(file, size);
+  values.resize(size);
+  file.read(reinterpret_cast<char *>(values.data()), size * sizeof(T));
+}
+
+/**
+ * Gets the fixed (final) energy of a spectrum in indirect geometry.
+ *
+ * @param convInfo Conversion info
+ * @param detIds Detector IDs of the spectrum
+ * @return Mean fixed energy of the detectors
+ */
+static double get_indirect_fixed_energy(const ConversionInfo &convInfo,
+                                        const DetectorIdRange &detIds) {
+  double energy(0.0);
+  for (const auto detId : detIds) {
+    const auto it = convInfo.detector_fixed_energies.find(detId);
+    energy += it != convInfo.detector_fixed_energies.cend()
+                  ? it->second
+                  : convInfo.fixed_energy;
+  }
+  return energy / detIds.size();
+}
+
+/**
+ * Calculates the parameters of an inelastic conversion plan.
+ *
+ * @param plan Conversion plan, with conversion info and spectrum index set
+ * @param inst Instrument
+ * @param spectra Index (in the instrument mapping) of the spectra to include
+ *                in the plan, in parameter index order
+ * @param beamDirection Beam direction
+ * @param l1 Source to sample distance
+ */
+static void create_inelastic_conversion_parameters(
+    ConversionPlan &plan, const Instrument &inst,
+    const std::vector<size_t> &spectra, const Eigen::Vector3f &beamDirection,
+    const double l1) {
+  const auto &convInfo = plan.conversion_info;
+  const auto &mapping = inst.spectrum_detector_mapping;
+  const bool direct = convInfo.energy_mode == EnergyTransferMode::Direct;
+
+  if (convInfo.lorentz_correction) {
+    throw std::runtime_error("Lorentz correction is not supported for "
+                             "inelastic conversion");
+  }
+
+  /* Get fixed energies (before any parallel region, so that invalid energies
+   * can be reported) */
+  plan.fixed_energy.resize(spectra.size());
+  for (size_t i = 0; i < spectra.size(); i++) {
+    plan.fixed_energy[i] =
+        direct ? convInfo.fixed_energy
+               : get_indirect_fixed_energy(convInfo,
+                                           mapping.detectors(spectra[i]));
+    if (!(plan.fixed_energy[i] > 0.0)) {
+      throw std::runtime_error(
+          "Inelastic conversion requires a positive fixed energy (spectrum " +
+          std::to_string(mapping.spectrumId(spectra[i])) + ")");
+    }
+  }
+
+  plan.incident_direction = convInfo.ub_matrix * beamDirection;
+
+  plan.final_direction.resize(spectra.size());
+  plan.conversion_factor.resize(spectra.size());
+  plan.fixed_wavenumber.resize(spectra.size());
+  plan.fixed_time.resize(spectra.size());
+
+#pragma omp parallel for
+  for (size_t i = 0; i < spectra.size(); i++) {
+    const auto detectorsForSpectrum = mapping.detectors(spectra[i]);
+
+    const double l2 = get_l2(inst, detectorsForSpectrum);
+    plan.final_direction[i] =
+        convInfo.ub_matrix *
+        get_detector_direction(inst, detectorsForSpectrum);
+
+    /* Leg travelled at the fixed energy */
+    const double fixedFlightPath = direct ? l1 : l2;
+    const double fixedVelocity =
+        std::sqrt(2.0 * plan.fixed_energy[i] * meV / NeutronMass);
+    plan.fixed_time[i] = 1e6 * fixedFlightPath / fixedVelocity;
+    plan.fixed_wavenumber[i] =
+        std::sqrt(plan.fixed_energy[i] / WavenumberSquaredToEnergy);
+
+    /* Leg travelled at the energy given by the TOF */
+    const double variableFlightPath = direct ? l2 : l1;
+    plan.conversion_factor[i] =
+        (NeutronMass * variableFlightPath * 1e-10) / (1e-6 * h_bar);
+  }
+}
+
+/**
+ * Creates a conversion plan.
+ *
+ * Spectra that have no detectors, or have detectors that are not in the
+ * instrument, are not included in the plan.
+ *
+ * For inelastic conversions every spectrum must have a positive fixed energy
+ * and Lorentz correction is not supported.
+ *
+ * @param inst Instrument (including spectrum to detector mapping)
+ * @param convInfo Conversion info
+ * @return Conversion plan
+ */
+ConversionPlan create_conversion_plan(const Instrument &inst,
+                                      const ConversionInfo &convInfo) {
+  ConversionPlan plan;
+  plan.conversion_info = convInfo;
+  plan.instrument_hash = instrument_hash(inst);
+
+  const auto &mapping = inst.spectrum_detector_mapping;
+
+  /* Get spectra that can be converted */
+  std::vector<size_t> spectra;
+  for (size_t i = 0; i < mapping.size(); i++) {
+    const auto detIds = mapping.detectors(i);
+    const bool valid =
+        !detIds.empty() &&
+        std::all_of(detIds.begin(), detIds.end(), [&inst](detid_t detId) {
+          return inst.detectors.contains(detId);
+        });
+    if (valid) {
+      spectra.push_back(i);
+    }
+  }
+
+  /* Generate spectrum number to index mapping (spectra of the mapping are in
+   * order of spectrum number) */
+  if (!mapping.empty()) {
+    const auto maxSpecId = mapping.spectrumId(mapping.size() - 1);
+    plan.spectrum_index.resize(maxSpecId + 1, ConversionPlan::NoSpectrum);
+  }
+  for (size_t i = 0; i < spectra.size(); i++) {
+    plan.spectrum_index[mapping.spectrumId(spectra[i])] = i;
+  }
+
+  /* Get common instrument parameters */
+  const Eigen::Vector3f beamDirection = get_beam_direction(inst);
+  const auto l1 = get_l1(inst);
+
+  if (convInfo.energy_mode != EnergyTransferMode::Elastic) {
+    create_inelastic_conversion_parameters(plan, inst, spectra, beamDirection,
+                                           l1);
+    return plan;
+  }
+
+  plan.q_direction.resize(spectra.size());
+  plan.conversion_factor.resize(spectra.size());
+  plan.sin_theta_squared.resize(spectra.size(), 0.0);
+
+#pragma omp parallel for
+  for (size_t i = 0; i < spectra.size(); i++) {
+    const auto detectorsForSpectrum = mapping.detectors(spectra[i]);
+
+    /* Get common detector parameters */
+    const auto neutronFlightPath = l1 + get_l2(inst, detectorsForSpectrum);
+    const Eigen::Vector3f qDirLabFrame =
+        beamDirection - get_detector_direction(inst, detectorsForSpectrum);
+    plan.q_direction[i] = convInfo.ub_matrix * qDirLabFrame;
+
+    plan.conversion_factor[i] =
+        (NeutronMass * neutronFlightPath * 1e-10) / (1e-6 * h_bar);
+
+    /* Lorentz correction */
+    if (convInfo.lorentz_correction) {
+      const auto theta = get_detector_two_theta(inst, detectorsForSpectrum);
+      plan.sin_theta_squared[i] = sin(theta);
+      plan.sin_theta_squared[i] *= plan.sin_theta_squared[i];
+    }
+  }
+
+  return plan;
+}
+
+/**
+ * Creates a conversion plan for the same instrument with an additional
+ * rotation applied after the UB matrix (e.g. a goniometer rotation), without
+ * recalculating the instrument geometry.
+ *
+ * The result is equivalent to a plan created with a UB matrix of rotation *
+ * ub_matrix (up to floating point rounding).
+ *
+ * @param plan Conversion plan
+ * @param rotation Rotation matrix
+ * @return Rotated conversion plan
+ */
+ConversionPlan rotate_conversion_plan(const ConversionPlan &plan,
+                                      const Eigen::Matrix3f &rotation) {
+  ConversionPlan rotated(plan);
+  rotated.conversion_info.ub_matrix = rotation * plan.conversion_info.ub_matrix;
+
+  for (auto &qDir : rotated.q_direction) {
+    qDir = rotation * qDir;
+  }
+
+  rotated.incident_direction = rotation * plan.incident_direction;
+  for (auto &finalDir : rotated.final_direction) {
+    finalDir = rotation * finalDir;
+  }
+
+  return rotated;
+}
+
+/**
+ * Gets the index of the parameters for a spectrum in a conversion plan.
+ *
+ * @param plan Conversion plan
+ * @param specId Spectrum number
+ * @return Index of parameters
+ */
+size_t get_spectrum_index(const ConversionPlan &plan, const specid_t specId) {
+  if (!has_spectrum(plan, specId)) {
+    throw std::runtime_error("No conversion parameters for spectrum " +
+                             std::to_string(specId));
+  }
+  return plan.spectrum_index[specId];
+}
+
+/**
+ * Saves a conversion plan to a binary file.
+ *
+ * The per detector fixed energies of the conversion info are not saved, they
+ * are only used to create the plan.
+ *
+ * @param plan Conversion plan
+ * @param filename Filename of file to save to
+ */
+void save_conversion_plan(const ConversionPlan &plan,
+                          const std::string &filename) {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::runtime_error("Failed to open conversion plan file " +
+                             filename);
+  }
+
+  file.write(ConversionPlanMagic, sizeof(ConversionPlanMagic));
+  write_binary(file, ConversionPlanVersion);
+
+  write_binary(file, static_cast<uint8_t>(
+                         plan.conversion_info.lorentz_correction));
+  write_binary(file, plan.conversion_info.ub_matrix);
+  write_binary(file, plan.conversion_info.energy_mode);
+  write_binary(file, plan.conversion_info.fixed_energy);
+  write_binary(file, plan.instrument_hash);
+
+  write_binary_vector(file, plan.spectrum_index);
+  write_binary_vector(file, plan.q_direction);
+  write_binary_vector(file, plan.conversion_factor);
+  write_binary_vector(file, plan.sin_theta_squared);
+
+  write_binary(file, plan.incident_direction);
+  write_binary_vector(file, plan.final_direction);
+  write_binary_vector(file, plan.fixed_energy);
+  write_binary_vector(file, plan.fixed_wavenumber);
+  write_binary_vector(file, plan.fixed_time);
+
+  if (!file) {
+    throw std::runtime_error("Failed to write conversion plan file " +
+                             filename);
+  }
+}
+
+/**
+ * Loads a conversion plan from a binary file created by
+ * save_conversion_plan().
+ *
+ * @param plan Reference to output conversion plan
+ * @param filename Filename of file to load from
+ */
+void load_conversion_plan(ConversionPlan &plan, const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Failed to open conversion plan file " +
+                             filename);
+  }
+
+  char magic[sizeof(ConversionPlanMagic)];
+  file.read(magic, sizeof(magic));
+  uint32_t version;
+  read_binary(file, version);
+  if (!file || std::memcmp(magic, ConversionPlanMagic, sizeof(magic)) != 0 ||
+      version != ConversionPlanVersion) {
+    throw std::runtime_error("Invalid conversion plan file " + filename);
+  }
+
+  uint8_t lorentzCorrection;
+  read_binary(file, lorentzCorrection);
+  plan.conversion_info.lorentz_correction = lorentzCorrection != 0;
+  read_binary(file, plan.conversion_info.ub_matrix);
+  read_binary(file, plan.conversion_info.energy_mode);
+  read_binary(file, plan.conversion_info.fixed_energy);
+  read_binary(file, plan.instrument_hash);
+
+  read_binary_vector(file, plan.spectrum_index);
+  read_binary_vector(file, plan.q_direction);
+  read_binary_vector(file, plan.conversion_factor);
+  read_binary_vector(file, plan.sin_theta_squared);
+
+  read_binary(file, plan.incident_direction);
+  read_binary_vector(file, plan.final_direction);
+  read_binary_vector(file, plan.fixed_energy);
+  read_binary_vector(file, plan.fixed_wavenumber);
+  read_binary_vector(file, plan.fixed_time);
+
+  if (!file) {
+    throw std::runtime_error("Failed to read conversion plan file " +
+                             filename);
+  }
+}
+
+/* Largest size of the per thread histograms of the counting sort, relative to
+ * the number of events sorted */
+constexpr size_t CountingSortHistogramFactor(4);
+
+/**
+ * Sorts TOF events by spectrum number using a counting sort.
+ *
+ * Each thread counts the events of each spectrum in its own part of the event
+ * list, a prefix sum over the counts (in spectrum then thread order) gives the
+ * output position of each thread's events for each spectrum, and each thread
+ * then scatters its events to a new event list. The relative order of events of
+ * a spectrum is preserved.
+ *
+ * The prefix sum is also split between threads by range of spectrum numbers:
+ * each thread totals the counts of its range, the (few) range totals are
+ * summed, then each thread converts the counts of its range to offsets.
+ *
+ * @param tofEvents TOF events
+ * @param idCount Number of spectrum numbers (one greater than the maximum
+ *                spectrum number)
+ * @param maxThreadCount Number of threads (and histograms) to use at most
+ */
+static void counting_sort_events(TofEventList &tofEvents, const size_t idCount,
+                                 const size_t maxThreadCount) {
+  const size_t eventCount = tofEvents.size();
+
+  /* Event counts, indexed by [thread * idCount + spectrum number], later
+   * converted to output offsets */
+  std::vector<size_t> offsets(maxThreadCount * idCount, 0);
+
+  /* Number of events preceding each thread's range of spectrum numbers */
+  std::vector<size_t> rangeOffsets(maxThreadCount + 1, 0);
+
+  TofEventList sortedEvents(eventCount);
+
+#pragma omp parallel num_threads(maxThreadCount)
+  {
+    const size_t threadCount = omp_get_num_threads();
+    const size_t threadIdx = omp_get_thread_num();
+
+    const size_t start = eventCount * threadIdx / threadCount;
+    const size_t end = eventCount * (threadIdx + 1) / threadCount;
+    size_t *threadOffsets = offsets.data() + threadIdx * idCount;
+
+    /* Count events of each spectrum */
+    for (size_t i = start; i < end; i++) {
+      threadOffsets[tofEvents[i].id]++;
+    }
+
+#pragma omp barrier
+
+    /* Total the counts of this thread's range of spectrum numbers */
+    const size_t idStart = idCount * threadIdx / threadCount;
+    const size_t idEnd = idCount * (threadIdx + 1) / threadCount;
+    size_t rangeCount(0);
+    for (size_t id = idStart; id < idEnd; id++) {
+      for (size_t t = 0; t < threadCount; t++) {
+        rangeCount += offsets[t * idCount + id];
+      }
+    }
+    rangeOffsets[threadIdx + 1] = rangeCount;
+
+#pragma omp barrier
+
+#pragma omp single
+    std::partial_sum(rangeOffsets.begin(),
+                     rangeOffsets.begin() + threadCount + 1,
+                     rangeOffsets.begin());
+
+    /* Convert counts to offsets */
+    size_t offset = rangeOffsets[threadIdx];
+    for (size_t id = idStart; id < idEnd; id++) {
+      for (size_t t = 0; t < threadCount; t++) {
+        const size_t count = offsets[t * idCount + id];
+        offsets[t * idCount + id] = offset;
+        offset += count;
+      }
+    }
+
+#pragma omp barrier
+
+    /* Scatter events */
+    for (size_t i = start; i < end; i++) {
+      sortedEvents[threadOffsets[tofEvents[i].id]++] = tofEvents[i];
+    }
+  }
+
+  tofEvents.swap(sortedEvents);
+}
+
 PreprocessedEventInfo preprocess_events(TofEventList &tofEvents) {
   PreprocessedEventInfo eventInfo;
 
-  /* Sort TOF events by spectrum ID */
-  boost::sort::block_indirect_sort(
-      tofEvents.begin(), tofEvents.end(),
-      [](const TofEvent &a, const TofEvent &b) { return a.id < b.id; });
+  if (tofEvents.empty()) {
+    return eventInfo;
+  }
+
+  /* Find the largest spectrum number */
+  uint32_t maxId(0);
+#pragma omp parallel for reduction(max : maxId)
+  for (size_t i = 0; i < tofEvents.size(); i++) {
+    maxId = std::max(maxId, tofEvents[i].id);
+  }
+  const size_t idCount = static_cast<size_t>(maxId) + 1;
+
+  /* Sort TOF events by spectrum ID. The counting sort holds a histogram of
+   * all spectrum numbers per thread, so only as many threads are used as keep
+   * the histograms within a small multiple of the event count. If spectrum
+   * numbers are too sparse for even one histogram a comparison sort is used.
+   * Both sorts are stable, keeping the events of each spectrum in pulse time
+   * order */
+  const size_t countingSortThreads =
+      std::min(static_cast<size_t>(omp_get_max_threads()),
+               CountingSortHistogramFactor * tofEvents.size() / idCount);
+  if (countingSortThreads > 0) {
+    counting_sort_events(tofEvents, idCount, countingSortThreads);
+  } else {
+    boost::sort::parallel_stable_sort(
+        tofEvents.begin(), tofEvents.end(),
+        [](const TofEvent &a, const TofEvent &b) { return a.id < b.id; });
+  }
 
   /* Get iterators to each spectrum range in TOF event list */
   auto rangeStart = tofEvents.begin();
@@ -16,6 +16,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -30,11 +36,83 @@
 
 #pragma once
 
+/**
+ * Geometry of an inelastic conversion (or Elastic for Q space only).
+ */
+enum class EnergyTransferMode : uint8_t { Elastic, Direct, Indirect };
+
 struct ConversionInfo {
   bool lorentz_correction = false;
   Eigen::Matrix3f ub_matrix;
+
+  EnergyTransferMode energy_mode = EnergyTransferMode::Elastic;
+
+  /* Incident energy (meV) in direct geometry, final energy (meV) of detectors
+   * not in detector_fixed_energies in indirect geometry */
+  double fixed_energy = 0.0;
+
+  /* Final energy (meV) of individual detectors in indirect geometry */
+  std::map<detid_t, double> detector_fixed_energies;
 };
 
+/**
+ * Per spectrum parameters of a conversion for a given instrument and conversion
+ * info.
+ *
+ * A plan only depends on the instrument (including the spectrum to detector
+ * mapping) and the conversion info, so it can be created once and reused for
+ * any number of conversions (and threads).
+ */
+struct ConversionPlan {
+  static constexpr size_t NoSpectrum = std::numeric_limits<size_t>::max();
+
+  ConversionInfo conversion_info;
+
+  /* instrument_hash() of the instrument the plan was created for */
+  uint64_t instrument_hash = 0;
+
+  /* Index of the parameters of each spectrum, indexed by spectrum number
+   * (NoSpectrum for spectra with no valid detectors) */
+  std::vector<size_t> spectrum_index;
+
+  /* Parameters, indexed by spectrum_index */
+  std::vector<Eigen::Vector3f> q_direction;
+  std::vector<double> conversion_factor;
+  std::vector<double> sin_theta_squared;
+
+  /* Inelastic parameters, only present for inelastic conversions.
+   *
+   * The flight path of one leg (source to sample in direct geometry, sample to
+   * detector in indirect geometry) is travelled at a known fixed energy, taking
+   * a fixed time. The remaining TOF gives the wavenumber on the other leg, via
+   * conversion_factor. */
+  Eigen::Vector3f incident_direction;
+  std::vector<Eigen::Vector3f> final_direction;
+  std::vector<double> fixed_energy;
+  std::vector<double> fixed_wavenumber;
+  std::vector<double> fixed_time;
+};
+
+ConversionPlan create_conversion_plan(const Instrument &inst,
+                                      const ConversionInfo &convInfo);
+
+ConversionPlan rotate_conversion_plan(const ConversionPlan &plan,
+                                      const Eigen::Matrix3f &rotation);
+
+/**
+ * @return True if the plan holds conversion parameters for a spectrum
+ */
+inline bool has_spectrum(const ConversionPlan &plan, const specid_t specId) {
+  return specId < plan.spectrum_index.size() &&
+         plan.spectrum_index[specId] != ConversionPlan::NoSpectrum;
+}
+
+size_t get_spectrum_index(const ConversionPlan &plan, const specid_t specId);
+
+void save_conversion_plan(const ConversionPlan &plan,
+                          const std::string &filename);
+void load_conversion_plan(ConversionPlan &plan, const std::string &filename);
+
 struct PreprocessedEventInfo {
   std::vector<
       std::tuple<specid_t, TofEventList::iterator, TofEventList::iterator>>
@@ -43,73 +121,605 @@ struct PreprocessedEventInfo {
 
 PreprocessedEventInfo preprocess_events(TofEventList &events);
 
-template <typename IntT, typename MortonT>
-void convert_events(std::vector<MDEvent<3, IntT, MortonT>> &mdEvents,
-                    TofEventList &tofEvents, const ConversionInfo &convInfo,
-                    const Instrument &inst, const MDSpaceBounds<3> &space) {
+/**
+ * Gets the index of the parameters in a conversion plan for each spectrum of
+ * preprocessed events.
+ *
+ * @param plan Conversion plan
+ * @param eventInfo Preprocessed events
+ * @return Index of parameters for each spectrum
+ */
+inline std::vector<size_t>
+get_spectrum_indices(const ConversionPlan &plan,
+                     const PreprocessedEventInfo &eventInfo) {
+  std::vector<size_t> paramIdxs(eventInfo.spectrum_to_events.size());
+  for (size_t i = 0; i < paramIdxs.size(); i++) {
+    paramIdxs[i] =
+        get_spectrum_index(plan, std::get<0>(eventInfo.spectrum_to_events[i]));
+  }
+  return paramIdxs;
+}
+
+/**
+ * Converts a single TOF event to Q space.
+ *
+ * @param plan Conversion plan
+ * @param paramIdx Index of parameters for the spectrum of the event
+ * @param space MD space
+ * @param event TOF event
+ * @param center Output Q space coordinates
+ * @param weight Output (Lorentz corrected) weight
+ * @return True if the event is within the MD space
+ */
+inline bool convert_tof_event(const ConversionPlan &plan, const size_t paramIdx,
+                              const MDSpaceBounds<3> &space,
+                              const TofEvent &event, Eigen::Vector3f &center,
+                              float &weight) {
+  const auto wavenumber = plan.conversion_factor[paramIdx] / event.tof;
+  center = plan.q_direction[paramIdx] * wavenumber;
+
+  weight = event.weight;
+
+  /* Ensure the event is within the bounds of the MD space */
+  if (!CheckCoordinatesInMDSpace<3>(space, center)) {
+    return false;
+  }
+
+  /* Lorentz correction */
+  if (plan.conversion_info.lorentz_correction) {
+    const auto corr = plan.sin_theta_squared[paramIdx] * wavenumber *
+                      wavenumber * wavenumber * wavenumber;
+    weight *= corr;
+  }
+
+  return true;
+}
+
+/**
+ * Converts events of a single spectrum to Q space, one event at a time.
+ */
+struct ScalarSpectrumConverter {
+  /**
+   * Counts the events of a spectrum that fall within the MD space.
+   *
+   * @param plan Conversion plan
+   * @param paramIdx Index of parameters for the spectrum
+   * @param space MD space
+   * @param events Events of the spectrum
+   * @param eventCount Number of events
+   * @return Number of events within the MD space
+   */
+  static size_t count(const ConversionPlan &plan, const size_t paramIdx,
+                      const MDSpaceBounds<3> &space, const TofEvent *events,
+                      const size_t eventCount) {
+    size_t inSpaceCount(0);
+    Eigen::Vector3f center;
+    float weight;
+    for (size_t i = 0; i < eventCount; i++) {
+      if (convert_tof_event(plan, paramIdx, space, events[i], center,
+                            weight)) {
+        inSpaceCount++;
+      }
+    }
+    return inSpaceCount;
+  }
+
+  /**
+   * Converts the events of a spectrum that fall within the MD space.
+   *
+   * @param plan Conversion plan
+   * @param paramIdx Index of parameters for the spectrum
+   * @param space MD space
+   * @param events Events of the spectrum
+   * @param eventCount Number of events
+   * @param out Output MD events
+   * @return Number of MD events written
+   */
+  template <typename IntT, typename MortonT>
+  static size_t convert(const ConversionPlan &plan, const size_t paramIdx,
+                        const MDSpaceBounds<3> &space, const TofEvent *events,
+                        const size_t eventCount,
+                        MDEvent<3, IntT, MortonT> *out) {
+    size_t outIdx(0);
+    Eigen::Vector3f center;
+    float weight;
+    for (size_t i = 0; i < eventCount; i++) {
+      if (convert_tof_event(plan, paramIdx, space, events[i], center,
+                            weight)) {
+        /* Create event */
+        out[outIdx++] = MDEvent<3, IntT, MortonT>(center, space, weight);
+      }
+    }
+    return outIdx;
+  }
+};
+
+/**
+ * Counts events that fall within the MD space, testing all events by a single
+ * loop that is vectorised (via OpenMP SIMD).
+ *
+ * @param eventCount Number of events
+ * @param eventInSpace Called with the index of an event, returns true if the
+ *                     event is within the MD space (must be inlinable and
+ *                     free of branches for the loop to vectorise)
+ * @return Number of events within the MD space
+ */
+template <typename EventInSpace>
+size_t count_events_in_space(const size_t eventCount,
+                             const EventInSpace &eventInSpace) {
+  size_t inSpaceCount(0);
+#pragma omp simd reduction(+ : inSpaceCount)
+  for (size_t i = 0; i < eventCount; i++) {
+    inSpaceCount += eventInSpace(i);
+  }
+  return inSpaceCount;
+}
+
+/**
+ * Converts events in batches of a fixed number of events, writing MD events
+ * for those within the MD space.
+ *
+ * The batch kernel converts all events of a batch into arrays of integer
+ * coordinates, weights and flags indicating if each event is within the MD
+ * space. Events within the MD space are then interleaved and written to the
+ * output.
+ *
+ * @tparam BatchSize Number of events in a batch
+ *
+ * @param eventCount Number of events
+ * @param out Output MD events
+ * @param convertBatch Batch kernel, called with the index of the first event
+ *                     of the batch, the number of events in the batch and the
+ *                     output integer coordinates (IntT[ND][BatchSize]),
+ *                     in space flags and weights of each event
+ * @return Number of MD events written
+ */
+template <size_t BatchSize, size_t ND, typename IntT, typename MortonT,
+          typename BatchKernel>
+size_t convert_event_batches(const size_t eventCount,
+                             MDEvent<ND, IntT, MortonT> *out,
+                             const BatchKernel &convertBatch) {
+  IntT intCoords[ND][BatchSize];
+  float weights[BatchSize];
+  bool inSpace[BatchSize];
+
+  size_t outIdx(0);
+  for (size_t batchStart = 0; batchStart < eventCount;
+       batchStart += BatchSize) {
+    const size_t batchCount = std::min(BatchSize, eventCount - batchStart);
+
+    convertBatch(batchStart, batchCount, intCoords, inSpace, weights);
+
+    /* Create events for those within the MD space */
+    for (size_t i = 0; i < batchCount; i++) {
+      if (inSpace[i]) {
+        IntArray<ND, IntT> intCoord;
+        for (size_t a = 0; a < ND; a++) {
+          intCoord[a] = intCoords[a][i];
+        }
+        out[outIdx++] = MDEvent<ND, IntT, MortonT>(
+            interleave<ND, IntT, MortonT>(intCoord), weights[i]);
+      }
+    }
+  }
+  return outIdx;
+}
+
+/**
+ * Converts events of a single spectrum to Q space, in batches of a fixed
+ * number of events.
+ *
+ * The TOF and weight of the events of a batch are gathered into arrays, then
+ * the wavenumber, Q coordinates, MD space bounds check, Lorentz correction and
+ * integer coordinates of all events in the batch are calculated by a loop that
+ * is vectorised (via OpenMP SIMD). Events within the MD space are then
+ * interleaved and written to the output.
+ *
+ * Results are identical to those of ScalarSpectrumConverter.
+ */
+class VectorisedSpectrumConverter {
+public:
+  static constexpr size_t BatchSize = 16;
+
+  /**
+   * Parameters of a spectrum and MD space, as scalars.
+   */
+  struct Parameters {
+    Parameters(const ConversionPlan &plan, const size_t paramIdx,
+               const MDSpaceBounds<3> &space)
+        : conversionFactor(plan.conversion_factor[paramIdx]),
+          sinThetaSquared(plan.sin_theta_squared[paramIdx]),
+          lorentzCorrection(plan.conversion_info.lorentz_correction) {
+      for (size_t a = 0; a < 3; a++) {
+        qDir[a] = plan.q_direction[paramIdx][a];
+        lower[a] = space(a, 0);
+        upper[a] = space(a, 1);
+        range[a] = upper[a] - lower[a];
+      }
+    }
+
+    double conversionFactor;
+    double sinThetaSquared;
+    bool lorentzCorrection;
+
+    float qDir[3];
+    float lower[3];
+    float upper[3];
+    float range[3];
+  };
+
+  /**
+   * @see ScalarSpectrumConverter::count
+   */
+  static size_t count(const ConversionPlan &plan, const size_t paramIdx,
+                      const MDSpaceBounds<3> &space, const TofEvent *events,
+                      const size_t eventCount) {
+    const Parameters p(plan, paramIdx, space);
+    return count_events_in_space(eventCount, [&p, events](const size_t i) {
+      double wavenumber;
+      float qx, qy, qz;
+      return convertTof(p, events[i].tof, p.qDir[0], p.qDir[1], p.qDir[2],
+                        wavenumber, qx, qy, qz);
+    });
+  }
+
+  /**
+   * @see ScalarSpectrumConverter::convert
+   */
+  template <typename IntT, typename MortonT>
+  static size_t convert(const ConversionPlan &plan, const size_t paramIdx,
+                        const MDSpaceBounds<3> &space, const TofEvent *events,
+                        const size_t eventCount,
+                        MDEvent<3, IntT, MortonT> *out) {
+    const Parameters p(plan, paramIdx, space);
+
+    /* All events of the spectrum share its Q direction */
+    float qDirs[3][BatchSize];
+    for (size_t a = 0; a < 3; a++) {
+      std::fill_n(qDirs[a], BatchSize, p.qDir[a]);
+    }
+
+    float tofs[BatchSize];
+    return convert_event_batches<BatchSize>(
+        eventCount, out,
+        [&p, events, &qDirs, &tofs](const size_t batchStart,
+                                    const size_t batchCount,
+                                    IntT (&intCoords)[3][BatchSize],
+                                    bool *inSpace, float *weights) {
+          /* Gather TOF and weight of the batch into contiguous arrays */
+          const TofEvent *batch = events + batchStart;
+          for (size_t i = 0; i < batchCount; i++) {
+            tofs[i] = batch[i].tof;
+            weights[i] = batch[i].weight;
+          }
+
+          if (p.lorentzCorrection) {
+            convertBatch<IntT, true>(p, batchCount, tofs, qDirs, weights,
+                                     intCoords, inSpace);
+          } else {
+            convertBatch<IntT, false>(p, batchCount, tofs, qDirs, weights,
+                                      intCoords, inSpace);
+          }
+        });
+  }
+
+  /**
+   * Converts the TOF of an event, giving its wavenumber and Q.
+   *
+   * @param p Parameters
+   * @param tof TOF of the event
+   * @param qDirX Q direction of the event (x component)
+   * @param qDirY Q direction of the event (y component)
+   * @param qDirZ Q direction of the event (z component)
+   * @param wavenumber Output wavenumber
+   * @param qx Output Q (x component)
+   * @param qy Output Q (y component)
+   * @param qz Output Q (z component)
+   * @return True if the event is within the MD space
+   */
+  static bool convertTof(const Parameters &p, const float tof,
+                         const float qDirX, const float qDirY,
+                         const float qDirZ, double &wavenumber, float &qx,
+                         float &qy, float &qz) {
+    wavenumber = p.conversionFactor / tof;
+    const float wavenumberF = static_cast<float>(wavenumber);
+
+    qx = qDirX * wavenumberF;
+    qy = qDirY * wavenumberF;
+    qz = qDirZ * wavenumberF;
+
+    return !((qx < p.lower[0]) | (qx > p.upper[0]) | (qy < p.lower[1]) |
+             (qy > p.upper[1]) | (qz < p.lower[2]) | (qz > p.upper[2]));
+  }
+
+  /**
+   * Converts a batch of events.
+   *
+   * Axes are written out explicitly and conditions combined without short
+   * circuiting, as inner loops and branches prevent vectorisation. The Q
+   * direction is given per event (the Q direction of Parameters is not used),
+   * so that events of a rotating sample can be converted by the same kernel.
+   *
+   * @param p Parameters
+   * @param count Number of events in batch
+   * @param tofs TOF of each event
+   * @param qDirs Q direction of each event, by axis
+   * @param weights Weight of each event, Lorentz corrected in place
+   * @param intCoords Output integer coordinates of each event
+   * @param inSpace Output flag indicating if each event is within the MD space
+   */
+  template <typename IntT, bool LorentzCorrection>
+  static void convertBatch(const Parameters &p, const size_t count,
+                           const float *tofs,
+                           const float (&qDirs)[3][BatchSize], float *weights,
+                           IntT (&intCoords)[3][BatchSize], bool *inSpace) {
+    const float intMax = std::numeric_limits<IntT>::max();
+
+#pragma omp simd
+    for (size_t i = 0; i < count; i++) {
+      double wavenumber;
+      float qx, qy, qz;
+      const bool eventInSpace = convertTof(p, tofs[i], qDirs[0][i], qDirs[1][i],
+                                           qDirs[2][i], wavenumber, qx, qy, qz);
+      inSpace[i] = eventInSpace;
+
+      /* Integer coordinates (events outside of the MD space are clamped to its
+       * lower bound so that conversion to integer is defined) */
+      const float cx = eventInSpace ? qx : p.lower[0];
+      const float cy = eventInSpace ? qy : p.lower[1];
+      const float cz = eventInSpace ? qz : p.lower[2];
+      intCoords[0][i] =
+          static_cast<IntT>(((cx - p.lower[0]) / p.range[0]) * intMax);
+      intCoords[1][i] =
+          static_cast<IntT>(((cy - p.lower[1]) / p.range[1]) * intMax);
+      intCoords[2][i] =
+          static_cast<IntT>(((cz - p.lower[2]) / p.range[2]) * intMax);
+
+      /* Lorentz correction */
+      if (LorentzCorrection) {
+        weights[i] *= p.sinThetaSquared * wavenumber * wavenumber *
+                      wavenumber * wavenumber;
+      }
+    }
+  }
+};
+
+/**
+ * Converts events to MD space using a given spectrum converter.
+ *
+ * Conversion is performed in two passes: the first counts the events of each
+ * spectrum that fall within the MD space, giving the offset of the events of
+ * each spectrum in the output, the second converts events directly into the
+ * output. Output events are therefore ordered by spectrum.
+ *
+ * @tparam SpectrumConverter Converter for the events of a single spectrum
+ *
+ * @param mdEvents Output events, converted events are appended
+ * @param tofEvents TOF events
+ * @param plan Conversion plan
+ * @param space MD space
+ * @param converter Spectrum converter (shared by all threads)
+ */
+template <typename SpectrumConverter, size_t ND, typename IntT,
+          typename MortonT>
+void convert_spectra(std::vector<MDEvent<ND, IntT, MortonT>> &mdEvents,
+                     TofEventList &tofEvents, const ConversionPlan &plan,
+                     const MDSpaceBounds<ND> &space,
+                     const SpectrumConverter &converter) {
   /* Do preprocessing */
   const auto eventInfo = preprocess_events(tofEvents);
+  const size_t spectrumCount = eventInfo.spectrum_to_events.size();
+
+  /* Get index of the parameters of each spectrum in the plan */
+  const auto paramIdxs = get_spectrum_indices(plan, eventInfo);
 
-  /* Get common instrument parameters */
-  const Eigen::Vector3f beamDirection = get_beam_direction(inst);
-  const auto l1 = get_l1(inst);
+  /* Number of events within the MD space for each spectrum, later converted
+   * to the offset of the first event of each spectrum in the output */
+  std::vector<size_t> offsets(spectrumCount + 1, 0);
 
+  /* First pass: count events that fall within the MD space */
 #pragma omp parallel for
-  /* Iterate over spectra */
-  for (size_t i = 0; i < eventInfo.spectrum_to_events.size(); i++) {
+  for (size_t i = 0; i < spectrumCount; i++) {
     const auto specInfo(eventInfo.spectrum_to_events[i]);
 
-    const auto specId(std::get<0>(specInfo));
     const auto eventIteratorStart(std::get<1>(specInfo));
     const auto eventIteratorEnd(std::get<2>(specInfo));
 
-    const auto detectorsForSpectrum = inst.spectrum_detector_mapping.at(specId);
+    offsets[i + 1] =
+        converter.count(plan, paramIdxs[i], space, &(*eventIteratorStart),
+                        std::distance(eventIteratorStart, eventIteratorEnd));
+  }
 
-    /* Get common detector parameters */
-    const auto neutronFlightPath = l1 + get_l2(inst, detectorsForSpectrum);
-    const Eigen::Vector3f qDirLabFrame =
-        beamDirection - get_detector_direction(inst, detectorsForSpectrum);
-    const Eigen::Vector3f qDir = convInfo.ub_matrix * qDirLabFrame;
+  /* Calculate the output offset of each spectrum (after any existing events)
+   * and size the output accordingly */
+  offsets[0] = mdEvents.size();
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  mdEvents.resize(offsets.back());
 
-    const auto conversionFactor =
-        (NeutronMass * neutronFlightPath * 1e-10) / (1e-6 * h_bar);
+  /* Second pass: convert events, writing each spectrum to its own range of the
+   * output */
+#pragma omp parallel for
+  for (size_t i = 0; i < spectrumCount; i++) {
+    const auto specInfo(eventInfo.spectrum_to_events[i]);
 
-    /* Lorentz correction */
-    auto sinThetaSquared = 0.0;
-    if (convInfo.lorentz_correction) {
-      const auto theta = get_detector_two_theta(inst, detectorsForSpectrum);
-      sinThetaSquared = sin(theta);
-      sinThetaSquared *= sinThetaSquared;
-    }
+    const auto eventIteratorStart(std::get<1>(specInfo));
+    const auto eventIteratorEnd(std::get<2>(specInfo));
 
-    /* Iterate over events for detector */
-    std::vector<MDEvent<3, IntT, MortonT>> mdEventsForSpectrum;
-    for (auto eventIt = eventIteratorStart; eventIt != eventIteratorEnd;
-         ++eventIt) {
-      const auto wavenumber = conversionFactor / eventIt->tof;
-      const Eigen::Vector3f center = qDir * wavenumber;
-
-      auto weight = eventIt->weight;
-
-      /* Ensure the event is within the bounds of the MD space */
-      if (CheckCoordinatesInMDSpace<3>(space, center)) {
-        /* Lorentz correction */
-        if (convInfo.lorentz_correction) {
-          const auto corr = sinThetaSquared * wavenumber * wavenumber *
-                            wavenumber * wavenumber;
-          weight *= corr;
-        }
+    converter.convert(plan, paramIdxs[i], space, &(*eventIteratorStart),
+                      std::distance(eventIteratorStart, eventIteratorEnd),
+                      mdEvents.data() + offsets[i]);
+  }
+}
 
-        /* Create event */
-        mdEventsForSpectrum.emplace_back(center, space, weight);
+/**
+ * Converts events to MD space using a stateless spectrum converter.
+ *
+ * @see convert_spectra()
+ */
+template <typename SpectrumConverter, size_t ND, typename IntT,
+          typename MortonT>
+void convert_spectra(std::vector<MDEvent<ND, IntT, MortonT>> &mdEvents,
+                     TofEventList &tofEvents, const ConversionPlan &plan,
+                     const MDSpaceBounds<ND> &space) {
+  convert_spectra<SpectrumConverter, ND>(mdEvents, tofEvents, plan, space,
+                                         SpectrumConverter());
+}
+
+/**
+ * Converts events to Q space.
+ *
+ * @see convert_spectra()
+ *
+ * @tparam SpectrumConverter Converter for the events of a single spectrum
+ *
+ * @param mdEvents Output events, converted events are appended
+ * @param tofEvents TOF events
+ * @param plan Conversion plan (for an elastic conversion)
+ * @param space MD space
+ */
+template <typename IntT, typename MortonT,
+          typename SpectrumConverter = ScalarSpectrumConverter>
+void convert_events(std::vector<MDEvent<3, IntT, MortonT>> &mdEvents,
+                    TofEventList &tofEvents, const ConversionPlan &plan,
+                    const MDSpaceBounds<3> &space) {
+  if (plan.conversion_info.energy_mode != EnergyTransferMode::Elastic) {
+    throw std::runtime_error("Q space conversion requires an elastic "
+                             "conversion plan");
+  }
+
+  convert_spectra<SpectrumConverter, 3>(mdEvents, tofEvents, plan, space);
+}
+
+template <typename IntT, typename MortonT>
+void convert_events(std::vector<MDEvent<3, IntT, MortonT>> &mdEvents,
+                    TofEventList &tofEvents, const ConversionInfo &convInfo,
+                    const Instrument &inst, const MDSpaceBounds<3> &space) {
+  convert_events(mdEvents, tofEvents, create_conversion_plan(inst, convInfo),
+                 space);
+}
+
+/**
+ * Converts events to Q space, grouping events into buckets such that a sorted
+ * curve is obtained by sorting each bucket independently (see
+ * sort_event_buckets()), avoiding a global sort.
+ *
+ * Each thread scatters converted events into its own set of buckets, selected
+ * by the most significant bits of the Morton number. Buckets of all threads are
+ * then concatenated (in bucket then thread order).
+ *
+ * When the number of bucket bits is a multiple of the number of dimensions,
+ * each bucket contains the events of a single box at a fixed depth of the box
+ * structure.
+ *
+ * @param mdEvents Output events, converted events are appended
+ * @param tofEvents TOF events
+ * @param plan Conversion plan
+ * @param space MD space
+ * @param bucketBits Number of Morton number bits used to select a bucket
+ * @return Offsets of the start of each bucket (and of the end of the last
+ *         bucket) in the output events
+ */
+template <typename IntT, typename MortonT>
+std::vector<size_t>
+convert_events_bucketed(std::vector<MDEvent<3, IntT, MortonT>> &mdEvents,
+                        TofEventList &tofEvents, const ConversionPlan &plan,
+                        const MDSpaceBounds<3> &space,
+                        const size_t bucketBits = 9) {
+  using EventT = MDEvent<3, IntT, MortonT>;
+
+  if (plan.conversion_info.energy_mode != EnergyTransferMode::Elastic) {
+    throw std::runtime_error("Q space conversion requires an elastic "
+                             "conversion plan");
+  }
+
+  const size_t keyBits = 3 * std::numeric_limits<IntT>::digits;
+  if (bucketBits > keyBits) {
+    throw std::runtime_error("Too many bucket bits for Morton number width");
+  }
+
+  const size_t bucketCount = size_t(1) << bucketBits;
+  const size_t bucketShift = keyBits - bucketBits;
+
+  /* Do preprocessing */
+  const auto eventInfo = preprocess_events(tofEvents);
+  const size_t spectrumCount = eventInfo.spectrum_to_events.size();
+
+  /* Get index of the parameters of each spectrum in the plan */
+  const auto paramIdxs = get_spectrum_indices(plan, eventInfo);
+
+  const size_t threadCount = omp_get_max_threads();
+  std::vector<std::vector<typename EventT::ZCurve>> threadBuckets(
+      threadCount, std::vector<typename EventT::ZCurve>(bucketCount));
+
+  /* Convert events, scattering them into thread local buckets */
+#pragma omp parallel num_threads(threadCount)
+  {
+    auto &buckets = threadBuckets[omp_get_thread_num()];
+
+#pragma omp for
+    for (size_t i = 0; i < spectrumCount; i++) {
+      const auto specInfo(eventInfo.spectrum_to_events[i]);
+
+      const auto eventIteratorStart(std::get<1>(specInfo));
+      const auto eventIteratorEnd(std::get<2>(specInfo));
+
+      Eigen::Vector3f center;
+      float weight;
+      for (auto eventIt = eventIteratorStart; eventIt != eventIteratorEnd;
+           ++eventIt) {
+        if (convert_tof_event(plan, paramIdxs[i], space, *eventIt, center,
+                              weight)) {
+          const EventT event(center, space, weight);
+          const auto bucket =
+              static_cast<size_t>(event.mortonNumber() >> bucketShift);
+          buckets[bucket].push_back(event);
+        }
       }
     }
+  }
+
+  /* Calculate the output offset of each thread's part of each bucket */
+  std::vector<size_t> bucketOffsets(bucketCount + 1);
+  std::vector<size_t> threadBucketOffsets(bucketCount * threadCount);
+  size_t offset(mdEvents.size());
+  for (size_t b = 0; b < bucketCount; b++) {
+    bucketOffsets[b] = offset;
+    for (size_t t = 0; t < threadCount; t++) {
+      threadBucketOffsets[b * threadCount + t] = offset;
+      offset += threadBuckets[t][b].size();
+    }
+  }
+  bucketOffsets[bucketCount] = offset;
+  mdEvents.resize(offset);
 
-#pragma omp critical
-    {
-      /* Add to event list */
-      mdEvents.insert(mdEvents.cend(), mdEventsForSpectrum.begin(),
-                      mdEventsForSpectrum.end());
+  /* Concatenate buckets, releasing thread local buckets as they are copied */
+#pragma omp parallel for
+  for (size_t t = 0; t < threadCount; t++) {
+    for (size_t b = 0; b < bucketCount; b++) {
+      auto &bucket = threadBuckets[t][b];
+      std::copy(bucket.cbegin(), bucket.cend(),
+                mdEvents.begin() + threadBucketOffsets[b * threadCount + t]);
+      typename EventT::ZCurve().swap(bucket);
     }
   }
+
+  return bucketOffsets;
+}
+
+/**
+ * Sorts each bucket of events produced by convert_events_bucketed(), in
+ * parallel.
+ *
+ * @param mdEvents Events
+ * @param bucketOffsets Offsets of the start of each bucket (and of the end of
+ *                      the last bucket)
+ */
+template <typename EventT>
+void sort_event_buckets(std::vector<EventT> &mdEvents,
+                        const std::vector<size_t> &bucketOffsets) {
+#pragma omp parallel for schedule(dynamic)
+  for (size_t b = 0; b < bucketOffsets.size() - 1; b++) {
+    std::sort(mdEvents.begin() + bucketOffsets[b],
+              mdEvents.begin() + bucketOffsets[b + 1]);
+  }
 }
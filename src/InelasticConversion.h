@@ -0,0 +1,327 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "Constants.h"
+#include "EventToMDEventConversion.h"
+#include "MDEvent.h"
+#include "TofEvent.h"
+#include "Types.h"
+
+#pragma once
+
+/**
+ * Converts a single TOF event to (Qx, Qy, Qz, energy transfer) space.
+ *
+ * The TOF minus the time spent on the fixed energy leg gives the wavenumber of
+ * the other leg (final in direct geometry, incident in indirect geometry),
+ * Q = ki - kf and the energy transfer is Ei - Ef.
+ *
+ * @param plan Conversion plan (for an inelastic conversion)
+ * @param paramIdx Index of parameters for the spectrum of the event
+ * @param space MD space
+ * @param event TOF event
+ * @param center Output MD space coordinates
+ * @param weight Output weight
+ * @return True if the event is within the MD space
+ */
+inline bool convert_tof_event_inelastic(const ConversionPlan &plan,
+                                        const size_t paramIdx,
+                                        const MDSpaceBounds<4> &space,
+                                        const TofEvent &event,
+                                        MDCoordinate<4> &center,
+                                        float &weight) {
+  const bool direct =
+      plan.conversion_info.energy_mode == EnergyTransferMode::Direct;
+
+  /* Events arriving before the fixed energy leg could have been travelled are
+   * not physical */
+  const double time = event.tof - plan.fixed_time[paramIdx];
+  if (time <= 0.0) {
+    return false;
+  }
+
+  const double wavenumber = plan.conversion_factor[paramIdx] / time;
+  const float wavenumberF = static_cast<float>(wavenumber);
+  const float fixedWavenumber =
+      static_cast<float>(plan.fixed_wavenumber[paramIdx]);
+
+  const float ki = direct ? fixedWavenumber : wavenumberF;
+  const float kf = direct ? wavenumberF : fixedWavenumber;
+
+  const auto &incidentDir = plan.incident_direction;
+  const auto &finalDir = plan.final_direction[paramIdx];
+  for (size_t a = 0; a < 3; a++) {
+    center[a] = incidentDir[a] * ki - finalDir[a] * kf;
+  }
+
+  const double energy = WavenumberSquaredToEnergy * wavenumber * wavenumber;
+  center[3] = static_cast<float>(direct ? plan.fixed_energy[paramIdx] - energy
+                                        : energy - plan.fixed_energy[paramIdx]);
+
+  weight = event.weight;
+
+  return CheckCoordinatesInMDSpace<4>(space, center);
+}
+
+/**
+ * Converts events of a single spectrum to (Q, energy transfer) space, one event
+ * at a time.
+ */
+struct ScalarInelasticSpectrumConverter {
+  /**
+   * @see ScalarSpectrumConverter::count
+   */
+  static size_t count(const ConversionPlan &plan, const size_t paramIdx,
+                      const MDSpaceBounds<4> &space, const TofEvent *events,
+                      const size_t eventCount) {
+    size_t inSpaceCount(0);
+    MDCoordinate<4> center;
+    float weight;
+    for (size_t i = 0; i < eventCount; i++) {
+      if (convert_tof_event_inelastic(plan, paramIdx, space, events[i], center,
+                                      weight)) {
+        inSpaceCount++;
+      }
+    }
+    return inSpaceCount;
+  }
+
+  /**
+   * @see ScalarSpectrumConverter::convert
+   */
+  template <typename IntT, typename MortonT>
+  static size_t convert(const ConversionPlan &plan, const size_t paramIdx,
+                        const MDSpaceBounds<4> &space, const TofEvent *events,
+                        const size_t eventCount,
+                        MDEvent<4, IntT, MortonT> *out) {
+    size_t outIdx(0);
+    MDCoordinate<4> center;
+    float weight;
+    for (size_t i = 0; i < eventCount; i++) {
+      if (convert_tof_event_inelastic(plan, paramIdx, space, events[i], center,
+                                      weight)) {
+        out[outIdx++] = MDEvent<4, IntT, MortonT>(center, space, weight);
+      }
+    }
+    return outIdx;
+  }
+};
+
+/**
+ * Converts events of a single spectrum to (Q, energy transfer) space, in
+ * batches of a fixed number of events.
+ *
+ * As VectorisedSpectrumConverter, the TOF of the events of a batch are gathered
+ * into an array and all events of the batch are converted by a single loop that
+ * is vectorised (via OpenMP SIMD), see convert_event_batches().
+ *
+ * Results are identical to those of ScalarInelasticSpectrumConverter.
+ */
+class VectorisedInelasticSpectrumConverter {
+public:
+  static constexpr size_t BatchSize = 16;
+
+  /**
+   * Parameters of a spectrum and MD space, as scalars.
+   */
+  struct Parameters {
+    Parameters(const ConversionPlan &plan, const size_t paramIdx,
+               const MDSpaceBounds<4> &space)
+        : conversionFactor(plan.conversion_factor[paramIdx]),
+          fixedTime(plan.fixed_time[paramIdx]),
+          fixedEnergy(plan.fixed_energy[paramIdx]),
+          fixedWavenumber(static_cast<float>(plan.fixed_wavenumber[paramIdx])),
+          direct(plan.conversion_info.energy_mode ==
+                 EnergyTransferMode::Direct) {
+      for (size_t a = 0; a < 3; a++) {
+        incidentDir[a] = plan.incident_direction[a];
+        finalDir[a] = plan.final_direction[paramIdx][a];
+      }
+      for (size_t a = 0; a < 4; a++) {
+        lower[a] = space(a, 0);
+        upper[a] = space(a, 1);
+        range[a] = upper[a] - lower[a];
+      }
+    }
+
+    double conversionFactor;
+    double fixedTime;
+    double fixedEnergy;
+    float fixedWavenumber;
+    bool direct;
+
+    float incidentDir[3];
+    float finalDir[3];
+    float lower[4];
+    float upper[4];
+    float range[4];
+  };
+
+  /**
+   * @see ScalarSpectrumConverter::count
+   */
+  static size_t count(const ConversionPlan &plan, const size_t paramIdx,
+                      const MDSpaceBounds<4> &space, const TofEvent *events,
+                      const size_t eventCount) {
+    const Parameters p(plan, paramIdx, space);
+    return p.direct ? countEvents<true>(p, events, eventCount)
+                    : countEvents<false>(p, events, eventCount);
+  }
+
+  /**
+   * @see ScalarSpectrumConverter::convert
+   */
+  template <typename IntT, typename MortonT>
+  static size_t convert(const ConversionPlan &plan, const size_t paramIdx,
+                        const MDSpaceBounds<4> &space, const TofEvent *events,
+                        const size_t eventCount,
+                        MDEvent<4, IntT, MortonT> *out) {
+    const Parameters p(plan, paramIdx, space);
+
+    float tofs[BatchSize];
+    return convert_event_batches<BatchSize>(
+        eventCount, out,
+        [&p, events, &tofs](const size_t batchStart, const size_t batchCount,
+                            IntT (&intCoords)[4][BatchSize], bool *inSpace,
+                            float *weights) {
+          /* Gather TOF and weight of the batch into contiguous arrays */
+          const TofEvent *batch = events + batchStart;
+          for (size_t i = 0; i < batchCount; i++) {
+            tofs[i] = batch[i].tof;
+            weights[i] = batch[i].weight;
+          }
+
+          if (p.direct) {
+            convertBatch<IntT, true>(p, batchCount, tofs, intCoords, inSpace);
+          } else {
+            convertBatch<IntT, false>(p, batchCount, tofs, intCoords, inSpace);
+          }
+        });
+  }
+
+private:
+  /**
+   * Converts the TOF of an event, giving its Q and energy transfer.
+   *
+   * @return True if the event is within the MD space
+   */
+  template <bool Direct>
+  static bool convertTof(const Parameters &p, const float tof, float &qx,
+                         float &qy, float &qz, float &de) {
+    const double time = tof - p.fixedTime;
+    const double wavenumber = p.conversionFactor / time;
+    const float wavenumberF = static_cast<float>(wavenumber);
+
+    const float ki = Direct ? p.fixedWavenumber : wavenumberF;
+    const float kf = Direct ? wavenumberF : p.fixedWavenumber;
+
+    qx = p.incidentDir[0] * ki - p.finalDir[0] * kf;
+    qy = p.incidentDir[1] * ki - p.finalDir[1] * kf;
+    qz = p.incidentDir[2] * ki - p.finalDir[2] * kf;
+
+    const double energy = WavenumberSquaredToEnergy * wavenumber * wavenumber;
+    de = static_cast<float>(Direct ? p.fixedEnergy - energy
+                                   : energy - p.fixedEnergy);
+
+    return !((time <= 0.0) | (qx < p.lower[0]) | (qx > p.upper[0]) |
+             (qy < p.lower[1]) | (qy > p.upper[1]) | (qz < p.lower[2]) |
+             (qz > p.upper[2]) | (de < p.lower[3]) | (de > p.upper[3]));
+  }
+
+  template <bool Direct>
+  static size_t countEvents(const Parameters &p, const TofEvent *events,
+                            const size_t eventCount) {
+    return count_events_in_space(eventCount, [&p, events](const size_t i) {
+      float qx, qy, qz, de;
+      return convertTof<Direct>(p, events[i].tof, qx, qy, qz, de);
+    });
+  }
+
+  /**
+   * Converts a batch of events.
+   *
+   * @see VectorisedSpectrumConverter::convertBatch
+   *
+   * @param p Parameters
+   * @param count Number of events in batch
+   * @param tofs TOF of each event
+   * @param intCoords Output integer coordinates of each event
+   * @param inSpace Output flag indicating if each event is within the MD space
+   */
+  template <typename IntT, bool Direct>
+  static void convertBatch(const Parameters &p, const size_t count,
+                           const float *tofs, IntT (&intCoords)[4][BatchSize],
+                           bool *inSpace) {
+    const float intMax = std::numeric_limits<IntT>::max();
+
+#pragma omp simd
+    for (size_t i = 0; i < count; i++) {
+      float qx, qy, qz, de;
+      const bool eventInSpace = convertTof<Direct>(p, tofs[i], qx, qy, qz, de);
+      inSpace[i] = eventInSpace;
+
+      /* Integer coordinates (events outside of the MD space are clamped to its
+       * lower bound so that conversion to integer is defined) */
+      const float cx = eventInSpace ? qx : p.lower[0];
+      const float cy = eventInSpace ? qy : p.lower[1];
+      const float cz = eventInSpace ? qz : p.lower[2];
+      const float ce = eventInSpace ? de : p.lower[3];
+      intCoords[0][i] =
+          static_cast<IntT>(((cx - p.lower[0]) / p.range[0]) * intMax);
+      intCoords[1][i] =
+          static_cast<IntT>(((cy - p.lower[1]) / p.range[1]) * intMax);
+      intCoords[2][i] =
+          static_cast<IntT>(((cz - p.lower[2]) / p.range[2]) * intMax);
+      intCoords[3][i] =
+          static_cast<IntT>(((ce - p.lower[3]) / p.range[3]) * intMax);
+    }
+  }
+};
+
+/**
+ * Converts events to (Qx, Qy, Qz, energy transfer) space, for direct or
+ * indirect geometry.
+ *
+ * @see convert_spectra()
+ *
+ * @tparam SpectrumConverter Converter for the events of a single spectrum
+ *
+ * @param mdEvents Output events, converted events are appended
+ * @param tofEvents TOF events
+ * @param plan Conversion plan (for an inelastic conversion)
+ * @param space MD space, energy transfer (in meV) is the fourth dimension
+ */
+template <typename IntT, typename MortonT,
+          typename SpectrumConverter = ScalarInelasticSpectrumConverter>
+void convert_events_inelastic(std::vector<MDEvent<4, IntT, MortonT>> &mdEvents,
+                              TofEventList &tofEvents,
+                              const ConversionPlan &plan,
+                              const MDSpaceBounds<4> &space) {
+  if (plan.conversion_info.energy_mode == EnergyTransferMode::Elastic) {
+    throw std::runtime_error("Inelastic conversion requires an inelastic "
+                             "conversion plan");
+  }
+
+  convert_spectra<SpectrumConverter, 4>(mdEvents, tofEvents, plan, space);
+}
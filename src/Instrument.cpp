@@ -19,12 +19,256 @@
 #include "Instrument.h"
 
 #include <cmath>
+#include <cstddef>
+#include <functional>
 #include <istream>
+#include <numeric>
+#include <stdexcept>
 
 #include <h5cpp/hdf5.hpp>
 
 using namespace hdf5;
 
+constexpr size_t Detectors::NoDetector;
+constexpr uint32_t Detectors::NoIndexEntry;
+constexpr size_t Detectors::MaxIndexSparsity;
+constexpr size_t SpectrumToDetectorMapping::NoSpectrum;
+
+/**
+ * Creates detectors from a list of detector IDs and positions.
+ *
+ * @param detectors Detector ID and detector of each detector
+ */
+Detectors::Detectors(
+    std::initializer_list<std::pair<detid_t, Detector>> detectors) {
+  for (const auto &detector : detectors) {
+    add(detector.first, detector.second.position);
+  }
+}
+
+/**
+ * Creates detectors from arrays of detector IDs and positions.
+ *
+ * @param ids Detector IDs (in any order, without duplicates)
+ * @param positions Positions of each detector (x, y and z of each detector in
+ *                  turn)
+ */
+Detectors::Detectors(const std::vector<detid_t> &ids,
+                     const std::vector<float> &positions) {
+  if (positions.size() != ids.size() * 3) {
+    throw std::runtime_error("Detector IDs and positions differ in length");
+  }
+
+  /* Get order of detectors by ID */
+  std::vector<size_t> order(ids.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (!std::is_sorted(ids.cbegin(), ids.cend())) {
+    std::sort(order.begin(), order.end(),
+              [&ids](size_t a, size_t b) { return ids[a] < ids[b]; });
+  }
+
+  m_ids.resize(ids.size());
+  m_x.resize(ids.size());
+  m_y.resize(ids.size());
+  m_z.resize(ids.size());
+
+  for (size_t i = 0; i < order.size(); i++) {
+    const size_t source(order[i]);
+    m_ids[i] = ids[source];
+    m_x[i] = positions[source * 3];
+    m_y[i] = positions[source * 3 + 1];
+    m_z[i] = positions[source * 3 + 2];
+
+    if (i > 0 && m_ids[i] == m_ids[i - 1]) {
+      throw std::runtime_error("Duplicate detector ID " +
+                               std::to_string(m_ids[i]));
+    }
+  }
+
+  buildIndex();
+}
+
+/**
+ * Adds a detector.
+ *
+ * Adding detectors in order of detector ID only appends to the existing
+ * storage.
+ *
+ * @param id Detector ID
+ * @param position Detector position
+ */
+void Detectors::add(const detid_t id, const Eigen::Vector3f &position) {
+  if (contains(id)) {
+    throw std::runtime_error("Duplicate detector ID " + std::to_string(id));
+  }
+
+  const bool append = m_ids.empty() || id > m_ids.back();
+  const auto it = append ? m_ids.cend()
+                          : std::lower_bound(m_ids.cbegin(), m_ids.cend(), id);
+  const size_t index = std::distance(m_ids.cbegin(), it);
+
+  m_ids.insert(m_ids.begin() + index, id);
+  m_x.insert(m_x.begin() + index, position[0]);
+  m_y.insert(m_y.begin() + index, position[1]);
+  m_z.insert(m_z.begin() + index, position[2]);
+
+  /* Extend the index table when appending, if it remains dense enough */
+  const size_t span = id - m_indexOffset + 1;
+  if (append && !m_index.empty() && span <= MaxIndexSparsity * m_ids.size()) {
+    m_index.resize(span, NoIndexEntry);
+    m_index[span - 1] = static_cast<uint32_t>(index);
+  } else {
+    buildIndex();
+  }
+}
+
+/**
+ * Builds the detector ID to index table, if the detector IDs are dense enough.
+ */
+void Detectors::buildIndex() {
+  m_index.clear();
+  if (m_ids.empty() || m_ids.size() >= NoIndexEntry) {
+    return;
+  }
+
+  const size_t span = m_ids.back() - m_ids.front() + 1;
+  if (span > MaxIndexSparsity * m_ids.size()) {
+    return;
+  }
+
+  m_indexOffset = m_ids.front();
+  m_index.resize(span, NoIndexEntry);
+  for (size_t i = 0; i < m_ids.size(); i++) {
+    m_index[m_ids[i] - m_indexOffset] = static_cast<uint32_t>(i);
+  }
+}
+
+/**
+ * Creates a mapping from a list of spectra.
+ *
+ * @param spectra Spectrum number and detector IDs of each spectrum
+ */
+SpectrumToDetectorMapping::SpectrumToDetectorMapping(
+    std::initializer_list<std::pair<specid_t, DetectorIdList>> spectra) {
+  for (const auto &spectrum : spectra) {
+    add(spectrum.first, spectrum.second);
+  }
+}
+
+/**
+ * Creates a mapping from its compressed sparse row form.
+ *
+ * @param spectrumIds Spectrum numbers, strictly increasing
+ * @param offsets Offset of the first detector ID of each spectrum, followed by
+ *                the number of detector IDs
+ * @param detectorIds Detector IDs of all spectra
+ */
+SpectrumToDetectorMapping::SpectrumToDetectorMapping(
+    std::vector<specid_t> spectrumIds, std::vector<size_t> offsets,
+    std::vector<detid_t> detectorIds)
+    : m_spectrumIds(std::move(spectrumIds)), m_offsets(std::move(offsets)),
+      m_detectorIds(std::move(detectorIds)) {
+  if (m_offsets.size() != m_spectrumIds.size() + 1 ||
+      m_offsets.front() != 0 || m_offsets.back() != m_detectorIds.size() ||
+      !std::is_sorted(m_offsets.cbegin(), m_offsets.cend())) {
+    throw std::runtime_error("Invalid spectrum to detector mapping offsets");
+  }
+
+  if (std::adjacent_find(m_spectrumIds.cbegin(), m_spectrumIds.cend(),
+                         std::greater_equal<specid_t>()) !=
+      m_spectrumIds.cend()) {
+    throw std::runtime_error(
+        "Spectrum numbers of mapping must be strictly increasing");
+  }
+}
+
+/**
+ * Adds a spectrum, replacing the detectors of an existing spectrum with the
+ * same spectrum number.
+ *
+ * Adding spectra in order of spectrum number only appends to the existing
+ * storage.
+ *
+ * @param specId Spectrum number
+ * @param detIds Detector IDs
+ */
+void SpectrumToDetectorMapping::add(const specid_t specId,
+                                    const DetectorIdRange &detIds) {
+  /* Append */
+  if (m_spectrumIds.empty() || specId > m_spectrumIds.back()) {
+    m_spectrumIds.push_back(specId);
+    m_detectorIds.insert(m_detectorIds.end(), detIds.begin(), detIds.end());
+    m_offsets.push_back(m_detectorIds.size());
+    return;
+  }
+
+  const auto it =
+      std::lower_bound(m_spectrumIds.cbegin(), m_spectrumIds.cend(), specId);
+  const size_t index = std::distance(m_spectrumIds.cbegin(), it);
+  const auto detBegin = m_detectorIds.begin() + m_offsets[index];
+
+  /* Remove the detectors of an existing spectrum, or insert a new spectrum */
+  ptrdiff_t change = detIds.size();
+  if (*it == specId) {
+    const auto existingCount = m_offsets[index + 1] - m_offsets[index];
+    m_detectorIds.erase(detBegin, detBegin + existingCount);
+    change -= existingCount;
+  } else {
+    m_spectrumIds.insert(it, specId);
+    m_offsets.insert(m_offsets.begin() + index + 1, m_offsets[index]);
+  }
+
+  m_detectorIds.insert(m_detectorIds.begin() + m_offsets[index],
+                       detIds.begin(), detIds.end());
+  for (size_t i = index + 1; i < m_offsets.size(); i++) {
+    m_offsets[i] += change;
+  }
+}
+
+/**
+ * Gets the index of a spectrum.
+ *
+ * @param specId Spectrum number
+ * @return Index of the spectrum, NoSpectrum if there is no such spectrum
+ */
+size_t SpectrumToDetectorMapping::index(const specid_t specId) const {
+  const auto it =
+      std::lower_bound(m_spectrumIds.cbegin(), m_spectrumIds.cend(), specId);
+  return it != m_spectrumIds.cend() && *it == specId
+             ? std::distance(m_spectrumIds.cbegin(), it)
+             : NoSpectrum;
+}
+
+/**
+ * Gets the detector IDs of a spectrum.
+ *
+ * @param specId Spectrum number
+ * @return Detector IDs
+ */
+DetectorIdRange SpectrumToDetectorMapping::at(const specid_t specId) const {
+  const size_t idx = index(specId);
+  if (idx == NoSpectrum) {
+    throw std::runtime_error("No detectors mapped for spectrum " +
+                             std::to_string(specId));
+  }
+  return detectors(idx);
+}
+
+/**
+ * Gets the position of a detector.
+ *
+ * @param inst Instrument
+ * @param detId Detector ID
+ */
+static Eigen::Vector3f get_detector_position(const Instrument &inst,
+                                             const detid_t detId) {
+  const size_t index = inst.detectors.index(detId);
+  if (index == Detectors::NoDetector) {
+    throw std::runtime_error("No detector with ID " + std::to_string(detId));
+  }
+  return inst.detectors.position(index);
+}
+
 /**
  * Gets L1 (source to sample) distance.
  * @param inst Instrument
@@ -38,10 +282,10 @@ float get_l1(const Instrument &inst) {
  * @param inst Instrument
  * @param detIds Detector IDs
  */
-float get_l2(const Instrument &inst, const DetectorIdList &detIds) {
+float get_l2(const Instrument &inst, const DetectorIdRange &detIds) {
   float l2(0.0f);
   for (const auto detId : detIds) {
-    l2 += (inst.detectors.at(detId).position - inst.sample_position).norm();
+    l2 += (get_detector_position(inst, detId) - inst.sample_position).norm();
   }
   return l2 / detIds.size();
 }
@@ -61,11 +305,11 @@ Eigen::Vector3f get_beam_direction(const Instrument &inst) {
  * @param detIds Detector IDs
  */
 Eigen::Vector3f get_detector_direction(const Instrument &inst,
-                                       const DetectorIdList &detIds) {
+                                       const DetectorIdRange &detIds) {
   Eigen::Vector3f pos(Eigen::Vector3f::Zero());
   for (const auto detId : detIds) {
     const Eigen::Vector3f &detPos =
-        inst.detectors.at(detId).position - inst.sample_position;
+        get_detector_position(inst, detId) - inst.sample_position;
     pos += (detPos / detPos.norm());
   }
   return pos / detIds.size();
@@ -79,7 +323,7 @@ Eigen::Vector3f get_detector_direction(const Instrument &inst,
  * @param detIds Detector IDs
  */
 float get_detector_two_theta(const Instrument &inst,
-                             const DetectorIdList &detIds) {
+                             const DetectorIdRange &detIds) {
   const Eigen::Vector3f beamDir = get_beam_direction(inst);
   const Eigen::Vector3f detectorDir = get_detector_direction(inst, detIds);
   return acos(beamDir.dot(detectorDir));
@@ -123,11 +367,7 @@ void load_instrument(Instrument &inst, const std::string &filename) {
   detPosDataset.read(detectorPositions);
 
   /* Create detectors */
-  auto posCoordIt = detectorPositions.cbegin();
-  for (const auto detId : detectorIds) {
-    inst.detectors[detId] = Detector{
-        Eigen::Vector3f(*(posCoordIt++), *(posCoordIt++), *(posCoordIt++))};
-  }
+  inst.detectors = Detectors(detectorIds, detectorPositions);
 }
 
 /**
@@ -137,14 +377,64 @@ void load_instrument(Instrument &inst, const std::string &filename) {
  * @param inst Reference to instrument to modify
  */
 void generate_1_to_1_spec_det_mapping(Instrument &inst) {
-  specid_t specNo = 0;
+  const size_t numDetectors(inst.detectors.size());
+
+  /* Consecutive spectrum numbers, each with a single detector (in order of
+   * detector ID) */
+  std::vector<specid_t> spectrumIds(numDetectors);
+  std::iota(spectrumIds.begin(), spectrumIds.end(), 0);
+
+  std::vector<size_t> offsets(numDetectors + 1);
+  std::iota(offsets.begin(), offsets.end(), 0);
 
-  /* For each detector */
-  for (const auto &det : inst.detectors) {
-    /* Get detector ID */
-    const auto detId(std::get<0>(det));
+  inst.spectrum_detector_mapping = SpectrumToDetectorMapping(
+      std::move(spectrumIds), std::move(offsets), inst.detectors.ids());
+}
 
-    /* Add entry in mapping with consecutive spectrum numbers */
-    inst.spectrum_detector_mapping[specNo++] = std::vector<detid_t>{detId};
+/**
+ * Adds the bytes of an array to a (64 bit FNV-1a) hash.
+ *
+ * @param hash Hash to update
+ * @param data Array
+ * @param size Size of the array in bytes
+ */
+static void hash_bytes(uint64_t &hash, const void *data, const size_t size) {
+  const auto bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
   }
 }
+
+template <typename T>
+static void hash_vector(uint64_t &hash, const std::vector<T> &values) {
+  const uint64_t size(values.size());
+  hash_bytes(hash, &size, sizeof(size));
+  hash_bytes(hash, values.data(), values.size() * sizeof(T));
+}
+
+/**
+ * Computes a (64 bit FNV-1a) hash identifying the geometry and spectrum to
+ * detector mapping of an instrument, i.e. everything a conversion plan is
+ * derived from besides the conversion info.
+ *
+ * @param inst Instrument
+ * @return Hash
+ */
+uint64_t instrument_hash(const Instrument &inst) {
+  uint64_t hash(14695981039346656037ull);
+
+  hash_bytes(hash, inst.sample_position.data(), 3 * sizeof(float));
+  hash_bytes(hash, inst.source_position.data(), 3 * sizeof(float));
+
+  hash_vector(hash, inst.detectors.ids());
+  hash_vector(hash, inst.detectors.x());
+  hash_vector(hash, inst.detectors.y());
+  hash_vector(hash, inst.detectors.z());
+
+  const auto &mapping = inst.spectrum_detector_mapping;
+  hash_vector(hash, mapping.spectrumIds());
+  hash_vector(hash, mapping.offsets());
+  hash_vector(hash, mapping.detectorIds());
+
+  return hash;
+}
@@ -16,7 +16,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <Eigen/Dense>
@@ -30,9 +35,160 @@ struct Detector {
   Eigen::Vector3f position;
 };
 
-using Detectors = std::map<detid_t, Detector>;
 using DetectorIdList = std::vector<detid_t>;
-using SpectrumToDetectorMapping = std::map<specid_t, DetectorIdList>;
+
+/**
+ * View of a contiguous list of detector IDs (e.g. the detectors of a spectrum
+ * in a SpectrumToDetectorMapping).
+ */
+class DetectorIdRange {
+public:
+  DetectorIdRange(const detid_t *first, const detid_t *last)
+      : m_first(first), m_last(last) {}
+  DetectorIdRange(const DetectorIdList &detIds)
+      : DetectorIdRange(detIds.data(), detIds.data() + detIds.size()) {}
+
+  const detid_t *begin() const { return m_first; }
+  const detid_t *end() const { return m_last; }
+
+  size_t size() const { return m_last - m_first; }
+  bool empty() const { return m_first == m_last; }
+
+  detid_t operator[](const size_t i) const { return m_first[i]; }
+
+  DetectorIdList toList() const { return DetectorIdList(m_first, m_last); }
+
+private:
+  const detid_t *m_first;
+  const detid_t *m_last;
+};
+
+/**
+ * Detectors of an instrument.
+ *
+ * Detectors are stored in order of detector ID, with each coordinate of the
+ * positions in a separate array indexed by the (dense) detector index. Indices
+ * are found from detector IDs via a table covering the range of detector IDs,
+ * or by searching the sorted IDs when they are too sparse for a table.
+ */
+class Detectors {
+public:
+  static constexpr size_t NoDetector = std::numeric_limits<size_t>::max();
+
+  Detectors() = default;
+  Detectors(std::initializer_list<std::pair<detid_t, Detector>> detectors);
+  Detectors(const std::vector<detid_t> &ids,
+            const std::vector<float> &positions);
+
+  void add(const detid_t id, const Eigen::Vector3f &position);
+
+  size_t size() const { return m_ids.size(); }
+  bool empty() const { return m_ids.empty(); }
+
+  const std::vector<detid_t> &ids() const { return m_ids; }
+  const std::vector<float> &x() const { return m_x; }
+  const std::vector<float> &y() const { return m_y; }
+  const std::vector<float> &z() const { return m_z; }
+
+  detid_t id(const size_t index) const { return m_ids[index]; }
+  Eigen::Vector3f position(const size_t index) const {
+    return Eigen::Vector3f(m_x[index], m_y[index], m_z[index]);
+  }
+
+  /**
+   * Gets the index of a detector.
+   *
+   * @param id Detector ID
+   * @return Index of the detector, NoDetector if there is no such detector
+   */
+  size_t index(const detid_t id) const {
+    if (!m_index.empty()) {
+      if (id < m_indexOffset || id - m_indexOffset >= m_index.size()) {
+        return NoDetector;
+      }
+      const auto index = m_index[id - m_indexOffset];
+      return index == NoIndexEntry ? NoDetector : index;
+    }
+
+    const auto it = std::lower_bound(m_ids.cbegin(), m_ids.cend(), id);
+    return it != m_ids.cend() && *it == id ? std::distance(m_ids.cbegin(), it)
+                                           : NoDetector;
+  }
+
+  bool contains(const detid_t id) const { return index(id) != NoDetector; }
+
+private:
+  static constexpr uint32_t NoIndexEntry =
+      std::numeric_limits<uint32_t>::max();
+
+  /* Maximum number of table entries per detector */
+  static constexpr size_t MaxIndexSparsity = 32;
+
+  void buildIndex();
+
+  std::vector<detid_t> m_ids;
+  std::vector<float> m_x;
+  std::vector<float> m_y;
+  std::vector<float> m_z;
+
+  /* Index of each detector ID from m_indexOffset (empty if the IDs are too
+   * sparse) */
+  detid_t m_indexOffset = 0;
+  std::vector<uint32_t> m_index;
+};
+
+/**
+ * Mapping of spectrum numbers to the IDs of the detectors contributing to each
+ * spectrum.
+ *
+ * Stored in compressed sparse row form: spectra are stored in order of
+ * spectrum number, the detector IDs of all spectra are stored in a single array
+ * with the offset of the first detector ID of each spectrum (and the end of the
+ * last spectrum) in a second array.
+ */
+class SpectrumToDetectorMapping {
+public:
+  static constexpr size_t NoSpectrum = std::numeric_limits<size_t>::max();
+
+  SpectrumToDetectorMapping() = default;
+  SpectrumToDetectorMapping(
+      std::initializer_list<std::pair<specid_t, DetectorIdList>> spectra);
+  SpectrumToDetectorMapping(std::vector<specid_t> spectrumIds,
+                            std::vector<size_t> offsets,
+                            std::vector<detid_t> detectorIds);
+
+  void add(const specid_t specId, const DetectorIdRange &detIds);
+
+  size_t size() const { return m_spectrumIds.size(); }
+  bool empty() const { return m_spectrumIds.empty(); }
+
+  const std::vector<specid_t> &spectrumIds() const { return m_spectrumIds; }
+  const std::vector<size_t> &offsets() const { return m_offsets; }
+  const std::vector<detid_t> &detectorIds() const { return m_detectorIds; }
+
+  specid_t spectrumId(const size_t index) const {
+    return m_spectrumIds[index];
+  }
+
+  /**
+   * Gets the detector IDs of a spectrum.
+   *
+   * @param index Index of the spectrum
+   * @return Detector IDs
+   */
+  DetectorIdRange detectors(const size_t index) const {
+    return DetectorIdRange(m_detectorIds.data() + m_offsets[index],
+                           m_detectorIds.data() + m_offsets[index + 1]);
+  }
+
+  size_t index(const specid_t specId) const;
+  DetectorIdRange at(const specid_t specId) const;
+
+private:
+  std::vector<specid_t> m_spectrumIds;
+  std::vector<size_t> m_offsets = {0};
+  std::vector<detid_t> m_detectorIds;
+};
 
 struct Instrument {
   Eigen::Vector3f sample_position;
@@ -42,13 +198,29 @@ struct Instrument {
 };
 
 float get_l1(const Instrument &inst);
-float get_l2(const Instrument &inst, const DetectorIdList &detIds);
+float get_l2(const Instrument &inst, const DetectorIdRange &detIds);
 Eigen::Vector3f get_beam_direction(const Instrument &inst);
 Eigen::Vector3f get_detector_direction(const Instrument &inst,
-                                       const DetectorIdList &detIds);
+                                       const DetectorIdRange &detIds);
 float get_detector_two_theta(const Instrument &inst,
-                             const DetectorIdList &detIds);
+                             const DetectorIdRange &detIds);
+
+inline float get_l2(const Instrument &inst, const DetectorIdList &detIds) {
+  return get_l2(inst, DetectorIdRange(detIds));
+}
+
+inline Eigen::Vector3f get_detector_direction(const Instrument &inst,
+                                              const DetectorIdList &detIds) {
+  return get_detector_direction(inst, DetectorIdRange(detIds));
+}
+
+inline float get_detector_two_theta(const Instrument &inst,
+                                    const DetectorIdList &detIds) {
+  return get_detector_two_theta(inst, DetectorIdRange(detIds));
+}
 
 void load_instrument(Instrument &inst, const std::string &filename);
 
 void generate_1_to_1_spec_det_mapping(Instrument &inst);
+
+uint64_t instrument_hash(const Instrument &inst);
@@ -0,0 +1,894 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "InstrumentDefinitionLoader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+using boost::property_tree::ptree;
+
+static const char GeometryCacheMagic[4] = {'M', 'D', 'I', 'G'};
+static const uint32_t GeometryCacheVersion = 1;
+
+template <typename T>
+static void write_binary(std::ofstream &file, const T &value) {
+  file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static void read_binary(std::ifstream &file, T &value) {
+  file.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+template <typename T>
+static void write_binary_vector(std::ofstream &file,
+                                const std::vector<T> &values) {
+  write_binary(file, static_cast<uint64_t>(values.size()));
+  file.write(reinterpret_cast<const char *>(values.data()),
+             values.size() * sizeof(T));
+}
+
+template <typename T>
+static void read_binary_vector(std::ifstream &file, std::vector<T> &values) {
+  uint64_t size;
+  read_binary(file, size);
+  values.resize(size);
+  file.read(reinterpret_cast<char *>(values.data()), size * sizeof(T));
+}
+
+/**
+ * Geometry expanded from an instrument definition or read from a geometry
+ * cache file.
+ */
+struct InstrumentGeometry {
+  Eigen::Vector3f source_position;
+  Eigen::Vector3f sample_position;
+  std::vector<detid_t> detector_ids;
+  std::vector<float> detector_positions;
+};
+
+/**
+ * Absolute position and orientation of a component.
+ */
+struct Placement {
+  Eigen::Vector3d position;
+  Eigen::Quaterniond rotation;
+};
+
+enum class ComponentKind {
+  Assembly,
+  Detector,
+  Monitor,
+  RectangularDetector,
+  Source,
+  SamplePosition
+};
+
+enum class Facing { None, Default, Point };
+
+/**
+ * Location of a component within its parent.
+ */
+struct ComponentLocation {
+  Eigen::Vector3d position;
+  Eigen::Quaterniond rotation;
+  Facing facing;
+  Eigen::Vector3d facing_point;
+};
+
+/**
+ * Placement of a type within a parent type, with the IDs of its detectors.
+ *
+ * Rectangular detectors are given IDs from the rectangular ID parameters,
+ * detectors in other components from the ID list of the nearest enclosing
+ * component that has one.
+ */
+struct Component {
+  size_t type;
+  std::vector<ComponentLocation> locations;
+  const std::vector<int64_t> *id_list;
+
+  int64_t id_start;
+  bool id_fill_by_first_y;
+  int64_t id_step_by_row;
+  int64_t id_step;
+};
+
+/**
+ * Component type, parsed once however many times it is placed.
+ */
+struct ComponentType {
+  std::string name;
+  ComponentKind kind;
+  std::vector<Component> components;
+  size_t detector_count;
+
+  /* Pixel grid of a rectangular detector */
+  int64_t x_pixels;
+  double x_start;
+  double x_step;
+  int64_t y_pixels;
+  double y_start;
+  double y_step;
+};
+
+/**
+ * Detector IDs consumed, in order of component definition, by the detectors
+ * of a component that has an ID list.
+ */
+struct IdSource {
+  const std::vector<int64_t> *ids;
+  size_t next;
+};
+
+static const ptree EmptyTree;
+
+/* Type index of a type whose components are being parsed */
+static const size_t TypeInProgress = std::numeric_limits<size_t>::max();
+
+static const ptree &attributes(const ptree &element) {
+  return element.get_child("<xmlattr>", EmptyTree);
+}
+
+static bool has_attribute(const ptree &element, const std::string &name) {
+  return attributes(element).count(name) > 0;
+}
+
+template <typename T>
+static T get_attribute(const ptree &element, const std::string &name) {
+  const auto &attrs = attributes(element);
+  if (attrs.count(name) == 0) {
+    throw std::runtime_error("Missing attribute " + name);
+  }
+  return attrs.get<T>(name);
+}
+
+template <typename T>
+static T get_attribute(const ptree &element, const std::string &name,
+                       const T &defaultValue) {
+  return attributes(element).get<T>(name, defaultValue);
+}
+
+static std::string to_lower(std::string str) {
+  std::transform(str.begin(), str.end(), str.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return str;
+}
+
+static ComponentKind parse_kind(const ptree &type) {
+  const auto is =
+      to_lower(get_attribute<std::string>(type, "is", std::string()));
+
+  if (is == "detector") {
+    return ComponentKind::Detector;
+  } else if (is == "monitor") {
+    return ComponentKind::Monitor;
+  } else if (is == "rectangular_detector" || is == "rectangulardetector") {
+    return ComponentKind::RectangularDetector;
+  } else if (is == "source") {
+    return ComponentKind::Source;
+  } else if (is == "samplepos" || is == "sampleposition") {
+    return ComponentKind::SamplePosition;
+  }
+  return ComponentKind::Assembly;
+}
+
+/**
+ * Parsed instrument definition (IDF).
+ *
+ * Supports the subset of the IDF format used by the definitions in
+ * scripts/idfs: nested components with x/y/z or r/t/p locations, rot
+ * attributes and nested rot elements, facing (per location or by default),
+ * rectangular detectors and ID lists.
+ */
+class InstrumentDefinition {
+public:
+  explicit InstrumentDefinition(const ptree &root);
+
+  void expand(InstrumentGeometry &geometry) const;
+
+private:
+  size_t parseType(const std::string &name);
+  Component parseComponent(const ptree &element);
+  ComponentLocation parseLocation(const ptree &element) const;
+  Eigen::Vector3d parsePosition(const ptree &element) const;
+  Eigen::Quaterniond parseRotation(const ptree &element,
+                                   const std::string &angleAttribute) const;
+
+  size_t detectorCount(const Component &component) const;
+  Placement place(const Placement &parent, const ComponentLocation &location,
+                  const bool orient) const;
+
+  void expandComponent(const Component &component, const Placement &parent,
+                       IdSource &idSource, detid_t *ids, float *positions,
+                       size_t &count) const;
+  void expandRectangularDetector(const Component &component,
+                                 const Placement &placement, detid_t *ids,
+                                 float *positions, size_t &count) const;
+
+  std::map<std::string, const ptree *> m_typeElements;
+  std::map<std::string, std::vector<int64_t>> m_idLists;
+
+  std::vector<ComponentType> m_types;
+  std::map<std::string, size_t> m_typeIndices;
+
+  /* Top level components */
+  std::vector<Component> m_components;
+
+  double m_angleToRadians;
+  bool m_haveDefaultFacing;
+  Eigen::Vector3d m_defaultFacing;
+};
+
+/**
+ * Parses the types, ID lists, defaults and components of an instrument
+ * definition.
+ *
+ * @param root Root (instrument) element of the definition
+ */
+InstrumentDefinition::InstrumentDefinition(const ptree &root)
+    : m_angleToRadians(M_PI / 180.0), m_haveDefaultFacing(false),
+      m_defaultFacing(Eigen::Vector3d::Zero()) {
+  for (const auto &child : root) {
+    if (child.first == "type") {
+      m_typeElements[get_attribute<std::string>(child.second, "name")] =
+          &child.second;
+    } else if (child.first == "idlist") {
+      auto &ids = m_idLists[get_attribute<std::string>(child.second, "idname")];
+      for (const auto &id : child.second) {
+        if (id.first != "id") {
+          continue;
+        }
+        if (has_attribute(id.second, "val")) {
+          ids.push_back(get_attribute<int64_t>(id.second, "val"));
+        } else {
+          const auto start = get_attribute<int64_t>(id.second, "start");
+          const auto end = get_attribute<int64_t>(id.second, "end");
+          const auto step = get_attribute<int64_t>(id.second, "step", 1);
+          if (step <= 0) {
+            throw std::runtime_error("Invalid ID list step");
+          }
+          for (int64_t i = start; i <= end; i += step) {
+            ids.push_back(i);
+          }
+        }
+      }
+    }
+  }
+
+  const auto &defaults = root.get_child("defaults", EmptyTree);
+
+  const auto angleUnit = get_attribute<std::string>(
+      defaults.get_child("angle", EmptyTree), "unit", "degree");
+  if (angleUnit == "radian") {
+    m_angleToRadians = 1.0;
+  } else if (angleUnit != "degree") {
+    throw std::runtime_error("Unsupported angle unit " + angleUnit);
+  }
+
+  const auto lengthUnit = get_attribute<std::string>(
+      defaults.get_child("length", EmptyTree), "unit", "metre");
+  if (lengthUnit != "metre" && lengthUnit != "meter") {
+    throw std::runtime_error("Unsupported length unit " + lengthUnit);
+  }
+
+  if (get_attribute<std::string>(defaults.get_child("offsets", EmptyTree),
+                                 "spherical", "vectors") != "vectors") {
+    throw std::runtime_error("Unsupported spherical offsets");
+  }
+
+  const auto facing = defaults.get_child_optional("components-are-facing");
+  if (facing) {
+    m_haveDefaultFacing = true;
+    m_defaultFacing = parsePosition(*facing);
+  }
+
+  for (const auto &child : root) {
+    if (child.first == "component") {
+      m_components.push_back(parseComponent(child.second));
+    }
+  }
+}
+
+/**
+ * Parses a type (and the types it contains) if not already parsed.
+ *
+ * @param name Name of the type
+ * @return Index of the type
+ */
+size_t InstrumentDefinition::parseType(const std::string &name) {
+  const auto it = m_typeIndices.find(name);
+  if (it != m_typeIndices.cend()) {
+    if (it->second == TypeInProgress) {
+      throw std::runtime_error("Type " + name + " contains itself");
+    }
+    return it->second;
+  }
+
+  const auto element = m_typeElements.find(name);
+  if (element == m_typeElements.cend()) {
+    throw std::runtime_error("No type named " + name);
+  }
+  const ptree &typeElement = *element->second;
+
+  /* Mark as in progress to detect cyclic definitions */
+  m_typeIndices[name] = TypeInProgress;
+
+  ComponentType type{name, parse_kind(typeElement), {}, 0, 0, 0.0, 0.0, 0,
+                     0.0, 0.0};
+
+  switch (type.kind) {
+  case ComponentKind::Detector:
+    type.detector_count = 1;
+    break;
+  case ComponentKind::RectangularDetector: {
+    const auto pixelType = get_attribute<std::string>(typeElement, "type");
+    const auto pixelElement = m_typeElements.find(pixelType);
+    if (pixelElement == m_typeElements.cend() ||
+        parse_kind(*pixelElement->second) != ComponentKind::Detector) {
+      throw std::runtime_error("Rectangular detector " + name +
+                               " does not have detector pixels");
+    }
+    type.x_pixels = get_attribute<int64_t>(typeElement, "xpixels");
+    type.x_start = get_attribute<double>(typeElement, "xstart");
+    type.x_step = get_attribute<double>(typeElement, "xstep");
+    type.y_pixels = get_attribute<int64_t>(typeElement, "ypixels");
+    type.y_start = get_attribute<double>(typeElement, "ystart");
+    type.y_step = get_attribute<double>(typeElement, "ystep");
+    if (type.x_pixels < 0 || type.y_pixels < 0) {
+      throw std::runtime_error("Invalid number of pixels in " + name);
+    }
+    type.detector_count = type.x_pixels * type.y_pixels;
+  } break;
+  case ComponentKind::Assembly:
+    for (const auto &child : typeElement) {
+      if (child.first == "component") {
+        type.components.push_back(parseComponent(child.second));
+        type.detector_count += detectorCount(type.components.back());
+      }
+    }
+    break;
+  default:
+    break;
+  }
+
+  m_types.push_back(std::move(type));
+  m_typeIndices[name] = m_types.size() - 1;
+  return m_types.size() - 1;
+}
+
+/**
+ * Parses a component element.
+ *
+ * @param element Component element
+ * @return Component
+ */
+Component InstrumentDefinition::parseComponent(const ptree &element) {
+  if (element.count("locations") > 0) {
+    throw std::runtime_error("Unsupported locations element");
+  }
+
+  const auto typeName = get_attribute<std::string>(element, "type");
+  Component component{parseType(typeName), {}, nullptr, 0, true, 0, 1};
+
+  for (const auto &child : element) {
+    if (child.first == "location") {
+      component.locations.push_back(parseLocation(child.second));
+    }
+  }
+
+  const auto &type = m_types[component.type];
+  if (type.kind == ComponentKind::RectangularDetector) {
+    component.id_start = get_attribute<int64_t>(element, "idstart", 0);
+    component.id_fill_by_first_y =
+        get_attribute<std::string>(element, "idfillbyfirst", "y") == "y";
+    component.id_step_by_row = get_attribute<int64_t>(
+        element, "idstepbyrow",
+        component.id_fill_by_first_y ? type.y_pixels : type.x_pixels);
+    component.id_step = get_attribute<int64_t>(element, "idstep", 1);
+  } else if (has_attribute(element, "idlist") && type.detector_count > 0) {
+    const auto name = get_attribute<std::string>(element, "idlist");
+    const auto it = m_idLists.find(name);
+    if (it == m_idLists.cend()) {
+      throw std::runtime_error("No ID list named " + name);
+    }
+    if (it->second.size() != detectorCount(component)) {
+      throw std::runtime_error("ID list " + name +
+                               " does not match the number of detectors");
+    }
+    component.id_list = &it->second;
+  }
+
+  return component;
+}
+
+/**
+ * Parses a location element.
+ *
+ * The location rotation is the rot attribute followed by each nested rot
+ * element in turn, each applied in the frame of the component.
+ *
+ * @param element Location element
+ * @return Location
+ */
+ComponentLocation
+InstrumentDefinition::parseLocation(const ptree &element) const {
+  if (element.count("trans") > 0) {
+    throw std::runtime_error("Unsupported trans element");
+  }
+
+  ComponentLocation location{parsePosition(element),
+                             Eigen::Quaterniond::Identity(),
+                             m_haveDefaultFacing ? Facing::Default
+                                                 : Facing::None,
+                             m_defaultFacing};
+
+  if (has_attribute(element, "rot")) {
+    location.rotation = parseRotation(element, "rot");
+  }
+  for (auto rot = element.get_child_optional("rot"); rot;
+       rot = rot->get_child_optional("rot")) {
+    location.rotation = location.rotation * parseRotation(*rot, "val");
+  }
+
+  const auto facing = element.get_child_optional("facing");
+  if (facing) {
+    if (has_attribute(*facing, "rot")) {
+      throw std::runtime_error("Unsupported facing rotation");
+    }
+    if (get_attribute<std::string>(*facing, "val", std::string()) == "none") {
+      location.facing = Facing::None;
+    } else {
+      location.facing = Facing::Point;
+      location.facing_point = parsePosition(*facing);
+    }
+  }
+
+  return location;
+}
+
+/**
+ * Parses a position given either as x, y and z or as spherical r, t and p
+ * attributes (with the polar angle t from the z axis and azimuthal angle p
+ * from the x axis).
+ *
+ * @param element Element with position attributes
+ * @return Position
+ */
+Eigen::Vector3d
+InstrumentDefinition::parsePosition(const ptree &element) const {
+  if (has_attribute(element, "r") || has_attribute(element, "t") ||
+      has_attribute(element, "p")) {
+    const double r(get_attribute(element, "r", 0.0));
+    const double t(get_attribute(element, "t", 0.0) * m_angleToRadians);
+    const double p(get_attribute(element, "p", 0.0) * m_angleToRadians);
+    return Eigen::Vector3d(r * std::sin(t) * std::cos(p),
+                           r * std::sin(t) * std::sin(p), r * std::cos(t));
+  }
+
+  return Eigen::Vector3d(get_attribute(element, "x", 0.0),
+                         get_attribute(element, "y", 0.0),
+                         get_attribute(element, "z", 0.0));
+}
+
+/**
+ * Parses a rotation about an axis given by axis-x, axis-y and axis-z
+ * attributes (each defaulting to the z axis).
+ *
+ * @param element Element with rotation attributes
+ * @param angleAttribute Name of the attribute holding the rotation angle
+ * @return Rotation
+ */
+Eigen::Quaterniond
+InstrumentDefinition::parseRotation(const ptree &element,
+                                    const std::string &angleAttribute) const {
+  const Eigen::Vector3d axis(get_attribute(element, "axis-x", 0.0),
+                             get_attribute(element, "axis-y", 0.0),
+                             get_attribute(element, "axis-z", 1.0));
+  if (axis.norm() == 0.0) {
+    throw std::runtime_error("Rotation axis has zero length");
+  }
+
+  const double angle(get_attribute<double>(element, angleAttribute) *
+                     m_angleToRadians);
+  return Eigen::Quaterniond(Eigen::AngleAxisd(angle, axis.normalized()));
+}
+
+/**
+ * Gets the number of detectors in all locations of a component.
+ *
+ * @param component Component
+ * @return Number of detectors
+ */
+size_t InstrumentDefinition::detectorCount(const Component &component) const {
+  return m_types[component.type].detector_count * component.locations.size();
+}
+
+/**
+ * Places a component at a location within its parent.
+ *
+ * A component facing a point is additionally rotated so that its z axis
+ * points away from that point, with the same construction Mantid uses.
+ *
+ * @param parent Placement of the parent component
+ * @param location Location of the component
+ * @param orient If the orientation of the component is needed
+ * @return Placement of the component
+ */
+Placement InstrumentDefinition::place(const Placement &parent,
+                                      const ComponentLocation &location,
+                                      const bool orient) const {
+  Placement placement{parent.position + parent.rotation * location.position,
+                      parent.rotation * location.rotation};
+
+  if (!orient || location.facing == Facing::None) {
+    return placement;
+  }
+
+  const Eigen::Vector3d facingDirection(placement.position -
+                                        location.facing_point);
+  if (facingDirection.norm() == 0.0) {
+    return placement;
+  }
+
+  /* Facing direction in the frame of the component */
+  const Eigen::Vector3d direction(placement.rotation.conjugate() *
+                                  facingDirection.normalized());
+  const Eigen::Vector3d z(Eigen::Vector3d::UnitZ());
+  const Eigen::Vector3d normal(direction.cross(z));
+  const double theta(
+      std::acos(std::max(-1.0, std::min(1.0, direction.dot(z)))));
+
+  const Eigen::Vector3d axis(normal.norm() > 0.0 ? normal.normalized()
+                                                 : Eigen::Vector3d::UnitY());
+  placement.rotation =
+      placement.rotation * Eigen::Quaterniond(Eigen::AngleAxisd(-theta, axis));
+
+  return placement;
+}
+
+/**
+ * Expands all locations of a component.
+ *
+ * @param component Component
+ * @param parent Placement of the parent component
+ * @param idSource IDs for detectors of the parent component
+ * @param ids Output detector IDs
+ * @param positions Output detector positions
+ * @param count Number of detectors written to the outputs
+ */
+void InstrumentDefinition::expandComponent(const Component &component,
+                                           const Placement &parent,
+                                           IdSource &idSource, detid_t *ids,
+                                           float *positions,
+                                           size_t &count) const {
+  const auto &type = m_types[component.type];
+  if (type.detector_count == 0) {
+    return;
+  }
+
+  /* A component with an ID list uses its own IDs for all detectors in all of
+   * its locations */
+  IdSource componentIdSource{component.id_list, 0};
+  IdSource &locationIdSource(component.id_list ? componentIdSource : idSource);
+
+  for (const auto &location : component.locations) {
+    const auto placement =
+        place(parent, location, type.kind != ComponentKind::Detector);
+
+    switch (type.kind) {
+    case ComponentKind::Detector: {
+      if (!locationIdSource.ids ||
+          locationIdSource.next >= locationIdSource.ids->size()) {
+        throw std::runtime_error("No ID for detector of type " + type.name);
+      }
+      const int64_t id((*locationIdSource.ids)[locationIdSource.next++]);
+      if (id < 0) {
+        throw std::runtime_error("Negative detector ID " + std::to_string(id));
+      }
+      ids[count] = static_cast<detid_t>(id);
+      for (size_t i = 0; i < 3; i++) {
+        positions[count * 3 + i] = static_cast<float>(placement.position[i]);
+      }
+      count++;
+    } break;
+    case ComponentKind::RectangularDetector:
+      expandRectangularDetector(component, placement, ids, positions, count);
+      break;
+    default:
+      for (const auto &child : type.components) {
+        expandComponent(child, placement, locationIdSource, ids, positions,
+                        count);
+      }
+      break;
+    }
+  }
+}
+
+/**
+ * Expands the pixels of a rectangular detector.
+ *
+ * Pixel (i, j) is at (xstart + i * xstep, ystart + j * ystep, 0) in the frame
+ * of the detector and has ID idstart + i * idstepbyrow + j * idstep when IDs
+ * are filled along y first (otherwise with i and j swapped).
+ *
+ * @param component Component placing the detector
+ * @param placement Placement of the detector
+ * @param ids Output detector IDs
+ * @param positions Output detector positions
+ * @param count Number of detectors written to the outputs
+ */
+void InstrumentDefinition::expandRectangularDetector(
+    const Component &component, const Placement &placement, detid_t *ids,
+    float *positions, size_t &count) const {
+  const auto &type = m_types[component.type];
+  const Eigen::Matrix3d rotation(placement.rotation.toRotationMatrix());
+
+  for (int64_t i = 0; i < type.x_pixels; i++) {
+    for (int64_t j = 0; j < type.y_pixels; j++) {
+      const int64_t id(
+          component.id_fill_by_first_y
+              ? component.id_start + i * component.id_step_by_row +
+                    j * component.id_step
+              : component.id_start + j * component.id_step_by_row +
+                    i * component.id_step);
+      if (id < 0) {
+        throw std::runtime_error("Negative detector ID " +
+                                 std::to_string(id));
+      }
+
+      const Eigen::Vector3d position(
+          placement.position +
+          rotation * Eigen::Vector3d(type.x_start + i * type.x_step,
+                                     type.y_start + j * type.y_step, 0.0));
+
+      ids[count] = static_cast<detid_t>(id);
+      for (size_t k = 0; k < 3; k++) {
+        positions[count * 3 + k] = static_cast<float>(position[k]);
+      }
+      count++;
+    }
+  }
+}
+
+/**
+ * Expands the definition into source, sample and detector positions.
+ *
+ * Each top level component containing detectors is expanded concurrently
+ * into its own range of the detector arrays, the offset of which is known
+ * from the detector counts of the types.
+ *
+ * @param geometry Reference to output geometry
+ */
+void InstrumentDefinition::expand(InstrumentGeometry &geometry) const {
+  const Placement origin{Eigen::Vector3d::Zero(),
+                         Eigen::Quaterniond::Identity()};
+
+  bool haveSource(false);
+  bool haveSample(false);
+  std::vector<const Component *> components;
+  std::vector<size_t> offsets = {0};
+
+  for (const auto &component : m_components) {
+    const auto &type = m_types[component.type];
+
+    if (type.kind == ComponentKind::Source ||
+        type.kind == ComponentKind::SamplePosition) {
+      if (component.locations.empty()) {
+        throw std::runtime_error("Component of type " + type.name +
+                                 " has no location");
+      }
+      const Eigen::Vector3f position(
+          place(origin, component.locations.front(), false)
+              .position.cast<float>());
+      if (type.kind == ComponentKind::Source) {
+        geometry.source_position = position;
+        haveSource = true;
+      } else {
+        geometry.sample_position = position;
+        haveSample = true;
+      }
+    } else if (detectorCount(component) > 0) {
+      components.push_back(&component);
+      offsets.push_back(offsets.back() + detectorCount(component));
+    }
+  }
+
+  if (!haveSource || !haveSample) {
+    throw std::runtime_error("Instrument definition has no source or sample");
+  }
+
+  geometry.detector_ids.resize(offsets.back());
+  geometry.detector_positions.resize(offsets.back() * 3);
+
+  std::exception_ptr error;
+
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < components.size(); i++) {
+    try {
+      IdSource idSource{nullptr, 0};
+      size_t count(0);
+      expandComponent(*components[i], origin, idSource,
+                      geometry.detector_ids.data() + offsets[i],
+                      geometry.detector_positions.data() + offsets[i] * 3,
+                      count);
+    } catch (...) {
+#pragma omp critical
+      error = std::current_exception();
+    }
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * Computes the (64 bit FNV-1a) hash identifying the content of an instrument
+ * definition file.
+ *
+ * @param content Content of the file
+ * @return Hash
+ */
+uint64_t instrument_definition_hash(const std::string &content) {
+  uint64_t hash(14695981039346656037ull);
+  for (const unsigned char c : content) {
+    hash = (hash ^ c) * 1099511628211ull;
+  }
+  return hash;
+}
+
+/**
+ * Saves the geometry of an instrument to a geometry cache file, with detectors
+ * in order of detector ID.
+ */
+static void save_geometry_cache(const Instrument &inst, const uint64_t hash,
+                                const std::string &filename) {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::runtime_error("Failed to open geometry cache file " + filename);
+  }
+
+  const auto &detectors = inst.detectors;
+  std::vector<float> positions(detectors.size() * 3);
+  for (size_t i = 0; i < detectors.size(); i++) {
+    positions[i * 3] = detectors.x()[i];
+    positions[i * 3 + 1] = detectors.y()[i];
+    positions[i * 3 + 2] = detectors.z()[i];
+  }
+
+  file.write(GeometryCacheMagic, sizeof(GeometryCacheMagic));
+  write_binary(file, GeometryCacheVersion);
+  write_binary(file, hash);
+
+  write_binary(file, inst.source_position);
+  write_binary(file, inst.sample_position);
+  write_binary_vector(file, detectors.ids());
+  write_binary_vector(file, positions);
+
+  if (!file) {
+    throw std::runtime_error("Failed to write geometry cache file " +
+                             filename);
+  }
+}
+
+/**
+ * Loads a geometry cache file, if it exists and was created from an
+ * instrument definition with the given hash.
+ *
+ * @return True if the geometry was loaded
+ */
+static bool load_geometry_cache(InstrumentGeometry &geometry,
+                                const uint64_t hash,
+                                const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  char magic[sizeof(GeometryCacheMagic)];
+  file.read(magic, sizeof(magic));
+  uint32_t version;
+  read_binary(file, version);
+  uint64_t fileHash;
+  read_binary(file, fileHash);
+  if (!file || std::memcmp(magic, GeometryCacheMagic, sizeof(magic)) != 0 ||
+      version != GeometryCacheVersion || fileHash != hash) {
+    return false;
+  }
+
+  read_binary(file, geometry.source_position);
+  read_binary(file, geometry.sample_position);
+  read_binary_vector(file, geometry.detector_ids);
+  read_binary_vector(file, geometry.detector_positions);
+
+  return static_cast<bool>(file) &&
+         geometry.detector_positions.size() ==
+             geometry.detector_ids.size() * 3;
+}
+
+/**
+ * Loads an instrument from a Mantid instrument definition (IDF) XML file.
+ *
+ * When a cache filename is given the expanded geometry is read from the cache
+ * if it was created from an identical definition, otherwise the definition is
+ * parsed and the cache (re)written.
+ *
+ * @param inst Reference to output instrument
+ * @param filename Filename of the instrument definition
+ * @param cacheFilename Filename of the geometry cache (no caching if empty)
+ */
+void load_instrument_definition(Instrument &inst, const std::string &filename,
+                                const std::string &cacheFilename) {
+  std::ifstream file(filename);
+  if (!file) {
+    throw std::runtime_error("Failed to open instrument definition " +
+                             filename);
+  }
+  std::stringstream content;
+  content << file.rdbuf();
+
+  const std::string contentStr(content.str());
+  const uint64_t hash(instrument_definition_hash(contentStr));
+
+  InstrumentGeometry geometry;
+  const bool cached(!cacheFilename.empty() &&
+                    load_geometry_cache(geometry, hash, cacheFilename));
+  if (!cached) {
+    ptree tree;
+    try {
+      std::istringstream stream(contentStr);
+      boost::property_tree::read_xml(stream, tree);
+    } catch (const boost::property_tree::xml_parser_error &e) {
+      throw std::runtime_error("Failed to parse instrument definition " +
+                               filename + ": " + e.what());
+    }
+
+    const auto root = tree.get_child_optional("instrument");
+    if (!root) {
+      throw std::runtime_error("No instrument in instrument definition " +
+                               filename);
+    }
+
+    InstrumentDefinition(*root).expand(geometry);
+  }
+
+  inst.source_position = geometry.source_position;
+  inst.sample_position = geometry.sample_position;
+  inst.detectors = Detectors(geometry.detector_ids,
+                             geometry.detector_positions);
+
+  /* Cached detectors are already in order of detector ID */
+  if (!cached && !cacheFilename.empty()) {
+    save_geometry_cache(inst, hash, cacheFilename);
+  }
+}
@@ -18,51 +18,136 @@
 
 #include "IsisEventNexusLoader.h"
 
+#include <algorithm>
+#include <functional>
+#include <future>
+
 #include "NexusLoaderUtils.h"
 
 using namespace hdf5;
 
+/* Number of events read at a time by loadFrames() (rounded up to whole chunks
+ * of the event ID dataset) */
+static const size_t EventReadBlockSize = 1024 * 1024;
+
 void generate_spectrum_detector_mapping(SpectrumToDetectorMapping &mapping,
                                         const std::vector<int32_t> &spec,
                                         const std::vector<int32_t> &udet) {
-  if (spec.size() != udet.size()) {
+  if (spec.size() != udet.size() || spec.empty()) {
     return;
   }
 
-  auto specLast = spec.cbegin();
-  auto udetLast = udet.cbegin();
-
-  auto specIt = spec.cbegin() + 1;
-  auto udetIt = udet.cbegin() + 1;
-
-  for (; specIt != spec.end() && udetIt != udet.end();) {
-    if (*specIt != *specLast) {
-      mapping[*specLast] = std::vector<detid_t>(udetLast, udetIt);
+  std::vector<detid_t> detectorIds(udet.cbegin(), udet.cend());
 
-      specLast = specIt;
-      udetLast = udetIt;
+  /* Runs of equal spectrum numbers, each giving the detectors of a spectrum */
+  std::vector<specid_t> spectrumIds;
+  std::vector<size_t> offsets;
+  for (size_t i = 0; i < spec.size(); i++) {
+    if (i == 0 || spec[i] != spec[i - 1]) {
+      spectrumIds.push_back(spec[i]);
+      offsets.push_back(i);
     }
+  }
+  offsets.push_back(spec.size());
+
+  if (std::adjacent_find(spectrumIds.cbegin(), spectrumIds.cend(),
+                         std::greater_equal<specid_t>()) ==
+      spectrumIds.cend()) {
+    /* Runs are in order of spectrum number, so are already a mapping */
+    mapping = SpectrumToDetectorMapping(
+        std::move(spectrumIds), std::move(offsets), std::move(detectorIds));
+  } else {
+    /* Add each run in turn (a later run of the same spectrum number replaces
+     * an earlier one) */
+    mapping = SpectrumToDetectorMapping();
+    for (size_t i = 0; i < spectrumIds.size(); i++) {
+      mapping.add(spectrumIds[i],
+                  DetectorIdRange(detectorIds.data() + offsets[i],
+                                  detectorIds.data() + offsets[i + 1]));
+    }
+  }
+}
 
-    ++specIt;
-    ++udetIt;
+/**
+ * Coalesces the event ranges of a list of frames into as few reads as
+ * possible.
+ *
+ * Frames are loaded into consecutive memory in the order given, so frames
+ * that are also consecutive in the file are read together. Reads are split
+ * where the file position crosses a multiple of the block size, limiting the
+ * size of each read and keeping reads aligned to the chunks of the dataset
+ * when the block size is a whole number of chunks.
+ *
+ * @param ranges Start and number of events in the file of each frame
+ * @param blockSize Maximum number of events in a read
+ * @return Reads
+ */
+std::vector<EventReadRange>
+coalesce_event_ranges(const std::vector<std::pair<size_t, size_t>> &ranges,
+                      const size_t blockSize) {
+  std::vector<EventReadRange> reads;
+  size_t memoryStart(0);
+
+  for (const auto &range : ranges) {
+    size_t fileStart(range.first);
+    const size_t fileEnd(range.first + range.second);
+
+    while (fileStart < fileEnd) {
+      const size_t blockEnd((fileStart / blockSize + 1) * blockSize);
+      const size_t end(std::min(fileEnd, blockEnd));
+
+      /* Extend the previous read if this continues it within the block */
+      if (!reads.empty() &&
+          reads.back().file_start + reads.back().count == fileStart &&
+          fileStart % blockSize != 0) {
+        reads.back().count += end - fileStart;
+      } else {
+        reads.push_back({fileStart, memoryStart, end - fileStart});
+      }
+
+      memoryStart += end - fileStart;
+      fileStart = end;
+    }
   }
-  mapping[*specLast] = std::vector<detid_t>(udetLast, udet.end());
+
+  return reads;
 }
 
+/**
+ * @param filename NeXus file to load
+ * @param dataPath Path to the event data group
+ * @param mapEventData If event IDs and time offsets should be read in place
+ *                     from a memory mapping of the file when their storage
+ *                     allows (see map_dataset())
+ */
 IsisEventNexusLoader::IsisEventNexusLoader(const std::string &filename,
-                                           const std::string &dataPath)
+                                           const std::string &dataPath,
+                                           const bool mapEventData)
     : m_file(file::open(filename, file::AccessFlags::READONLY)) {
   m_datasetGroup = m_file.root()[dataPath];
   m_vmsCompatGroup = m_datasetGroup.link().parent()["isis_vms_compat"];
 
   resize_and_read_dataset(m_eventIndex, m_datasetGroup["event_index"]);
   resize_and_read_dataset(m_eventTimeZero, m_datasetGroup["event_time_zero"]);
+
+  node::Dataset dataset = m_datasetGroup["event_id"];
+  m_totalEventCount = dataset.dataspace().size();
+
+  if (mapEventData) {
+    m_eventIdMapping = map_dataset<uint32_t>(filename, dataset);
+    m_eventTimeOffsetMapping =
+        map_dataset<float>(filename, m_datasetGroup["event_time_offset"]);
+
+    /* Only used when all event data can be mapped */
+    if (!m_eventIdMapping || !m_eventTimeOffsetMapping) {
+      m_eventIdMapping.reset();
+      m_eventTimeOffsetMapping.reset();
+    }
+  }
 }
 
 size_t IsisEventNexusLoader::totalEventCount() const {
-  node::Dataset dataset = m_datasetGroup["event_id"];
-  const auto space = dataset.dataspace();
-  return space.size();
+  return m_totalEventCount;
 }
 
 size_t IsisEventNexusLoader::frameCount() const { return m_eventIndex.size(); }
@@ -77,13 +162,47 @@ const std::vector<double> &IsisEventNexusLoader::eventTimeZero() const {
 
 void IsisEventNexusLoader::eventId(std::vector<uint32_t> &data, size_t start,
                                    size_t end) const {
-  resize_and_read_dataset_range(data, m_datasetGroup["event_id"], start, end);
+  if (eventDataMapped()) {
+    const auto mapped = mappedEventId();
+    data.assign(mapped.begin() + start, mapped.begin() + end);
+  } else {
+    resize_and_read_dataset_range(data, m_datasetGroup["event_id"], start,
+                                  end);
+  }
 }
 
 void IsisEventNexusLoader::eventTimeOffset(std::vector<float> &data,
                                            size_t start, size_t end) const {
-  resize_and_read_dataset_range(data, m_datasetGroup["event_time_offset"],
-                                start, end);
+  if (eventDataMapped()) {
+    const auto mapped = mappedEventTimeOffset();
+    data.assign(mapped.begin() + start, mapped.begin() + end);
+  } else {
+    resize_and_read_dataset_range(data, m_datasetGroup["event_time_offset"],
+                                  start, end);
+  }
+}
+
+/**
+ * @return True if event IDs and time offsets are read in place from the file
+ */
+bool IsisEventNexusLoader::eventDataMapped() const {
+  return m_eventIdMapping != nullptr;
+}
+
+/**
+ * @return Event IDs of all events, empty if event data is not mapped
+ */
+DatasetSpan<uint32_t> IsisEventNexusLoader::mappedEventId() const {
+  return eventDataMapped() ? m_eventIdMapping->span<uint32_t>()
+                           : DatasetSpan<uint32_t>{nullptr, 0};
+}
+
+/**
+ * @return Event time offsets of all events, empty if event data is not mapped
+ */
+DatasetSpan<float> IsisEventNexusLoader::mappedEventTimeOffset() const {
+  return eventDataMapped() ? m_eventTimeOffsetMapping->span<float>()
+                           : DatasetSpan<float>{nullptr, 0};
 }
 
 std::pair<size_t, size_t>
@@ -96,65 +215,111 @@ IsisEventNexusLoader::getFrameEventRange(size_t frameIdx) const {
   return std::make_pair(start, end - start);
 }
 
+/**
+ * Loads the events of a list of frames.
+ *
+ * When event data is mapped, events are populated directly from the mapping
+ * in parallel. Otherwise frames that are consecutive in the file are read
+ * together, in blocks aligned to the chunks of the event datasets (with the
+ * chunks of each block decompressed in parallel), and the next block is read
+ * while the events of the current block are populated (HDF5 is only ever
+ * called from one thread at a time).
+ *
+ * @param events Reference to output events (in order of the frames given)
+ * @param frameIdxs Indices of frames to load
+ */
 void IsisEventNexusLoader::loadFrames(
     std::vector<TofEvent> &events, const std::vector<size_t> &frameIdxs) const {
-  struct FrameParams {
-    size_t nexusEventStart;
-    size_t memoryEventStart;
-    size_t numEvents;
-    double timeZero;
-  };
-
-  /* Calculate total number of events and frame parameters */
-  size_t numEvents = 0;
-  std::vector<FrameParams> frameParams;
-
+  /* Get event range of each frame */
+  std::vector<std::pair<size_t, size_t>> frameRanges;
+  frameRanges.reserve(frameIdxs.size());
   for (const auto &frameIdx : frameIdxs) {
-    /* Get event start and end range for frame */
-    const auto eventRange = getFrameEventRange(frameIdx);
-
-    /* Record frame event ranges */
-    frameParams.push_back({eventRange.first, numEvents, eventRange.second,
-                           m_eventTimeZero[frameIdx]});
+    frameRanges.push_back(getFrameEventRange(frameIdx));
+  }
 
-    /* Increment total event count */
-    numEvents += eventRange.second;
+  /* Offset of the events of each frame in memory */
+  std::vector<size_t> memoryStart(frameIdxs.size() + 1, 0);
+  for (size_t i = 0; i < frameIdxs.size(); i++) {
+    memoryStart[i + 1] = memoryStart[i] + frameRanges[i].second;
   }
 
   /* Allocate vector of correct size */
-  events.resize(numEvents);
+  events.resize(memoryStart.back());
+
+  if (eventDataMapped()) {
+    const auto eventId = mappedEventId();
+    const auto eventTimeOffset = mappedEventTimeOffset();
+
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < frameIdxs.size(); i++) {
+      const double timeZero(m_eventTimeZero[frameIdxs[i]]);
+      const size_t fileStart(frameRanges[i].first);
+      TofEvent *const frameEvents = events.data() + memoryStart[i];
+      for (size_t j = 0; j < frameRanges[i].second; j++) {
+        const size_t k(fileStart + j);
+        frameEvents[j] = {eventId[k], eventTimeOffset[k], timeZero, 1.0f};
+      }
+    }
+    return;
+  }
+
+  /* Set the frame time and weight of each event */
+#pragma omp parallel for schedule(dynamic, 64)
+  for (size_t i = 0; i < frameIdxs.size(); i++) {
+    const double timeZero(m_eventTimeZero[frameIdxs[i]]);
+    for (size_t j = memoryStart[i]; j < memoryStart[i + 1]; j++) {
+      events[j].pulse_time = timeZero;
+      events[j].weight = 1.0f;
+    }
+  }
 
   /* Retrieve datasets */
   node::Dataset eventIdDataset = m_datasetGroup["event_id"];
   node::Dataset eventTimeOffsetDataset = m_datasetGroup["event_time_offset"];
 
-  /* Create storage for events to be read */
-  std::vector<uint32_t> eventId;
-  std::vector<float> eventTimeOffset;
-
-  /* Load each frame */
-  for (size_t i = 0; i < frameParams.size(); ++i) {
-    const auto params = frameParams[i];
-
-    /* Obtain iterator to start of memory for this frame */
-    auto eventIt = events.begin();
-    std::advance(eventIt, params.memoryEventStart);
+  const size_t blockSize(
+      chunk_aligned_block_size(eventIdDataset, EventReadBlockSize));
+  const auto reads = coalesce_event_ranges(frameRanges, blockSize);
 
-    /* Create slab */
-    const dataspace::Hyperslab slab({params.nexusEventStart},
-                                    {params.numEvents}, {1}, {1});
+  /* Storage for the block being populated and the block being read */
+  struct EventBlock {
+    std::vector<uint32_t> eventId;
+    std::vector<float> eventTimeOffset;
+  };
+  EventBlock blocks[2];
+
+  const auto readBlock = [&](const EventReadRange &read, EventBlock &block) {
+    const size_t end(read.file_start + read.count);
+    resize_and_read_dataset_range_parallel(block.eventId, eventIdDataset,
+                                           read.file_start, end);
+    resize_and_read_dataset_range_parallel(
+        block.eventTimeOffset, eventTimeOffsetDataset, read.file_start, end);
+  };
 
-    /* Resize containers to correct size for this frame */
-    eventId.resize(params.numEvents);
-    eventTimeOffset.resize(params.numEvents);
+  if (!reads.empty()) {
+    readBlock(reads[0], blocks[0]);
+  }
 
-    /* Read event data */
-    eventIdDataset.read(eventId, slab);
-    eventTimeOffsetDataset.read(eventTimeOffset, slab);
+  for (size_t i = 0; i < reads.size(); i++) {
+    /* Read the next block while populating this one */
+    std::future<void> nextRead;
+    if (i + 1 < reads.size()) {
+      nextRead =
+          std::async(std::launch::async, readBlock, std::cref(reads[i + 1]),
+                     std::ref(blocks[1 - i % 2]));
+    }
 
     /* Populate events in output storage */
-    for (size_t i = 0; i < params.numEvents; ++i) {
-      *(eventIt++) = {eventId[i], eventTimeOffset[i], params.timeZero, 1.0f};
+    const auto &block = blocks[i % 2];
+    TofEvent *const blockEvents = events.data() + reads[i].memory_start;
+#pragma omp parallel for
+    for (size_t j = 0; j < reads[i].count; j++) {
+      blockEvents[j].id = block.eventId[j];
+      blockEvents[j].tof = block.eventTimeOffset[j];
+    }
+
+    if (nextRead.valid()) {
+      nextRead.get();
     }
   }
 }
@@ -16,23 +16,41 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <h5cpp/hdf5.hpp>
 
 #include "Instrument.h"
+#include "MappedDataset.h"
 #include "TofEvent.h"
 
 #pragma once
 
+/**
+ * Range of events read from an event dataset into memory.
+ */
+struct EventReadRange {
+  size_t file_start;
+  size_t memory_start;
+  size_t count;
+};
+
 void generate_spectrum_detector_mapping(SpectrumToDetectorMapping &mapping,
                                         const std::vector<int32_t> &spec,
                                         const std::vector<int32_t> &udet);
 
+std::vector<EventReadRange>
+coalesce_event_ranges(const std::vector<std::pair<size_t, size_t>> &ranges,
+                      const size_t blockSize);
+
 class IsisEventNexusLoader {
 public:
   IsisEventNexusLoader(const std::string &filename,
-                       const std::string &dataPath);
+                       const std::string &dataPath,
+                       const bool mapEventData = true);
 
   size_t totalEventCount() const;
   size_t frameCount() const;
@@ -44,6 +62,10 @@ public:
   void eventTimeOffset(std::vector<float> &data, size_t start,
                        size_t end) const;
 
+  bool eventDataMapped() const;
+  DatasetSpan<uint32_t> mappedEventId() const;
+  DatasetSpan<float> mappedEventTimeOffset() const;
+
   std::pair<size_t, size_t> getFrameEventRange(size_t frameIdx) const;
 
   void loadFrames(std::vector<TofEvent> &events,
@@ -58,4 +80,9 @@ private:
 
   std::vector<uint64_t> m_eventIndex;
   std::vector<double> m_eventTimeZero;
+  size_t m_totalEventCount;
+
+  /* Event data read in place from the file, if stored contiguously */
+  std::unique_ptr<MappedDataset> m_eventIdMapping;
+  std::unique_ptr<MappedDataset> m_eventTimeOffsetMapping;
 };
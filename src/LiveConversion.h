@@ -0,0 +1,521 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <boost/sort/sort.hpp>
+
+#include "BoundedQueue.h"
+#include "EventMessage.h"
+#include "EventMessageStream.h"
+#include "EventToMDEventConversion.h"
+#include "MDBox.h"
+#include "MDEvent.h"
+#include "Merge.h"
+#include "TofEvent.h"
+
+#pragma once
+
+/**
+ * Parameters of live conversion.
+ */
+struct LiveConversionOptions {
+  /* Number of TOF events at which a micro-batch is converted without waiting
+   * for further messages */
+  size_t batch_events;
+
+  /* Longest time (in seconds) the first message of a micro-batch waits for
+   * further messages before the batch is converted */
+  double max_batch_age;
+
+  /* Number of received messages that may wait for conversion */
+  size_t queue_depth;
+
+  /* Number of events at which a box will be further split */
+  size_t split_threshold;
+
+  /* Maximum box tree depth (including root box) */
+  size_t max_box_depth;
+
+  /* Number of MD events at which the delta curve is frozen and folded into the
+   * main curve in the background */
+  size_t delta_events;
+};
+
+/**
+ * Statistics of a single micro-batch.
+ */
+struct LiveBatchStats {
+  /* Number of messages and TOF events in the batch */
+  size_t message_count;
+  size_t tof_event_count;
+
+  /* Number of TOF events dropped as their spectrum is not in the conversion
+   * plan */
+  size_t dropped_event_count;
+
+  /* Number of MD events added to the curve */
+  size_t md_event_count;
+
+  /* Number of MD events in the delta curve once the batch was merged into it
+   * (the size of the merge) */
+  size_t delta_event_count;
+
+  /* Number of MD events of a background fold that completed before the batch
+   * was flushed, and so joined the main curve (zero if none completed) */
+  size_t folded_event_count;
+
+  /* Time from receiving the first message of the batch until its events could
+   * be queried in seconds */
+  double latency;
+
+  /* Time taken to convert, sort and merge the batch in seconds */
+  double processing_time;
+};
+
+/**
+ * Output of ingest_event_stream().
+ */
+struct LiveIngestionResult {
+  size_t message_count;
+  size_t batch_count;
+
+  /* Number of MD events added to the curve */
+  size_t event_count;
+
+  /* Number of TOF events dropped as their spectrum is not in the conversion
+   * plan */
+  size_t dropped_event_count;
+
+  /* Longest latency of any batch in seconds */
+  double max_latency;
+
+  /* Total time spent converting, sorting and merging in seconds */
+  double processing_time;
+};
+
+/**
+ * @class LiveConversion
+ *
+ * Curve of MD events and the box tree over it, grown by micro-batches of
+ * events received as event messages.
+ *
+ * Messages are buffered by add(), flush() converts the buffered events using
+ * the conversion plan (the per spectrum geometry created once from the
+ * instrument) and sorts them. Events of spectra missing from the plan are
+ * dropped (and counted) rather than ending the stream.
+ *
+ * Events are held in tiers, each a curve with a box tree over it: the main
+ * tier, frozen delta tiers waiting to be folded into it, and the active delta
+ * tier. Batches are merged into the active delta, updating its box tree
+ * incrementally (see merge_event_curves_incremental()). Once the delta holds
+ * delta_events events it is frozen and a new delta started, so the cost of a
+ * batch is bounded by the batch and delta sizes, however many events have been
+ * received. Frozen deltas are folded into a new main tier on a background
+ * thread, while queries keep using the old main tier. The new main tier
+ * replaces it (and the frozen deltas it holds) at the first flush after the
+ * fold completes. All tiers cover the same MD space with identical box
+ * bounds, so a query visits the corresponding boxes of each tree.
+ */
+template <typename IntT, typename MortonT> class LiveConversion {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Event = MDEvent<3, IntT, MortonT>;
+  using ZCurve = typename Event::ZCurve;
+  using Box = MDBox<3, IntT, MortonT>;
+
+  /**
+   * Curve of MD events with the box tree over it.
+   *
+   * The box tree refers to the curve, so a tier is never copied or moved.
+   */
+  struct Tier {
+    Tier() : rootBox(curve.cbegin(), curve.cend()) {}
+
+    /**
+     * Creates a tier holding the events of an existing tier and a sorted batch,
+     * updating a copy of the existing box tree (see MDBox::insertEvents()).
+     */
+    Tier(const Tier &base, const ZCurve &batch, const size_t splitThreshold,
+         const size_t maxDepth)
+        : rootBox(base.rootBox) {
+      merge_event_curves<Event>(curve, base.curve, batch);
+      rootBox.insertEvents(base.curve.cbegin(), curve.cbegin(), batch.cbegin(),
+                           batch.cend(), 0, splitThreshold, maxDepth);
+    }
+
+    Tier(const Tier &) = delete;
+    Tier &operator=(const Tier &) = delete;
+
+    ZCurve curve;
+    Box rootBox;
+  };
+
+  using TierList = std::vector<std::shared_ptr<const Tier>>;
+
+  /* Called after each micro-batch has been flushed */
+  using BatchCallback =
+      std::function<void(const LiveConversion &, const LiveBatchStats &)>;
+
+  /**
+   * @param plan Conversion plan for the instrument the events are recorded on,
+   *             must outlive the live conversion
+   * @param space MD space bounds
+   * @param options Batching and box splitting settings
+   */
+  LiveConversion(const ConversionPlan &plan, const MDSpaceBounds<3> &space,
+                 const LiveConversionOptions &options)
+      : m_plan(plan), m_space(space), m_options(options),
+        m_main(std::make_shared<Tier>()), m_delta(std::make_shared<Tier>()),
+        m_foldingCount(0), m_pendingMessageCount(0) {}
+
+  /**
+   * Buffers the events of a message for the next micro-batch.
+   *
+   * @param message Event message
+   * @param received Time the message was received
+   */
+  void add(const EventMessage &message, const Clock::time_point received) {
+    if (m_pendingMessageCount++ == 0) {
+      m_pendingSince = received;
+    }
+    append_tof_events(m_pending, message);
+  }
+
+  /**
+   * Converts the buffered events and merges them into the delta curve.
+   *
+   * A completed background fold replaces the main tier first. A full delta is
+   * then frozen and, unless a fold is still running, the frozen deltas are
+   * folded in the background.
+   *
+   * @return Statistics of the micro-batch
+   */
+  LiveBatchStats flush() {
+    const auto start = Clock::now();
+
+    size_t foldedEventCount(0);
+    if (m_fold.valid() &&
+        m_fold.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+      foldedEventCount = finishFold();
+    }
+
+    /* Drop events the plan has no parameters for */
+    const size_t tofEventCount = m_pending.size();
+    m_pending.erase(std::remove_if(m_pending.begin(), m_pending.end(),
+                                   [this](const TofEvent &event) {
+                                     return !has_spectrum(m_plan, event.id);
+                                   }),
+                    m_pending.end());
+
+    ZCurve batch;
+    convert_events(batch, m_pending, m_plan, m_space);
+    boost::sort::block_indirect_sort(batch.begin(), batch.end());
+
+    merge_event_curves_incremental<Event>(m_delta->curve, m_delta->rootBox,
+                                          batch, m_options.split_threshold,
+                                          m_options.max_box_depth);
+    const size_t deltaEventCount = m_delta->curve.size();
+
+    if (deltaEventCount >= m_options.delta_events) {
+      freezeDelta();
+    }
+    if (!m_fold.valid()) {
+      startFold();
+    }
+
+    const auto end = Clock::now();
+    const LiveBatchStats stats{
+        m_pendingMessageCount, tofEventCount, tofEventCount - m_pending.size(),
+        batch.size(), deltaEventCount, foldedEventCount,
+        std::chrono::duration<double>(end - m_pendingSince).count(),
+        std::chrono::duration<double>(end - start).count()};
+
+    /* Keep the storage for the next batch */
+    m_pending.clear();
+    m_pendingMessageCount = 0;
+
+    return stats;
+  }
+
+  /**
+   * Folds all delta curves into the main curve, waiting for a running
+   * background fold and then folding the remaining deltas on this thread.
+   *
+   * @return Number of events folded, including those of the waited for fold
+   */
+  size_t fold() {
+    size_t foldedEventCount(0);
+    if (m_fold.valid()) {
+      foldedEventCount += finishFold();
+    }
+
+    if (!m_delta->curve.empty()) {
+      freezeDelta();
+    }
+    startFold();
+    if (m_fold.valid()) {
+      foldedEventCount += finishFold();
+    }
+
+    return foldedEventCount;
+  }
+
+  /**
+   * @return Number of messages buffered for the next micro-batch
+   */
+  size_t pendingMessageCount() const { return m_pendingMessageCount; }
+
+  /**
+   * @return Number of TOF events buffered for the next micro-batch
+   */
+  size_t pendingEventCount() const { return m_pending.size(); }
+
+  /**
+   * @return Time the first buffered message was received
+   */
+  Clock::time_point pendingSince() const { return m_pendingSince; }
+
+  const LiveConversionOptions &options() const { return m_options; }
+
+  /**
+   * @return Number of MD events in all tiers
+   */
+  size_t eventCount() const {
+    size_t count(0);
+    for (const auto &tier : tiers()) {
+      count += tier->curve.size();
+    }
+    return count;
+  }
+
+  /**
+   * @return Main tier, frozen delta tiers (oldest first) and active delta tier,
+   *         together holding all events flushed so far
+   */
+  TierList tiers() const {
+    TierList tiers{m_main};
+    tiers.insert(tiers.end(), m_frozen.cbegin(), m_frozen.cend());
+    tiers.push_back(m_delta);
+    return tiers;
+  }
+
+  const Tier &mainTier() const { return *m_main; }
+  const TierList &frozenTiers() const { return m_frozen; }
+  const Tier &deltaTier() const { return *m_delta; }
+
+  /**
+   * @return True if frozen deltas are being folded in the background
+   */
+  bool folding() const { return m_fold.valid(); }
+
+private:
+  /**
+   * Replaces the active delta with an empty one, keeping the full delta until
+   * it is folded into the main tier.
+   */
+  void freezeDelta() {
+    m_frozen.push_back(m_delta);
+    m_delta = std::make_shared<Tier>();
+  }
+
+  /**
+   * Starts folding the frozen deltas into a new main tier in the background.
+   */
+  void startFold() {
+    if (m_frozen.empty()) {
+      return;
+    }
+
+    m_foldingCount = m_frozen.size();
+    m_fold = std::async(
+        std::launch::async,
+        [main = m_main, frozen = m_frozen,
+         splitThreshold = m_options.split_threshold,
+         maxDepth = m_options.max_box_depth]() {
+          /* Combine several frozen deltas into a single batch first */
+          const ZCurve *batch = &frozen.front()->curve;
+          ZCurve combined;
+          if (frozen.size() > 1) {
+            std::vector<ZCurve> curves;
+            for (const auto &tier : frozen) {
+              curves.push_back(tier->curve);
+            }
+            merge_event_curves_k<Event>(combined, curves);
+            batch = &combined;
+          }
+
+          return std::shared_ptr<const Tier>(std::make_shared<Tier>(
+              *main, *batch, splitThreshold, maxDepth));
+        });
+  }
+
+  /**
+   * Waits for the background fold and replaces the main tier and the frozen
+   * deltas it holds with its result.
+   *
+   * @return Number of events folded
+   */
+  size_t finishFold() {
+    const size_t foldedTierCount = m_foldingCount;
+    m_foldingCount = 0;
+    m_main = m_fold.get();
+
+    size_t foldedEventCount(0);
+    for (size_t i = 0; i < foldedTierCount; i++) {
+      foldedEventCount += m_frozen[i]->curve.size();
+    }
+    m_frozen.erase(m_frozen.begin(), m_frozen.begin() + foldedTierCount);
+
+    return foldedEventCount;
+  }
+
+  const ConversionPlan &m_plan;
+  const MDSpaceBounds<3> m_space;
+  const LiveConversionOptions m_options;
+
+  std::shared_ptr<const Tier> m_main;
+  TierList m_frozen;
+  std::shared_ptr<Tier> m_delta;
+
+  /* New main tier holding the first m_foldingCount frozen deltas */
+  std::future<std::shared_ptr<const Tier>> m_fold;
+  size_t m_foldingCount;
+
+  TofEventList m_pending;
+  size_t m_pendingMessageCount;
+  Clock::time_point m_pendingSince;
+};
+
+/**
+ * Message received from an event stream.
+ */
+struct ReceivedEventMessage {
+  EventMessage message;
+  std::chrono::steady_clock::time_point received;
+};
+
+/**
+ * Converts event messages from a stream into a live curve until the stream
+ * ends.
+ *
+ * Two stages run concurrently, connected by a bounded queue:
+ *  - receiving: messages are read from the stream and time stamped
+ *  - conversion (on the calling thread): messages are buffered until the
+ *    micro-batch holds enough events, or its first message reaches the
+ *    maximum batch age, then the batch is flushed into the live curve.
+ *
+ * The latency from receiving a message to its events being queryable is
+ * therefore bounded by the maximum batch age plus the time to flush a batch
+ * (which depends on the batch size and the maximum size of the delta curve,
+ * as folding runs in the background). Queries made from the batch callback see
+ * all events flushed so far, in the tiers of the live conversion.
+ *
+ * @param reader Event stream
+ * @param live Live conversion the events are added to
+ * @param onBatch Called after each micro-batch is flushed (may be empty)
+ * @return Totals over all micro-batches
+ */
+template <typename IntT, typename MortonT>
+LiveIngestionResult ingest_event_stream(
+    EventMessageReader &reader, LiveConversion<IntT, MortonT> &live,
+    const typename LiveConversion<IntT, MortonT>::BatchCallback &onBatch) {
+  using Clock = std::chrono::steady_clock;
+
+  const auto &options = live.options();
+  const auto maxBatchAge = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(options.max_batch_age));
+
+  BoundedQueue<ReceivedEventMessage> messages(options.queue_depth);
+
+  /* Stopping the reader and closing the queue releases the receiving stage
+   * (a reader blocked on a pipe is only released by the writer) */
+  auto abort = [&reader, &messages]() {
+    reader.cancel();
+    messages.close();
+  };
+
+  /* Receiving stage */
+  auto receiveStage = std::async(std::launch::async, [&]() {
+    try {
+      ReceivedEventMessage item;
+      while (reader.next(item.message)) {
+        item.received = Clock::now();
+        if (!messages.push(std::move(item))) {
+          break;
+        }
+      }
+    } catch (...) {
+      messages.close();
+      throw;
+    }
+    messages.close();
+  });
+
+  /* Conversion stage */
+  LiveIngestionResult result{0, 0, 0, 0, 0.0, 0.0};
+  try {
+    ReceivedEventMessage item;
+    while (true) {
+      bool received;
+      if (live.pendingMessageCount() == 0) {
+        /* Nothing waiting to be flushed, wait for the next message or the end
+         * of the stream */
+        received = messages.pop(item);
+        if (!received) {
+          break;
+        }
+      } else {
+        received = messages.pop_until(item, live.pendingSince() + maxBatchAge);
+      }
+
+      if (received) {
+        live.add(item.message, item.received);
+        result.message_count++;
+        if (live.pendingEventCount() < options.batch_events) {
+          continue;
+        }
+      }
+
+      /* Batch is full, too old or the stream has ended */
+      const auto stats = live.flush();
+      result.batch_count++;
+      result.event_count += stats.md_event_count;
+      result.dropped_event_count += stats.dropped_event_count;
+      result.max_latency = std::max(result.max_latency, stats.latency);
+      result.processing_time += stats.processing_time;
+
+      if (onBatch) {
+        onBatch(live, stats);
+      }
+    }
+  } catch (...) {
+    abort();
+    throw;
+  }
+
+  /* Rethrow any failure to receive */
+  receiveStage.get();
+
+  return result;
+}
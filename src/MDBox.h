@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <functional>
 #include <vector>
 
@@ -237,6 +238,97 @@ public:
       }
 
 /* Wait for all tasks to be completed */
+#pragma omp taskwait
+    }
+  }
+
+  /**
+   * Updates the event ranges of this box and its children after a sorted batch
+   * of events has been merged into the Z-curve this box tree was built over.
+   *
+   * Boxes that receive no new events only have their event ranges shifted,
+   * leaf boxes that receive new events are split further if they now reach the
+   * split threshold. Boxes are never merged, as event counts only increase.
+   *
+   * Every box of the tree is visited, as event ranges are iterators into the
+   * curve and all of them move to the merged curve.
+   *
+   * The old Z-curve must still be valid when this is called (i.e. the merge
+   * must not have been performed in place).
+   *
+   * @param oldCurveBegin Start of the Z-curve the tree currently refers to
+   * @param newCurveBegin Start of the merged Z-curve
+   * @param batchBegin First new event that falls within this box
+   * @param batchEnd One past the last new event that falls within this box
+   * @param insertedBefore Number of new events that precede this box
+   * @param splitThreshold Number of events at which a box will be further split
+   * @param maxDepth Maximum box tree depth (including this box)
+   */
+  void insertEvents(ZCurveIterator oldCurveBegin, ZCurveIterator newCurveBegin,
+                    ZCurveIterator batchBegin, ZCurveIterator batchEnd,
+                    const size_t insertedBefore, const size_t splitThreshold,
+                    const size_t maxDepth) {
+    const size_t insertedCount = std::distance(batchBegin, batchEnd);
+
+    /* Position of this box in the merged curve is its old position plus the
+     * number of new events that sort before it */
+    const size_t newEventStart =
+        std::distance(oldCurveBegin, m_eventBegin) + insertedBefore;
+    const size_t newEventCount = eventCount() + insertedCount;
+
+    m_eventBegin = newCurveBegin + newEventStart;
+    m_eventEnd = m_eventBegin + newEventCount;
+
+    if (m_childBoxes.empty()) {
+      /* Only leaf boxes that gained events may need splitting */
+      if (insertedCount > 0) {
+        distributeEvents(splitThreshold, maxDepth);
+      }
+      return;
+    }
+
+    if (insertedCount == 0) {
+      /* Nothing new in this subtree, only the event ranges need shifting */
+      for (auto &child : m_childBoxes) {
+        child.insertEvents(oldCurveBegin, newCurveBegin, batchEnd, batchEnd,
+                           insertedBefore, splitThreshold, maxDepth - 1);
+      }
+      return;
+    }
+
+    /* Partition the new events between child boxes */
+    std::vector<ZCurveIterator> childBatchEnds;
+    childBatchEnds.reserve(m_childBoxes.size());
+
+    auto batchIt = batchBegin;
+    for (const auto &child : m_childBoxes) {
+      batchIt = std::upper_bound(
+          batchIt, batchEnd, child.max(),
+          [](const MortonT morton, const MDEvent<ND, IntT, MortonT> &event) {
+            return morton < event.mortonNumber();
+          });
+      childBatchEnds.push_back(batchIt);
+    }
+
+/* Update child boxes in parallel, see distributeEvents() */
+#pragma omp parallel
+#pragma omp single nowait
+    {
+      auto childBatchBegin = batchBegin;
+      for (size_t i = 0; i < m_childBoxes.size(); i++) {
+        const auto childBatchEnd = childBatchEnds[i];
+        const size_t childInsertedBefore =
+            insertedBefore + std::distance(batchBegin, childBatchBegin);
+
+#pragma omp task
+        m_childBoxes[i].insertEvents(oldCurveBegin, newCurveBegin,
+                                     childBatchBegin, childBatchEnd,
+                                     childInsertedBefore, splitThreshold,
+                                     maxDepth - 1);
+
+        childBatchBegin = childBatchEnd;
+      }
+
 #pragma omp taskwait
     }
   }
@@ -328,8 +420,10 @@ private:
    * contained in this box. */
   const MortonT m_upperBound;
 
-  const ZCurveIterator m_eventBegin;
-  const ZCurveIterator m_eventEnd;
+  /* Range of events contained in this box. Not const as they are shifted when
+   * new events are inserted into the curve (see insertEvents()). */
+  ZCurveIterator m_eventBegin;
+  ZCurveIterator m_eventEnd;
 
   /**
    * Vector of child boxes.
@@ -18,67 +18,205 @@
 
 #include "MantidEventNexusLoader.h"
 
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
 #include <omp.h>
 
 #include "NexusLoaderUtils.h"
 
 using namespace hdf5;
 
-MantidEventNexusLoader::MantidEventNexusLoader(const std::string &filename)
+/* Number of events read at a time (rounded up to whole chunks of the ToF
+ * dataset) */
+static const size_t EventReadBlockSize = 1024 * 1024;
+
+/**
+ * @param filename NeXus file to load
+ * @param mapEventData If ToF and weights should be read in place from a memory
+ *                     mapping of the file when their storage allows (see
+ *                     map_dataset())
+ */
+MantidEventNexusLoader::MantidEventNexusLoader(const std::string &filename,
+                                               const bool mapEventData)
     : m_file(file::open(filename, file::AccessFlags::READONLY)) {
   m_eventDataGroup = m_file.root()["/mantid_workspace_1/event_workspace"];
   m_detectorsGroup = m_file.root()["/mantid_workspace_1/instrument/detector"];
+
+  /* Load spectrum/event indices */
+  resize_and_read_dataset(m_eventIndices, m_eventDataGroup["indices"]);
+
+  node::Dataset dataset = m_eventDataGroup["tof"];
+  m_totalEventCount = dataset.dataspace().size();
+
+  /* Events of a spectrum end where the next spectrum starts */
+  for (size_t i = 0; i + 1 < m_eventIndices.size(); i++) {
+    if (m_eventIndices[i] > m_eventIndices[i + 1]) {
+      throw std::runtime_error("Event indices are not in order");
+    }
+  }
+  if (!m_eventIndices.empty() && m_eventIndices.back() > m_totalEventCount) {
+    throw std::runtime_error("Event indices exceed the number of events");
+  }
+
+  if (mapEventData) {
+    m_tofMapping = map_dataset<double>(filename, dataset);
+    if (eventsHaveWeight()) {
+      m_weightMapping =
+          map_dataset<float>(filename, m_eventDataGroup["weight"]);
+    }
+
+    /* Only used when all event data can be mapped */
+    if (!m_tofMapping || (eventsHaveWeight() && !m_weightMapping)) {
+      m_tofMapping.reset();
+      m_weightMapping.reset();
+    }
+  }
 }
 
 size_t MantidEventNexusLoader::totalEventCount() const {
-  node::Dataset dataset = m_eventDataGroup["tof"];
-  const auto space = dataset.dataspace();
-  return space.size();
+  return m_totalEventCount;
+}
+
+size_t MantidEventNexusLoader::spectrumCount() const {
+  return m_eventIndices.size();
 }
 
 bool MantidEventNexusLoader::eventsHaveWeight() const {
   return m_eventDataGroup.exists("weight");
 }
 
+/**
+ * @return True if ToF (and weights) are read in place from the file
+ */
+bool MantidEventNexusLoader::eventDataMapped() const {
+  return m_tofMapping != nullptr;
+}
+
+/**
+ * @return ToF of all events, empty if event data is not mapped
+ */
+DatasetSpan<double> MantidEventNexusLoader::mappedTof() const {
+  return eventDataMapped() ? m_tofMapping->span<double>()
+                           : DatasetSpan<double>{nullptr, 0};
+}
+
+/**
+ * @return Weights of all events, empty if event data is not mapped or events
+ *         have no weights
+ */
+DatasetSpan<float> MantidEventNexusLoader::mappedWeight() const {
+  return m_weightMapping ? m_weightMapping->span<float>()
+                         : DatasetSpan<float>{nullptr, 0};
+}
+
+/**
+ * Loads all events, appending them to a list of events.
+ *
+ * @param events Reference to output events
+ */
 void MantidEventNexusLoader::loadAllEvents(
     std::vector<TofEvent> &events) const {
-  /* Load spectrum/event indices */
-  std::vector<uint64_t> eventIndices;
-  resize_and_read_dataset(eventIndices, m_eventDataGroup["indices"]);
+  loadSpectra(events, 0, spectrumCount());
+}
 
-  /* Reserve storage for output events */
-  events.reserve(totalEventCount());
+/**
+ * Loads the events of a range of spectra, appending them to a list of events.
+ *
+ * Events are given the index of their spectrum as ID. When event data is
+ * mapped the events are populated directly from the mapping, otherwise ToF and
+ * weight are read in large blocks aligned to the chunking of the ToF dataset
+ * (with the chunks of each block decompressed in parallel) and written into
+ * the (presized) output.
+ *
+ * @param events Reference to output events
+ * @param start Index of the first spectrum to load
+ * @param end Index after the last spectrum to load
+ */
+void MantidEventNexusLoader::loadSpectra(std::vector<TofEvent> &events,
+                                         size_t start, size_t end) const {
+  end = std::min(end, spectrumCount());
+  if (start >= end) {
+    return;
+  }
 
-  /* Cache flags for weights */
-  const bool haveWeights(eventsHaveWeight());
+  /* Events of a spectrum end where the next spectrum starts */
+  const auto spectrumEnd = [&](const size_t i) -> size_t {
+    return i + 1 < spectrumCount() ? m_eventIndices[i + 1] : m_totalEventCount;
+  };
 
-  uint32_t specId(0);
+  const size_t firstEvent(m_eventIndices[start]);
+  const size_t lastEvent(spectrumEnd(end - 1));
 
-  /* Iterate over spectra */
-  for (auto it = eventIndices.cbegin(); it != eventIndices.cend(); ++it) {
-    const auto start(*it);
+  /* Presize output events, appended after any existing events */
+  const size_t outputOffset(events.size());
+  events.resize(outputOffset + lastEvent - firstEvent);
 
-    /* Calculate end index */
-    const auto endIt = it + 1;
-    const auto end = endIt == eventIndices.cend() ? totalEventCount() : *endIt;
+  if (eventDataMapped()) {
+    const auto tof = mappedTof();
+    const auto weight = mappedWeight();
 
-    /* Load ToF */
-    std::vector<double> tof;
-    resize_and_read_dataset_range(tof, m_eventDataGroup["tof"], start, end);
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = start; i < end; i++) {
+      const size_t spectrumEventEnd(spectrumEnd(i));
+      for (size_t j = m_eventIndices[i]; j < spectrumEventEnd; j++) {
+        events[outputOffset + (j - firstEvent)] = {
+            static_cast<uint32_t>(i), static_cast<float>(tof[j]), 0.0,
+            weight.empty() ? 1.0f : weight[j]};
+      }
+    }
+    return;
+  }
 
-    /* Load weights */
-    std::vector<float> weight;
+  /* Assign spectrum IDs (and defaults for the remaining fields) */
+#pragma omp parallel for schedule(dynamic, 64)
+  for (size_t i = start; i < end; i++) {
+    const size_t spectrumEventEnd(spectrumEnd(i));
+    for (size_t j = m_eventIndices[i]; j < spectrumEventEnd; j++) {
+      events[outputOffset + (j - firstEvent)] = {static_cast<uint32_t>(i),
+                                                 0.0f, 0.0, 1.0f};
+    }
+  }
+
+  /* Cache flags for weights */
+  const bool haveWeights(eventsHaveWeight());
+  const node::Dataset tofDataset = m_eventDataGroup["tof"];
+  node::Dataset weightDataset;
+  if (haveWeights) {
+    weightDataset = m_eventDataGroup["weight"];
+  }
+
+  /* Read ToF and weights block by block */
+  const size_t blockSize(
+      chunk_aligned_block_size(tofDataset, EventReadBlockSize));
+  std::vector<double> tof;
+  std::vector<float> weight;
+
+  for (size_t blockStart = firstEvent; blockStart < lastEvent;) {
+    const size_t blockEnd(
+        std::min(lastEvent, (blockStart / blockSize + 1) * blockSize));
+
+    resize_and_read_dataset_range_parallel(tof, tofDataset, blockStart,
+                                           blockEnd);
     if (haveWeights) {
-      resize_and_read_dataset_range(weight, m_eventDataGroup["weight"], start,
-                                    end);
+      resize_and_read_dataset_range_parallel(weight, weightDataset, blockStart,
+                                             blockEnd);
     }
 
-    /* Fill events */
-    for (size_t i = 0; i < tof.size(); i++) {
-      const auto eventWeight = haveWeights ? weight[i] : 1.0f;
-      events.push_back({specId, (float)tof[i], 0.0f, eventWeight});
+    TofEvent *const blockEvents =
+        events.data() + outputOffset + (blockStart - firstEvent);
+    const size_t blockEventCount(blockEnd - blockStart);
+
+#pragma omp parallel for
+    for (size_t i = 0; i < blockEventCount; i++) {
+      blockEvents[i].tof = static_cast<float>(tof[i]);
+      if (haveWeights) {
+        blockEvents[i].weight = weight[i];
+      }
     }
-    specId++;
+
+    blockStart = blockEnd;
   }
 }
 
@@ -92,17 +230,30 @@ void MantidEventNexusLoader::loadSpectrumDetectorMapping(
   resize_and_read_dataset(detectorIndices, m_detectorsGroup["detector_index"]);
   resize_and_read_dataset(detectorCounts, m_detectorsGroup["detector_count"]);
 
-#pragma omp parallel for
-  for (size_t i = 0; i < detectorIndices.size(); i++) {
-    const size_t detIndexForSpectrum(detectorIndices[i]);
-    const size_t detCountForSpectrum(detectorCounts[i]);
+  if (detectorIndices.size() != detectorCounts.size()) {
+    throw std::runtime_error("Detector index and count differ in length");
+  }
 
-    std::vector<detid_t> detectorsForSpectrum;
-    for (size_t j = 0; j < detCountForSpectrum; j++) {
-      detectorsForSpectrum.push_back(detectorIds[detIndexForSpectrum + j]);
-    }
+  /* Spectrum numbers are the spectrum indices */
+  const size_t numSpectra(detectorIndices.size());
+  std::vector<specid_t> spectrumIds(numSpectra);
+  std::iota(spectrumIds.begin(), spectrumIds.end(), 0);
 
-#pragma omp critical
-    { mapping[i] = detectorsForSpectrum; }
+  /* Offset of the detectors of each spectrum in the mapping */
+  std::vector<size_t> offsets(numSpectra + 1, 0);
+  std::partial_sum(detectorCounts.cbegin(), detectorCounts.cend(),
+                   offsets.begin() + 1);
+
+  /* Copy the detectors of each spectrum */
+  std::vector<detid_t> mappedDetectorIds(offsets.back());
+#pragma omp parallel for
+  for (size_t i = 0; i < numSpectra; i++) {
+    const auto detectorsForSpectrum =
+        detectorIds.cbegin() + detectorIndices[i];
+    std::copy(detectorsForSpectrum, detectorsForSpectrum + detectorCounts[i],
+              mappedDetectorIds.begin() + offsets[i]);
   }
+
+  mapping = SpectrumToDetectorMapping(
+      std::move(spectrumIds), std::move(offsets), std::move(mappedDetectorIds));
 }
@@ -16,24 +16,35 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <h5cpp/hdf5.hpp>
 
 #include "Instrument.h"
+#include "MappedDataset.h"
 #include "TofEvent.h"
 
 #pragma once
 
 class MantidEventNexusLoader {
 public:
-  MantidEventNexusLoader(const std::string &filename);
+  MantidEventNexusLoader(const std::string &filename,
+                         const bool mapEventData = true);
 
   size_t totalEventCount() const;
+  size_t spectrumCount() const;
 
   bool eventsHaveWeight() const;
 
+  bool eventDataMapped() const;
+  DatasetSpan<double> mappedTof() const;
+  DatasetSpan<float> mappedWeight() const;
+
   void loadAllEvents(std::vector<TofEvent> &events) const;
+  void loadSpectra(std::vector<TofEvent> &events, size_t start,
+                   size_t end) const;
 
   void loadSpectrumDetectorMapping(SpectrumToDetectorMapping &mapping) const;
 
@@ -42,4 +53,11 @@ private:
 
   hdf5::node::Group m_eventDataGroup;
   hdf5::node::Group m_detectorsGroup;
+
+  std::vector<uint64_t> m_eventIndices;
+  size_t m_totalEventCount;
+
+  /* Event data read in place from the file, if stored contiguously */
+  std::unique_ptr<MappedDataset> m_tofMapping;
+  std::unique_ptr<MappedDataset> m_weightMapping;
 };
@@ -0,0 +1,177 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <h5cpp/hdf5.hpp>
+
+#pragma once
+
+/**
+ * Read only view of a contiguous array of elements held elsewhere.
+ */
+template <typename T> struct DatasetSpan {
+  const T *data;
+  size_t size;
+
+  const T *begin() const { return data; }
+  const T *end() const { return data + size; }
+
+  const T &operator[](const size_t i) const { return data[i]; }
+
+  bool empty() const { return size == 0; }
+};
+
+/**
+ * @class MappedDataset
+ *
+ * Read only memory mapping of the storage of a dataset in its file.
+ *
+ * Elements are read in place (through the page cache) rather than being
+ * copied through the HDF5 library into a buffer first. Use map_dataset() to
+ * map a dataset whose storage allows this.
+ */
+class MappedDataset {
+public:
+  /**
+   * Maps a range of bytes of a file.
+   *
+   * @param filename File to map
+   * @param offset Offset of the first byte in the file
+   * @param size Number of bytes to map
+   */
+  MappedDataset(const std::string &filename, const size_t offset,
+                const size_t size)
+      : m_mapping(nullptr), m_mappingSize(0), m_data(nullptr), m_size(size) {
+    if (size == 0) {
+      return;
+    }
+
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + filename + " for mapping");
+    }
+
+    struct stat fileStat;
+    if (::fstat(fd, &fileStat) != 0 ||
+        offset + size > static_cast<size_t>(fileStat.st_size)) {
+      ::close(fd);
+      throw std::runtime_error("Mapped range exceeds the size of " + filename);
+    }
+
+    /* Mappings start on a page boundary */
+    const size_t pageSize(::sysconf(_SC_PAGESIZE));
+    const size_t mappingOffset(offset / pageSize * pageSize);
+    m_mappingSize = size + (offset - mappingOffset);
+
+    m_mapping = ::mmap(nullptr, m_mappingSize, PROT_READ, MAP_PRIVATE, fd,
+                       mappingOffset);
+    ::close(fd);
+    if (m_mapping == MAP_FAILED) {
+      m_mapping = nullptr;
+      throw std::runtime_error("Failed to map " + filename);
+    }
+
+    /* Events are mostly read front to back */
+    ::madvise(m_mapping, m_mappingSize, MADV_SEQUENTIAL);
+
+    m_data = static_cast<const char *>(m_mapping) + (offset - mappingOffset);
+  }
+
+  MappedDataset(const MappedDataset &) = delete;
+  MappedDataset &operator=(const MappedDataset &) = delete;
+
+  ~MappedDataset() {
+    if (m_mapping) {
+      ::munmap(m_mapping, m_mappingSize);
+    }
+  }
+
+  /**
+   * @return Mapped bytes
+   */
+  const char *data() const { return m_data; }
+
+  /**
+   * @return Number of mapped bytes
+   */
+  size_t size() const { return m_size; }
+
+  /**
+   * @return Mapped bytes viewed as elements of type T
+   */
+  template <typename T> DatasetSpan<T> span() const {
+    return {reinterpret_cast<const T *>(m_data), m_size / sizeof(T)};
+  }
+
+private:
+  void *m_mapping;
+  size_t m_mappingSize;
+
+  const char *m_data;
+  const size_t m_size;
+};
+
+/**
+ * Maps the elements of a one dimensional dataset, if they can be read in
+ * place as elements of type T.
+ *
+ * This requires the dataset to be stored contiguously (so unfiltered) in the
+ * file it was opened from, using the native representation of T at an offset
+ * aligned for T. Otherwise no mapping is made and the dataset must be read
+ * through the HDF5 library.
+ *
+ * @param filename File the dataset was opened from (with the default file
+ *                 driver)
+ * @param dataset Dataset to map
+ * @return Mapping of the dataset, null if it cannot be mapped
+ */
+template <typename T>
+std::unique_ptr<MappedDataset> map_dataset(const std::string &filename,
+                                           const hdf5::node::Dataset &dataset) {
+  if (dataset.creation_list().layout() !=
+      hdf5::property::DatasetLayout::CONTIGUOUS) {
+    return nullptr;
+  }
+
+  /* Element type stored in the file must be the native type, so no conversion
+   * is needed */
+  const auto fileType = dataset.datatype();
+  const auto memoryType = hdf5::datatype::create<T>();
+  if (H5Tequal(static_cast<hid_t>(fileType), static_cast<hid_t>(memoryType)) <=
+      0) {
+    return nullptr;
+  }
+
+  /* Undefined when storage is not allocated or external to the file */
+  const haddr_t offset = H5Dget_offset(static_cast<hid_t>(dataset));
+  if (offset == HADDR_UNDEF || offset % alignof(T) != 0) {
+    return nullptr;
+  }
+
+  const size_t size(dataset.dataspace().size() * sizeof(T));
+  return std::unique_ptr<MappedDataset>(
+      new MappedDataset(filename, offset, size));
+}
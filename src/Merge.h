@@ -16,6 +16,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
 #pragma once
 
 template <typename EventT>
@@ -43,3 +51,636 @@ void merge_event_curves(typename EventT::ZCurve &curve,
   curve.reserve(a.size() + b.size());
   std::merge(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(curve));
 }
+
+/**
+ * Merges a new curve into the spare capacity of an existing curve.
+ *
+ * Events are merged backwards from the end of both curves, so no event of the
+ * existing curve is overwritten before it has been moved and no additional
+ * storage is required.
+ *
+ * Capacity planning is left to the caller: the existing curve must already have
+ * capacity for the merged curve, it is never reallocated.
+ *
+ * @param curve Existing curve, replaced with the merged curve
+ * @param curveNew Curve to merge into the existing curve
+ */
+template <typename EventT>
+void merge_event_curves_bounded(typename EventT::ZCurve &curve,
+                                const typename EventT::ZCurve &curveNew) {
+  const size_t numExisting = curve.size();
+
+  if (curve.capacity() < numExisting + curveNew.size()) {
+    throw std::runtime_error("Insufficient capacity in event curve for merge");
+  }
+
+  /* Does not reallocate as capacity is sufficient */
+  curve.resize(numExisting + curveNew.size());
+
+  auto outIt = curve.end();
+  auto existingIt = curve.begin() + numExisting;
+  auto newIt = curveNew.cend();
+
+  /* Once the new curve is exhausted the remaining existing events are already
+   * in place */
+  while (newIt != curveNew.cbegin()) {
+    /* Equal events from the new curve are placed after existing ones */
+    if (existingIt != curve.begin() && *(newIt - 1) < *(existingIt - 1)) {
+      *(--outIt) = *(--existingIt);
+    } else {
+      *(--outIt) = *(--newIt);
+    }
+  }
+}
+
+/**
+ * Merges two adjacent sorted ranges using a fixed size scratch buffer.
+ *
+ * If the smaller range fits in the buffer the ranges are merged directly,
+ * otherwise the ranges are split around the median of the larger range, the
+ * inner blocks are swapped with a rotation and both halves are merged
+ * recursively. The merge is stable.
+ *
+ * @param first Start of the first range
+ * @param middle End of the first range and start of the second range
+ * @param last End of the second range
+ * @param len1 Length of the first range
+ * @param len2 Length of the second range
+ * @param buffer Start of the scratch buffer
+ * @param bufferSize Number of elements the scratch buffer can hold
+ */
+template <typename Iterator, typename BufferIterator>
+void merge_adaptive_bounded(Iterator first, Iterator middle, Iterator last,
+                            const size_t len1, const size_t len2,
+                            BufferIterator buffer, const size_t bufferSize) {
+  if (len1 == 0 || len2 == 0) {
+    return;
+  }
+
+  if (len1 + len2 == 2) {
+    if (*middle < *first) {
+      std::iter_swap(first, middle);
+    }
+    return;
+  }
+
+  if (len1 <= len2 && len1 <= bufferSize) {
+    /* Move first range to buffer and merge forwards */
+    const auto bufferEnd = std::move(first, middle, buffer);
+    auto bufferIt = buffer;
+    while (bufferIt != bufferEnd && middle != last) {
+      if (*middle < *bufferIt) {
+        *(first++) = std::move(*(middle++));
+      } else {
+        *(first++) = std::move(*(bufferIt++));
+      }
+    }
+    std::move(bufferIt, bufferEnd, first);
+  } else if (len2 <= bufferSize) {
+    /* Move second range to buffer and merge backwards */
+    const auto bufferEnd = std::move(middle, last, buffer);
+    auto bufferIt = bufferEnd;
+    while (bufferIt != buffer && middle != first) {
+      if (*(bufferIt - 1) < *(middle - 1)) {
+        *(--last) = std::move(*(--middle));
+      } else {
+        *(--last) = std::move(*(--bufferIt));
+      }
+    }
+    std::move_backward(buffer, bufferIt, last);
+  } else {
+    /* Split the larger range in half and find the corresponding split in the
+     * other range */
+    Iterator cut1, cut2;
+    size_t len11, len22;
+    if (len1 > len2) {
+      len11 = len1 / 2;
+      cut1 = first + len11;
+      cut2 = std::lower_bound(middle, last, *cut1);
+      len22 = std::distance(middle, cut2);
+    } else {
+      len22 = len2 / 2;
+      cut2 = middle + len22;
+      cut1 = std::upper_bound(first, middle, *cut2);
+      len11 = std::distance(first, cut1);
+    }
+
+    /* Swap the inner blocks, leaving two independent merges */
+    const auto newMiddle = std::rotate(cut1, middle, cut2);
+
+    merge_adaptive_bounded(first, cut1, newMiddle, len11, len22, buffer,
+                           bufferSize);
+    merge_adaptive_bounded(newMiddle, cut2, last, len1 - len11, len2 - len22,
+                           buffer, bufferSize);
+  }
+}
+
+/**
+ * Merges two curves that are stored adjacently in the same container using a
+ * scratch buffer of bounded size.
+ *
+ * Unlike std::inplace_merge the scratch buffer never exceeds the given memory
+ * budget; smaller budgets increase the number of events moved (roughly
+ * O(n log(n / b)) for a buffer of b events).
+ *
+ * @param curve Container holding both curves
+ * @param middle Index of the first event of the second curve
+ * @param memoryBudget Maximum size of the scratch buffer in bytes
+ */
+template <typename EventT>
+void merge_event_curves_inplace_bounded(typename EventT::ZCurve &curve,
+                                        const size_t middle,
+                                        const size_t memoryBudget) {
+  const size_t len1 = middle;
+  const size_t len2 = curve.size() - middle;
+
+  /* Buffer is never required to hold more than the smaller curve */
+  const size_t bufferSize =
+      std::min(memoryBudget / sizeof(EventT), std::min(len1, len2));
+  typename EventT::ZCurve buffer(bufferSize);
+
+  merge_adaptive_bounded(curve.begin(), curve.begin() + middle, curve.end(),
+                         len1, len2, buffer.begin(), bufferSize);
+}
+
+/**
+ * Finds the number of elements taken from the first curve in the first k
+ * elements of the merge of two curves (i.e. the intersection of the merge path
+ * with diagonal k).
+ *
+ * Ties are resolved in the same way as std::merge (elements from the first
+ * curve come first), so merging each partition separately gives the same
+ * result as merging the whole curves.
+ *
+ * @param a First sorted curve
+ * @param b Second sorted curve
+ * @param k Position in the merged curve
+ * @return Number of elements from a preceding position k in the merged curve
+ */
+template <typename EventT>
+size_t merge_path_partition(const typename EventT::ZCurve &a,
+                            const typename EventT::ZCurve &b, const size_t k) {
+  size_t low = k > b.size() ? k - b.size() : 0;
+  size_t high = std::min(k, a.size());
+
+  /* Binary search for the smallest count from a for which the last element
+   * taken from b sorts strictly before the next element of a */
+  while (low < high) {
+    const size_t i = low + (high - low) / 2;
+    if (b[k - i - 1] < a[i]) {
+      high = i;
+    } else {
+      low = i + 1;
+    }
+  }
+
+  return low;
+}
+
+/**
+ * Merges two curves in parallel.
+ *
+ * The output is split into equally sized partitions, the input ranges for each
+ * partition are found by merge_path_partition() and each thread merges its own
+ * partition directly into the output curve.
+ *
+ * If curve is already of the merged size it is not resized, so storage for the
+ * output may be allocated (and reused) by the caller. Otherwise the resize
+ * default constructs every event on the calling thread before the parallel
+ * merge, which is a serial pass over the output (std::vector offers no way to
+ * leave the events uninitialised for the threads to construct).
+ *
+ * @param curve Output curve
+ * @param a First curve
+ * @param b Second curve
+ * @param numThreads Number of threads (and partitions) to use
+ */
+template <typename EventT>
+void merge_event_curves_parallel(
+    typename EventT::ZCurve &curve, const typename EventT::ZCurve &a,
+    const typename EventT::ZCurve &b,
+    const size_t numThreads = omp_get_max_threads()) {
+  const size_t numEvents = a.size() + b.size();
+  curve.resize(numEvents);
+
+#pragma omp parallel num_threads(std::max<size_t>(numThreads, 1))
+  {
+    const size_t thread = omp_get_thread_num();
+    const size_t threadCount = omp_get_num_threads();
+
+    /* Output range for this thread */
+    const size_t outStart = numEvents * thread / threadCount;
+    const size_t outEnd = numEvents * (thread + 1) / threadCount;
+
+    /* Corresponding input ranges */
+    const size_t aStart = merge_path_partition<EventT>(a, b, outStart);
+    const size_t aEnd = merge_path_partition<EventT>(a, b, outEnd);
+
+    std::merge(a.cbegin() + aStart, a.cbegin() + aEnd,
+               b.cbegin() + (outStart - aStart), b.cbegin() + (outEnd - aEnd),
+               curve.begin() + outStart);
+  }
+}
+
+/**
+ * @class LoserTree
+ *
+ * Tournament tree used to repeatedly select the smallest head element of
+ * several sorted ranges.
+ *
+ * Each internal node stores the index of the range that lost the comparison at
+ * that node, the overall winner is stored separately. Advancing the winning
+ * range only requires replaying the comparisons on the path from its leaf to
+ * the root (log2(k) comparisons for k ranges).
+ *
+ * Equal elements are taken from the range with the lowest index first.
+ */
+template <typename Iterator> class LoserTree {
+public:
+  using Range = std::pair<Iterator, Iterator>;
+
+public:
+  LoserTree(const std::vector<Range> &ranges)
+      : m_ranges(ranges), m_losers(ranges.size()), m_winner(0) {
+    const size_t k = m_ranges.size();
+    if (k < 2) {
+      return;
+    }
+
+    /* Play the initial tournament, leaves are at [k, 2k) */
+    std::vector<size_t> winners(2 * k);
+    for (size_t i = 0; i < k; i++) {
+      winners[k + i] = i;
+    }
+    for (size_t node = k - 1; node > 0; node--) {
+      auto a = winners[2 * node];
+      auto b = winners[2 * node + 1];
+      if (less(b, a)) {
+        std::swap(a, b);
+      }
+      winners[node] = a;
+      m_losers[node] = b;
+    }
+    m_winner = winners[1];
+  }
+
+  /**
+   * Checks if all ranges are exhausted.
+   */
+  bool empty() const { return m_ranges.empty() || exhausted(m_winner); }
+
+  /**
+   * Gets the smallest head element.
+   */
+  Iterator top() const { return m_ranges[m_winner].first; }
+
+  /**
+   * Advances the range holding the smallest head element.
+   */
+  void pop() {
+    ++m_ranges[m_winner].first;
+
+    /* Replay comparisons from the leaf of the winning range to the root */
+    auto current = m_winner;
+    for (size_t node = (m_ranges.size() + m_winner) / 2; node > 0; node /= 2) {
+      if (less(m_losers[node], current)) {
+        std::swap(m_losers[node], current);
+      }
+    }
+    m_winner = current;
+  }
+
+private:
+  bool exhausted(const size_t i) const {
+    return m_ranges[i].first == m_ranges[i].second;
+  }
+
+  /**
+   * Compares the head elements of two ranges, exhausted ranges are greater than
+   * any element.
+   */
+  bool less(const size_t a, const size_t b) const {
+    if (exhausted(a)) {
+      return false;
+    }
+    if (exhausted(b)) {
+      return true;
+    }
+    if (*m_ranges[a].first < *m_ranges[b].first) {
+      return true;
+    }
+    if (*m_ranges[b].first < *m_ranges[a].first) {
+      return false;
+    }
+    return a < b;
+  }
+
+private:
+  std::vector<Range> m_ranges;
+  std::vector<size_t> m_losers;
+  size_t m_winner;
+};
+
+/**
+ * Finds the Morton number that splits a set of curves such that at least a
+ * given number of events have a Morton number less than or equal to it.
+ *
+ * @param curves Sorted curves
+ * @param rank Number of events in the merged curve preceding the split
+ * @return Smallest Morton number with at least rank events at or below it
+ */
+template <typename EventT>
+auto merge_key_partition(const std::vector<typename EventT::ZCurve> &curves,
+                         const size_t rank) {
+  using MortonT = decltype(std::declval<EventT>().mortonNumber());
+
+  auto count_less_equal = [&curves](const MortonT key) {
+    size_t count(0);
+    for (const auto &curve : curves) {
+      count += std::distance(
+          curve.cbegin(),
+          std::upper_bound(curve.cbegin(), curve.cend(), key,
+                           [](const MortonT morton, const EventT &event) {
+                             return morton < event.mortonNumber();
+                           }));
+    }
+    return count;
+  };
+
+  /* Search space is bounded by the largest Morton number in any curve */
+  MortonT low(0);
+  MortonT high(0);
+  for (const auto &curve : curves) {
+    if (!curve.empty() && high < curve.back().mortonNumber()) {
+      high = curve.back().mortonNumber();
+    }
+  }
+
+  /* Binary search over Morton numbers */
+  while (low < high) {
+    const MortonT mid = low + (high - low) / 2;
+    if (count_less_equal(mid) >= rank) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  return low;
+}
+
+/**
+ * Merges any number of curves, writing each event once.
+ *
+ * The key space is split into partitions containing approximately equal
+ * numbers of events (one per thread), partitions are merged in parallel using a
+ * LoserTree over the corresponding ranges of every input curve.
+ *
+ * The result is identical to repeated pairwise merging in input order (i.e.
+ * equal events are ordered by the index of their source curve).
+ *
+ * As for merge_event_curves_parallel() resizing the output curve initialises
+ * every event serially, a caller merging repeatedly should reuse a curve that
+ * already has the merged size.
+ *
+ * @param curve Output curve
+ * @param curves Input curves
+ * @param numThreads Number of threads (and partitions) to use
+ */
+template <typename EventT>
+void merge_event_curves_k(typename EventT::ZCurve &curve,
+                          const std::vector<typename EventT::ZCurve> &curves,
+                          const size_t numThreads = omp_get_max_threads()) {
+  using Iterator = typename EventT::ZCurve::const_iterator;
+  using MortonT = decltype(std::declval<EventT>().mortonNumber());
+
+  size_t numEvents(0);
+  for (const auto &c : curves) {
+    numEvents += c.size();
+  }
+  curve.resize(numEvents);
+
+  /* Find partition boundaries in each input curve, partition p covers
+   * [boundaries[p], boundaries[p + 1]) */
+  const size_t numPartitions = std::max<size_t>(numThreads, 1);
+  std::vector<std::vector<Iterator>> boundaries(numPartitions + 1);
+
+  for (const auto &c : curves) {
+    boundaries.front().push_back(c.cbegin());
+    boundaries.back().push_back(c.cend());
+  }
+
+#pragma omp parallel for num_threads(numPartitions)
+  for (size_t p = 1; p < numPartitions; p++) {
+    const MortonT key = merge_key_partition<EventT>(
+        curves, numEvents * p / numPartitions);
+
+    for (const auto &c : curves) {
+      boundaries[p].push_back(
+          std::upper_bound(c.cbegin(), c.cend(), key,
+                           [](const MortonT morton, const EventT &event) {
+                             return morton < event.mortonNumber();
+                           }));
+    }
+  }
+
+  /* Output position of each partition */
+  std::vector<size_t> outStart(numPartitions + 1, 0);
+  for (size_t p = 0; p < numPartitions; p++) {
+    outStart[p + 1] = outStart[p];
+    for (size_t i = 0; i < curves.size(); i++) {
+      outStart[p + 1] += std::distance(boundaries[p][i], boundaries[p + 1][i]);
+    }
+  }
+
+#pragma omp parallel for num_threads(numPartitions)
+  for (size_t p = 0; p < numPartitions; p++) {
+    std::vector<typename LoserTree<Iterator>::Range> ranges;
+    for (size_t i = 0; i < curves.size(); i++) {
+      ranges.emplace_back(boundaries[p][i], boundaries[p + 1][i]);
+    }
+
+    LoserTree<Iterator> tree(ranges);
+    for (auto outIt = curve.begin() + outStart[p]; !tree.empty(); ++outIt) {
+      *outIt = *tree.top();
+      tree.pop();
+    }
+  }
+}
+
+/**
+ * Merges a sorted batch of new events into an existing curve and updates the
+ * box tree built over that curve in place of rebuilding it.
+ *
+ * Boxes that receive no new events only have their event ranges shifted, leaf
+ * boxes that reach the split threshold are split further. The resulting tree is
+ * identical to one created by distributeEvents() over the merged curve with the
+ * same parameters.
+ *
+ * This avoids re-sorting and re-splitting, but the cost is still linear in the
+ * size of the whole curve: the merge writes every event to a new curve and
+ * every box is visited to shift its event range (which is held as iterators
+ * into the curve). Only the splitting is limited to boxes that gain events.
+ *
+ * @param curve Existing curve, replaced with the merged curve
+ * @param rootBox Root of the box tree over curve
+ * @param batch Sorted batch of new events
+ * @param splitThreshold Number of events at which a box will be further split
+ * @param maxDepth Maximum box tree depth (including root box)
+ */
+template <typename EventT, typename BoxT>
+void merge_event_curves_incremental(typename EventT::ZCurve &curve,
+                                    BoxT &rootBox,
+                                    const typename EventT::ZCurve &batch,
+                                    const size_t splitThreshold,
+                                    const size_t maxDepth) {
+  /* The old curve must outlive the tree update as box event ranges are
+   * translated from it */
+  typename EventT::ZCurve merged;
+  merge_event_curves<EventT>(merged, curve, batch);
+
+  rootBox.insertEvents(curve.cbegin(), merged.cbegin(), batch.cbegin(),
+                       batch.cend(), 0, splitThreshold, maxDepth);
+
+  /* Iterators into merged remain valid after the swap */
+  curve.swap(merged);
+}
+
+/**
+ * Recursive step of merge_event_curves_and_box_trees().
+ *
+ * Merges the events of two corresponding boxes (with identical bounds) into the
+ * output box. Where either input box has been split the child boxes are reused
+ * (the events of an unsplit input box are partitioned using the child box
+ * bounds), where neither has the events are merged and the output box is split
+ * if the combined event count reaches the split threshold.
+ *
+ * @param out Output box, event range must already be set
+ * @param outIt Start of the output box event range
+ * @param a First input box (nullptr if this range is not split in the input)
+ * @param aEvents Events from the first input in this box
+ * @param b Second input box (nullptr if this range is not split in the input)
+ * @param bEvents Events from the second input in this box
+ * @param splitThreshold Number of events at which a box will be further split
+ * @param maxDepth Maximum box tree depth (including this box)
+ */
+template <typename EventT, typename BoxT>
+void merge_box_tree_events(BoxT &out, typename EventT::ZCurve::iterator outIt,
+                           const BoxT *a,
+                           const typename BoxT::EventRange aEvents,
+                           const BoxT *b,
+                           const typename BoxT::EventRange bEvents,
+                           const size_t splitThreshold, const size_t maxDepth) {
+  const bool aSplit = a != nullptr && !a->children().empty();
+  const bool bSplit = b != nullptr && !b->children().empty();
+
+  /* Neither input has structure below this box, merge the events directly and
+   * split if the combined box reaches the threshold */
+  if (maxDepth == 1 || (!aSplit && !bSplit)) {
+    std::merge(aEvents.first, aEvents.second, bEvents.first, bEvents.second,
+               outIt);
+    out.distributeEvents(splitThreshold, maxDepth);
+    return;
+  }
+
+  /* Reuse child box bounds from whichever input has been split */
+  const auto &childBounds = aSplit ? a->children() : b->children();
+
+  /* Find the input event ranges for each child box */
+  auto find_child_events = [](const typename BoxT::EventRange &events,
+                              typename BoxT::ZCurveIterator &it,
+                              const BoxT &bounds) {
+    const auto begin = it;
+    it = std::upper_bound(it, events.second, bounds.max(),
+                          [](const auto morton, const EventT &event) {
+                            return morton < event.mortonNumber();
+                          });
+    return typename BoxT::EventRange(begin, it);
+  };
+
+  std::vector<typename BoxT::EventRange> aChildEvents, bChildEvents;
+  std::vector<typename EventT::ZCurve::iterator> outChildIts;
+
+  auto aIt = aEvents.first;
+  auto bIt = bEvents.first;
+
+  out.children().reserve(childBounds.size());
+  for (size_t i = 0; i < childBounds.size(); i++) {
+    const auto &bounds = childBounds[i];
+
+    aChildEvents.push_back(
+        aSplit ? typename BoxT::EventRange(a->children()[i].eventBegin(),
+                                           a->children()[i].eventEnd())
+               : find_child_events(aEvents, aIt, bounds));
+    bChildEvents.push_back(
+        bSplit ? typename BoxT::EventRange(b->children()[i].eventBegin(),
+                                           b->children()[i].eventEnd())
+               : find_child_events(bEvents, bIt, bounds));
+
+    /* Output child box event range is the sum of the input ranges */
+    const auto numEvents =
+        std::distance(aChildEvents[i].first, aChildEvents[i].second) +
+        std::distance(bChildEvents[i].first, bChildEvents[i].second);
+
+    outChildIts.push_back(outIt);
+    out.children().emplace_back(outIt, outIt + numEvents, bounds.min(),
+                                bounds.max());
+    outIt += numEvents;
+  }
+
+/* Merge child boxes in parallel, see MDBox::distributeEvents() */
+#pragma omp parallel
+#pragma omp single nowait
+  {
+    for (size_t i = 0; i < childBounds.size(); i++) {
+#pragma omp task
+      merge_box_tree_events<EventT, BoxT>(
+          out.children()[i], outChildIts[i],
+          aSplit ? &a->children()[i] : nullptr, aChildEvents[i],
+          bSplit ? &b->children()[i] : nullptr, bChildEvents[i],
+          splitThreshold, maxDepth - 1);
+    }
+
+#pragma omp taskwait
+  }
+}
+
+/**
+ * Merges two curves and their box trees, producing the box tree for the merged
+ * curve directly.
+ *
+ * Both curves must have been created with the same MD extents (and therefore
+ * have the same box bounds). Rather than rebuilding the box tree over the
+ * merged curve, both input trees are walked together: events are merged box by
+ * box (with each subtree being an independent unit of work) and only boxes
+ * that were unsplit in both inputs but whose combined event count reaches the
+ * split threshold are split further.
+ *
+ * @param curve Output curve
+ * @param a First curve
+ * @param aRoot Root of the box tree over a
+ * @param b Second curve
+ * @param bRoot Root of the box tree over b
+ * @param splitThreshold Number of events at which a box will be further split
+ * @param maxDepth Maximum box tree depth (including root box)
+ * @return Root of the box tree over curve
+ */
+template <typename EventT, typename BoxT>
+BoxT merge_event_curves_and_box_trees(typename EventT::ZCurve &curve,
+                                      const typename EventT::ZCurve &a,
+                                      const BoxT &aRoot,
+                                      const typename EventT::ZCurve &b,
+                                      const BoxT &bRoot,
+                                      const size_t splitThreshold,
+                                      const size_t maxDepth) {
+  curve.resize(a.size() + b.size());
+
+  BoxT root(curve.cbegin(), curve.cend(), aRoot.min(), aRoot.max());
+  merge_box_tree_events<EventT, BoxT>(
+      root, curve.begin(), &aRoot,
+      typename BoxT::EventRange(aRoot.eventBegin(), aRoot.eventEnd()), &bRoot,
+      typename BoxT::EventRange(bRoot.eventBegin(), bRoot.eventEnd()),
+      splitThreshold, maxDepth);
+
+  return root;
+}
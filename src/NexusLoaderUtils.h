@@ -16,9 +16,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <vector>
 
 #include <h5cpp/hdf5.hpp>
+#include <zlib.h>
 
 #pragma once
 
@@ -37,3 +41,195 @@ void resize_and_read_dataset(std::vector<T> &data,
   data.resize(dataset.dataspace().size());
   dataset.read(data);
 }
+
+/**
+ * Gets the number of elements of a one dimensional dataset to read at a time.
+ *
+ * For a chunked dataset the size is rounded up to a whole number of chunks, so
+ * reads of consecutive blocks starting at multiples of the size never read (or
+ * decompress) a chunk twice.
+ *
+ * @param dataset Dataset to read
+ * @param targetSize Minimum number of elements to read at a time
+ * @return Number of elements to read at a time
+ */
+inline size_t chunk_aligned_block_size(const hdf5::node::Dataset &dataset,
+                                       const size_t targetSize) {
+  const auto creationList = dataset.creation_list();
+  if (creationList.layout() != hdf5::property::DatasetLayout::CHUNKED) {
+    return targetSize;
+  }
+
+  const size_t chunkSize(creationList.chunk()[0]);
+  if (chunkSize == 0) {
+    return targetSize;
+  }
+  return (targetSize + chunkSize - 1) / chunkSize * chunkSize;
+}
+
+/**
+ * Storage of a dataset that can be read with direct chunk reads.
+ */
+struct DirectChunkLayout {
+  /* Number of elements per chunk, zero if the dataset can not be read with
+   * direct chunk reads */
+  size_t chunk_size;
+
+  /* If chunks are compressed with deflate (unless their filter mask says the
+   * filter was skipped) */
+  bool deflate;
+};
+
+/**
+ * Gets how a one dimensional dataset can be read with direct chunk reads.
+ *
+ * This requires the dataset to be chunked, compressed with deflate alone (or
+ * not filtered at all) and stored in the native representation of T, so that
+ * a decompressed chunk is the elements of the chunk.
+ *
+ * @param dataset Dataset to read
+ * @return Chunk layout (with a chunk size of zero if not supported)
+ */
+template <typename T>
+DirectChunkLayout direct_chunk_layout(const hdf5::node::Dataset &dataset) {
+  DirectChunkLayout layout{0, false};
+
+  const auto creationList = dataset.creation_list();
+  if (creationList.layout() != hdf5::property::DatasetLayout::CHUNKED ||
+      creationList.chunk().size() != 1) {
+    return layout;
+  }
+
+  const auto fileType = dataset.datatype();
+  const auto memoryType = hdf5::datatype::create<T>();
+  if (H5Tequal(static_cast<hid_t>(fileType), static_cast<hid_t>(memoryType)) <=
+      0) {
+    return layout;
+  }
+
+  const hid_t plist = static_cast<hid_t>(creationList);
+  const int filterCount = H5Pget_nfilters(plist);
+  if (filterCount < 0 || filterCount > 1) {
+    return layout;
+  }
+  if (filterCount == 1) {
+    unsigned int flags;
+    size_t valueCount(0);
+    if (H5Pget_filter2(plist, 0, &flags, &valueCount, nullptr, 0, nullptr,
+                       nullptr) != H5Z_FILTER_DEFLATE) {
+      return layout;
+    }
+    layout.deflate = true;
+  }
+
+  layout.chunk_size = creationList.chunk()[0];
+  return layout;
+}
+
+/**
+ * Reads a range of a one dimensional dataset, decompressing its chunks in
+ * parallel.
+ *
+ * HDF5 decompresses the chunks of a read one after another. Here the raw
+ * chunks covering the range are read with direct chunk reads (one at a time,
+ * HDF5 is only ever called from one thread) and then decompressed into the
+ * output across OpenMP threads. Chunks wholly inside the range are
+ * decompressed in place.
+ *
+ * Datasets that direct_chunk_layout() does not support, and chunks that are
+ * not allocated, are read through HDF5 as by resize_and_read_dataset_range().
+ *
+ * @param data Output elements
+ * @param dataset Dataset to read
+ * @param start Index of the first element to read
+ * @param end Index after the last element to read
+ */
+template <typename T>
+void resize_and_read_dataset_range_parallel(std::vector<T> &data,
+                                            hdf5::node::Dataset dataset,
+                                            size_t start, size_t end) {
+#if H5_VERSION_GE(1, 10, 2)
+  const auto layout = direct_chunk_layout<T>(dataset);
+  if (layout.chunk_size > 0 && start < end) {
+    const size_t chunkSize(layout.chunk_size);
+    const size_t firstChunk(start / chunkSize);
+    const size_t chunkCount((end - 1) / chunkSize + 1 - firstChunk);
+    const hid_t datasetId = static_cast<hid_t>(dataset);
+
+    /* Read raw chunks */
+    std::vector<std::vector<unsigned char>> rawChunks(chunkCount);
+    std::vector<uint32_t> filterMasks(chunkCount);
+    bool allocated(true);
+    for (size_t i = 0; i < chunkCount && allocated; i++) {
+      hsize_t offset((firstChunk + i) * chunkSize);
+      hsize_t storageSize(0);
+      allocated = H5Dget_chunk_storage_size(datasetId, &offset, &storageSize) >=
+                      0 &&
+                  storageSize > 0;
+      if (allocated) {
+        rawChunks[i].resize(storageSize);
+        if (H5Dread_chunk(datasetId, H5P_DEFAULT, &offset, &filterMasks[i],
+                          rawChunks[i].data()) < 0) {
+          throw std::runtime_error("Failed to read chunk");
+        }
+      }
+    }
+
+    if (allocated) {
+      data.resize(end - start);
+      const size_t chunkBytes(chunkSize * sizeof(T));
+      bool failed(false);
+
+#pragma omp parallel
+      {
+        std::vector<T> buffer;
+
+#pragma omp for schedule(dynamic)
+        for (size_t i = 0; i < chunkCount; i++) {
+          const size_t chunkStart((firstChunk + i) * chunkSize);
+          const size_t copyStart(std::max(chunkStart, start));
+          const size_t copyEnd(std::min(chunkStart + chunkSize, end));
+
+          /* Partly read chunks are decompressed into a buffer first */
+          const bool whole(copyEnd - copyStart == chunkSize);
+          if (!whole) {
+            buffer.resize(chunkSize);
+          }
+          T *const chunk =
+              whole ? data.data() + (chunkStart - start) : buffer.data();
+
+          const auto &raw = rawChunks[i];
+          bool ok;
+          if (layout.deflate && (filterMasks[i] & 1) == 0) {
+            uLongf size(chunkBytes);
+            ok = uncompress(reinterpret_cast<Bytef *>(chunk), &size,
+                            raw.data(), raw.size()) == Z_OK &&
+                 size == chunkBytes;
+          } else {
+            ok = raw.size() == chunkBytes;
+            if (ok) {
+              std::memcpy(chunk, raw.data(), chunkBytes);
+            }
+          }
+
+          if (!ok) {
+#pragma omp atomic write
+            failed = true;
+          } else if (!whole) {
+            std::copy(buffer.cbegin() + (copyStart - chunkStart),
+                      buffer.cbegin() + (copyEnd - chunkStart),
+                      data.begin() + (copyStart - start));
+          }
+        }
+      }
+
+      if (failed) {
+        throw std::runtime_error("Failed to decompress chunk");
+      }
+      return;
+    }
+  }
+#endif
+
+  resize_and_read_dataset_range(data, dataset, start, end);
+}
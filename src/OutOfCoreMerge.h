@@ -0,0 +1,241 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BitInterleaving.h"
+#include "EventCurveFile.h"
+#include "MDEvent.h"
+#include "Merge.h"
+
+#pragma once
+
+/**
+ * A single box in a box structure built over an event curve that is not held in
+ * memory (e.g. one stored in a sorted event curve file).
+ *
+ * Equivalent to MDBox, with the range of events in the box given as indices
+ * into the curve rather than iterators.
+ */
+template <typename MortonT> struct StreamedBox {
+  MortonT lower;
+  MortonT upper;
+  size_t eventBegin;
+  size_t eventEnd;
+  std::vector<StreamedBox<MortonT>> children;
+
+  size_t eventCount() const { return eventEnd - eventBegin; }
+};
+
+/**
+ * @class StreamingBoxTreeBuilder
+ *
+ * Builds a box structure over a curve from a stream of Morton numbers in sorted
+ * order, without requiring the curve to be held in memory.
+ *
+ * The resulting structure is identical to that created by
+ * MDBox::distributeEvents() with the same parameters.
+ *
+ * The path of boxes containing the most recent event is kept open down to the
+ * maximum depth. When a box is closed (i.e. an event outside of it is added)
+ * its event count is known: if it is below the split threshold its children
+ * are discarded, otherwise its remaining (empty) children are added. Memory
+ * use is therefore bounded by the size of the final box structure plus the
+ * open path.
+ */
+template <size_t ND, typename IntT, typename MortonT>
+class StreamingBoxTreeBuilder {
+public:
+  using Box = StreamedBox<MortonT>;
+
+  /**
+   * The number of child boxes a box can have.
+   */
+  static constexpr size_t ChildBoxCount = 1 << ND;
+
+public:
+  /**
+   * @param splitThreshold Number of events at which a box will be split
+   * @param maxDepth Maximum box tree depth (including root box)
+   */
+  StreamingBoxTreeBuilder(const size_t splitThreshold, const size_t maxDepth)
+      : m_splitThreshold(splitThreshold), m_maxDepth(maxDepth),
+        m_eventCount(0) {
+    IntArray<ND, IntT> minCoord, maxCoord;
+    minCoord.fill(std::numeric_limits<IntT>::min());
+    maxCoord.fill(std::numeric_limits<IntT>::max());
+
+    m_openBoxes.push_back(Box{interleave<ND, IntT, MortonT>(minCoord),
+                              interleave<ND, IntT, MortonT>(maxCoord), 0, 0,
+                              {}});
+  }
+
+  /**
+   * Adds the next event in the curve.
+   *
+   * @param morton Morton number of the event, must not be less than that of
+   *               the previous event
+   */
+  void add(const MortonT morton) {
+    /* Close boxes that end before this event */
+    while (m_openBoxes.size() > 1 && m_openBoxes.back().upper < morton) {
+      closeBox();
+    }
+
+    /* Open boxes containing this event down to the maximum depth */
+    while (m_openBoxes.size() < m_maxDepth) {
+      const auto &parent = m_openBoxes.back();
+      const MortonT childBoxWidth =
+          (parent.upper - parent.lower) / ChildBoxCount;
+      const MortonT childIdx = (morton - parent.lower) / (childBoxWidth + 1);
+      const MortonT boxLower = parent.lower + (childBoxWidth + 1) * childIdx;
+
+      m_openBoxes.push_back(
+          Box{boxLower, boxLower + childBoxWidth, m_eventCount, 0, {}});
+    }
+
+    m_eventCount++;
+  }
+
+  /**
+   * Closes all remaining boxes.
+   *
+   * @return Root box
+   */
+  Box finish() {
+    while (m_openBoxes.size() > 1) {
+      closeBox();
+    }
+
+    Box root = std::move(m_openBoxes.back());
+    root.eventEnd = m_eventCount;
+    finaliseChildren(root, 0);
+    return root;
+  }
+
+  size_t eventCount() const { return m_eventCount; }
+
+private:
+  /**
+   * Closes the deepest open box and adds it to its parent.
+   */
+  void closeBox() {
+    Box box = std::move(m_openBoxes.back());
+    m_openBoxes.pop_back();
+
+    box.eventEnd = m_eventCount;
+    finaliseChildren(box, m_openBoxes.size());
+
+    /* Add empty boxes preceding this one in the parent */
+    auto &parent = m_openBoxes.back();
+    const MortonT childBoxWidth = (parent.upper - parent.lower) / ChildBoxCount;
+    const MortonT childIdx = (box.lower - parent.lower) / (childBoxWidth + 1);
+    fillChildren(parent, static_cast<size_t>(childIdx), box.eventBegin);
+
+    parent.children.push_back(std::move(box));
+  }
+
+  /**
+   * Keeps the children of a closed box if the box should be split, otherwise
+   * discards them.
+   */
+  void finaliseChildren(Box &box, const size_t depth) {
+    if (depth + 1 >= m_maxDepth || box.eventCount() < m_splitThreshold) {
+      box.children.clear();
+    } else {
+      fillChildren(box, ChildBoxCount, box.eventEnd);
+    }
+  }
+
+  /**
+   * Adds empty child boxes to a box until it has a given number of children.
+   */
+  void fillChildren(Box &box, const size_t childCount, const size_t eventIdx) {
+    const MortonT childBoxWidth = (box.upper - box.lower) / ChildBoxCount;
+
+    while (box.children.size() < childCount) {
+      const MortonT boxLower =
+          box.lower + (childBoxWidth + 1) * MortonT(box.children.size());
+      box.children.push_back(
+          Box{boxLower, boxLower + childBoxWidth, eventIdx, eventIdx, {}});
+    }
+  }
+
+private:
+  const size_t m_splitThreshold;
+  const size_t m_maxDepth;
+
+  /* Number of events added */
+  size_t m_eventCount;
+
+  /* Path of open boxes, from the root box to the deepest box containing the
+   * most recent event */
+  std::vector<Box> m_openBoxes;
+};
+
+template <size_t ND, typename IntT, typename MortonT>
+constexpr size_t StreamingBoxTreeBuilder<ND, IntT, MortonT>::ChildBoxCount;
+
+/**
+ * Merges sorted event curve files into a new sorted event curve file, without
+ * holding any of the curves in memory.
+ *
+ * Input files are read sequentially in blocks (with read ahead), merged using
+ * a LoserTree and the output is written in blocks (with write behind), so
+ * memory use is bounded by two blocks per input and output file. The box
+ * structure of the merged curve is built as events are written.
+ *
+ * @param inputFilenames Sorted event curve files to merge
+ * @param outputFilename Output sorted event curve file
+ * @param blockSize Number of events per block in the output file
+ * @param splitThreshold Number of events at which a box will be split
+ * @param maxDepth Maximum box tree depth (including root box)
+ * @return Root of the box structure over the merged curve
+ */
+template <size_t ND, typename IntT, typename MortonT>
+StreamedBox<MortonT>
+merge_event_curve_files(const std::vector<std::string> &inputFilenames,
+                        const std::string &outputFilename,
+                        const size_t blockSize, const size_t splitThreshold,
+                        const size_t maxDepth) {
+  using Reader = EventCurveFileReader<ND, IntT, MortonT>;
+
+  std::vector<std::unique_ptr<Reader>> readers;
+  std::vector<typename LoserTree<typename Reader::Iterator>::Range> ranges;
+  for (const auto &filename : inputFilenames) {
+    readers.emplace_back(new Reader(filename));
+    ranges.emplace_back(readers.back()->begin(), readers.back()->end());
+  }
+
+  EventCurveFileWriter<ND, IntT, MortonT> writer(outputFilename, blockSize);
+  StreamingBoxTreeBuilder<ND, IntT, MortonT> builder(splitThreshold, maxDepth);
+
+  for (LoserTree<typename Reader::Iterator> tree(ranges); !tree.empty();
+       tree.pop()) {
+    const auto &event = *tree.top();
+    writer.write(event);
+    builder.add(event.mortonNumber());
+  }
+
+  writer.close();
+
+  return builder.finish();
+}
@@ -0,0 +1,246 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "TofEvent.h"
+
+#pragma once
+
+/**
+ * @class PrefetchReader
+ *
+ * Reads blocks of TOF events on a background thread ahead of their use, so
+ * that reading the next block overlaps processing of the current one.
+ *
+ * At most queueDepth blocks are read ahead of the consumer. Buffers handed
+ * back through next() are reused for later blocks, so with a queue depth of one
+ * the reader and the consumer alternate between two buffers.
+ *
+ * Time the consumer spends waiting for a block in next() is accumulated as
+ * stall time. It includes reading the first block and is otherwise close to
+ * zero when reading keeps up with processing.
+ *
+ * Only the reader thread calls the block reader, so a loader that is not
+ * thread safe (e.g. anything using HDF5) may be used as long as the consumer
+ * does not use it while the reader is running.
+ */
+class PrefetchReader {
+public:
+  /* Reads the events of the block with the given index into an empty list */
+  using BlockReader = std::function<void(TofEventList &, size_t)>;
+
+  /**
+   * Starts reading blocks in the background.
+   *
+   * @param blockCount Number of blocks to read
+   * @param readBlock Function reading a block of events
+   * @param queueDepth Maximum number of blocks read ahead (at least one)
+   */
+  PrefetchReader(const size_t blockCount, BlockReader readBlock,
+                 const size_t queueDepth)
+      : m_blockCount(blockCount), m_blocks(queueDepth), m_stallTime(0.0),
+        m_readNanoseconds(0) {
+    m_reader = std::async(std::launch::async, [this, readBlock]() {
+      try {
+        for (size_t i = 0; i < m_blockCount; i++) {
+          TofEventList events(takeFreeBuffer());
+
+          const auto start = std::chrono::steady_clock::now();
+          readBlock(events, i);
+          m_readNanoseconds += std::chrono::duration_cast<
+                                   std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count();
+
+          if (!m_blocks.push(std::move(events))) {
+            break;
+          }
+        }
+      } catch (...) {
+        m_blocks.close();
+        throw;
+      }
+      m_blocks.close();
+    });
+  }
+
+  PrefetchReader(const PrefetchReader &) = delete;
+  PrefetchReader &operator=(const PrefetchReader &) = delete;
+
+  ~PrefetchReader() {
+    cancel();
+    if (m_reader.valid()) {
+      m_reader.wait();
+    }
+  }
+
+  /**
+   * Gets the next block of events, waiting until it has been read.
+   *
+   * The previous contents of events are discarded and its buffer is reused for
+   * a later block.
+   *
+   * Rethrows any exception thrown while reading once all blocks read before
+   * the failure have been consumed.
+   *
+   * @param events Storage for the block of events
+   * @return False once all blocks have been consumed (or reading was
+   *         cancelled)
+   */
+  bool next(TofEventList &events) {
+    returnFreeBuffer(events);
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool haveBlock = m_blocks.pop(events);
+    m_stallTime += std::chrono::steady_clock::now() - start;
+
+    if (!haveBlock && m_reader.valid()) {
+      m_reader.get();
+    }
+    return haveBlock;
+  }
+
+  /**
+   * Stops reading further blocks, next() returns the blocks already read.
+   */
+  void cancel() { m_blocks.close(); }
+
+  size_t blockCount() const { return m_blockCount; }
+  size_t queueDepth() const { return m_blocks.capacity(); }
+
+  /**
+   * @return Time spent waiting for blocks in next() in seconds
+   */
+  double stallTime() const { return m_stallTime.count(); }
+
+  /**
+   * @return Time spent reading blocks in the background in seconds
+   */
+  double readTime() const { return m_readNanoseconds * 1e-9; }
+
+private:
+  TofEventList takeFreeBuffer() {
+    TofEventList events;
+    std::lock_guard<std::mutex> lock(m_freeBufferMutex);
+    if (!m_freeBuffers.empty()) {
+      events.swap(m_freeBuffers.back());
+      m_freeBuffers.pop_back();
+    }
+    return events;
+  }
+
+  void returnFreeBuffer(TofEventList &events) {
+    events.clear();
+    std::lock_guard<std::mutex> lock(m_freeBufferMutex);
+    /* Keep a single spare buffer, any more would only hold on to memory */
+    if (events.capacity() > 0 && m_freeBuffers.empty()) {
+      m_freeBuffers.emplace_back();
+      m_freeBuffers.back().swap(events);
+    }
+  }
+
+  const size_t m_blockCount;
+
+  BoundedQueue<TofEventList> m_blocks;
+
+  std::mutex m_freeBufferMutex;
+  std::vector<TofEventList> m_freeBuffers;
+
+  std::chrono::duration<double> m_stallTime;
+  std::atomic<int64_t> m_readNanoseconds;
+
+  std::future<void> m_reader;
+};
+
+/**
+ * Prefetches blocks of frames from an event loader.
+ *
+ * @param loader Event loader, must provide loadFrames(TofEventList &, const
+ *               std::vector<size_t> &) and outlive the reader
+ * @param frameIdxs Indices of the frames to load
+ * @param framesPerBlock Number of frames per block
+ * @param queueDepth Maximum number of blocks read ahead
+ * @return Reader returning the events of each block of frames in order
+ */
+template <typename LoaderT>
+std::unique_ptr<PrefetchReader>
+prefetch_frames(const LoaderT &loader, const std::vector<size_t> &frameIdxs,
+                const size_t framesPerBlock, const size_t queueDepth) {
+  if (framesPerBlock == 0) {
+    throw std::runtime_error("Prefetching requires at least one frame per "
+                             "block");
+  }
+
+  const size_t blockCount =
+      (frameIdxs.size() + framesPerBlock - 1) / framesPerBlock;
+
+  return std::unique_ptr<PrefetchReader>(new PrefetchReader(
+      blockCount,
+      [&loader, frameIdxs, framesPerBlock](TofEventList &events,
+                                           const size_t block) {
+        const size_t first = block * framesPerBlock;
+        const size_t last = first + framesPerBlock < frameIdxs.size()
+                                ? first + framesPerBlock
+                                : frameIdxs.size();
+        loader.loadFrames(events,
+                          std::vector<size_t>(frameIdxs.begin() + first,
+                                              frameIdxs.begin() + last));
+      },
+      queueDepth));
+}
+
+/**
+ * Prefetches blocks of spectra from an event loader.
+ *
+ * @param loader Event loader, must provide spectrumCount() and
+ *               loadSpectra(TofEventList &, size_t, size_t) and outlive the
+ *               reader
+ * @param spectraPerBlock Number of spectra per block
+ * @param queueDepth Maximum number of blocks read ahead
+ * @return Reader returning the events of each block of spectra in order
+ */
+template <typename LoaderT>
+std::unique_ptr<PrefetchReader> prefetch_spectra(const LoaderT &loader,
+                                                 const size_t spectraPerBlock,
+                                                 const size_t queueDepth) {
+  if (spectraPerBlock == 0) {
+    throw std::runtime_error("Prefetching requires at least one spectrum per "
+                             "block");
+  }
+
+  const size_t blockCount =
+      (loader.spectrumCount() + spectraPerBlock - 1) / spectraPerBlock;
+
+  return std::unique_ptr<PrefetchReader>(new PrefetchReader(
+      blockCount,
+      [&loader, spectraPerBlock](TofEventList &events, const size_t block) {
+        loader.loadSpectra(events, block * spectraPerBlock,
+                           (block + 1) * spectraPerBlock);
+      },
+      queueDepth));
+}
@@ -0,0 +1,256 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
+#include "MDEvent.h"
+#include "Merge.h"
+#include "Types.h"
+
+#pragma once
+
+/**
+ * Calculates the smallest MD space that contains both given MD spaces.
+ */
+template <size_t ND>
+MDSpaceBounds<ND> union_md_space_bounds(const MDSpaceBounds<ND> &a,
+                                        const MDSpaceBounds<ND> &b) {
+  MDSpaceBounds<ND> bounds;
+  bounds.col(0) = a.col(0).min(b.col(0));
+  bounds.col(1) = a.col(1).max(b.col(1));
+  return bounds;
+}
+
+/**
+ * Sorts an event curve using a least significant digit radix sort over the
+ * Morton numbers of the events.
+ *
+ * Each pass is parallel: every thread counts the digits of its own part of the
+ * curve, a prefix sum over the counts (in digit then thread order) gives the
+ * output position of each thread's events for each digit, and each thread then
+ * scatters its events. The relative order of events with equal keys is
+ * preserved. Passes over digits that are identical for all events are skipped.
+ *
+ * @param curve Curve to sort
+ * @param keyBits Number of (least significant) bits of the Morton number used
+ *                as the sort key
+ * @param maxThreadCount Number of threads to use at most
+ */
+template <typename EventT>
+void radix_sort_event_curve(
+    typename EventT::ZCurve &curve, const size_t keyBits,
+    const size_t maxThreadCount = omp_get_max_threads()) {
+  using MortonT = decltype(std::declval<EventT>().mortonNumber());
+
+  constexpr size_t RadixBits = 8;
+  constexpr size_t BucketCount = 1 << RadixBits;
+
+  const auto digit = [](const EventT &event, const size_t shift) {
+    return static_cast<size_t>((event.mortonNumber() >> shift) &
+                               MortonT(BucketCount - 1));
+  };
+
+  const size_t eventCount = curve.size();
+  typename EventT::ZCurve buffer(eventCount);
+
+  /* Digit counts of each thread, later converted to output offsets */
+  const size_t threads = std::max<size_t>(maxThreadCount, 1);
+  std::vector<std::array<size_t, BucketCount>> offsets(threads);
+
+  for (size_t shift = 0; shift < keyBits; shift += RadixBits) {
+    bool skip(false);
+
+#pragma omp parallel num_threads(threads)
+    {
+      const size_t threadCount = omp_get_num_threads();
+      const size_t threadIdx = omp_get_thread_num();
+
+      const size_t start = eventCount * threadIdx / threadCount;
+      const size_t end = eventCount * (threadIdx + 1) / threadCount;
+      auto &threadOffsets = offsets[threadIdx];
+
+      /* Count events in each bucket */
+      threadOffsets.fill(0);
+      for (size_t i = start; i < end; i++) {
+        threadOffsets[digit(curve[i], shift)]++;
+      }
+
+#pragma omp barrier
+
+#pragma omp single
+      {
+        /* Convert counts to offsets, skipping digits that do not change the
+         * order */
+        size_t offset(0);
+        for (size_t b = 0; b < BucketCount; b++) {
+          const size_t bucketStart = offset;
+          for (size_t t = 0; t < threadCount; t++) {
+            const size_t count = offsets[t][b];
+            offsets[t][b] = offset;
+            offset += count;
+          }
+          skip = skip || offset - bucketStart == eventCount;
+        }
+      }
+
+      /* Scatter events (in a stable manner) */
+      if (!skip) {
+        for (size_t i = start; i < end; i++) {
+          buffer[threadOffsets[digit(curve[i], shift)]++] = curve[i];
+        }
+      }
+    }
+
+    if (!skip) {
+      std::swap(curve, buffer);
+    }
+  }
+}
+
+/**
+ * Maps an event curve from one MD space to another.
+ *
+ * Integer coordinates of each event are transformed by the affine
+ * transformation between the integer ranges of the two spaces (evaluated per
+ * axis in double precision, or in long double for integer coordinates wider
+ * than the double mantissa), events that fall outside of the target space are
+ * removed and the curve is radix sorted.
+ *
+ * Events falling within one integer step of the edge of the target space are
+ * treated as being within the space and clamped to its edge. Where long double
+ * is no wider than double (so 64 bit coordinates are rounded) this still keeps
+ * events at the edge of the target space.
+ *
+ * @param curve Curve to remap
+ * @param from MD space the curve currently occupies
+ * @param to MD space the curve is mapped to
+ * @return Number of events that were outside of the target space
+ */
+template <size_t ND, typename IntT, typename MortonT>
+size_t remap_event_curve(typename MDEvent<ND, IntT, MortonT>::ZCurve &curve,
+                         const MDSpaceBounds<ND> &from,
+                         const MDSpaceBounds<ND> &to) {
+  using EventT = MDEvent<ND, IntT, MortonT>;
+  using Real = typename std::conditional<
+      (std::numeric_limits<IntT>::digits > std::numeric_limits<double>::digits),
+      long double, double>::type;
+  using Array = Eigen::Array<Real, ND, 1>;
+
+  if ((from == to).all()) {
+    return 0;
+  }
+
+  /* Generate transformation between integer ranges */
+  const Real maxCoord(static_cast<Real>(std::numeric_limits<IntT>::max()));
+  const Array fromRange = (from.col(1) - from.col(0)).template cast<Real>();
+  const Array toRange = (to.col(1) - to.col(0)).template cast<Real>();
+  const Array scale = fromRange / toRange;
+  const Array offset =
+      (from.col(0) - to.col(0)).template cast<Real>() / toRange * maxCoord;
+
+  /* Where maxCoord + 1 is not representable the limit is the next value
+   * above maxCoord, so rounded coordinates at the edge are kept */
+  const Real lowerLimit(-1.0);
+  const Real aboveMaxCoord(
+      std::nextafter(maxCoord, std::numeric_limits<Real>::max()));
+  const Real upperLimit(std::max<Real>(maxCoord + 1, aboveMaxCoord));
+
+  /* Transform coordinates, flagging events outside the target space */
+  std::vector<char> outOfBounds(curve.size(), 0);
+  size_t outOfBoundsCount(0);
+
+#pragma omp parallel for reduction(+ : outOfBoundsCount)
+  for (size_t i = 0; i < curve.size(); i++) {
+    const auto &event = curve[i];
+
+    const Array coord =
+        event.integerCoordinates().template cast<Real>() * scale + offset;
+
+    if ((coord <= lowerLimit).any() || (coord >= upperLimit).any()) {
+      outOfBounds[i] = 1;
+      outOfBoundsCount++;
+    } else {
+      const IntArray<ND, IntT> intCoord =
+          coord.max(Real(0.0)).min(maxCoord).template cast<IntT>();
+      curve[i] = EventT(interleave<ND, IntT, MortonT>(intCoord),
+                        event.signal(), event.errorSquared());
+    }
+  }
+
+  /* Remove events outside of the target space */
+  if (outOfBoundsCount > 0) {
+    size_t outIdx(0);
+    for (size_t i = 0; i < curve.size(); i++) {
+      if (!outOfBounds[i]) {
+        curve[outIdx++] = curve[i];
+      }
+    }
+    curve.resize(outIdx);
+  }
+
+  radix_sort_event_curve<EventT>(curve,
+                                 ND * std::numeric_limits<IntT>::digits);
+
+  return outOfBoundsCount;
+}
+
+/**
+ * Merges two curves occupying different MD spaces into a curve occupying a
+ * given (potentially different) MD space.
+ *
+ * Typically the output space is either one of the input spaces or the union of
+ * both (see union_md_space_bounds()).
+ *
+ * @param curve Output curve
+ * @param a First curve
+ * @param aSpace MD space of the first curve
+ * @param b Second curve
+ * @param bSpace MD space of the second curve
+ * @param space MD space of the output curve
+ * @return Number of events from both curves that were outside of the output
+ *         space (and therefore not merged)
+ */
+template <size_t ND, typename IntT, typename MortonT>
+size_t merge_event_curves_remapped(
+    typename MDEvent<ND, IntT, MortonT>::ZCurve &curve,
+    const typename MDEvent<ND, IntT, MortonT>::ZCurve &a,
+    const MDSpaceBounds<ND> &aSpace,
+    const typename MDEvent<ND, IntT, MortonT>::ZCurve &b,
+    const MDSpaceBounds<ND> &bSpace, const MDSpaceBounds<ND> &space) {
+  using EventT = MDEvent<ND, IntT, MortonT>;
+
+  auto aRemapped(a);
+  size_t outOfBoundsCount =
+      remap_event_curve<ND, IntT, MortonT>(aRemapped, aSpace, space);
+
+  auto bRemapped(b);
+  outOfBoundsCount +=
+      remap_event_curve<ND, IntT, MortonT>(bRemapped, bSpace, space);
+
+  merge_event_curves<EventT>(curve, aRemapped, bRemapped);
+
+  return outOfBoundsCount;
+}
@@ -0,0 +1,371 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "EventToMDEventConversion.h"
+#include "MDEvent.h"
+#include "TofEvent.h"
+#include "Types.h"
+
+#pragma once
+
+/**
+ * Sample rotation over time, for measurements in which the sample is rotated
+ * continuously during a run.
+ *
+ * The rotation of rotations[i] applies to pulses from times[i] until
+ * times[i + 1] (the last one applies to all later pulses, the first also to
+ * all earlier pulses). Rotations are applied after the UB matrix.
+ */
+struct RotationLog {
+  /* Start times of each rotation, increasing (same time base as
+   * TofEvent::pulse_time) */
+  std::vector<double> times;
+  std::vector<Eigen::Matrix3f> rotations;
+};
+
+/**
+ * Creates a rotation log from a sample angle log, grouping angles into bins of
+ * a fixed width.
+ *
+ * Consecutive log entries with angles in the same bin are combined, each bin
+ * uses the rotation about the axis by the angle at the centre of the bin.
+ *
+ * @param times Times of the angle log entries, increasing
+ * @param angles Sample angle (in degrees) of each entry
+ * @param axis Rotation axis
+ * @param angleBinWidth Width of angle bins (in degrees)
+ * @return Rotation log
+ */
+inline RotationLog create_rotation_log(const std::vector<double> &times,
+                                       const std::vector<double> &angles,
+                                       const Eigen::Vector3f &axis,
+                                       const double angleBinWidth) {
+  if (times.size() != angles.size()) {
+    throw std::runtime_error("Angle log times and angles differ in length");
+  }
+  if (!(angleBinWidth > 0.0)) {
+    throw std::runtime_error("Angle bin width must be positive");
+  }
+
+  const Eigen::Vector3f unitAxis = axis.normalized();
+
+  RotationLog log;
+  double lastBin(std::nan(""));
+  for (size_t i = 0; i < times.size(); i++) {
+    const double bin = std::floor(angles[i] / angleBinWidth);
+    if (bin == lastBin) {
+      continue;
+    }
+    lastBin = bin;
+
+    const double binCentre = (bin + 0.5) * angleBinWidth * M_PI / 180.0;
+    log.times.push_back(times[i]);
+    log.rotations.push_back(
+        Eigen::AngleAxisf(static_cast<float>(binCentre), unitAxis).matrix());
+  }
+  return log;
+}
+
+/**
+ * Gets the index of the rotation applying at a given time.
+ *
+ * @param log Rotation log
+ * @param time Pulse time
+ * @return Index of rotation
+ */
+inline size_t find_rotation(const RotationLog &log, const double time) {
+  const auto it =
+      std::upper_bound(log.times.cbegin(), log.times.cend(), time);
+  return it == log.times.cbegin() ? 0
+                                  : std::distance(log.times.cbegin(), it) - 1;
+}
+
+/**
+ * Gets the index of the rotation applying at a given time, starting from the
+ * rotation applying at an earlier time.
+ *
+ * The log is searched forward from the cursor in increasing steps, so the cost
+ * depends on the number of rotations between the two times rather than on the
+ * length of the log. A time earlier than the cursor falls back to a search of
+ * the whole log.
+ *
+ * @param log Rotation log
+ * @param cursor Index of the rotation applying at an earlier time
+ * @param time Pulse time
+ * @return Index of rotation
+ */
+inline size_t advance_rotation(const RotationLog &log, const size_t cursor,
+                               const double time) {
+  if (cursor > 0 && time < log.times[cursor]) {
+    return find_rotation(log, time);
+  }
+
+  const size_t rotationCount = log.times.size();
+
+  /* Gallop forward to bracket the rotation */
+  size_t lower(cursor);
+  size_t step(1);
+  while (lower + step < rotationCount && log.times[lower + step] <= time) {
+    lower += step;
+    step *= 2;
+  }
+
+  /* Search within the bracket */
+  const auto begin = log.times.cbegin() + lower + 1;
+  const auto end = log.times.cbegin() + std::min(lower + step, rotationCount);
+  return std::distance(log.times.cbegin(), std::upper_bound(begin, end, time)) -
+         1;
+}
+
+/**
+ * Converts events of a single spectrum to Q space for a sample rotating during
+ * the measurement, in batches of a fixed number of events.
+ *
+ * As VectorisedSpectrumConverter (and using its batch kernel), except that a Q
+ * direction is gathered for each event along with its TOF and weight. Events
+ * of a spectrum are in pulse time order, so each spectrum keeps a cursor on the
+ * rotation log holding the rotated Q direction of the spectrum, which is only
+ * recalculated when an event is past the end of the current rotation. The new
+ * rotation is then found via an index of the rotation at the start of equal
+ * time intervals of the log, so sparse spectra (with events many rotations
+ * apart) do not search the log.
+ *
+ * Results are identical to those of ScalarSpectrumConverter using the
+ * conversion plan rotated by the rotation of each event.
+ */
+class RotatingSpectrumConverter {
+public:
+  static constexpr size_t BatchSize = VectorisedSpectrumConverter::BatchSize;
+
+  /**
+   * @param log Rotation log
+   */
+  explicit RotatingSpectrumConverter(const RotationLog &log) : m_log(log) {
+    /* Index the log with several intervals per rotation, so that most
+     * intervals contain at most one change of rotation */
+    const size_t rotationCount = log.times.size();
+    const size_t intervalCount = 4 * rotationCount;
+    const double duration = log.times.back() - log.times.front();
+
+    m_indexStart = log.times.front();
+    m_indexScale = duration > 0.0 ? intervalCount / duration : 0.0;
+    m_index.resize(intervalCount);
+
+    size_t rotation(0);
+    for (size_t i = 0; i < intervalCount; i++) {
+      const double time = m_indexStart + i * duration / intervalCount;
+      rotation = advance_rotation(log, rotation, time);
+      m_index[i] = rotation;
+    }
+  }
+
+  /**
+   * @see ScalarSpectrumConverter::count
+   */
+  size_t count(const ConversionPlan &plan, const size_t paramIdx,
+               const MDSpaceBounds<3> &space, const TofEvent *events,
+               const size_t eventCount) const {
+    const Parameters p(plan, paramIdx, space);
+    Cursor cursor;
+
+    float tofs[BatchSize];
+    float weights[BatchSize];
+    float qDirs[3][BatchSize];
+
+    size_t inSpaceCount(0);
+    for (size_t batchStart = 0; batchStart < eventCount;
+         batchStart += BatchSize) {
+      const size_t remaining = eventCount - batchStart;
+      const size_t batchCount = remaining < BatchSize ? remaining : BatchSize;
+      gatherBatch(plan, paramIdx, events + batchStart, batchCount, cursor, tofs,
+                  weights, qDirs);
+
+      inSpaceCount += count_events_in_space(
+          batchCount, [&p, &tofs, &qDirs](const size_t i) {
+            double wavenumber;
+            float qx, qy, qz;
+            return VectorisedSpectrumConverter::convertTof(
+                p, tofs[i], qDirs[0][i], qDirs[1][i], qDirs[2][i], wavenumber,
+                qx, qy, qz);
+          });
+    }
+    return inSpaceCount;
+  }
+
+  /**
+   * @see ScalarSpectrumConverter::convert
+   */
+  template <typename IntT, typename MortonT>
+  size_t convert(const ConversionPlan &plan, const size_t paramIdx,
+                 const MDSpaceBounds<3> &space, const TofEvent *events,
+                 const size_t eventCount,
+                 MDEvent<3, IntT, MortonT> *out) const {
+    const Parameters p(plan, paramIdx, space);
+    Cursor cursor;
+
+    float tofs[BatchSize];
+    float qDirs[3][BatchSize];
+    return convert_event_batches<BatchSize>(
+        eventCount, out,
+        [this, &plan, paramIdx, &p, events, &cursor, &tofs,
+         &qDirs](const size_t batchStart, const size_t batchCount,
+                 IntT (&intCoords)[3][BatchSize], bool *inSpace,
+                 float *weights) {
+          gatherBatch(plan, paramIdx, events + batchStart, batchCount, cursor,
+                      tofs, weights, qDirs);
+
+          if (p.lorentzCorrection) {
+            VectorisedSpectrumConverter::convertBatch<IntT, true>(
+                p, batchCount, tofs, qDirs, weights, intCoords, inSpace);
+          } else {
+            VectorisedSpectrumConverter::convertBatch<IntT, false>(
+                p, batchCount, tofs, qDirs, weights, intCoords, inSpace);
+          }
+        });
+  }
+
+private:
+  using Parameters = VectorisedSpectrumConverter::Parameters;
+
+  /**
+   * Position in the rotation log of the events of a spectrum.
+   */
+  struct Cursor {
+    size_t rotation = 0;
+
+    /* Time range of the current rotation (initially empty, so that the first
+     * event moves the cursor) */
+    double start = INFINITY;
+    double end = -INFINITY;
+
+    /* Q direction of the spectrum rotated by the current rotation */
+    Eigen::Vector3f qDir;
+  };
+
+  /**
+   * Gathers the TOF, weight and rotated Q direction of a batch of events.
+   *
+   * @param plan Conversion plan
+   * @param paramIdx Index of parameters for the spectrum
+   * @param events Events of the batch
+   * @param count Number of events in batch
+   * @param cursor Position in the rotation log, updated
+   * @param tofs Output TOF of each event
+   * @param weights Output weight of each event
+   * @param qDirs Output rotated Q direction of each event, by axis
+   */
+  void gatherBatch(const ConversionPlan &plan, const size_t paramIdx,
+                   const TofEvent *events, const size_t count, Cursor &cursor,
+                   float *tofs, float *weights,
+                   float (&qDirs)[3][BatchSize]) const {
+    for (size_t i = 0; i < count; i++) {
+      const double time = events[i].pulse_time;
+      if (time < cursor.start || time >= cursor.end) {
+        moveCursor(plan.q_direction[paramIdx], time, cursor);
+      }
+
+      tofs[i] = events[i].tof;
+      weights[i] = events[i].weight;
+      qDirs[0][i] = cursor.qDir[0];
+      qDirs[1][i] = cursor.qDir[1];
+      qDirs[2][i] = cursor.qDir[2];
+    }
+  }
+
+  /**
+   * Moves a cursor to the rotation applying at a given time.
+   *
+   * @param qDir Q direction of the spectrum (without rotation)
+   * @param time Pulse time
+   * @param cursor Cursor to move
+   */
+  void moveCursor(const Eigen::Vector3f &qDir, const double time,
+                  Cursor &cursor) const {
+    const size_t rotationCount = m_log.times.size();
+
+    cursor.rotation = findRotation(time);
+    cursor.start =
+        cursor.rotation == 0 ? -INFINITY : m_log.times[cursor.rotation];
+    cursor.end = cursor.rotation + 1 < rotationCount
+                     ? m_log.times[cursor.rotation + 1]
+                     : INFINITY;
+    cursor.qDir = m_log.rotations[cursor.rotation] * qDir;
+  }
+
+  /**
+   * Gets the index of the rotation applying at a given time, searching forward
+   * from the rotation at the start of the index interval containing the time.
+   *
+   * @param time Pulse time
+   * @return Index of rotation
+   */
+  size_t findRotation(const double time) const {
+    const double position = (time - m_indexStart) * m_indexScale;
+    const size_t interval =
+        position >= m_index.size()
+            ? m_index.size() - 1
+            : (position > 0.0 ? static_cast<size_t>(position) : 0);
+    return advance_rotation(m_log, m_index[interval], time);
+  }
+
+  const RotationLog &m_log;
+
+  /* Rotation at the start of each of a number of equal time intervals from the
+   * first time of the log */
+  double m_indexStart;
+  double m_indexScale;
+  std::vector<size_t> m_index;
+};
+
+/**
+ * Converts events to Q space for a sample rotating during the measurement.
+ *
+ * Each event is converted using the rotation at its pulse time (applied after
+ * the UB matrix of the plan), see RotatingSpectrumConverter.
+ *
+ * @see convert_spectra()
+ *
+ * @param mdEvents Output events, converted events are appended
+ * @param tofEvents TOF events
+ * @param plan Conversion plan (for an elastic conversion)
+ * @param log Rotation log
+ * @param space MD space
+ */
+template <typename IntT, typename MortonT>
+void convert_events_rotating(std::vector<MDEvent<3, IntT, MortonT>> &mdEvents,
+                             TofEventList &tofEvents,
+                             const ConversionPlan &plan, const RotationLog &log,
+                             const MDSpaceBounds<3> &space) {
+  if (plan.conversion_info.energy_mode != EnergyTransferMode::Elastic) {
+    throw std::runtime_error("Q space conversion requires an elastic "
+                             "conversion plan");
+  }
+  if (log.times.empty() || log.times.size() != log.rotations.size()) {
+    throw std::runtime_error("Invalid rotation log");
+  }
+
+  convert_spectra<RotatingSpectrumConverter, 3>(
+      mdEvents, tofEvents, plan, space, RotatingSpectrumConverter(log));
+}
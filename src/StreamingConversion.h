@@ -0,0 +1,232 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/sort/sort.hpp>
+
+#include "BoundedQueue.h"
+#include "EventCurveFile.h"
+#include "EventToMDEventConversion.h"
+#include "MDEvent.h"
+#include "Merge.h"
+#include "PrefetchReader.h"
+#include "TofEvent.h"
+
+#pragma once
+
+/**
+ * Parameters of convert_events_streamed().
+ */
+struct StreamingConversionOptions {
+  /* Number of frames loaded and converted at a time */
+  size_t frames_per_chunk;
+
+  /* Number of chunks that may wait between two stages of the pipeline */
+  size_t queue_depth;
+
+  /* Maximum size of the merged curve held in memory in bytes */
+  size_t memory_budget;
+
+  /* Prefix of sorted run files, runs are named <prefix><index>.mdec */
+  std::string spill_prefix;
+
+  /* Number of events per block in sorted run files */
+  size_t block_size;
+};
+
+/**
+ * Output of convert_events_streamed().
+ *
+ * If the converted events fit within the memory budget they are returned as a
+ * single sorted curve, otherwise they are returned as sorted run files (to be
+ * merged with merge_event_curve_files()) and the curve is empty.
+ */
+template <typename IntT, typename MortonT> struct StreamingConversionResult {
+  typename MDEvent<3, IntT, MortonT>::ZCurve curve;
+  std::vector<std::string> run_filenames;
+
+  /* Number of MD events created */
+  size_t event_count;
+
+  /* Number of chunks of frames processed */
+  size_t chunk_count;
+
+  /* Time the conversion stage spent waiting for loaded chunks in seconds */
+  double load_stall_time;
+};
+
+/**
+ * Converts frames of TOF events to a sorted curve of MD events in chunks,
+ * without holding all TOF or MD events in memory at once.
+ *
+ * Three stages run concurrently, connected by bounded queues:
+ *  - loading: chunks of frames are prefetched using loader.loadFrames() (see
+ *    PrefetchReader)
+ *  - conversion: each chunk is converted to MD events and sorted
+ *  - merging (on the calling thread): sorted chunks are held in memory as a
+ *    stack of sorted runs, merging the two newest runs whenever they are of
+ *    similar size, so each event is merged O(log(events / chunk)) times rather
+ *    than once per chunk. When the runs would exceed the memory budget they
+ *    are combined with a single k-way merge and written to disk as a sorted
+ *    run, at the end they are combined into the returned curve.
+ *
+ * Peak memory is therefore bounded by twice the memory budget (while the runs
+ * are combined) plus at most (2 * queue_depth + 3) chunks in flight.
+ *
+ * @param loader Event loader, must provide loadFrames(TofEventList &, const
+ *               std::vector<size_t> &)
+ * @param frameIdxs Indices of the frames to convert
+ * @param plan Conversion plan for the instrument the events were recorded on
+ * @param space MD space bounds
+ * @param options Chunk size, queue depth, memory budget and run file settings
+ * @return Sorted curve or sorted run files
+ */
+template <typename IntT, typename MortonT, typename LoaderT>
+StreamingConversionResult<IntT, MortonT>
+convert_events_streamed(const LoaderT &loader,
+                        const std::vector<size_t> &frameIdxs,
+                        const ConversionPlan &plan,
+                        const MDSpaceBounds<3> &space,
+                        const StreamingConversionOptions &options) {
+  using Event = MDEvent<3, IntT, MortonT>;
+  using ZCurve = typename Event::ZCurve;
+
+  if (options.frames_per_chunk == 0) {
+    throw std::runtime_error("Streaming conversion requires at least one frame "
+                             "per chunk");
+  }
+
+  const size_t maxCurveEvents = options.memory_budget / sizeof(Event);
+
+  /* Load stage */
+  auto tofChunks = prefetch_frames(loader, frameIdxs, options.frames_per_chunk,
+                                   options.queue_depth);
+  BoundedQueue<ZCurve> mdChunks(options.queue_depth);
+
+  /* Stopping the reader and closing the queue releases every stage, used to
+   * stop the pipeline when any stage fails */
+  auto abort = [&tofChunks, &mdChunks]() {
+    tofChunks->cancel();
+    mdChunks.close();
+  };
+
+  /* Conversion stage */
+  auto convertStage = std::async(std::launch::async, [&]() {
+    try {
+      TofEventList tofEvents;
+      while (tofChunks->next(tofEvents)) {
+        ZCurve mdEvents;
+        convert_events(mdEvents, tofEvents, plan, space);
+
+        /* Free the chunk rather than holding it while waiting on the merge */
+        TofEventList().swap(tofEvents);
+
+        boost::sort::block_indirect_sort(mdEvents.begin(), mdEvents.end());
+        if (!mdChunks.push(std::move(mdEvents))) {
+          break;
+        }
+      }
+    } catch (...) {
+      abort();
+      throw;
+    }
+    mdChunks.close();
+  });
+
+  /* Merge stage */
+  StreamingConversionResult<IntT, MortonT> result{{}, {}, 0, 0, 0.0};
+
+  /* Sorted runs held in memory, each at least twice the size of the next */
+  std::vector<ZCurve> runs;
+  size_t runEvents(0);
+
+  auto combineRuns = [&runs, &runEvents]() {
+    ZCurve curve;
+    if (runs.size() == 1) {
+      curve = std::move(runs.front());
+    } else if (runs.size() > 1) {
+      merge_event_curves_k<Event>(curve, runs);
+    }
+    runs.clear();
+    runEvents = 0;
+    return curve;
+  };
+
+  auto spill = [&](ZCurve &run) {
+    result.run_filenames.push_back(options.spill_prefix +
+                                   std::to_string(result.run_filenames.size()) +
+                                   ".mdec");
+    write_event_curve_file<3, IntT, MortonT>(result.run_filenames.back(), run,
+                                             options.block_size);
+    run.clear();
+  };
+
+  try {
+    ZCurve chunk;
+    while (mdChunks.pop(chunk)) {
+      result.event_count += chunk.size();
+      result.chunk_count++;
+
+      /* A chunk that alone exceeds the budget becomes a run of its own */
+      if (chunk.size() > maxCurveEvents) {
+        spill(chunk);
+        continue;
+      }
+
+      if (runEvents + chunk.size() > maxCurveEvents) {
+        auto curve = combineRuns();
+        spill(curve);
+      }
+
+      runEvents += chunk.size();
+      runs.push_back(std::move(chunk));
+      chunk = ZCurve();
+
+      /* Merge runs of similar size */
+      while (runs.size() > 1 &&
+             runs[runs.size() - 2].size() <= 2 * runs.back().size()) {
+        ZCurve merged;
+        merge_event_curves<Event>(merged, runs[runs.size() - 2], runs.back());
+        runs.pop_back();
+        runs.back().swap(merged);
+      }
+    }
+
+    result.curve = combineRuns();
+
+    /* Once any run has been spilled all events are returned as runs */
+    if (!result.run_filenames.empty() && !result.curve.empty()) {
+      spill(result.curve);
+    }
+  } catch (...) {
+    abort();
+    throw;
+  }
+
+  /* Rethrow any failure in the other stages (load failures are rethrown by
+   * the conversion stage) */
+  convertStage.get();
+  result.load_stall_time = tofChunks->stallTime();
+
+  return result;
+}
@@ -0,0 +1,259 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <random>
+
+#include <boost/sort/sort.hpp>
+
+#include "InelasticConversion.h"
+#include "Instrument.h"
+#include "MDBox.h"
+#include "MDEvent.h"
+#include "scoped_wallclock_timer.hpp"
+
+/* Number of events in each benchmark */
+constexpr size_t EventCount(20000000);
+
+/**
+ * Gets the TOF (in microseconds) of a neutron travelling a given distance at a
+ * given energy.
+ */
+double flight_time(const double distance, const double energy) {
+  return 1e6 * distance / std::sqrt(2.0 * energy * meV / NeutronMass);
+}
+
+/**
+ * Creates an instrument with detectors on a vertical cylinder around the
+ * sample, as found on direct and indirect geometry spectrometers.
+ */
+Instrument make_cylindrical_instrument(const float l1, const float radius) {
+  Instrument inst;
+  inst.sample_position = Eigen::Vector3f(0.0f, 0.0f, 0.0f);
+  inst.source_position = Eigen::Vector3f(0.0f, 0.0f, -l1);
+
+  /* 256 tubes of 128 pixels, covering 3 to 135 degrees */
+  detid_t detId(0);
+  for (size_t tube = 0; tube < 256; tube++) {
+    const float angle = (3.0f + 132.0f * tube / 255.0f) * M_PI / 180.0f;
+    for (size_t pixel = 0; pixel < 128; pixel++) {
+      const float height = -1.5f + 3.0f * pixel / 127.0f;
+      inst.detectors.add(detId++,
+                         Eigen::Vector3f(radius * std::sin(angle), height,
+                                         radius * std::cos(angle)));
+    }
+  }
+
+  generate_1_to_1_spec_det_mapping(inst);
+  return inst;
+}
+
+/**
+ * Generates events with energy transfers uniformly distributed over a given
+ * range, at random detectors.
+ */
+void generate_inelastic_events(std::vector<TofEvent> &events,
+                               const Instrument &inst,
+                               const ConversionInfo &convInfo,
+                               const float minEnergyTransfer,
+                               const float maxEnergyTransfer) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<specid_t> specDist(
+      0, inst.spectrum_detector_mapping.size() - 1);
+  std::uniform_real_distribution<double> energyTransferDist(minEnergyTransfer,
+                                                            maxEnergyTransfer);
+
+  const bool direct = convInfo.energy_mode == EnergyTransferMode::Direct;
+  const double l1 = get_l1(inst);
+
+  std::vector<double> l2s;
+  const auto &mapping = inst.spectrum_detector_mapping;
+  for (size_t i = 0; i < mapping.size(); i++) {
+    l2s.push_back(get_l2(inst, mapping.detectors(i)));
+  }
+
+  events.reserve(EventCount);
+  for (size_t i = 0; i < EventCount; i++) {
+    const auto specId = specDist(gen);
+    const double l2 = l2s[specId];
+
+    const double energyTransfer = energyTransferDist(gen);
+    const double ei = direct ? convInfo.fixed_energy
+                             : convInfo.fixed_energy + energyTransfer;
+    const double ef = direct ? convInfo.fixed_energy - energyTransfer
+                             : convInfo.fixed_energy;
+
+    events.push_back(TofEvent{
+        static_cast<uint32_t>(specId),
+        static_cast<float>(flight_time(l1, ei) + flight_time(l2, ef)), 0.0,
+        1.0f});
+  }
+}
+
+template <typename IntT, typename MortonT, typename SpectrumConverter>
+void do_inelastic_conversion(benchmark::State &state, const Instrument &inst,
+                             const std::vector<TofEvent> &tofEventsRaw,
+                             const MDSpaceBounds<4> &mdSpace,
+                             const ConversionInfo &convInfo,
+                             const size_t splitThreshold,
+                             const size_t maxBoxTreeDepth) {
+  /* Copy raw ToF events (needed as convert_events_inelastic() sorts the
+   * vector) */
+  state.PauseTiming();
+  std::vector<TofEvent> tofEvents(tofEventsRaw);
+  state.ResumeTiming();
+
+  /* Convert to (Q, energy transfer) space */
+  std::vector<MDEvent<4, IntT, MortonT>> mdEvents;
+  {
+    scoped_wallclock_timer timer(state, "q_conversion");
+    const auto plan = create_conversion_plan(inst, convInfo);
+    convert_events_inelastic<IntT, MortonT, SpectrumConverter>(
+        mdEvents, tofEvents, plan, mdSpace);
+  }
+
+  state.counters["md_events"] += mdEvents.size();
+
+  /* Sort events */
+  {
+    scoped_wallclock_timer timer(state, "sort");
+    boost::sort::block_indirect_sort(mdEvents.begin(), mdEvents.end());
+  }
+
+  /* Construct box structure */
+  MDBox<4, IntT, MortonT> rootMdBox(mdEvents.cbegin(), mdEvents.cend());
+  {
+    scoped_wallclock_timer timer(state, "box_structure");
+    rootMdBox.distributeEvents(splitThreshold, maxBoxTreeDepth);
+  }
+
+  benchmark::DoNotOptimize(mdEvents);
+}
+
+/**
+ * Average counters (there are counter flags to do this in the latest Google
+ * Benchmark)
+ */
+void average_counters(benchmark::State &state) {
+  for (const auto &name :
+       {"q_conversion", "sort", "box_structure", "md_events"}) {
+    state.counters[name] /= state.iterations();
+  }
+}
+
+/**
+ * Direct geometry, 100 meV incident energy (similar to MERLIN).
+ */
+template <typename IntT, typename MortonT, typename SpectrumConverter>
+void BM_InelasticConversion_Direct(benchmark::State &state) {
+  const auto inst = make_cylindrical_instrument(12.0f, 2.5f);
+
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  convInfo.energy_mode = EnergyTransferMode::Direct;
+  convInfo.fixed_energy = 100.0;
+
+  std::vector<TofEvent> tofEventsRaw;
+  generate_inelastic_events(tofEventsRaw, inst, convInfo, -20.0f, 90.0f);
+
+  MDSpaceBounds<4> space;
+  // clang-format off
+  space <<
+    -15.0f, 15.0f,
+    -15.0f, 15.0f,
+    -15.0f, 15.0f,
+    -20.0f, 90.0f;
+  // clang-format on
+
+  for (auto _ : state) {
+    do_inelastic_conversion<IntT, MortonT, SpectrumConverter>(
+        state, inst, tofEventsRaw, space, convInfo, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Direct, uint16_t, uint64_t,
+                   ScalarInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Direct, uint32_t, uint128_t,
+                   ScalarInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Direct, uint64_t, uint256_t,
+                   ScalarInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Direct, uint16_t, uint64_t,
+                   VectorisedInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Direct, uint32_t, uint128_t,
+                   VectorisedInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Direct, uint64_t, uint256_t,
+                   VectorisedInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+
+/**
+ * Indirect geometry, 3.6 meV final energy (similar to OSIRIS).
+ */
+template <typename IntT, typename MortonT, typename SpectrumConverter>
+void BM_InelasticConversion_Indirect(benchmark::State &state) {
+  const auto inst = make_cylindrical_instrument(34.0f, 1.5f);
+
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  convInfo.energy_mode = EnergyTransferMode::Indirect;
+  convInfo.fixed_energy = 3.6;
+
+  std::vector<TofEvent> tofEventsRaw;
+  generate_inelastic_events(tofEventsRaw, inst, convInfo, -1.0f, 2.0f);
+
+  MDSpaceBounds<4> space;
+  // clang-format off
+  space <<
+    -3.0f, 3.0f,
+    -3.0f, 3.0f,
+    -3.0f, 3.0f,
+    -1.0f, 2.0f;
+  // clang-format on
+
+  for (auto _ : state) {
+    do_inelastic_conversion<IntT, MortonT, SpectrumConverter>(
+        state, inst, tofEventsRaw, space, convInfo, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Indirect, uint16_t, uint64_t,
+                   ScalarInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Indirect, uint32_t, uint128_t,
+                   ScalarInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Indirect, uint64_t, uint256_t,
+                   ScalarInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Indirect, uint16_t, uint64_t,
+                   VectorisedInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Indirect, uint32_t, uint128_t,
+                   VectorisedInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InelasticConversion_Indirect, uint64_t, uint256_t,
+                   VectorisedInelasticSpectrumConverter)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,260 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <random>
+
+#include <h5cpp/hdf5.hpp>
+#include <omp.h>
+
+#include "IsisEventNexusLoader.h"
+#include "MantidEventNexusLoader.h"
+
+using namespace hdf5;
+
+/* Number of events in each file */
+constexpr size_t EventCount(20000000);
+
+/* Number of frames (ISIS) or spectra (Mantid) the events are split into */
+constexpr size_t GroupCount(10000);
+
+/* Number of elements per chunk of chunked datasets */
+constexpr size_t ChunkSize(1024 * 1024);
+
+/* Storage of event datasets */
+enum class EventStorage { Contiguous, Chunked, Compressed };
+
+const char *event_storage_name(const EventStorage storage) {
+  return storage == EventStorage::Contiguous
+             ? "contiguous"
+             : storage == EventStorage::Chunked ? "chunked" : "compressed";
+}
+
+/**
+ * Writes a one dimensional dataset, contiguous, chunked (unfiltered) or
+ * chunked and compressed with deflate.
+ */
+template <typename T>
+void write_dataset(node::Group &group, const std::string &name,
+                   const std::vector<T> &data, const EventStorage storage) {
+  property::DatasetCreationList dcpl;
+  if (storage != EventStorage::Contiguous) {
+    dcpl.layout(property::DatasetLayout::CHUNKED);
+    dcpl.chunk({std::min(ChunkSize, data.size())});
+  }
+  if (storage == EventStorage::Compressed) {
+    H5Pset_deflate(static_cast<hid_t>(dcpl), 6);
+  }
+
+  node::Dataset dataset = group.create_dataset(
+      name, datatype::create<std::vector<T>>(),
+      dataspace::Simple{{data.size()}}, dcpl);
+  dataset.write(data);
+}
+
+/**
+ * Gets the index of the first element of each of a number of equally sized
+ * groups.
+ */
+std::vector<uint64_t> group_index(const size_t count, const size_t groups) {
+  std::vector<uint64_t> index(groups);
+  for (size_t i = 0; i < groups; i++) {
+    index[i] = i * count / groups;
+  }
+  return index;
+}
+
+/**
+ * Writes random events to an ISIS style event NeXus file.
+ */
+void write_isis_event_file(const std::string &filename,
+                           const EventStorage storage) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<uint32_t> idDist(0, 100000);
+  std::uniform_real_distribution<float> tofDist(10.0f, 20000.0f);
+
+  std::vector<uint32_t> eventId(EventCount);
+  std::vector<float> eventTimeOffset(EventCount);
+  for (size_t i = 0; i < EventCount; i++) {
+    eventId[i] = idDist(gen);
+    eventTimeOffset[i] = tofDist(gen);
+  }
+
+  std::vector<double> eventTimeZero(GroupCount);
+  std::iota(eventTimeZero.begin(), eventTimeZero.end(), 0.0);
+
+  file::File f = file::create(filename, file::AccessFlags::TRUNCATE);
+  node::Group entry = f.root().create_group("raw_data_1");
+  entry.create_group("isis_vms_compat");
+  node::Group events = entry.create_group("detector_1_events");
+
+  write_dataset(events, "event_id", eventId, storage);
+  write_dataset(events, "event_time_offset", eventTimeOffset, storage);
+  write_dataset(events, "event_index", group_index(EventCount, GroupCount),
+                EventStorage::Contiguous);
+  write_dataset(events, "event_time_zero", eventTimeZero,
+                EventStorage::Contiguous);
+}
+
+/**
+ * Writes random events to a Mantid processed event NeXus file.
+ */
+void write_mantid_event_file(const std::string &filename,
+                             const EventStorage storage) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<double> tofDist(10.0, 20000.0);
+  std::uniform_real_distribution<float> weightDist(0.5f, 1.5f);
+
+  std::vector<double> tof(EventCount);
+  std::vector<float> weight(EventCount);
+  for (size_t i = 0; i < EventCount; i++) {
+    tof[i] = tofDist(gen);
+    weight[i] = weightDist(gen);
+  }
+
+  file::File f = file::create(filename, file::AccessFlags::TRUNCATE);
+  node::Group workspace = f.root().create_group("mantid_workspace_1");
+  workspace.create_group("instrument").create_group("detector");
+  node::Group events = workspace.create_group("event_workspace");
+
+  write_dataset(events, "tof", tof, storage);
+  write_dataset(events, "weight", weight, storage);
+  write_dataset(events, "indices", group_index(EventCount, GroupCount),
+                EventStorage::Contiguous);
+}
+
+/**
+ * Gets the name of an ISIS event file with the given storage, writing the file
+ * on first use (it is kept for later runs).
+ */
+std::string isis_event_file(const EventStorage storage) {
+  const std::string filename(std::string("loader_benchmark_isis_") +
+                             event_storage_name(storage) + ".nxs");
+  if (!std::ifstream(filename)) {
+    write_isis_event_file(filename, storage);
+  }
+  return filename;
+}
+
+/**
+ * Gets the name of a Mantid event file with the given storage, writing the
+ * file on first use (it is kept for later runs).
+ */
+std::string mantid_event_file(const EventStorage storage) {
+  const std::string filename(std::string("loader_benchmark_mantid_") +
+                             event_storage_name(storage) + ".nxs");
+  if (!std::ifstream(filename)) {
+    write_mantid_event_file(filename, storage);
+  }
+  return filename;
+}
+
+/**
+ * Loads all frames of an ISIS event file.
+ *
+ * Arguments are the storage of the event datasets and if the loader may map
+ * contiguous event data.
+ */
+void BM_LoadFrames_ISIS(benchmark::State &state) {
+  const std::string filename(
+      isis_event_file(static_cast<EventStorage>(state.range(0))));
+
+  IsisEventNexusLoader loader(filename, "raw_data_1/detector_1_events",
+                              state.range(1));
+  state.counters["mapped"] = loader.eventDataMapped();
+
+  std::vector<size_t> frameIdxs(loader.frameCount());
+  std::iota(frameIdxs.begin(), frameIdxs.end(), 0);
+
+  for (auto _ : state) {
+    std::vector<TofEvent> events;
+    loader.loadFrames(events, frameIdxs);
+    benchmark::DoNotOptimize(events);
+  }
+
+  state.SetItemsProcessed(state.iterations() * loader.totalEventCount());
+}
+BENCHMARK(BM_LoadFrames_ISIS)
+    ->Args({0, 0})
+    ->Args({0, 1})
+    ->Args({1, 1})
+    ->Args({2, 1})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+/**
+ * Loads all spectra of a Mantid event file.
+ *
+ * Arguments are the storage of the event datasets and if the loader may map
+ * contiguous event data.
+ */
+void BM_LoadSpectra_Mantid(benchmark::State &state) {
+  const std::string filename(
+      mantid_event_file(static_cast<EventStorage>(state.range(0))));
+
+  MantidEventNexusLoader loader(filename, state.range(1));
+  state.counters["mapped"] = loader.eventDataMapped();
+
+  for (auto _ : state) {
+    std::vector<TofEvent> events;
+    loader.loadAllEvents(events);
+    benchmark::DoNotOptimize(events);
+  }
+
+  state.SetItemsProcessed(state.iterations() * loader.totalEventCount());
+}
+BENCHMARK(BM_LoadSpectra_Mantid)
+    ->Args({0, 0})
+    ->Args({0, 1})
+    ->Args({1, 1})
+    ->Args({2, 1})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+/**
+ * Loads all spectra of a compressed Mantid event file with a varying number of
+ * threads, to show scaling of the parallel decompression (the Mantid loader
+ * reads on the calling thread, so uses its thread count).
+ */
+void BM_LoadSpectra_Mantid_Compressed_Threads(benchmark::State &state) {
+  MantidEventNexusLoader loader(mantid_event_file(EventStorage::Compressed));
+
+  const auto maxThreads = omp_get_max_threads();
+  omp_set_num_threads(state.range(0));
+
+  for (auto _ : state) {
+    std::vector<TofEvent> events;
+    loader.loadAllEvents(events);
+    benchmark::DoNotOptimize(events);
+  }
+
+  omp_set_num_threads(maxThreads);
+
+  state.SetItemsProcessed(state.iterations() * loader.totalEventCount());
+}
+BENCHMARK(BM_LoadSpectra_Mantid_Compressed_Threads)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -166,4 +166,272 @@ BENCHMARK_TEMPLATE(BM_Merge_New, uint32_t, uint128_t)
 BENCHMARK_TEMPLATE(BM_Merge_New, uint64_t, uint256_t)
     ->Unit(benchmark::kMillisecond);
 
+template <typename IntT, typename MortonT>
+void BM_Merge_Bounded(benchmark::State &state) {
+  constexpr size_t ND(3);
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+  typename Event::ZCurve mdEvents1, mdEvents2;
+  load_and_convert<ND, IntT, MortonT>(mdEvents1, "/SXD30528_event.nxs");
+  load_and_convert<ND, IntT, MortonT>(mdEvents2, "/SXD30529_event.nxs");
+  state.counters["md_events_curve_1"] = mdEvents1.size();
+  state.counters["md_events_curve_2"] = mdEvents2.size();
+
+  for (auto _ : state) {
+    /* Copy first curve so that original data is not modified, capacity for
+     * the merged curve is allocated by the caller */
+    state.PauseTiming();
+    typename Event::ZCurve mdEvents1Copy;
+    mdEvents1Copy.reserve(mdEvents1.size() + mdEvents2.size());
+    mdEvents1Copy.insert(mdEvents1Copy.cend(), mdEvents1.cbegin(),
+                         mdEvents1.cend());
+    state.ResumeTiming();
+
+    /* Merge event curves */
+    {
+      scoped_wallclock_timer timer(state, "merge");
+      merge_event_curves_bounded<Event>(mdEvents1Copy, mdEvents2);
+    }
+
+    /* Construct box structure */
+    MDBox<ND, IntT, MortonT> rootMdBox(mdEvents1Copy.cbegin(),
+                                       mdEvents1Copy.cend());
+    {
+      scoped_wallclock_timer timer(state, "box_structure");
+      rootMdBox.distributeEvents(1000, 20);
+    }
+
+    /* Record number of events in merged curve */
+    state.PauseTiming();
+    state.counters["md_events_merged"] = mdEvents1Copy.size();
+    state.ResumeTiming();
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_Merge_Bounded, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Bounded, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Bounded, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Bounded, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_Merge_Inplace_Bounded(benchmark::State &state) {
+  constexpr size_t ND(3);
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+  /* Scratch buffer size as a percentage of the merged curve size */
+  const size_t budgetPercent(state.range(0));
+
+  typename Event::ZCurve mdEvents1, mdEvents2;
+  load_and_convert<ND, IntT, MortonT>(mdEvents1, "/SXD30528_event.nxs");
+  load_and_convert<ND, IntT, MortonT>(mdEvents2, "/SXD30529_event.nxs");
+  state.counters["md_events_curve_1"] = mdEvents1.size();
+  state.counters["md_events_curve_2"] = mdEvents2.size();
+
+  const size_t memoryBudget = (mdEvents1.size() + mdEvents2.size()) *
+                              sizeof(Event) * budgetPercent / 100;
+
+  for (auto _ : state) {
+    /* Store both curves adjacently in a single container */
+    state.PauseTiming();
+    typename Event::ZCurve curve;
+    curve.reserve(mdEvents1.size() + mdEvents2.size());
+    curve.insert(curve.cend(), mdEvents1.cbegin(), mdEvents1.cend());
+    curve.insert(curve.cend(), mdEvents2.cbegin(), mdEvents2.cend());
+    state.ResumeTiming();
+
+    /* Merge event curves */
+    {
+      scoped_wallclock_timer timer(state, "merge");
+      merge_event_curves_inplace_bounded<Event>(curve, mdEvents1.size(),
+                                                memoryBudget);
+    }
+
+    /* Construct box structure */
+    MDBox<ND, IntT, MortonT> rootMdBox(curve.cbegin(), curve.cend());
+    {
+      scoped_wallclock_timer timer(state, "box_structure");
+      rootMdBox.distributeEvents(1000, 20);
+    }
+
+    /* Record number of events in merged curve */
+    state.PauseTiming();
+    state.counters["md_events_merged"] = curve.size();
+    state.ResumeTiming();
+  }
+
+  average_counters(state);
+}
+/* Argument is scratch buffer size as a percentage of the merged curve */
+BENCHMARK_TEMPLATE(BM_Merge_Inplace_Bounded, uint8_t, uint32_t)
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(10)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Inplace_Bounded, uint16_t, uint64_t)
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(10)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Inplace_Bounded, uint32_t, uint128_t)
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(10)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Inplace_Bounded, uint64_t, uint256_t)
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(10)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_Merge_Parallel(benchmark::State &state) {
+  constexpr size_t ND(3);
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+  const size_t numThreads(state.range(0));
+
+  typename Event::ZCurve mdEvents1, mdEvents2;
+  load_and_convert<ND, IntT, MortonT>(mdEvents1, "/SXD30528_event.nxs");
+  load_and_convert<ND, IntT, MortonT>(mdEvents2, "/SXD30529_event.nxs");
+  state.counters["md_events_curve_1"] = mdEvents1.size();
+  state.counters["md_events_curve_2"] = mdEvents2.size();
+
+  for (auto _ : state) {
+    /* Merge event curves */
+    typename Event::ZCurve curve;
+    {
+      scoped_wallclock_timer timer(state, "merge");
+      merge_event_curves_parallel<Event>(curve, mdEvents1, mdEvents2,
+                                         numThreads);
+    }
+
+    /* Construct box structure */
+    MDBox<ND, IntT, MortonT> rootMdBox(curve.cbegin(), curve.cend());
+    {
+      scoped_wallclock_timer timer(state, "box_structure");
+      rootMdBox.distributeEvents(1000, 20);
+    }
+
+    /* Record number of events in merged curve */
+    state.PauseTiming();
+    state.counters["md_events_merged"] = curve.size();
+    state.ResumeTiming();
+  }
+
+  average_counters(state);
+}
+/* Argument is number of threads used for merging */
+BENCHMARK_TEMPLATE(BM_Merge_Parallel, uint8_t, uint32_t)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Parallel, uint16_t, uint64_t)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Parallel, uint32_t, uint128_t)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Parallel, uint64_t, uint256_t)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_Merge_Incremental(benchmark::State &state) {
+  constexpr size_t ND(3);
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+  typename Event::ZCurve mdEvents1, mdEvents2;
+  load_and_convert<ND, IntT, MortonT>(mdEvents1, "/SXD30528_event.nxs");
+  load_and_convert<ND, IntT, MortonT>(mdEvents2, "/SXD30529_event.nxs");
+  state.counters["md_events_curve_1"] = mdEvents1.size();
+  state.counters["md_events_curve_2"] = mdEvents2.size();
+
+  for (auto _ : state) {
+    /* Copy first curve and build its box structure so that original data is
+     * not modified */
+    state.PauseTiming();
+    typename Event::ZCurve curve(mdEvents1);
+    MDBox<ND, IntT, MortonT> rootMdBox(curve.cbegin(), curve.cend());
+    rootMdBox.distributeEvents(1000, 20);
+    state.ResumeTiming();
+
+    /* Merge event curves and update the existing box structure (there is no
+     * separate box_structure step) */
+    {
+      scoped_wallclock_timer timer(state, "merge");
+      merge_event_curves_incremental<Event>(curve, rootMdBox, mdEvents2, 1000,
+                                            20);
+    }
+
+    /* Record number of events in merged curve */
+    state.PauseTiming();
+    state.counters["md_events_merged"] = curve.size();
+    state.ResumeTiming();
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_Merge_Incremental, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Incremental, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Incremental, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Incremental, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_Merge_BoxTrees(benchmark::State &state) {
+  constexpr size_t ND(3);
+  using Event = MDEvent<ND, IntT, MortonT>;
+  using Box = MDBox<ND, IntT, MortonT>;
+
+  typename Event::ZCurve mdEvents1, mdEvents2;
+  load_and_convert<ND, IntT, MortonT>(mdEvents1, "/SXD30528_event.nxs");
+  load_and_convert<ND, IntT, MortonT>(mdEvents2, "/SXD30529_event.nxs");
+  state.counters["md_events_curve_1"] = mdEvents1.size();
+  state.counters["md_events_curve_2"] = mdEvents2.size();
+
+  /* Box structures of the input curves */
+  Box rootMdBox1(mdEvents1.cbegin(), mdEvents1.cend());
+  rootMdBox1.distributeEvents(1000, 20);
+  Box rootMdBox2(mdEvents2.cbegin(), mdEvents2.cend());
+  rootMdBox2.distributeEvents(1000, 20);
+
+  for (auto _ : state) {
+    /* Merge event curves and box structures (there is no separate
+     * box_structure step) */
+    typename Event::ZCurve curve;
+    {
+      scoped_wallclock_timer timer(state, "merge");
+      const auto rootMdBox = merge_event_curves_and_box_trees<Event>(
+          curve, mdEvents1, rootMdBox1, mdEvents2, rootMdBox2, 1000, 20);
+      benchmark::DoNotOptimize(rootMdBox);
+    }
+
+    /* Record number of events in merged curve */
+    state.PauseTiming();
+    state.counters["md_events_merged"] = curve.size();
+    state.ResumeTiming();
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_Merge_BoxTrees, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_BoxTrees, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_BoxTrees, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_BoxTrees, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
 BENCHMARK_MAIN();
@@ -0,0 +1,141 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+
+#include <boost/sort/sort.hpp>
+#include <omp.h>
+
+#include "BitInterleaving.h"
+#include "MDEvent.h"
+#include "Merge.h"
+
+template <size_t ND, typename IntT, typename MortonT>
+void generate_curves(
+    std::vector<typename MDEvent<ND, IntT, MortonT>::ZCurve> &curves,
+    const size_t numCurves, const size_t numEvents) {
+  std::mt19937 gen;
+  std::uniform_int_distribution<IntT> dist;
+
+  curves.resize(numCurves);
+  for (auto &curve : curves) {
+    for (size_t i = 0; i < numEvents; i++) {
+      IntArray<ND, IntT> coord;
+      for (size_t j = 0; j < ND; j++) {
+        coord[j] = dist(gen);
+      }
+      curve.emplace_back(interleave<ND, IntT, MortonT>(coord));
+    }
+    boost::sort::block_indirect_sort(curve.begin(), curve.end());
+  }
+}
+
+template <typename IntT, typename MortonT>
+void BM_Merge_Pairwise(benchmark::State &state) {
+  constexpr size_t ND(3);
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+  /* Test parameters */
+  const size_t numCurves(state.range(0));
+  const size_t numEvents(state.range(1));
+  const size_t numThreads(omp_get_max_threads());
+  state.counters["threads"] = numThreads;
+
+  std::vector<typename Event::ZCurve> curves;
+  generate_curves<ND, IntT, MortonT>(curves, numCurves, numEvents);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::vector<typename Event::ZCurve> toMerge(curves);
+    state.ResumeTiming();
+
+    /* Merge pairs of curves until a single curve remains, using as many
+     * threads as the k-way merge */
+    while (toMerge.size() > 1) {
+      std::vector<typename Event::ZCurve> merged(toMerge.size() / 2);
+      for (size_t i = 0; i < merged.size(); i++) {
+        merge_event_curves_parallel<Event>(merged[i], toMerge[2 * i],
+                                           toMerge[2 * i + 1], numThreads);
+      }
+
+      /* Carry an odd curve over to the next round */
+      if (toMerge.size() % 2 == 1) {
+        merged.push_back(std::move(toMerge.back()));
+      }
+
+      toMerge.swap(merged);
+    }
+
+    benchmark::DoNotOptimize(toMerge);
+  }
+
+  state.SetItemsProcessed(state.iterations() * numCurves * numEvents);
+}
+/* Arguments are number of curves and number of events per curve */
+BENCHMARK_TEMPLATE(BM_Merge_Pairwise, uint16_t, uint64_t)
+    ->Args({2, 10000000})
+    ->Args({4, 10000000})
+    ->Args({9, 10000000})
+    ->Args({32, 10000000})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_Pairwise, uint32_t, uint128_t)
+    ->Args({2, 10000000})
+    ->Args({4, 10000000})
+    ->Args({9, 10000000})
+    ->Args({32, 10000000})
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_Merge_KWay(benchmark::State &state) {
+  constexpr size_t ND(3);
+  using Event = MDEvent<ND, IntT, MortonT>;
+
+  /* Test parameters */
+  const size_t numCurves(state.range(0));
+  const size_t numEvents(state.range(1));
+  const size_t numThreads(omp_get_max_threads());
+  state.counters["threads"] = numThreads;
+
+  std::vector<typename Event::ZCurve> curves;
+  generate_curves<ND, IntT, MortonT>(curves, numCurves, numEvents);
+
+  for (auto _ : state) {
+    typename Event::ZCurve curve;
+    merge_event_curves_k<Event>(curve, curves, numThreads);
+    benchmark::DoNotOptimize(curve);
+  }
+
+  state.SetItemsProcessed(state.iterations() * numCurves * numEvents);
+}
+/* Arguments are number of curves and number of events per curve */
+BENCHMARK_TEMPLATE(BM_Merge_KWay, uint16_t, uint64_t)
+    ->Args({2, 10000000})
+    ->Args({4, 10000000})
+    ->Args({9, 10000000})
+    ->Args({32, 10000000})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Merge_KWay, uint32_t, uint128_t)
+    ->Args({2, 10000000})
+    ->Args({4, 10000000})
+    ->Args({9, 10000000})
+    ->Args({32, 10000000})
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -18,9 +18,11 @@
 
 #include <benchmark/benchmark.h>
 
+#include <algorithm>
 #include <numeric>
 
 #include <boost/sort/sort.hpp>
+#include <omp.h>
 
 #include "BitInterleaving.h"
 #include "EventToMDEventConversion.h"
@@ -29,6 +31,8 @@
 #include "MDBox.h"
 #include "MDEvent.h"
 #include "MantidEventNexusLoader.h"
+#include "PrefetchReader.h"
+#include "RotatingSampleConversion.h"
 #include "scoped_wallclock_timer.hpp"
 
 const std::string dataDirPath("..");
@@ -66,7 +70,8 @@ MDSpaceBounds<3> md_space_sxd() {
   return space;
 }
 
-template <size_t ND, typename IntT, typename MortonT>
+template <size_t ND, typename IntT, typename MortonT,
+          typename SpectrumConverter = ScalarSpectrumConverter>
 void do_conversion(benchmark::State &state, const Instrument &inst,
                    const std::vector<TofEvent> &tofEventsRaw,
                    const MDSpaceBounds<ND> &mdSpace,
@@ -82,7 +87,9 @@ void do_conversion(benchmark::State &state, const Instrument &inst,
   std::vector<MDEvent<ND, IntT, MortonT>> mdEvents;
   {
     scoped_wallclock_timer timer(state, "q_conversion");
-    convert_events(mdEvents, tofEvents, convInfo, inst, mdSpace);
+    const auto plan = create_conversion_plan(inst, convInfo);
+    convert_events<IntT, MortonT, SpectrumConverter>(mdEvents, tofEvents, plan,
+                                                     mdSpace);
   }
 
   state.counters["md_events"] += mdEvents.size();
@@ -103,6 +110,172 @@ void do_conversion(benchmark::State &state, const Instrument &inst,
   benchmark::DoNotOptimize(mdEvents);
 }
 
+/**
+ * Performs conversion with events grouped into buckets during conversion, so
+ * only each bucket needs to be sorted.
+ */
+template <size_t ND, typename IntT, typename MortonT>
+void do_bucketed_conversion(benchmark::State &state, const Instrument &inst,
+                            const std::vector<TofEvent> &tofEventsRaw,
+                            const MDSpaceBounds<ND> &mdSpace,
+                            const ConversionInfo &convInfo,
+                            const size_t splitThreshold,
+                            const size_t maxBoxTreeDepth) {
+  /* Copy raw ToF events from loaded events (needed as
+   * convert_events_bucketed() sorts the vector) */
+  state.PauseTiming();
+  std::vector<TofEvent> tofEvents(tofEventsRaw);
+  state.ResumeTiming();
+
+  /* Convert to Q space */
+  std::vector<MDEvent<ND, IntT, MortonT>> mdEvents;
+  std::vector<size_t> bucketOffsets;
+  {
+    scoped_wallclock_timer timer(state, "q_conversion");
+    const auto plan = create_conversion_plan(inst, convInfo);
+    bucketOffsets = convert_events_bucketed(mdEvents, tofEvents, plan, mdSpace);
+  }
+
+  state.counters["md_events"] += mdEvents.size();
+
+  /* Sort events */
+  {
+    scoped_wallclock_timer timer(state, "sort");
+    sort_event_buckets(mdEvents, bucketOffsets);
+  }
+
+  /* Construct box structure */
+  MDBox<ND, IntT, MortonT> rootMdBox(mdEvents.cbegin(), mdEvents.cend());
+  {
+    scoped_wallclock_timer timer(state, "box_structure");
+    rootMdBox.distributeEvents(splitThreshold, maxBoxTreeDepth);
+  }
+
+  benchmark::DoNotOptimize(mdEvents);
+}
+
+/**
+ * Performs conversion for a sample rotating during the measurement.
+ */
+template <typename IntT, typename MortonT>
+void do_rotating_conversion(benchmark::State &state, const Instrument &inst,
+                            const std::vector<TofEvent> &tofEventsRaw,
+                            const MDSpaceBounds<3> &mdSpace,
+                            const ConversionInfo &convInfo,
+                            const RotationLog &log,
+                            const size_t splitThreshold,
+                            const size_t maxBoxTreeDepth) {
+  /* Copy raw ToF events from loaded events (needed as
+   * convert_events_rotating() sorts the vector) */
+  state.PauseTiming();
+  std::vector<TofEvent> tofEvents(tofEventsRaw);
+  state.ResumeTiming();
+
+  /* Convert to Q space */
+  std::vector<MDEvent<3, IntT, MortonT>> mdEvents;
+  {
+    scoped_wallclock_timer timer(state, "q_conversion");
+    const auto plan = create_conversion_plan(inst, convInfo);
+    convert_events_rotating(mdEvents, tofEvents, plan, log, mdSpace);
+  }
+
+  state.counters["md_events"] += mdEvents.size();
+
+  /* Sort events */
+  {
+    scoped_wallclock_timer timer(state, "sort");
+    boost::sort::block_indirect_sort(mdEvents.begin(), mdEvents.end());
+  }
+
+  /* Construct box structure */
+  MDBox<3, IntT, MortonT> rootMdBox(mdEvents.cbegin(), mdEvents.cend());
+  {
+    scoped_wallclock_timer timer(state, "box_structure");
+    rootMdBox.distributeEvents(splitThreshold, maxBoxTreeDepth);
+  }
+
+  benchmark::DoNotOptimize(mdEvents);
+}
+
+/**
+ * Performs loading and conversion, timed together.
+ *
+ * With a queue depth (first benchmark argument) of zero all events are loaded
+ * before conversion, otherwise blocks of events are converted while the
+ * following blocks are prefetched. Time spent waiting for blocks is reported
+ * as load_stall.
+ */
+template <typename IntT, typename MortonT, typename LoadAllFn,
+          typename PrefetchFn>
+void do_prefetched_conversion(benchmark::State &state, const Instrument &inst,
+                              LoadAllFn loadAll, PrefetchFn prefetch,
+                              const MDSpaceBounds<3> &mdSpace,
+                              const ConversionInfo &convInfo,
+                              const size_t splitThreshold,
+                              const size_t maxBoxTreeDepth) {
+  const size_t queueDepth(state.range(0));
+
+  /* Load and convert to Q space */
+  std::vector<MDEvent<3, IntT, MortonT>> mdEvents;
+  double stallTime(0.0);
+  {
+    scoped_wallclock_timer timer(state, "load_and_conversion");
+    const auto plan = create_conversion_plan(inst, convInfo);
+
+    TofEventList tofEvents;
+    if (queueDepth == 0) {
+      loadAll(tofEvents);
+      convert_events(mdEvents, tofEvents, plan, mdSpace);
+    } else {
+      auto reader = prefetch(queueDepth);
+      while (reader->next(tofEvents)) {
+        convert_events(mdEvents, tofEvents, plan, mdSpace);
+      }
+      stallTime = reader->stallTime();
+    }
+  }
+
+  state.counters["load_stall"] += stallTime;
+  state.counters["md_events"] += mdEvents.size();
+
+  /* Sort events */
+  {
+    scoped_wallclock_timer timer(state, "sort");
+    boost::sort::block_indirect_sort(mdEvents.begin(), mdEvents.end());
+  }
+
+  /* Construct box structure */
+  MDBox<3, IntT, MortonT> rootMdBox(mdEvents.cbegin(), mdEvents.cend());
+  {
+    scoped_wallclock_timer timer(state, "box_structure");
+    rootMdBox.distributeEvents(splitThreshold, maxBoxTreeDepth);
+  }
+
+  benchmark::DoNotOptimize(mdEvents);
+}
+
+/**
+ * Creates a rotation log for a sample rotating a full turn about the vertical
+ * axis over the duration of a run, in 0.1 degree steps.
+ */
+RotationLog full_turn_rotation_log(const std::vector<TofEvent> &events) {
+  const auto pulseTimes = std::minmax_element(
+      events.cbegin(), events.cend(),
+      [](const TofEvent &a, const TofEvent &b) {
+        return a.pulse_time < b.pulse_time;
+      });
+  const double start = pulseTimes.first->pulse_time;
+  const double duration = pulseTimes.second->pulse_time - start;
+
+  std::vector<double> times;
+  std::vector<double> angles;
+  for (size_t i = 0; i < 3600; i++) {
+    times.push_back(start + duration * i / 3600.0);
+    angles.push_back(i * 0.1);
+  }
+  return create_rotation_log(times, angles, Eigen::Vector3f::UnitY(), 0.1);
+}
+
 void load_isis(Instrument &inst, std::vector<TofEvent> &events,
                const std::string &instFile, const std::string &dataFile,
                const std::string &dataPath) {
@@ -171,6 +344,38 @@ BENCHMARK_TEMPLATE(BM_QConversion_WISH_34509, uint32_t, uint128_t)
 BENCHMARK_TEMPLATE(BM_QConversion_WISH_34509, uint64_t, uint256_t)
     ->Unit(benchmark::kMillisecond);
 
+/**
+ * Conversion of the same data with a varying number of threads, to show
+ * scaling of the conversion.
+ */
+template <typename IntT, typename MortonT>
+void BM_QConversion_WISH_34509_Threads(benchmark::State &state) {
+  constexpr size_t ND(3);
+
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_isis(inst, tofEventsRaw, dataDirPath + "/wish.h5",
+            dataDirPath + "/WISH00034509.nxs", "/raw_data_1/detector_1_events");
+
+  const auto maxThreads = omp_get_max_threads();
+  omp_set_num_threads(state.range(0));
+
+  for (auto _ : state) {
+    do_conversion<ND, IntT, MortonT>(state, inst, tofEventsRaw, md_space_wish(),
+                                     {false, Eigen::Matrix3f::Identity()}, 1000,
+                                     20);
+  }
+
+  omp_set_num_threads(maxThreads);
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_WISH_34509_Threads, uint16_t, uint64_t)
+    ->RangeMultiplier(2)
+    ->Range(1, 32)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
 template <typename IntT, typename MortonT>
 void BM_QConversion_WISH_34509_2x(benchmark::State &state) {
   constexpr size_t ND(3);
@@ -328,4 +533,264 @@ BENCHMARK_TEMPLATE(BM_QConversion_SXD_23767, uint32_t, uint128_t)
 BENCHMARK_TEMPLATE(BM_QConversion_SXD_23767, uint64_t, uint256_t)
     ->Unit(benchmark::kMillisecond);
 
+template <typename IntT, typename MortonT>
+void BM_QConversion_Bucketed_WISH_34509(benchmark::State &state) {
+  constexpr size_t ND(3);
+
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_isis(inst, tofEventsRaw, dataDirPath + "/wish.h5",
+            dataDirPath + "/WISH00034509.nxs", "/raw_data_1/detector_1_events");
+
+  for (auto _ : state) {
+    do_bucketed_conversion<ND, IntT, MortonT>(
+        state, inst, tofEventsRaw, md_space_wish(),
+        {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_WISH_34509, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_WISH_34509, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_WISH_34509, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_WISH_34509, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_QConversion_Bucketed_TOPAZ_3132(benchmark::State &state) {
+  constexpr size_t ND(3);
+
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_mantid(inst, tofEventsRaw, dataDirPath + "/topaz.h5",
+              dataDirPath + "/TOPAZ_3132_event.nxs");
+
+  for (auto _ : state) {
+    do_bucketed_conversion<ND, IntT, MortonT>(
+        state, inst, tofEventsRaw, md_space_topaz(),
+        {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_TOPAZ_3132, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_TOPAZ_3132, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_TOPAZ_3132, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_TOPAZ_3132, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_QConversion_Bucketed_SXD_23767(benchmark::State &state) {
+  constexpr size_t ND(3);
+
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_mantid(inst, tofEventsRaw, dataDirPath + "/sxd.h5",
+              dataDirPath + "/SXD23767_event.nxs");
+
+  for (auto _ : state) {
+    do_bucketed_conversion<ND, IntT, MortonT>(
+        state, inst, tofEventsRaw, md_space_sxd(),
+        {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_SXD_23767, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_SXD_23767, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_SXD_23767, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Bucketed_SXD_23767, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_QConversion_Vectorised_WISH_34509(benchmark::State &state) {
+  constexpr size_t ND(3);
+
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_isis(inst, tofEventsRaw, dataDirPath + "/wish.h5",
+            dataDirPath + "/WISH00034509.nxs", "/raw_data_1/detector_1_events");
+
+  for (auto _ : state) {
+    do_conversion<ND, IntT, MortonT, VectorisedSpectrumConverter>(
+        state, inst, tofEventsRaw, md_space_wish(),
+        {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_WISH_34509, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_WISH_34509, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_WISH_34509, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_WISH_34509, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_QConversion_Vectorised_TOPAZ_3132(benchmark::State &state) {
+  constexpr size_t ND(3);
+
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_mantid(inst, tofEventsRaw, dataDirPath + "/topaz.h5",
+              dataDirPath + "/TOPAZ_3132_event.nxs");
+
+  for (auto _ : state) {
+    do_conversion<ND, IntT, MortonT, VectorisedSpectrumConverter>(
+        state, inst, tofEventsRaw, md_space_topaz(),
+        {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_TOPAZ_3132, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_TOPAZ_3132, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_TOPAZ_3132, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_TOPAZ_3132, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_QConversion_Vectorised_SXD_23767(benchmark::State &state) {
+  constexpr size_t ND(3);
+
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_mantid(inst, tofEventsRaw, dataDirPath + "/sxd.h5",
+              dataDirPath + "/SXD23767_event.nxs");
+
+  for (auto _ : state) {
+    do_conversion<ND, IntT, MortonT, VectorisedSpectrumConverter>(
+        state, inst, tofEventsRaw, md_space_sxd(),
+        {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_SXD_23767, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_SXD_23767, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_SXD_23767, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Vectorised_SXD_23767, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+template <typename IntT, typename MortonT>
+void BM_QConversion_Rotating_WISH_34509(benchmark::State &state) {
+  Instrument inst;
+  std::vector<TofEvent> tofEventsRaw;
+  load_isis(inst, tofEventsRaw, dataDirPath + "/wish.h5",
+            dataDirPath + "/WISH00034509.nxs", "/raw_data_1/detector_1_events");
+
+  const auto log = full_turn_rotation_log(tofEventsRaw);
+
+  for (auto _ : state) {
+    do_rotating_conversion<IntT, MortonT>(
+        state, inst, tofEventsRaw, md_space_wish(),
+        {false, Eigen::Matrix3f::Identity()}, log, 1000, 20);
+  }
+
+  average_counters(state);
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Rotating_WISH_34509, uint8_t, uint32_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Rotating_WISH_34509, uint16_t, uint64_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Rotating_WISH_34509, uint32_t, uint128_t)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_QConversion_Rotating_WISH_34509, uint64_t, uint256_t)
+    ->Unit(benchmark::kMillisecond);
+
+/**
+ * Loading and conversion of frames in 16 blocks, with a varying prefetch queue
+ * depth (zero loads all frames before conversion).
+ */
+template <typename IntT, typename MortonT>
+void BM_QConversion_Prefetch_WISH_34509(benchmark::State &state) {
+  Instrument inst;
+  load_instrument(inst, dataDirPath + "/wish.h5");
+
+  IsisEventNexusLoader loader(dataDirPath + "/WISH00034509.nxs",
+                              "/raw_data_1/detector_1_events");
+  loader.loadSpectrumDetectorMapping(inst.spectrum_detector_mapping);
+
+  std::vector<size_t> frameIdxs(loader.frameCount());
+  std::iota(frameIdxs.begin(), frameIdxs.end(), 0);
+  const size_t framesPerBlock((frameIdxs.size() + 15) / 16);
+
+  for (auto _ : state) {
+    do_prefetched_conversion<IntT, MortonT>(
+        state, inst,
+        [&](TofEventList &events) { loader.loadFrames(events, frameIdxs); },
+        [&](const size_t queueDepth) {
+          return prefetch_frames(loader, frameIdxs, framesPerBlock,
+                                 queueDepth);
+        },
+        md_space_wish(), {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+  for (const auto &name : {"load_and_conversion", "load_stall"}) {
+    state.counters[name] /= state.iterations();
+  }
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Prefetch_WISH_34509, uint16_t, uint64_t)
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+/**
+ * Loading and conversion of spectra in 16 blocks, with a varying prefetch
+ * queue depth (zero loads all spectra before conversion).
+ */
+template <typename IntT, typename MortonT>
+void BM_QConversion_Prefetch_WISH_38423(benchmark::State &state) {
+  Instrument inst;
+  load_instrument(inst, dataDirPath + "/wish.h5");
+
+  MantidEventNexusLoader loader(dataDirPath + "/WISH00038423_event.nxs");
+  loader.loadSpectrumDetectorMapping(inst.spectrum_detector_mapping);
+
+  const size_t spectraPerBlock((loader.spectrumCount() + 15) / 16);
+
+  for (auto _ : state) {
+    do_prefetched_conversion<IntT, MortonT>(
+        state, inst,
+        [&](TofEventList &events) { loader.loadAllEvents(events); },
+        [&](const size_t queueDepth) {
+          return prefetch_spectra(loader, spectraPerBlock, queueDepth);
+        },
+        md_space_wish(), {false, Eigen::Matrix3f::Identity()}, 1000, 20);
+  }
+
+  average_counters(state);
+  for (const auto &name : {"load_and_conversion", "load_stall"}) {
+    state.counters[name] /= state.iterations();
+  }
+}
+BENCHMARK_TEMPLATE(BM_QConversion_Prefetch_WISH_38423, uint16_t, uint64_t)
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
 BENCHMARK_MAIN();
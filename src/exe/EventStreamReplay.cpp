@@ -0,0 +1,119 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <iostream>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <gflags/gflags.h>
+
+#include "EventMessage.h"
+#include "EventMessageStream.h"
+#include "IsisEventNexusLoader.h"
+#include "PrefetchReader.h"
+
+const std::string AllFrames("all");
+
+DEFINE_string(data, "raw_data.nxs", "TOF event data file.");
+DEFINE_string(dataset, "raw_data_1/detector_1_events", "Path to HDF5 dataset.");
+DEFINE_string(frames, AllFrames, "Frames to replay.");
+DEFINE_string(output, "events.evs",
+              "Replay file the messages are written to (when not serving).");
+DEFINE_uint64(port, 0,
+              "Port to serve the messages on to a single subscriber (0 to "
+              "write a replay file).");
+DEFINE_double(speed, 0.0,
+              "Replay speed relative to the pulse times of the run (0 to "
+              "send messages as fast as possible).");
+DEFINE_string(source_name, "isis_replay", "Source name of the messages.");
+DEFINE_uint64(queue_depth, 16, "Frames loaded ahead of sending.");
+
+void parse_integer_string_array(std::vector<size_t> &numbers,
+                                const std::string &str) {
+  std::vector<std::string> subStrings;
+  boost::algorithm::split(subStrings, str, boost::algorithm::is_any_of(","));
+  for (const auto &p : subStrings) {
+    numbers.push_back(std::stol(p));
+  }
+}
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  /* A subscriber disconnecting is reported as a failed write */
+  std::signal(SIGPIPE, SIG_IGN);
+
+  IsisEventNexusLoader loader(FLAGS_data, FLAGS_dataset);
+
+  /* Select frames */
+  std::vector<size_t> frameIdxs;
+  if (FLAGS_frames == AllFrames) {
+    frameIdxs.resize(loader.frameCount());
+    std::iota(frameIdxs.begin(), frameIdxs.end(), 0);
+  } else {
+    parse_integer_string_array(frameIdxs, FLAGS_frames);
+  }
+
+  /* Open the stream */
+  std::unique_ptr<EventMessageWriter> writer;
+  if (FLAGS_port > 0) {
+    EventStreamListener listener(FLAGS_port);
+    std::cout << "Waiting for a subscriber on port " << listener.port()
+              << "\n";
+    writer = listener.accept();
+  } else {
+    writer = create_event_file(FLAGS_output);
+  }
+
+  /* Send one message per frame, loading frames ahead of sending */
+  using Clock = std::chrono::steady_clock;
+  const auto start = Clock::now();
+
+  auto reader = prefetch_frames(loader, frameIdxs, 1, FLAGS_queue_depth);
+  const auto &timeZero = loader.eventTimeZero();
+
+  size_t eventCount(0);
+  TofEventList events;
+  for (size_t i = 0; reader->next(events); i++) {
+    const double pulseTime = timeZero[frameIdxs[i]];
+
+    /* Keep the pulse times of the run, scaled by the replay speed */
+    if (FLAGS_speed > 0.0) {
+      const double offset =
+          (pulseTime - timeZero[frameIdxs.front()]) / FLAGS_speed;
+      std::this_thread::sleep_until(
+          start + std::chrono::duration_cast<Clock::duration>(
+                      std::chrono::duration<double>(offset)));
+    }
+
+    writer->write(make_event_message(FLAGS_source_name, i,
+                                     std::llround(pulseTime * 1e9), events));
+    eventCount += events.size();
+  }
+
+  std::cout << "Sent " << frameIdxs.size() << " messages (" << eventCount
+            << " events) in "
+            << std::chrono::duration<double>(Clock::now() - start).count()
+            << " seconds\n";
+}
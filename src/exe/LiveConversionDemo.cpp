@@ -0,0 +1,141 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <gflags/gflags.h>
+
+#include "EventMessageStream.h"
+#include "EventToMDEventConversion.h"
+#include "Instrument.h"
+#include "InstrumentDefinitionLoader.h"
+#include "IsisEventNexusLoader.h"
+#include "LiveConversion.h"
+
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+DEFINE_string(instrument, "instrument.h5",
+              "Instrument geometry file (HDF5, or Mantid IDF if .xml).");
+DEFINE_string(mapping_data, "",
+              "ISIS event file to read the spectrum to detector mapping from "
+              "(one to one mapping if empty).");
+DEFINE_string(dataset, "raw_data_1/detector_1_events", "Path to HDF5 dataset.");
+DEFINE_string(stream, "events.evs",
+              "Event stream: replay file, or tcp://<host>:<port>.");
+DEFINE_string(space, "-10,10,-10,10,-10,10", "Q space dimensions.");
+DEFINE_uint64(split_threshold, 1000, "Box splitting threshold.");
+DEFINE_uint64(max_box_depth, 20, "Maximum box structure tree depth.");
+DEFINE_uint64(batch_events, 1000000,
+              "TOF events at which a micro-batch is converted.");
+DEFINE_double(max_batch_age, 100,
+              "Longest time (ms) a message waits for its micro-batch to be "
+              "converted.");
+DEFINE_uint64(queue_depth, 64,
+              "Received messages buffered ahead of conversion.");
+DEFINE_uint64(delta_events, 1000000,
+              "MD events at which the delta curve is folded into the main "
+              "curve in the background.");
+DEFINE_bool(print_batches, false, "Print statistics of each micro-batch.");
+
+void parse_float_string_array(std::vector<float> &numbers,
+                              const std::string &str) {
+  std::vector<std::string> subStrings;
+  boost::algorithm::split(subStrings, str, boost::algorithm::is_any_of(","));
+  for (const auto &p : subStrings) {
+    numbers.push_back(std::stof(p));
+  }
+}
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  /* Load instrument */
+  Instrument inst;
+  const std::string idfExtension(".xml");
+  if (boost::algorithm::ends_with(FLAGS_instrument, idfExtension)) {
+    load_instrument_definition(inst, FLAGS_instrument);
+  } else {
+    load_instrument(inst, FLAGS_instrument);
+  }
+
+  if (FLAGS_mapping_data.empty()) {
+    generate_1_to_1_spec_det_mapping(inst);
+  } else {
+    IsisEventNexusLoader loader(FLAGS_mapping_data, FLAGS_dataset);
+    loader.loadSpectrumDetectorMapping(inst.spectrum_detector_mapping);
+  }
+
+  /* Parse MD space */
+  MDSpaceBounds<3> space;
+  {
+    std::vector<float> extents;
+    parse_float_string_array(extents, FLAGS_space);
+
+    space(0, 0) = extents[0];
+    space(0, 1) = extents[1];
+    space(1, 0) = extents[2];
+    space(1, 1) = extents[3];
+    space(2, 0) = extents[4];
+    space(2, 1) = extents[5];
+  }
+
+  /* Geometry of each spectrum is calculated once, before any events arrive */
+  const ConversionPlan plan =
+      create_conversion_plan(inst, {false, Eigen::Matrix3f::Identity()});
+
+  const LiveConversionOptions options{
+      FLAGS_batch_events, FLAGS_max_batch_age * 1e-3, FLAGS_queue_depth,
+      FLAGS_split_threshold, FLAGS_max_box_depth, FLAGS_delta_events};
+  LiveConversion<IntT, MortonT> live(plan, space, options);
+
+  auto reader = open_event_stream(FLAGS_stream);
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto result = ingest_event_stream(
+      *reader, live, [](const LiveConversion<IntT, MortonT> &l,
+                        const LiveBatchStats &stats) {
+        if (FLAGS_print_batches) {
+          std::cout << "Batch: " << stats.message_count << " messages, "
+                    << stats.tof_event_count << " TOF events ("
+                    << stats.dropped_event_count << " dropped), "
+                    << stats.md_event_count << " MD events added ("
+                    << l.eventCount() << " total in " << l.tiers().size()
+                    << " tiers, " << stats.folded_event_count
+                    << " folded), latency "
+                    << stats.latency * 1e3 << " ms, processing "
+                    << stats.processing_time * 1e3 << " ms\n";
+        }
+      });
+  const std::chrono::duration<double> duration(
+      std::chrono::steady_clock::now() - start);
+
+  std::cout << "Received " << result.message_count << " messages in "
+            << duration.count() << " seconds\n"
+            << "Converted " << result.event_count << " MD events in "
+            << result.batch_count << " batches ("
+            << result.processing_time << " seconds processing)\n"
+            << "Dropped " << result.dropped_event_count
+            << " TOF events of spectra not in the instrument\n"
+            << "Maximum latency " << result.max_latency * 1e3 << " ms\n";
+}
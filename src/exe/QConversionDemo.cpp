@@ -17,12 +17,15 @@
  */
 
 #include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <vector>
 #include <numeric>
 
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/sort/sort.hpp>
 #include <gflags/gflags.h>
@@ -30,8 +33,12 @@
 
 #include "EventToMDEventConversion.h"
 #include "Instrument.h"
+#include "InstrumentDefinitionLoader.h"
 #include "IsisEventNexusLoader.h"
 #include "MDBox.h"
+#include "OutOfCoreMerge.h"
+#include "PrefetchReader.h"
+#include "StreamingConversion.h"
 
 constexpr size_t ND(3);
 using IntT = uint16_t;
@@ -39,13 +46,33 @@ using MortonT = uint64_t;
 
 const std::string AllFrames("all");
 
-DEFINE_string(instrument, "instrument.h5", "Instrument geometry file.");
+DEFINE_string(instrument, "instrument.h5",
+              "Instrument geometry file (HDF5, or Mantid IDF if .xml).");
 DEFINE_string(data, "raw_data.nxs", "TOF event data file.");
 DEFINE_string(dataset, "raw_data_1/detector_1_events", "Path to HDF5 dataset.");
 DEFINE_string(frames, "0", "Frames to load.");
 DEFINE_string(space, "-10,10,-10,10,-10,10", "Q space dimensions.");
 DEFINE_uint64(split_threshold, 1000, "Box splitting threshold.");
 DEFINE_uint64(max_box_depth, 20, "Maximum box structure tree depth.");
+DEFINE_uint64(bucket_bits, 0,
+              "Morton number bits used to bucket events during conversion (0 "
+              "to sort all events after conversion).");
+DEFINE_bool(cache_instrument_geometry, false,
+            "Cache the geometry expanded from an IDF next to the IDF.");
+DEFINE_bool(cache_conversion_plan, false,
+            "Cache the conversion plan next to the instrument file.");
+DEFINE_uint64(frames_per_chunk, 0,
+              "Frames loaded and converted at a time (0 to load all frames "
+              "before conversion).");
+DEFINE_uint64(prefetch_frames, 0,
+              "Frames per block read ahead of conversion when not chunked (0 "
+              "to load all frames before conversion, ignores -bucket_bits).");
+DEFINE_uint64(queue_depth, 2,
+              "Chunks (or prefetched blocks) buffered between stages of the "
+              "chunked conversion.");
+DEFINE_uint64(memory_budget, 4096,
+              "Memory (MB) for the merged curve during chunked conversion, "
+              "sorted runs are written to disk beyond this.");
 
 void parse_integer_string_array(std::vector<size_t> &numbers,
                                 const std::string &str) {
@@ -93,7 +120,15 @@ int main(int argc, char **argv) {
   Instrument inst;
   {
     scoped_wallclock_timer timer("Load instrument");
-    load_instrument(inst, FLAGS_instrument);
+    const std::string idfExtension(".xml");
+    if (boost::algorithm::ends_with(FLAGS_instrument, idfExtension)) {
+      load_instrument_definition(inst, FLAGS_instrument,
+                                 FLAGS_cache_instrument_geometry
+                                     ? FLAGS_instrument + ".geometry"
+                                     : "");
+    } else {
+      load_instrument(inst, FLAGS_instrument);
+    }
   }
 
   IsisEventNexusLoader loader(FLAGS_data, FLAGS_dataset);
@@ -104,23 +139,15 @@ int main(int argc, char **argv) {
     loader.loadSpectrumDetectorMapping(inst.spectrum_detector_mapping);
   }
 
-  /* Load ToF events */
-  std::vector<TofEvent> events;
+  /* Select frames */
+  std::vector<size_t> frameIdxs;
   {
-    scoped_wallclock_timer timer("Load TOF events");
-
-    std::vector<size_t> frameIdxs;
-    {
-      if (FLAGS_frames == AllFrames) {
-        frameIdxs.resize(loader.frameCount());
-        std::iota(frameIdxs.begin(), frameIdxs.end(), 0);
-      } else {
-        parse_integer_string_array(frameIdxs, FLAGS_frames);
-      }
+    if (FLAGS_frames == AllFrames) {
+      frameIdxs.resize(loader.frameCount());
+      std::iota(frameIdxs.begin(), frameIdxs.end(), 0);
+    } else {
+      parse_integer_string_array(frameIdxs, FLAGS_frames);
     }
-
-    loader.loadFrames(events, frameIdxs);
-    std::cout << " (" << events.size() << " ToF events loaded)\n";
   }
 
   /* Parse MD space */
@@ -137,21 +164,126 @@ int main(int argc, char **argv) {
     space(2, 1) = extents[5];
   }
 
-  /* Convert to Q space */
-  std::vector<MDEvent<ND, IntT, MortonT>> mdEvents;
+  /* Create conversion plan */
+  ConversionPlan plan;
   {
-    scoped_wallclock_timer timer("Convert to Q space");
+    scoped_wallclock_timer timer("Create conversion plan");
 
     ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
 
-    convert_events(mdEvents, events, convInfo, inst, space);
-    std::cout << " (" << mdEvents.size() << " MD events created)\n";
+    const std::string planFilename(FLAGS_instrument + ".conversion_plan");
+
+    /* Use cached plan if it exists and was created for the same conversion of
+     * the same instrument geometry and spectrum to detector mapping (the
+     * latter comes from the data file) */
+    bool planLoaded(false);
+    if (FLAGS_cache_conversion_plan && std::ifstream(planFilename)) {
+      load_conversion_plan(plan, planFilename);
+      planLoaded = plan.instrument_hash == instrument_hash(inst) &&
+                   plan.conversion_info.lorentz_correction ==
+                       convInfo.lorentz_correction &&
+                   plan.conversion_info.ub_matrix == convInfo.ub_matrix;
+      std::cout << " (cached plan " << (planLoaded ? "used" : "outdated")
+                << ")\n";
+    }
+
+    if (!planLoaded) {
+      plan = create_conversion_plan(inst, convInfo);
+      if (FLAGS_cache_conversion_plan) {
+        save_conversion_plan(plan, planFilename);
+      }
+    }
   }
 
-  /* Sort events */
-  {
-    scoped_wallclock_timer timer("Sort events");
-    boost::sort::block_indirect_sort(mdEvents.begin(), mdEvents.end());
+  std::vector<MDEvent<ND, IntT, MortonT>> mdEvents;
+
+  if (FLAGS_frames_per_chunk > 0) {
+    /* Load, convert and sort chunks of frames concurrently */
+    StreamingConversionResult<IntT, MortonT> result;
+    {
+      scoped_wallclock_timer timer("Chunked conversion to Q space");
+
+      const StreamingConversionOptions options{
+          FLAGS_frames_per_chunk, FLAGS_queue_depth,
+          FLAGS_memory_budget * 1024 * 1024, "md_events_run_", 1024 * 1024};
+      result = convert_events_streamed<IntT, MortonT>(loader, frameIdxs, plan,
+                                                      space, options);
+      std::cout << " (" << result.event_count << " MD events created in "
+                << result.chunk_count << " chunks, "
+                << result.run_filenames.size() << " runs written, "
+                << result.load_stall_time << " seconds waiting for loading)\n";
+    }
+
+    if (result.run_filenames.empty()) {
+      mdEvents = std::move(result.curve);
+    } else {
+      /* Events exceed the memory budget, merge the sorted runs on disk */
+      scoped_wallclock_timer timer("Merge runs and construct box structure");
+
+      const auto rootBox = merge_event_curve_files<ND, IntT, MortonT>(
+          result.run_filenames, "md_events_out.mdec", 1024 * 1024,
+          FLAGS_split_threshold, FLAGS_max_box_depth);
+      std::cout << " (" << rootBox.eventCount()
+                << " MD events written to md_events_out.mdec)\n";
+
+      for (const auto &filename : result.run_filenames) {
+        std::remove(filename.c_str());
+      }
+      return 0;
+    }
+  } else if (FLAGS_prefetch_frames > 0) {
+    /* Convert blocks of frames while the next blocks are loaded */
+    {
+      scoped_wallclock_timer timer("Load and convert to Q space");
+
+      auto reader = prefetch_frames(loader, frameIdxs, FLAGS_prefetch_frames,
+                                    FLAGS_queue_depth);
+      TofEventList events;
+      while (reader->next(events)) {
+        convert_events(mdEvents, events, plan, space);
+      }
+      std::cout << " (" << mdEvents.size() << " MD events created in "
+                << reader->blockCount() << " blocks, " << reader->stallTime()
+                << " seconds waiting for loading)\n";
+    }
+
+    /* Sort events */
+    {
+      scoped_wallclock_timer timer("Sort events");
+      boost::sort::block_indirect_sort(mdEvents.begin(), mdEvents.end());
+    }
+  } else {
+    /* Load ToF events */
+    std::vector<TofEvent> events;
+    {
+      scoped_wallclock_timer timer("Load TOF events");
+      loader.loadFrames(events, frameIdxs);
+      std::cout << " (" << events.size() << " ToF events loaded)\n";
+    }
+
+    /* Convert to Q space */
+    std::vector<size_t> bucketOffsets;
+    {
+      scoped_wallclock_timer timer("Convert to Q space");
+
+      if (FLAGS_bucket_bits > 0) {
+        bucketOffsets = convert_events_bucketed(mdEvents, events, plan, space,
+                                                FLAGS_bucket_bits);
+      } else {
+        convert_events(mdEvents, events, plan, space);
+      }
+      std::cout << " (" << mdEvents.size() << " MD events created)\n";
+    }
+
+    /* Sort events */
+    {
+      scoped_wallclock_timer timer("Sort events");
+      if (FLAGS_bucket_bits > 0) {
+        sort_event_buckets(mdEvents, bucketOffsets);
+      } else {
+        boost::sort::block_indirect_sort(mdEvents.begin(), mdEvents.end());
+      }
+    }
   }
 
   /* Construct box structure */
@@ -0,0 +1,157 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <stdexcept>
+
+#include "BatchConversion.h"
+#include "TestUtil.h"
+
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Event = MDEvent<3, IntT, MortonT>;
+using Box = MDBox<3, IntT, MortonT>;
+
+class BatchConversionTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    inst = make_random_test_instrument();
+    plan = create_conversion_plan(inst, {false, make_test_ub_matrix()});
+    space = make_test_space();
+
+    std::mt19937 gen(1);
+
+    /* Runs at 15 degree steps about the vertical axis */
+    std::uniform_int_distribution<uint32_t> specDist(0, 99);
+    std::uniform_real_distribution<float> tofDist(1000.0f, 20000.0f);
+    for (size_t run = 0; run < 7; run++) {
+      const std::string filename("run_" + std::to_string(run) + ".nxs");
+      const float angle = run * 15.0f * M_PI / 180.0f;
+      runs.push_back(BatchRun{
+          filename,
+          Eigen::AngleAxisf(angle, Eigen::Vector3f::UnitY()).matrix()});
+
+      for (size_t i = 0; i < 2000; i++) {
+        runEvents[filename].push_back(
+            TofEvent{specDist(gen), tofDist(gen), 0.0, 1.0f});
+      }
+    }
+  }
+
+  void loadRun(TofEventList &events, const std::string &filename) const {
+    events = runEvents.at(filename);
+  }
+
+  /**
+   * Converts each run separately and sorts the combined events.
+   */
+  Event::ZCurve convertRunsSeparately() const {
+    Event::ZCurve expected;
+    for (const auto &run : runs) {
+      auto tofEvents = runEvents.at(run.filename);
+      convert_events(expected, tofEvents,
+                     rotate_conversion_plan(plan, run.goniometer), space);
+    }
+    std::stable_sort(expected.begin(), expected.end());
+    return expected;
+  }
+
+  Instrument inst;
+  ConversionPlan plan;
+  MDSpaceBounds<3> space;
+  std::vector<BatchRun> runs;
+  std::map<std::string, TofEventList> runEvents;
+};
+
+TEST_F(BatchConversionTest, rotate_conversion_plan) {
+  const Eigen::Matrix3f rotation =
+      Eigen::AngleAxisf(0.3f, Eigen::Vector3f::UnitY()).matrix();
+
+  const auto rotated = rotate_conversion_plan(plan, rotation);
+  const auto expected = create_conversion_plan(
+      inst, {false, rotation * plan.conversion_info.ub_matrix});
+
+  EXPECT_TRUE(expected.conversion_info.ub_matrix.isApprox(
+      rotated.conversion_info.ub_matrix));
+  EXPECT_EQ(expected.spectrum_index, rotated.spectrum_index);
+  EXPECT_EQ(expected.conversion_factor, rotated.conversion_factor);
+  ASSERT_EQ(expected.q_direction.size(), rotated.q_direction.size());
+  for (size_t i = 0; i < expected.q_direction.size(); i++) {
+    EXPECT_TRUE(expected.q_direction[i].isApprox(rotated.q_direction[i]));
+  }
+}
+
+TEST_F(BatchConversionTest, convert_runs) {
+  const auto expected = convertRunsSeparately();
+
+  Box expectedBox(expected.cbegin(), expected.cend());
+  expectedBox.distributeEvents(100, 10);
+
+  for (const size_t maxConcurrentRuns : {1, 3, 16}) {
+    Event::ZCurve curve{Event(42)};
+    const auto rootBox = convert_runs<IntT, MortonT>(
+        curve, runs,
+        [this](TofEventList &events, const std::string &filename) {
+          loadRun(events, filename);
+        },
+        plan, space, maxConcurrentRuns, 100, 10);
+
+    ASSERT_EQ(expected.size(), curve.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      EXPECT_EQ(expected[i].mortonNumber(), curve[i].mortonNumber());
+    }
+
+    EXPECT_EQ(curve.cbegin(), rootBox.eventBegin());
+    EXPECT_EQ(curve.cend(), rootBox.eventEnd());
+    EXPECT_EQ(expectedBox.children().size(), rootBox.children().size());
+    for (size_t i = 0; i < expectedBox.children().size(); i++) {
+      EXPECT_EQ(expectedBox.children()[i].eventCount(),
+                rootBox.children()[i].eventCount());
+    }
+  }
+}
+
+TEST_F(BatchConversionTest, convert_runs_empty) {
+  Event::ZCurve curve;
+  const auto rootBox = convert_runs<IntT, MortonT>(
+      curve, {}, [](TofEventList &, const std::string &) {}, plan, space, 4,
+      100, 10);
+
+  EXPECT_TRUE(curve.empty());
+  EXPECT_EQ(0, rootBox.eventCount());
+}
+
+TEST_F(BatchConversionTest, convert_runs_load_failure) {
+  Event::ZCurve curve;
+  EXPECT_THROW(
+      (convert_runs<IntT, MortonT>(
+          curve, runs,
+          [this](TofEventList &events, const std::string &filename) {
+            if (filename == "run_4.nxs") {
+              throw std::runtime_error("Failed to load run");
+            }
+            loadRun(events, filename);
+          },
+          plan, space, 2, 100, 10)),
+      std::runtime_error);
+}
@@ -0,0 +1,125 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+#include "BoundedQueue.h"
+
+TEST(BoundedQueueTest, fifo_order) {
+  BoundedQueue<int> queue(3);
+  EXPECT_EQ(3, queue.capacity());
+
+  EXPECT_TRUE(queue.push(1));
+  EXPECT_TRUE(queue.push(2));
+  EXPECT_TRUE(queue.push(3));
+
+  int item;
+  EXPECT_TRUE(queue.pop(item));
+  EXPECT_EQ(1, item);
+  EXPECT_TRUE(queue.pop(item));
+  EXPECT_EQ(2, item);
+  EXPECT_TRUE(queue.pop(item));
+  EXPECT_EQ(3, item);
+}
+
+TEST(BoundedQueueTest, zero_capacity) {
+  BoundedQueue<int> queue(0);
+  EXPECT_EQ(1, queue.capacity());
+}
+
+TEST(BoundedQueueTest, close) {
+  BoundedQueue<int> queue(2);
+  queue.push(1);
+  queue.close();
+
+  /* No new items are accepted, queued items remain */
+  EXPECT_FALSE(queue.push(2));
+
+  int item;
+  EXPECT_TRUE(queue.pop(item));
+  EXPECT_EQ(1, item);
+  EXPECT_FALSE(queue.pop(item));
+}
+
+TEST(BoundedQueueTest, close_wakes_consumer) {
+  BoundedQueue<int> queue(2);
+
+  bool popped(true);
+  std::thread consumer([&]() {
+    int item;
+    popped = queue.pop(item);
+  });
+
+  queue.close();
+  consumer.join();
+  EXPECT_FALSE(popped);
+}
+
+TEST(BoundedQueueTest, pop_until) {
+  using Clock = std::chrono::steady_clock;
+  BoundedQueue<int> queue(2);
+
+  /* Nothing queued before the deadline */
+  int item(0);
+  const auto start = Clock::now();
+  EXPECT_FALSE(queue.pop_until(item, start + std::chrono::milliseconds(50)));
+  EXPECT_GE(Clock::now() - start, std::chrono::milliseconds(50));
+
+  /* Item queued while waiting */
+  std::thread producer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    queue.push(1);
+  });
+  EXPECT_TRUE(queue.pop_until(item, Clock::now() + std::chrono::seconds(10)));
+  EXPECT_EQ(1, item);
+  producer.join();
+
+  /* Closed queue returns immediately once empty */
+  queue.push(2);
+  queue.close();
+  EXPECT_TRUE(queue.pop_until(item, Clock::now() + std::chrono::seconds(10)));
+  EXPECT_EQ(2, item);
+  EXPECT_FALSE(queue.pop_until(item, Clock::now() + std::chrono::seconds(10)));
+}
+
+TEST(BoundedQueueTest, producer_consumer) {
+  const int itemCount(10000);
+  BoundedQueue<int> queue(4);
+
+  std::thread producer([&]() {
+    for (int i = 0; i < itemCount; i++) {
+      queue.push(i);
+    }
+    queue.close();
+  });
+
+  std::vector<int> items;
+  int item;
+  while (queue.pop(item)) {
+    items.push_back(item);
+  }
+  producer.join();
+
+  ASSERT_EQ(itemCount, items.size());
+  for (int i = 0; i < itemCount; i++) {
+    EXPECT_EQ(i, items[i]);
+  }
+}
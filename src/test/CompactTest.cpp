@@ -0,0 +1,193 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <random>
+
+#include "Compact.h"
+#include "MDEvent.h"
+
+constexpr size_t ND(3);
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Event = MDEvent<ND, IntT, MortonT>;
+
+/* Generates events with many duplicate Morton numbers */
+void generate_curve(Event::ZCurve &curve, size_t n, size_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<MortonT> mortonDist(0, n / 4);
+  std::uniform_real_distribution<float> signalDist(0.5f, 2.0f);
+  for (size_t i = 0; i < n; i++) {
+    const float signal = signalDist(gen);
+    curve.emplace_back(mortonDist(gen), signal, signal * signal);
+  }
+}
+
+/* Compacts a curve using a map, used as the expected result */
+Event::ZCurve reference_compaction(const Event::ZCurve &curve,
+                                   const MortonT mask) {
+  std::map<MortonT, std::pair<double, double>> sums;
+  for (const auto &event : curve) {
+    auto &sum = sums[event.mortonNumber() & mask];
+    sum.first += event.signal();
+    sum.second += event.errorSquared();
+  }
+
+  Event::ZCurve result;
+  for (const auto &sum : sums) {
+    result.emplace_back(sum.first, sum.second.first, sum.second.second);
+  }
+  return result;
+}
+
+void expect_curves_equal(const Event::ZCurve &expected,
+                         const Event::ZCurve &actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), actual[i].mortonNumber());
+    EXPECT_NEAR(expected[i].signal(), actual[i].signal(),
+                1e-4f * expected[i].signal());
+    EXPECT_NEAR(expected[i].errorSquared(), actual[i].errorSquared(),
+                1e-4f * expected[i].errorSquared());
+  }
+}
+
+TEST(CompactTest, morton_truncation_mask) {
+  EXPECT_EQ(0xFFFFFFFFFFFFFFFF,
+            (morton_truncation_mask<ND, IntT, MortonT>(0)));
+  EXPECT_EQ(0xFFFFFFFFFFFFFFF8,
+            (morton_truncation_mask<ND, IntT, MortonT>(1)));
+  EXPECT_EQ(0xFFFFFFFFFFFFFE00,
+            (morton_truncation_mask<ND, IntT, MortonT>(3)));
+  EXPECT_EQ(0xFFFF000000000000,
+            (morton_truncation_mask<ND, IntT, MortonT>(16)));
+}
+
+TEST(CompactTest, morton_truncation_mask_all_bits) {
+  /* Four axes of 16 bits fill a 64 bit Morton number */
+  EXPECT_EQ(0xFFFFFFFFFFFF0000, (morton_truncation_mask<4, IntT, MortonT>(4)));
+  EXPECT_EQ(0, (morton_truncation_mask<4, IntT, MortonT>(16)));
+
+  EXPECT_THROW((morton_truncation_mask<ND, IntT, MortonT>(17)),
+               std::runtime_error);
+  EXPECT_THROW((morton_truncation_mask<4, IntT, MortonT>(64)),
+               std::runtime_error);
+}
+
+TEST(CompactTest, compact_event_curve) {
+  Event::ZCurve curve;
+  curve.emplace_back(1, 1.0f, 1.0f);
+  curve.emplace_back(1, 2.0f, 4.0f);
+  curve.emplace_back(3, 1.0f, 1.0f);
+  curve.emplace_back(5, 1.0f, 1.0f);
+  curve.emplace_back(5, 1.0f, 1.0f);
+  curve.emplace_back(5, 3.0f, 9.0f);
+
+  compact_event_curve<Event>(curve);
+
+  ASSERT_EQ(3, curve.size());
+  EXPECT_EQ(1, curve[0].mortonNumber());
+  EXPECT_EQ(3.0f, curve[0].signal());
+  EXPECT_EQ(5.0f, curve[0].errorSquared());
+  EXPECT_EQ(3, curve[1].mortonNumber());
+  EXPECT_EQ(1.0f, curve[1].signal());
+  EXPECT_EQ(1.0f, curve[1].errorSquared());
+  EXPECT_EQ(5, curve[2].mortonNumber());
+  EXPECT_EQ(5.0f, curve[2].signal());
+  EXPECT_EQ(11.0f, curve[2].errorSquared());
+}
+
+TEST(CompactTest, compact_event_curve_empty) {
+  Event::ZCurve curve;
+  compact_event_curve<Event>(curve);
+  EXPECT_TRUE(curve.empty());
+}
+
+TEST(CompactTest, compact_event_curve_partitions) {
+  Event::ZCurve curve;
+  generate_curve(curve, 10000, 1);
+  std::sort(curve.begin(), curve.end());
+
+  const auto expected = reference_compaction(curve, ~MortonT(0));
+
+  for (size_t numThreads : {1, 2, 3, 7, 64}) {
+    auto result = curve;
+    compact_event_curve<Event>(result, ~MortonT(0), numThreads);
+    expect_curves_equal(expected, result);
+  }
+}
+
+TEST(CompactTest, compact_event_curve_all_duplicates) {
+  Event::ZCurve curve(1000, Event(42));
+
+  compact_event_curve<Event>(curve, ~MortonT(0), 4);
+
+  ASSERT_EQ(1, curve.size());
+  EXPECT_EQ(42, curve[0].mortonNumber());
+  EXPECT_EQ(1000.0f, curve[0].signal());
+}
+
+TEST(CompactTest, compact_event_curve_lossy) {
+  Event::ZCurve curve;
+  generate_curve(curve, 10000, 2);
+  std::sort(curve.begin(), curve.end());
+
+  const auto mask = morton_truncation_mask<ND, IntT, MortonT>(2);
+  const auto expected = reference_compaction(curve, mask);
+
+  compact_event_curve<Event>(curve, mask, 3);
+
+  expect_curves_equal(expected, curve);
+}
+
+TEST(CompactTest, sort_and_compact_event_curve) {
+  Event::ZCurve curve;
+  generate_curve(curve, 10000, 3);
+
+  const auto expected = reference_compaction(curve, ~MortonT(0));
+
+  sort_and_compact_event_curve<Event>(curve);
+
+  expect_curves_equal(expected, curve);
+}
+
+TEST(CompactTest, merge_event_curves_compacted) {
+  Event::ZCurve a;
+  generate_curve(a, 5000, 4);
+  std::sort(a.begin(), a.end());
+
+  Event::ZCurve b;
+  generate_curve(b, 7000, 5);
+  std::sort(b.begin(), b.end());
+
+  Event::ZCurve all(a);
+  all.insert(all.end(), b.cbegin(), b.cend());
+
+  for (size_t bits : {0, 1, 4}) {
+    const auto mask = morton_truncation_mask<ND, IntT, MortonT>(bits);
+    const auto expected = reference_compaction(all, mask);
+
+    Event::ZCurve curve;
+    merge_event_curves_compacted<Event>(curve, a, b, mask);
+
+    expect_curves_equal(expected, curve);
+  }
+}
@@ -0,0 +1,101 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+
+#include "EventCurveFile.h"
+
+constexpr size_t ND(3);
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Event = MDEvent<ND, IntT, MortonT>;
+
+TEST(EventCurveFileTest, test_write_and_read) {
+  const std::string filename("event_curve_file_test.mdec");
+
+  Event::ZCurve curve;
+  for (MortonT i = 0; i < 1000; i++) {
+    curve.emplace_back(i * 3, (float)i, 0.5f);
+  }
+
+  /* Block size does not divide number of events */
+  write_event_curve_file<ND, IntT, MortonT>(filename, curve, 64);
+
+  EventCurveFileReader<ND, IntT, MortonT> reader(filename);
+  EXPECT_EQ(1000, reader.eventCount());
+  EXPECT_EQ(64, reader.blockSize());
+
+  size_t i(0);
+  for (auto it = reader.begin(); it != reader.end(); ++it) {
+    ASSERT_EQ(curve[i].mortonNumber(), (*it).mortonNumber());
+    ASSERT_EQ(curve[i].signal(), (*it).signal());
+    ASSERT_EQ(curve[i].errorSquared(), (*it).errorSquared());
+    i++;
+  }
+  EXPECT_EQ(1000, i);
+
+  std::remove(filename.c_str());
+}
+
+TEST(EventCurveFileTest, test_read_into_curve) {
+  const std::string filename("event_curve_file_test_read.mdec");
+
+  Event::ZCurve curve{Event(10), Event(30), Event(40)};
+  write_event_curve_file<ND, IntT, MortonT>(filename, curve, 1);
+
+  Event::ZCurve result;
+  read_event_curve_file<ND, IntT, MortonT>(filename, result);
+
+  EXPECT_EQ(3, result.size());
+  EXPECT_EQ(10, result[0].mortonNumber());
+  EXPECT_EQ(30, result[1].mortonNumber());
+  EXPECT_EQ(40, result[2].mortonNumber());
+
+  std::remove(filename.c_str());
+}
+
+TEST(EventCurveFileTest, test_empty_curve) {
+  const std::string filename("event_curve_file_test_empty.mdec");
+
+  write_event_curve_file<ND, IntT, MortonT>(filename, Event::ZCurve(), 16);
+
+  EventCurveFileReader<ND, IntT, MortonT> reader(filename);
+  EXPECT_EQ(0, reader.eventCount());
+  EXPECT_TRUE(reader.begin() == reader.end());
+
+  std::remove(filename.c_str());
+}
+
+TEST(EventCurveFileTest, test_event_type_mismatch) {
+  const std::string filename("event_curve_file_test_mismatch.mdec");
+
+  write_event_curve_file<ND, IntT, MortonT>(filename, Event::ZCurve(), 16);
+
+  using Reader = EventCurveFileReader<ND, uint32_t, uint128_t>;
+  EXPECT_THROW(Reader reader(filename), std::runtime_error);
+
+  std::remove(filename.c_str());
+}
+
+TEST(EventCurveFileTest, test_missing_file) {
+  using Reader = EventCurveFileReader<ND, IntT, MortonT>;
+  EXPECT_THROW(Reader reader("no_such_file.mdec"), std::runtime_error);
+}
@@ -0,0 +1,200 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#include "EventMessage.h"
+#include "EventMessageStream.h"
+
+EventMessage make_test_message(const uint64_t messageId) {
+  return {"test_source",
+          messageId,
+          1000000000 + messageId,
+          {1000, 2500, 20000, 4000000},
+          {1, 5, 2, 99}};
+}
+
+void expect_messages_equal(const EventMessage &expected,
+                           const EventMessage &actual) {
+  EXPECT_EQ(expected.source_name, actual.source_name);
+  EXPECT_EQ(expected.message_id, actual.message_id);
+  EXPECT_EQ(expected.pulse_time, actual.pulse_time);
+  EXPECT_EQ(expected.time_of_flight, actual.time_of_flight);
+  EXPECT_EQ(expected.detector_id, actual.detector_id);
+}
+
+TEST(EventMessageTest, test_serialize_round_trip) {
+  const auto message = make_test_message(7);
+
+  std::vector<char> buffer;
+  serialize_event_message(buffer, message);
+
+  /* Length prefix, identifier, IDs and times, name, count and events */
+  const size_t payloadSize(4 + 16 + 4 + 11 + 4 + 4 * 8);
+  ASSERT_EQ(EventMessageLengthSize + payloadSize, buffer.size());
+  uint32_t size;
+  std::memcpy(&size, buffer.data(), sizeof(size));
+  EXPECT_EQ(payloadSize, size);
+
+  EventMessage result;
+  deserialize_event_message(result, buffer.data() + EventMessageLengthSize,
+                            payloadSize);
+  expect_messages_equal(message, result);
+}
+
+TEST(EventMessageTest, test_serialize_empty_message) {
+  const EventMessage message{"", 0, 0, {}, {}};
+
+  std::vector<char> buffer;
+  serialize_event_message(buffer, message);
+
+  EventMessage result = make_test_message(1);
+  deserialize_event_message(result, buffer.data() + EventMessageLengthSize,
+                            buffer.size() - EventMessageLengthSize);
+  expect_messages_equal(message, result);
+}
+
+TEST(EventMessageTest, test_serialize_mismatched_fields) {
+  auto message = make_test_message(1);
+  message.detector_id.pop_back();
+
+  std::vector<char> buffer;
+  EXPECT_THROW(serialize_event_message(buffer, message), std::runtime_error);
+}
+
+TEST(EventMessageTest, test_deserialize_invalid) {
+  std::vector<char> buffer;
+  serialize_event_message(buffer, make_test_message(1));
+  const char *payload = buffer.data() + EventMessageLengthSize;
+  const size_t payloadSize = buffer.size() - EventMessageLengthSize;
+
+  EventMessage result;
+
+  /* Truncated */
+  EXPECT_THROW(deserialize_event_message(result, payload, payloadSize - 1),
+               std::runtime_error);
+  EXPECT_THROW(deserialize_event_message(result, payload, 10),
+               std::runtime_error);
+
+  /* Trailing data */
+  buffer.push_back(0);
+  EXPECT_THROW(deserialize_event_message(result, payload, payloadSize + 1),
+               std::runtime_error);
+
+  /* Not an ev42 message */
+  buffer[EventMessageLengthSize] = 'x';
+  EXPECT_THROW(deserialize_event_message(result, payload, payloadSize),
+               std::runtime_error);
+}
+
+TEST(EventMessageTest, test_tof_event_conversion) {
+  const TofEventList events{{3, 1234.5f, 2.0, 1.0f}, {8, 20000.0f, 2.0, 1.0f}};
+
+  const auto message = make_event_message("source", 4, 2000000000, events);
+  EXPECT_EQ("source", message.source_name);
+  EXPECT_EQ(4, message.message_id);
+  EXPECT_EQ(std::vector<uint32_t>({1234500, 20000000}),
+            message.time_of_flight);
+  EXPECT_EQ(std::vector<uint32_t>({3, 8}), message.detector_id);
+
+  /* Events are appended */
+  TofEventList result{{1, 1.0f, 0.0, 1.0f}};
+  append_tof_events(result, message);
+  ASSERT_EQ(3, result.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    EXPECT_EQ(events[i].id, result[i + 1].id);
+    EXPECT_FLOAT_EQ(events[i].tof, result[i + 1].tof);
+    EXPECT_DOUBLE_EQ(2.0, result[i + 1].pulse_time);
+    EXPECT_EQ(1.0f, result[i + 1].weight);
+  }
+}
+
+TEST(EventMessageTest, test_replay_file) {
+  const std::string filename("event_message_test.evs");
+
+  {
+    auto writer = create_event_file(filename);
+    for (uint64_t i = 0; i < 3; i++) {
+      writer->write(make_test_message(i));
+    }
+  }
+
+  auto reader = open_event_stream(filename);
+  EventMessage message;
+  for (uint64_t i = 0; i < 3; i++) {
+    ASSERT_TRUE(reader->next(message));
+    expect_messages_equal(make_test_message(i), message);
+  }
+
+  /* Stream stays ended */
+  EXPECT_FALSE(reader->next(message));
+  EXPECT_FALSE(reader->next(message));
+
+  std::remove(filename.c_str());
+}
+
+TEST(EventMessageTest, test_replay_file_truncated) {
+  const std::string filename("event_message_test_truncated.evs");
+
+  {
+    std::vector<char> buffer;
+    serialize_event_message(buffer, make_test_message(0));
+    serialize_event_message(buffer, make_test_message(1));
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    file.write(buffer.data(), buffer.size() - 3);
+  }
+
+  auto reader = open_event_stream(filename);
+  EventMessage message;
+  EXPECT_TRUE(reader->next(message));
+  EXPECT_THROW(reader->next(message), std::runtime_error);
+
+  std::remove(filename.c_str());
+
+  EXPECT_THROW(open_event_stream("no_such_file.evs"), std::runtime_error);
+}
+
+TEST(EventMessageTest, test_tcp_stream) {
+  EventStreamListener listener(0);
+  EXPECT_NE(0, listener.port());
+
+  std::thread publisher([&listener]() {
+    auto writer = listener.accept();
+    for (uint64_t i = 0; i < 3; i++) {
+      writer->write(make_test_message(i));
+    }
+  });
+
+  auto reader = open_event_stream("tcp://localhost:" +
+                                  std::to_string(listener.port()));
+  EventMessage message;
+  for (uint64_t i = 0; i < 3; i++) {
+    ASSERT_TRUE(reader->next(message));
+    expect_messages_equal(make_test_message(i), message);
+  }
+
+  /* Publisher disconnecting ends the stream */
+  publisher.join();
+  EXPECT_FALSE(reader->next(message));
+
+  EXPECT_THROW(open_event_stream("tcp://localhost"), std::runtime_error);
+}
@@ -18,7 +18,14 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iterator>
+#include <random>
+
 #include "EventToMDEventConversion.h"
+#include "TestUtil.h"
 
 TEST(EventToMDEventConversionTest, preprocess_events) {
   // clang-format off
@@ -73,6 +80,76 @@ TEST(EventToMDEventConversionTest, preprocess_events) {
   }
 }
 
+void test_preprocess_events_random(const uint32_t maxId) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<uint32_t> idDist(0, maxId);
+
+  TofEventList events;
+  for (size_t i = 0; i < 10000; i++) {
+    /* TOF is used to record the original order of events */
+    events.push_back(TofEvent{idDist(gen), static_cast<float>(i), 0.0});
+  }
+
+  auto expected(events);
+  std::stable_sort(
+      expected.begin(), expected.end(),
+      [](const TofEvent &a, const TofEvent &b) { return a.id < b.id; });
+
+  const auto info = preprocess_events(events);
+
+  /* Events are sorted by spectrum, keeping their order within each spectrum */
+  ASSERT_EQ(expected.size(), events.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].id, events[i].id);
+    EXPECT_EQ(expected[i].tof, events[i].tof);
+  }
+
+  /* Each range contains all events of a single spectrum */
+  auto it = events.begin();
+  for (const auto &mapping : info.spectrum_to_events) {
+    EXPECT_EQ(it, std::get<1>(mapping));
+    for (; it != std::get<2>(mapping); ++it) {
+      EXPECT_EQ(std::get<0>(mapping), it->id);
+    }
+  }
+  EXPECT_EQ(events.end(), it);
+}
+
+TEST(EventToMDEventConversionTest, preprocess_events_dense) {
+  test_preprocess_events_random(500);
+}
+
+TEST(EventToMDEventConversionTest, preprocess_events_many_spectra) {
+  /* More spectra than events, counted with fewer histograms */
+  test_preprocess_events_random(25000);
+}
+
+TEST(EventToMDEventConversionTest, preprocess_events_sparse) {
+  test_preprocess_events_random(1000000);
+}
+
+TEST(EventToMDEventConversionTest, preprocess_events_stable) {
+  TofEventList events;
+  for (size_t i = 0; i < 1000; i++) {
+    events.push_back(TofEvent{static_cast<uint32_t>(i % 7),
+                              static_cast<float>(i), 0.0});
+  }
+
+  preprocess_events(events);
+
+  for (size_t i = 1; i < events.size(); i++) {
+    if (events[i].id == events[i - 1].id) {
+      EXPECT_LT(events[i - 1].tof, events[i].tof);
+    }
+  }
+}
+
+TEST(EventToMDEventConversionTest, preprocess_events_empty) {
+  TofEventList events;
+  const auto info = preprocess_events(events);
+  EXPECT_TRUE(info.spectrum_to_events.empty());
+}
+
 TEST(EventToMDEventConversionTest, convert_events) {
   // clang-format off
   TofEventList events{
@@ -116,3 +193,363 @@ TEST(EventToMDEventConversionTest, convert_events) {
 
   convert_events(mdEvents, events, convInfo, inst, space);
 }
+
+TEST(EventToMDEventConversionTest, convert_events_output_order) {
+  // clang-format off
+  TofEventList events{
+    TofEvent{5, 6000.0f, 0.0},
+    TofEvent{2, 6000.0f, 0.0},
+    TofEvent{1, 3000.0f, 0.0},
+    TofEvent{5, 7000.0f, 0.0},
+    TofEvent{2, 1.0f, 0.0},
+    TofEvent{1, 6000.0f, 0.0},
+  };
+  // clang-format on
+
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+
+  Instrument inst{Eigen::Vector3f(0.0f, 0.0f, 0.0f),
+                  Eigen::Vector3f(0.0f, 0.0f, -1.5f),
+                  {
+                      {10, Detector{Eigen::Vector3f(-1.0f, 0.0f, 1.0f)}},
+                      {20, Detector{Eigen::Vector3f(-0.5f, 0.0f, 1.0f)}},
+                      {50, Detector{Eigen::Vector3f(1.0f, 0.0f, 1.0f)}},
+                  },
+                  {
+                      {1, {10}}, {2, {20}}, {5, {50}},
+                  }};
+
+  MDSpaceBounds<3> space;
+  // clang-format off
+  space <<
+    -10.0f, 10.0f,
+    -10.0f, 10.0f,
+    -10.0f, 10.0f;
+  // clang-format on
+
+  using Event = MDEvent<3, uint16_t, uint64_t>;
+
+  /* Existing events are kept */
+  std::vector<Event> mdEvents{Event(42)};
+
+  convert_events(mdEvents, events, convInfo, inst, space);
+
+  /* The event with a TOF of 1 is outside of the MD space */
+  ASSERT_EQ(6, mdEvents.size());
+  EXPECT_EQ(42, mdEvents[0].mortonNumber());
+
+  /* Events are in spectrum order, in the same order as when each spectrum is
+   * converted individually */
+  std::vector<Event> expected;
+  for (const specid_t specId : {1, 2, 5}) {
+    TofEventList spectrumEvents;
+    std::copy_if(events.cbegin(), events.cend(),
+                 std::back_inserter(spectrumEvents),
+                 [specId](const TofEvent &e) { return e.id == specId; });
+    convert_events(expected, spectrumEvents, convInfo, inst, space);
+  }
+
+  ASSERT_EQ(5, expected.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), mdEvents[i + 1].mortonNumber());
+  }
+}
+
+Instrument make_plan_test_instrument() {
+  return Instrument{Eigen::Vector3f(0.0f, 0.0f, 0.0f),
+                    Eigen::Vector3f(0.0f, 0.0f, -1.5f),
+                    {
+                        {10, Detector{Eigen::Vector3f(-1.0f, 0.0f, 1.0f)}},
+                        {20, Detector{Eigen::Vector3f(-0.5f, 0.0f, 1.0f)}},
+                        {50, Detector{Eigen::Vector3f(1.0f, 0.0f, 1.0f)}},
+                    },
+                    {
+                        {1, {10}}, {2, {20, 50}}, {4, {40}}, {5, {50}},
+                    }};
+}
+
+TEST(EventToMDEventConversionTest, create_conversion_plan) {
+  const auto inst = make_plan_test_instrument();
+
+  Eigen::Matrix3f ub;
+  ub << 0.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 2.0f;
+  const ConversionInfo convInfo{true, ub};
+
+  const auto plan = create_conversion_plan(inst, convInfo);
+
+  ASSERT_EQ(6, plan.spectrum_index.size());
+  EXPECT_EQ(ConversionPlan::NoSpectrum, plan.spectrum_index[0]);
+  EXPECT_EQ(ConversionPlan::NoSpectrum, plan.spectrum_index[3]);
+
+  /* Spectrum 4 has a detector that is not in the instrument */
+  EXPECT_EQ(ConversionPlan::NoSpectrum, plan.spectrum_index[4]);
+  EXPECT_THROW(get_spectrum_index(plan, 4), std::runtime_error);
+  EXPECT_THROW(get_spectrum_index(plan, 6), std::runtime_error);
+
+  EXPECT_EQ(3, plan.q_direction.size());
+  EXPECT_EQ(3, plan.conversion_factor.size());
+  EXPECT_EQ(3, plan.sin_theta_squared.size());
+
+  const auto l1 = get_l1(inst);
+  const Eigen::Vector3f beamDirection = get_beam_direction(inst);
+
+  for (const specid_t specId : {1, 2, 5}) {
+    const auto idx = get_spectrum_index(plan, specId);
+    const auto &detIds = inst.spectrum_detector_mapping.at(specId);
+
+    const Eigen::Vector3f qDir =
+        ub * (beamDirection - get_detector_direction(inst, detIds));
+    EXPECT_TRUE(qDir.isApprox(plan.q_direction[idx]));
+
+    const double conversionFactor =
+        (NeutronMass * (l1 + get_l2(inst, detIds)) * 1e-10) / (1e-6 * h_bar);
+    EXPECT_DOUBLE_EQ(conversionFactor, plan.conversion_factor[idx]);
+
+    const double sinTheta = sin(get_detector_two_theta(inst, detIds));
+    EXPECT_DOUBLE_EQ(sinTheta * sinTheta, plan.sin_theta_squared[idx]);
+  }
+}
+
+TEST(EventToMDEventConversionTest, convert_events_with_plan) {
+  // clang-format off
+  TofEventList events{
+    TofEvent{5, 6000.0f, 0.0, 1.0f},
+    TofEvent{2, 6000.0f, 0.0, 0.5f},
+    TofEvent{1, 3000.0f, 0.0, 2.0f},
+    TofEvent{5, 7000.0f, 0.0, 0.25f},
+    TofEvent{1, 6000.0f, 0.0, 3.0f},
+  };
+  // clang-format on
+
+  const auto inst = make_plan_test_instrument();
+
+  /* Signal is the event weight with the Lorentz correction (sin^2 of the
+   * scattering angle times the fourth power of the wavenumber) applied */
+  std::vector<float> expectedSignals;
+  const auto l1 = get_l1(inst);
+  for (const auto &event : events) {
+    const auto &detIds = inst.spectrum_detector_mapping.at(event.id);
+    const double wavenumber =
+        (NeutronMass * (l1 + get_l2(inst, detIds)) * 1e-10) /
+        (1e-6 * h_bar) / event.tof;
+    const double sinTheta = sin(get_detector_two_theta(inst, detIds));
+    expectedSignals.push_back(event.weight * sinTheta * sinTheta *
+                              std::pow(wavenumber, 4));
+  }
+  std::sort(expectedSignals.begin(), expectedSignals.end());
+  const ConversionInfo convInfo{true, Eigen::Matrix3f::Identity()};
+
+  MDSpaceBounds<3> space;
+  // clang-format off
+  space <<
+    -10.0f, 10.0f,
+    -10.0f, 10.0f,
+    -10.0f, 10.0f;
+  // clang-format on
+
+  using Event = MDEvent<3, uint16_t, uint64_t>;
+
+  std::vector<Event> expected;
+  convert_events(expected, events, convInfo, inst, space);
+
+  /* The same plan can be used for multiple conversions */
+  const auto plan = create_conversion_plan(inst, convInfo);
+  for (size_t i = 0; i < 2; i++) {
+    std::vector<Event> mdEvents;
+    convert_events(mdEvents, events, plan, space);
+
+    ASSERT_EQ(expected.size(), mdEvents.size());
+    for (size_t j = 0; j < expected.size(); j++) {
+      EXPECT_EQ(expected[j].mortonNumber(), mdEvents[j].mortonNumber());
+      EXPECT_EQ(expected[j].signal(), mdEvents[j].signal());
+    }
+
+    /* Output is grouped by spectrum, so compare signals in sorted order */
+    std::vector<float> signals;
+    for (const auto &event : mdEvents) {
+      signals.push_back(event.signal());
+    }
+    std::sort(signals.begin(), signals.end());
+    ASSERT_EQ(expectedSignals.size(), signals.size());
+    for (size_t j = 0; j < signals.size(); j++) {
+      EXPECT_FLOAT_EQ(expectedSignals[j], signals[j]);
+    }
+  }
+
+  /* Without the Lorentz correction the signal is the event weight */
+  {
+    const auto uncorrectedPlan = create_conversion_plan(
+        inst, ConversionInfo{false, Eigen::Matrix3f::Identity()});
+    std::vector<Event> mdEvents;
+    convert_events(mdEvents, events, uncorrectedPlan, space);
+
+    std::vector<float> signals;
+    for (const auto &event : mdEvents) {
+      signals.push_back(event.signal());
+    }
+    std::sort(signals.begin(), signals.end());
+    EXPECT_EQ(std::vector<float>({0.25f, 0.5f, 1.0f, 2.0f, 3.0f}), signals);
+  }
+
+  /* Events from spectra without conversion parameters cannot be converted */
+  events.push_back(TofEvent{4, 6000.0f, 0.0});
+  std::vector<Event> mdEvents;
+  EXPECT_THROW(convert_events(mdEvents, events, plan, space),
+               std::runtime_error);
+}
+
+TEST(EventToMDEventConversionTest, save_and_load_conversion_plan) {
+  const auto inst = make_plan_test_instrument();
+
+  Eigen::Matrix3f ub;
+  ub << 0.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 2.0f;
+  const auto plan = create_conversion_plan(inst, {true, ub});
+
+  const std::string filename("conversion_plan_test.bin");
+  save_conversion_plan(plan, filename);
+
+  ConversionPlan loadedPlan;
+  load_conversion_plan(loadedPlan, filename);
+  std::remove(filename.c_str());
+
+  EXPECT_TRUE(loadedPlan.conversion_info.lorentz_correction);
+  EXPECT_EQ(ub, loadedPlan.conversion_info.ub_matrix);
+  EXPECT_EQ(instrument_hash(inst), loadedPlan.instrument_hash);
+  EXPECT_EQ(plan.spectrum_index, loadedPlan.spectrum_index);
+  EXPECT_EQ(plan.q_direction, loadedPlan.q_direction);
+  EXPECT_EQ(plan.conversion_factor, loadedPlan.conversion_factor);
+  EXPECT_EQ(plan.sin_theta_squared, loadedPlan.sin_theta_squared);
+}
+
+TEST(EventToMDEventConversionTest, load_conversion_plan_invalid_file) {
+  ConversionPlan plan;
+  EXPECT_THROW(load_conversion_plan(plan, "does_not_exist.bin"),
+               std::runtime_error);
+}
+
+template <typename IntT, typename MortonT>
+void test_convert_events_bucketed(const size_t bucketBits) {
+  using Event = MDEvent<3, IntT, MortonT>;
+
+  std::mt19937 gen(1);
+  TofEventList events;
+  std::uniform_int_distribution<uint32_t> specDist(0, 99);
+  std::uniform_real_distribution<float> tofDist(1000.0f, 20000.0f);
+  for (size_t i = 0; i < 10000; i++) {
+    events.push_back(TofEvent{specDist(gen), tofDist(gen), 0.0, 1.0f});
+  }
+
+  const auto space = make_test_space();
+  const auto plan = create_conversion_plan(make_random_test_instrument(),
+                                           {true, Eigen::Matrix3f::Identity()});
+
+  std::vector<Event> expected;
+  {
+    auto tofEvents(events);
+    convert_events(expected, tofEvents, plan, space);
+    std::sort(expected.begin(), expected.end());
+  }
+
+  /* Existing events are kept and not sorted */
+  std::vector<Event> mdEvents{Event(42), Event(1)};
+  const auto bucketOffsets =
+      convert_events_bucketed(mdEvents, events, plan, space, bucketBits);
+
+  ASSERT_EQ((1 << bucketBits) + 1, bucketOffsets.size());
+  EXPECT_EQ(2, bucketOffsets.front());
+  EXPECT_EQ(mdEvents.size(), bucketOffsets.back());
+
+  sort_event_buckets(mdEvents, bucketOffsets);
+
+  ASSERT_EQ(expected.size() + 2, mdEvents.size());
+  EXPECT_EQ(42, mdEvents[0].mortonNumber());
+  EXPECT_EQ(1, mdEvents[1].mortonNumber());
+
+  EXPECT_TRUE(std::is_sorted(mdEvents.cbegin() + 2, mdEvents.cend()));
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), mdEvents[i + 2].mortonNumber());
+  }
+}
+
+TEST(EventToMDEventConversionTest, convert_events_bucketed) {
+  test_convert_events_bucketed<uint16_t, uint64_t>(0);
+  test_convert_events_bucketed<uint16_t, uint64_t>(3);
+  test_convert_events_bucketed<uint16_t, uint64_t>(9);
+  test_convert_events_bucketed<uint16_t, uint64_t>(12);
+  test_convert_events_bucketed<uint8_t, uint32_t>(6);
+  test_convert_events_bucketed<uint32_t, uint128_t>(9);
+}
+
+TEST(EventToMDEventConversionTest, convert_events_bucketed_too_many_bits) {
+  const auto inst = make_plan_test_instrument();
+  const auto plan =
+      create_conversion_plan(inst, {false, Eigen::Matrix3f::Identity()});
+
+  TofEventList events{TofEvent{1, 6000.0f, 0.0}};
+
+  MDSpaceBounds<3> space;
+  // clang-format off
+  space <<
+    -10.0f, 10.0f,
+    -10.0f, 10.0f,
+    -10.0f, 10.0f;
+  // clang-format on
+
+  std::vector<MDEvent<3, uint8_t, uint32_t>> mdEvents;
+  EXPECT_THROW(convert_events_bucketed(mdEvents, events, plan, space, 25),
+               std::runtime_error);
+}
+
+template <typename IntT, typename MortonT>
+void test_convert_events_vectorised(const bool lorentzCorrection) {
+  using Event = MDEvent<3, IntT, MortonT>;
+
+  const auto inst = make_random_test_instrument(50, 2);
+
+  /* Spectra have event counts that are not multiples of the batch size */
+  std::mt19937 gen(2);
+  TofEventList events;
+  std::uniform_int_distribution<uint32_t> specDist(0, 49);
+  std::uniform_real_distribution<float> tofDist(1000.0f, 20000.0f);
+  std::uniform_real_distribution<float> weightDist(0.5f, 2.0f);
+  for (size_t i = 0; i < 5003; i++) {
+    events.push_back(
+        TofEvent{specDist(gen), tofDist(gen), 0.0, weightDist(gen)});
+  }
+
+  MDSpaceBounds<3> space;
+  // clang-format off
+  space <<
+    -5.0f, 5.0f,
+    -4.0f, 6.0f,
+    -5.0f, 3.0f;
+  // clang-format on
+
+  const auto plan = create_conversion_plan(
+      inst, {lorentzCorrection, Eigen::Matrix3f::Identity()});
+
+  std::vector<Event> expected;
+  {
+    auto tofEvents(events);
+    convert_events(expected, tofEvents, plan, space);
+  }
+
+  std::vector<Event> mdEvents;
+  convert_events<IntT, MortonT, VectorisedSpectrumConverter>(mdEvents, events,
+                                                             plan, space);
+
+  ASSERT_EQ(expected.size(), mdEvents.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), mdEvents[i].mortonNumber());
+    EXPECT_EQ(expected[i].signal(), mdEvents[i].signal());
+    EXPECT_EQ(expected[i].errorSquared(), mdEvents[i].errorSquared());
+  }
+}
+
+TEST(EventToMDEventConversionTest, convert_events_vectorised) {
+  test_convert_events_vectorised<uint8_t, uint32_t>(false);
+  test_convert_events_vectorised<uint16_t, uint64_t>(false);
+  test_convert_events_vectorised<uint16_t, uint64_t>(true);
+  test_convert_events_vectorised<uint32_t, uint128_t>(true);
+  test_convert_events_vectorised<uint64_t, uint256_t>(true);
+}
@@ -0,0 +1,294 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include "InelasticConversion.h"
+#include "TestUtil.h"
+
+/**
+ * Gets the TOF (in microseconds) of a neutron travelling a given distance at a
+ * given energy.
+ */
+double flight_time(const double distance, const double energy) {
+  return 1e6 * distance / std::sqrt(2.0 * energy * meV / NeutronMass);
+}
+
+Instrument make_inelastic_test_instrument() {
+  Instrument inst;
+  inst.sample_position = Eigen::Vector3f(0.0f, 0.0f, 0.0f);
+  inst.source_position = Eigen::Vector3f(0.0f, 0.0f, -10.0f);
+  inst.detectors.add(0, Eigen::Vector3f(2.0f, 0.0f, 0.0f));
+  inst.detectors.add(1, Eigen::Vector3f(0.0f, 0.0f, 4.0f));
+  generate_1_to_1_spec_det_mapping(inst);
+  return inst;
+}
+
+MDSpaceBounds<4> inelastic_test_space() {
+  MDSpaceBounds<4> space;
+  // clang-format off
+  space <<
+    -10.0f, 10.0f,
+    -10.0f, 10.0f,
+    -10.0f, 10.0f,
+    -60.0f, 60.0f;
+  // clang-format on
+  return space;
+}
+
+void expect_event_coordinates(const MDEvent<4, uint16_t, uint64_t> &event,
+                              const MDSpaceBounds<4> &space,
+                              const Eigen::Vector3f &q, const float de) {
+  const auto coord = event.coordinates(space);
+  EXPECT_NEAR(q[0], coord[0], 1e-3f);
+  EXPECT_NEAR(q[1], coord[1], 1e-3f);
+  EXPECT_NEAR(q[2], coord[2], 1e-3f);
+  EXPECT_NEAR(de, coord[3], 1e-2f);
+}
+
+TEST(InelasticConversionTest, wavenumber_squared_to_energy) {
+  /* 81.8 meV for a wavelength of 1 Angstrom */
+  EXPECT_NEAR(81.8042,
+              WavenumberSquaredToEnergy * (2.0 * M_PI) * (2.0 * M_PI), 1e-3);
+}
+
+TEST(InelasticConversionTest, convert_events_direct) {
+  const auto inst = make_inelastic_test_instrument();
+
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  convInfo.energy_mode = EnergyTransferMode::Direct;
+  convInfo.fixed_energy = 50.0;
+  const auto plan = create_conversion_plan(inst, convInfo);
+
+  const double ki = std::sqrt(50.0 / WavenumberSquaredToEnergy);
+  const double kf = std::sqrt(20.0 / WavenumberSquaredToEnergy);
+  const double l1Time = flight_time(10.0, 50.0);
+
+  TofEventList events{
+      /* Elastic */
+      TofEvent{0, static_cast<float>(l1Time + flight_time(2.0, 50.0)), 0.0,
+               1.0f},
+      /* 30 meV energy transfer */
+      TofEvent{0, static_cast<float>(l1Time + flight_time(2.0, 20.0)), 0.0,
+               2.0f},
+      /* Forward scattering, 30 meV energy transfer */
+      TofEvent{1, static_cast<float>(l1Time + flight_time(4.0, 20.0)), 0.0,
+               3.0f},
+      /* Before the incident neutrons reach the sample */
+      TofEvent{1, static_cast<float>(0.5 * l1Time), 0.0, 1.0f},
+  };
+
+  const auto space = inelastic_test_space();
+
+  std::vector<MDEvent<4, uint16_t, uint64_t>> mdEvents;
+  convert_events_inelastic(mdEvents, events, plan, space);
+
+  ASSERT_EQ(3, mdEvents.size());
+
+  expect_event_coordinates(mdEvents[0], space,
+                           Eigen::Vector3f(-ki, 0.0f, ki), 0.0f);
+  EXPECT_EQ(1.0f, mdEvents[0].signal());
+
+  expect_event_coordinates(mdEvents[1], space,
+                           Eigen::Vector3f(-kf, 0.0f, ki), 30.0f);
+  EXPECT_EQ(2.0f, mdEvents[1].signal());
+
+  expect_event_coordinates(mdEvents[2], space,
+                           Eigen::Vector3f(0.0f, 0.0f, ki - kf), 30.0f);
+  EXPECT_EQ(3.0f, mdEvents[2].signal());
+}
+
+TEST(InelasticConversionTest, convert_events_indirect) {
+  const auto inst = make_inelastic_test_instrument();
+
+  /* Detector 0 has its own final energy, detector 1 uses the default */
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  convInfo.energy_mode = EnergyTransferMode::Indirect;
+  convInfo.fixed_energy = 5.0;
+  convInfo.detector_fixed_energies[0] = 3.6;
+  const auto plan = create_conversion_plan(inst, convInfo);
+
+  EXPECT_DOUBLE_EQ(3.6, plan.fixed_energy[get_spectrum_index(plan, 0)]);
+  EXPECT_DOUBLE_EQ(5.0, plan.fixed_energy[get_spectrum_index(plan, 1)]);
+
+  TofEventList events{
+      TofEvent{0,
+               static_cast<float>(flight_time(10.0, 10.0) +
+                                  flight_time(2.0, 3.6)),
+               0.0, 1.0f},
+      TofEvent{1,
+               static_cast<float>(flight_time(10.0, 10.0) +
+                                  flight_time(4.0, 5.0)),
+               0.0, 1.0f},
+  };
+
+  const auto space = inelastic_test_space();
+
+  std::vector<MDEvent<4, uint16_t, uint64_t>> mdEvents;
+  convert_events_inelastic(mdEvents, events, plan, space);
+
+  ASSERT_EQ(2, mdEvents.size());
+
+  const float ki = std::sqrt(10.0 / WavenumberSquaredToEnergy);
+  const float kf0 = std::sqrt(3.6 / WavenumberSquaredToEnergy);
+  const float kf1 = std::sqrt(5.0 / WavenumberSquaredToEnergy);
+
+  expect_event_coordinates(mdEvents[0], space,
+                           Eigen::Vector3f(-kf0, 0.0f, ki), 6.4f);
+  expect_event_coordinates(mdEvents[1], space,
+                           Eigen::Vector3f(0.0f, 0.0f, ki - kf1), 5.0f);
+}
+
+template <typename IntT, typename MortonT>
+void test_vectorised_inelastic_conversion(const EnergyTransferMode mode) {
+  using Event = MDEvent<4, IntT, MortonT>;
+
+  const auto inst = make_random_test_instrument();
+
+  /* Some events arrive too early, or fall outside of the MD space */
+  std::mt19937 gen(1);
+  TofEventList events;
+  std::uniform_int_distribution<uint32_t> specDist(0, 99);
+  std::uniform_real_distribution<float> tofDist(500.0f, 20000.0f);
+  std::uniform_real_distribution<float> weightDist(0.5f, 2.0f);
+  for (size_t i = 0; i < 10000; i++) {
+    events.push_back(
+        TofEvent{specDist(gen), tofDist(gen), 0.0, weightDist(gen)});
+  }
+
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  convInfo.energy_mode = mode;
+  convInfo.fixed_energy = mode == EnergyTransferMode::Direct ? 100.0 : 4.0;
+  const auto plan = create_conversion_plan(inst, convInfo);
+
+  const auto space = inelastic_test_space();
+
+  std::vector<Event> expected;
+  {
+    auto tofEvents(events);
+    convert_events_inelastic<IntT, MortonT, ScalarInelasticSpectrumConverter>(
+        expected, tofEvents, plan, space);
+  }
+  EXPECT_LT(0, expected.size());
+  EXPECT_GT(events.size(), expected.size());
+
+  std::vector<Event> mdEvents;
+  convert_events_inelastic<IntT, MortonT,
+                           VectorisedInelasticSpectrumConverter>(
+      mdEvents, events, plan, space);
+
+  ASSERT_EQ(expected.size(), mdEvents.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), mdEvents[i].mortonNumber());
+    EXPECT_EQ(expected[i].signal(), mdEvents[i].signal());
+  }
+}
+
+TEST(InelasticConversionTest, vectorised_direct) {
+  test_vectorised_inelastic_conversion<uint16_t, uint64_t>(
+      EnergyTransferMode::Direct);
+  test_vectorised_inelastic_conversion<uint32_t, uint128_t>(
+      EnergyTransferMode::Direct);
+  test_vectorised_inelastic_conversion<uint64_t, uint256_t>(
+      EnergyTransferMode::Direct);
+}
+
+TEST(InelasticConversionTest, vectorised_indirect) {
+  test_vectorised_inelastic_conversion<uint16_t, uint64_t>(
+      EnergyTransferMode::Indirect);
+  test_vectorised_inelastic_conversion<uint32_t, uint128_t>(
+      EnergyTransferMode::Indirect);
+  test_vectorised_inelastic_conversion<uint64_t, uint256_t>(
+      EnergyTransferMode::Indirect);
+}
+
+TEST(InelasticConversionTest, create_conversion_plan_invalid) {
+  const auto inst = make_inelastic_test_instrument();
+
+  /* No fixed energy */
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  convInfo.energy_mode = EnergyTransferMode::Direct;
+  EXPECT_THROW(create_conversion_plan(inst, convInfo), std::runtime_error);
+
+  /* No fixed energy for one detector */
+  convInfo.energy_mode = EnergyTransferMode::Indirect;
+  convInfo.detector_fixed_energies[0] = 3.6;
+  EXPECT_THROW(create_conversion_plan(inst, convInfo), std::runtime_error);
+
+  /* Lorentz correction */
+  convInfo.fixed_energy = 5.0;
+  EXPECT_NO_THROW(create_conversion_plan(inst, convInfo));
+  convInfo.lorentz_correction = true;
+  EXPECT_THROW(create_conversion_plan(inst, convInfo), std::runtime_error);
+}
+
+TEST(InelasticConversionTest, conversion_mode_mismatch) {
+  const auto inst = make_inelastic_test_instrument();
+
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  const auto elasticPlan = create_conversion_plan(inst, convInfo);
+
+  convInfo.energy_mode = EnergyTransferMode::Direct;
+  convInfo.fixed_energy = 50.0;
+  const auto inelasticPlan = create_conversion_plan(inst, convInfo);
+
+  TofEventList events{TofEvent{0, 6000.0f, 0.0}};
+
+  MDSpaceBounds<3> space;
+  space << -10.0f, 10.0f, -10.0f, 10.0f, -10.0f, 10.0f;
+
+  std::vector<MDEvent<3, uint16_t, uint64_t>> mdEvents;
+  EXPECT_THROW(convert_events(mdEvents, events, inelasticPlan, space),
+               std::runtime_error);
+
+  std::vector<MDEvent<4, uint16_t, uint64_t>> mdEvents4;
+  EXPECT_THROW(convert_events_inelastic(mdEvents4, events, elasticPlan,
+                                        inelastic_test_space()),
+               std::runtime_error);
+}
+
+TEST(InelasticConversionTest, save_load_conversion_plan) {
+  const auto inst = make_inelastic_test_instrument();
+
+  ConversionInfo convInfo{false, Eigen::Matrix3f::Identity()};
+  convInfo.energy_mode = EnergyTransferMode::Indirect;
+  convInfo.fixed_energy = 5.0;
+  convInfo.detector_fixed_energies[0] = 3.6;
+  const auto plan = create_conversion_plan(inst, convInfo);
+
+  const std::string filename("inelastic_conversion_plan_test.bin");
+  save_conversion_plan(plan, filename);
+
+  ConversionPlan loaded;
+  load_conversion_plan(loaded, filename);
+  std::remove(filename.c_str());
+
+  EXPECT_EQ(EnergyTransferMode::Indirect, loaded.conversion_info.energy_mode);
+  EXPECT_EQ(5.0, loaded.conversion_info.fixed_energy);
+  EXPECT_EQ(plan.spectrum_index, loaded.spectrum_index);
+  EXPECT_EQ(plan.conversion_factor, loaded.conversion_factor);
+  EXPECT_EQ(plan.incident_direction, loaded.incident_direction);
+  EXPECT_EQ(plan.final_direction, loaded.final_direction);
+  EXPECT_EQ(plan.fixed_energy, loaded.fixed_energy);
+  EXPECT_EQ(plan.fixed_wavenumber, loaded.fixed_wavenumber);
+  EXPECT_EQ(plan.fixed_time, loaded.fixed_time);
+}
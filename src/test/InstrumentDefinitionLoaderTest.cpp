@@ -0,0 +1,273 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+#include "InstrumentDefinitionLoader.h"
+
+static void write_file(const std::string &filename,
+                       const std::string &content) {
+  std::ofstream file(filename, std::ios::trunc);
+  file << content;
+}
+
+static void expect_detector(const Instrument &inst, const detid_t id,
+                            const Eigen::Vector3f &position) {
+  const size_t index(inst.detectors.index(id));
+  ASSERT_NE(Detectors::NoDetector, index) << "Detector " << id;
+  EXPECT_NEAR(position[0], inst.detectors.position(index)[0], 1e-5f);
+  EXPECT_NEAR(position[1], inst.detectors.position(index)[1], 1e-5f);
+  EXPECT_NEAR(position[2], inst.detectors.position(index)[2], 1e-5f);
+}
+
+static const std::string TestDefinition(R"(<?xml version="1.0"?>
+<instrument name="TEST">
+  <defaults>
+    <length unit="metre"/>
+    <angle unit="degree"/>
+  </defaults>
+  <component type="moderator"><location z="-10.0"/></component>
+  <type name="moderator" is="Source"/>
+  <component type="sample-position"><location z="0.5"/></component>
+  <type name="sample-position" is="SamplePos"/>
+  <component type="monitors" idlist="monitors"><location/></component>
+  <type name="monitors">
+    <component type="monitor"><location z="-1.0"/></component>
+  </type>
+  <type name="monitor" is="monitor"/>
+  <component type="bank" idlist="bank">
+    <location x="1.0" rot="90" axis-x="0" axis-y="1" axis-z="0">
+      <rot val="90"/>
+    </location>
+    <location r="2.0" t="90" p="90"/>
+  </component>
+  <type name="bank">
+    <component type="pixel">
+      <location x="0.1"/>
+      <location y="0.1"/>
+    </component>
+  </type>
+  <type name="pixel" is="detector"/>
+  <component type="panel" idstart="100" idfillbyfirst="y" idstepbyrow="10">
+    <location z="2.0"/>
+  </component>
+  <component type="panel" idstart="200" idfillbyfirst="x" idstepbyrow="10">
+    <location z="3.0"/>
+  </component>
+  <type name="panel" is="rectangular_detector" type="pixel"
+      xpixels="2" xstart="-0.5" xstep="1.0"
+      ypixels="3" ystart="0.0" ystep="0.1"/>
+  <idlist idname="monitors"><id val="-1"/></idlist>
+  <idlist idname="bank"><id start="10" end="12"/><id val="20"/></idlist>
+</instrument>
+)");
+
+TEST(InstrumentDefinitionLoaderTest, test_load) {
+  const std::string filename("idf_loader_test.xml");
+  write_file(filename, TestDefinition);
+
+  Instrument inst;
+  load_instrument_definition(inst, filename);
+  std::remove(filename.c_str());
+
+  EXPECT_EQ(Eigen::Vector3f(0.0f, 0.0f, -10.0f), inst.source_position);
+  EXPECT_EQ(Eigen::Vector3f(0.0f, 0.0f, 0.5f), inst.sample_position);
+
+  /* Monitors are not detectors */
+  EXPECT_EQ(16, inst.detectors.size());
+
+  /* ID list, rot attribute and nested rot element */
+  expect_detector(inst, 10, Eigen::Vector3f(1.0f, 0.1f, 0.0f));
+  expect_detector(inst, 11, Eigen::Vector3f(1.0f, 0.0f, 0.1f));
+
+  /* Spherical location */
+  expect_detector(inst, 12, Eigen::Vector3f(0.1f, 2.0f, 0.0f));
+  expect_detector(inst, 20, Eigen::Vector3f(0.0f, 2.1f, 0.0f));
+
+  /* Rectangular detector filled by y first */
+  expect_detector(inst, 100, Eigen::Vector3f(-0.5f, 0.0f, 2.0f));
+  expect_detector(inst, 102, Eigen::Vector3f(-0.5f, 0.2f, 2.0f));
+  expect_detector(inst, 110, Eigen::Vector3f(0.5f, 0.0f, 2.0f));
+  expect_detector(inst, 112, Eigen::Vector3f(0.5f, 0.2f, 2.0f));
+
+  /* Rectangular detector filled by x first */
+  expect_detector(inst, 200, Eigen::Vector3f(-0.5f, 0.0f, 3.0f));
+  expect_detector(inst, 201, Eigen::Vector3f(0.5f, 0.0f, 3.0f));
+  expect_detector(inst, 210, Eigen::Vector3f(-0.5f, 0.1f, 3.0f));
+  expect_detector(inst, 221, Eigen::Vector3f(0.5f, 0.2f, 3.0f));
+}
+
+TEST(InstrumentDefinitionLoaderTest, test_load_facing) {
+  const std::string filename("idf_loader_test_facing.xml");
+  write_file(filename, R"(<?xml version="1.0"?>
+<instrument name="TEST">
+  <defaults>
+    <components-are-facing x="0.0" y="0.0" z="0.0"/>
+  </defaults>
+  <component type="moderator"><location z="-10.0"/></component>
+  <type name="moderator" is="Source"/>
+  <component type="sample-position"><location/></component>
+  <type name="sample-position" is="SamplePos"/>
+  <component type="tube" idlist="tubes">
+    <location x="1.0"/>
+    <location x="-1.0"><facing val="none"/></location>
+    <location y="-1.0"><facing x="0.0" y="1.0" z="0.0"/></location>
+  </component>
+  <type name="tube">
+    <component type="pixel">
+      <location x="0.2"/>
+      <location z="0.5"/>
+    </component>
+  </type>
+  <type name="pixel" is="detector"/>
+  <idlist idname="tubes"><id start="1" end="6"/></idlist>
+</instrument>
+)");
+
+  Instrument inst;
+  load_instrument_definition(inst, filename);
+  std::remove(filename.c_str());
+
+  ASSERT_EQ(6, inst.detectors.size());
+
+  /* Facing the default point, z axis points away from the point */
+  expect_detector(inst, 1, Eigen::Vector3f(1.0f, 0.0f, -0.2f));
+  expect_detector(inst, 2, Eigen::Vector3f(1.5f, 0.0f, 0.0f));
+
+  /* Not facing */
+  expect_detector(inst, 3, Eigen::Vector3f(-0.8f, 0.0f, 0.0f));
+  expect_detector(inst, 4, Eigen::Vector3f(-1.0f, 0.0f, 0.5f));
+
+  /* Facing a point given in the location */
+  expect_detector(inst, 6, Eigen::Vector3f(0.0f, -1.5f, 0.0f));
+}
+
+TEST(InstrumentDefinitionLoaderTest, test_load_invalid) {
+  const std::string filename("idf_loader_test_invalid.xml");
+  Instrument inst;
+
+  /* Not XML */
+  write_file(filename, "not an instrument definition");
+  EXPECT_THROW(load_instrument_definition(inst, filename), std::runtime_error);
+
+  /* ID list shorter than the number of detectors */
+  std::string definition(TestDefinition);
+  definition.replace(definition.find("<id val=\"20\"/>"), 14, "");
+  write_file(filename, definition);
+  EXPECT_THROW(load_instrument_definition(inst, filename), std::runtime_error);
+
+  /* Undefined type */
+  definition = TestDefinition;
+  definition.replace(definition.find("type=\"bank\""), 11, "type=\"none\"");
+  write_file(filename, definition);
+  EXPECT_THROW(load_instrument_definition(inst, filename), std::runtime_error);
+
+  /* Type containing itself */
+  definition = TestDefinition;
+  definition.replace(definition.find("<component type=\"pixel\">"), 24,
+                     "<component type=\"bank\">");
+  write_file(filename, definition);
+  EXPECT_THROW(load_instrument_definition(inst, filename), std::runtime_error);
+
+  std::remove(filename.c_str());
+
+  EXPECT_THROW(load_instrument_definition(inst, "no_such_file.xml"),
+               std::runtime_error);
+}
+
+TEST(InstrumentDefinitionLoaderTest, test_geometry_cache) {
+  const std::string filename("idf_loader_test_cache.xml");
+  const std::string cacheFilename(filename + ".geometry");
+  write_file(filename, TestDefinition);
+  std::remove(cacheFilename.c_str());
+
+  Instrument inst;
+  load_instrument_definition(inst, filename, cacheFilename);
+  EXPECT_TRUE(std::ifstream(cacheFilename).good());
+
+  /* Geometry is read from the cache while the definition is unchanged */
+  Instrument cachedInst;
+  load_instrument_definition(cachedInst, filename, cacheFilename);
+  EXPECT_EQ(inst.source_position, cachedInst.source_position);
+  EXPECT_EQ(inst.sample_position, cachedInst.sample_position);
+  EXPECT_EQ(inst.detectors.ids(), cachedInst.detectors.ids());
+  EXPECT_EQ(inst.detectors.x(), cachedInst.detectors.x());
+  EXPECT_EQ(inst.detectors.y(), cachedInst.detectors.y());
+  EXPECT_EQ(inst.detectors.z(), cachedInst.detectors.z());
+
+  /* Changing the definition invalidates the cache */
+  std::string definition(TestDefinition);
+  definition.replace(definition.find("z=\"-10.0\""), 9, "z=\"-20.0\"");
+  write_file(filename, definition);
+  load_instrument_definition(cachedInst, filename, cacheFilename);
+  EXPECT_EQ(Eigen::Vector3f(0.0f, 0.0f, -20.0f), cachedInst.source_position);
+  EXPECT_NE(instrument_definition_hash(TestDefinition),
+            instrument_definition_hash(definition));
+
+  std::remove(filename.c_str());
+  std::remove(cacheFilename.c_str());
+}
+
+TEST(InstrumentDefinitionLoaderTest, test_load_WISH) {
+  Instrument inst;
+  load_instrument_definition(inst,
+                             "test_data/idfs/WISH_Definition_10Panels.xml");
+
+  EXPECT_EQ(Eigen::Vector3f(0.0f, 0.0f, -40.0f), inst.source_position);
+  EXPECT_EQ(Eigen::Vector3f(0.0f, 0.0f, 0.0f), inst.sample_position);
+
+  /* 10 panels of 152 tubes of 512 pixels */
+  EXPECT_EQ(10 * 152 * 512, inst.detectors.size());
+
+  /* Same positions as given by Mantid (see InstrumentTest) */
+  expect_detector(inst, 1707000,
+                  Eigen::Vector3f(-0.3863891422122102f, -0.517983f,
+                                  2.169422723964781f));
+  expect_detector(inst, 5400300,
+                  Eigen::Vector3f(-0.9404389225826723f, 0.0889775f,
+                                  -1.992881186268733f));
+}
+
+TEST(InstrumentDefinitionLoaderTest, test_load_SXD) {
+  Instrument inst;
+  load_instrument_definition(inst, "test_data/idfs/SXD_Definition.xml");
+
+  EXPECT_EQ(Eigen::Vector3f(0.0f, 0.0f, -8.3f), inst.source_position);
+
+  /* 11 banks of 64x64 pixels with consecutive IDs */
+  ASSERT_EQ(11 * 64 * 64, inst.detectors.size());
+  EXPECT_EQ(1, inst.detectors.ids().front());
+  EXPECT_EQ(11 * 64 * 64, inst.detectors.ids().back());
+
+  /* First pixels of bank 2, rotated by -90 degrees about y */
+  expect_detector(inst, 4097, Eigen::Vector3f(0.225f, -0.0945f, -0.0945f));
+  expect_detector(inst, 4098, Eigen::Vector3f(0.225f, -0.0915f, -0.0945f));
+  expect_detector(inst, 4097 + 64,
+                  Eigen::Vector3f(0.225f, -0.0945f, -0.0915f));
+}
+
+TEST(InstrumentDefinitionLoaderTest, test_load_TOPAZ) {
+  Instrument inst;
+  load_instrument_definition(inst,
+                             "test_data/idfs/TOPAZ_Definition_2011-01-01.xml");
+
+  /* 14 banks of 256x256 pixels */
+  ASSERT_EQ(14 * 256 * 256, inst.detectors.size());
+
+  /* Bank 17 is perpendicular to its position at 0.455m from the sample, so no
+   * pixel is closer than that and the corners are furthest away */
+  const detid_t firstId(1114112);
+  const float halfDiagonal(std::sqrt(2.0f) * 0.078795f);
+  float minDistance(1.0f);
+  float maxDistance(0.0f);
+  for (detid_t id = firstId; id < firstId + 256 * 256; id++) {
+    const float distance(
+        inst.detectors.position(inst.detectors.index(id)).norm());
+    minDistance = std::min(minDistance, distance);
+    maxDistance = std::max(maxDistance, distance);
+  }
+  EXPECT_NEAR(0.455f, minDistance, 1e-3f);
+  EXPECT_NEAR(std::sqrt(0.455f * 0.455f + halfDiagonal * halfDiagonal),
+              maxDistance, 1e-3f);
+}
@@ -18,7 +18,9 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <sstream>
+#include <stdexcept>
 
 #include "Instrument.h"
 
@@ -117,6 +119,150 @@ TEST(InstrumentTest, test_instrument_generate_1_to_1_spec_det_mapping) {
 
     /* Test detector ID */
     const specid_t expected((i + 1) * 10);
-    EXPECT_EQ(expected, detList.at(0));
+    EXPECT_EQ(expected, detList[0]);
   }
 }
+
+TEST(InstrumentTest, test_detectors) {
+  /* Detectors out of order of detector ID */
+  const Detectors detectors({7, 3, 5},
+                            {7.0f, 0.7f, -7.0f, 3.0f, 0.3f, -3.0f, 5.0f,
+                             0.5f, -5.0f});
+
+  ASSERT_EQ(3, detectors.size());
+  EXPECT_EQ(std::vector<detid_t>({3, 5, 7}), detectors.ids());
+  EXPECT_EQ(std::vector<float>({3.0f, 5.0f, 7.0f}), detectors.x());
+  EXPECT_EQ(std::vector<float>({0.3f, 0.5f, 0.7f}), detectors.y());
+  EXPECT_EQ(std::vector<float>({-3.0f, -5.0f, -7.0f}), detectors.z());
+
+  EXPECT_EQ(0, detectors.index(3));
+  EXPECT_EQ(1, detectors.index(5));
+  EXPECT_EQ(2, detectors.index(7));
+  EXPECT_EQ(Eigen::Vector3f(5.0f, 0.5f, -5.0f), detectors.position(1));
+
+  for (const detid_t detId : {0, 2, 4, 6, 8, 100}) {
+    EXPECT_EQ(Detectors::NoDetector, detectors.index(detId));
+    EXPECT_FALSE(detectors.contains(detId));
+  }
+}
+
+TEST(InstrumentTest, test_detectors_add) {
+  Detectors detectors;
+  EXPECT_TRUE(detectors.empty());
+
+  /* Dense detector IDs, then sparse detector IDs (no longer indexed by a
+   * table), then detector IDs out of order */
+  std::vector<detid_t> detIds{10, 11, 12, 13, 100000, 200000, 5, 12000};
+  for (const auto detId : detIds) {
+    detectors.add(detId, Eigen::Vector3f(detId, 0.0f, 0.0f));
+
+    EXPECT_TRUE(std::is_sorted(detectors.ids().cbegin(),
+                               detectors.ids().cend()));
+    for (size_t i = 0; i < detectors.size(); i++) {
+      EXPECT_EQ(i, detectors.index(detectors.id(i)));
+      EXPECT_FLOAT_EQ(detectors.id(i), detectors.position(i)[0]);
+    }
+  }
+
+  EXPECT_EQ(detIds.size(), detectors.size());
+  EXPECT_FALSE(detectors.contains(14));
+  EXPECT_FALSE(detectors.contains(150000));
+
+  EXPECT_THROW(detectors.add(12, Eigen::Vector3f::Zero()), std::runtime_error);
+}
+
+TEST(InstrumentTest, test_detectors_invalid) {
+  EXPECT_THROW(Detectors({1, 2}, {0.0f, 0.0f, 0.0f}), std::runtime_error);
+  EXPECT_THROW(Detectors({1, 1}, std::vector<float>(6, 0.0f)),
+               std::runtime_error);
+}
+
+TEST(InstrumentTest, test_detector_not_in_instrument) {
+  Instrument inst{Eigen::Vector3f(0.0f, 0.0f, 0.0f),
+                  Eigen::Vector3f(0.0f, 0.0f, -1.5f),
+                  {
+                      {10, Detector{Eigen::Vector3f(-1.0f, 0.0f, 1.0f)}},
+                  }};
+
+  EXPECT_THROW(get_l2(inst, {20}), std::runtime_error);
+  EXPECT_THROW(get_detector_direction(inst, {10, 20}), std::runtime_error);
+}
+
+TEST(InstrumentTest, test_spectrum_detector_mapping) {
+  const SpectrumToDetectorMapping mapping({1, 4, 5}, {0, 2, 2, 5},
+                                          {10, 11, 20, 21, 22});
+
+  ASSERT_EQ(3, mapping.size());
+  EXPECT_EQ(1, mapping.spectrumId(0));
+  EXPECT_EQ(5, mapping.spectrumId(2));
+
+  EXPECT_EQ(0, mapping.index(1));
+  EXPECT_EQ(2, mapping.index(5));
+  EXPECT_EQ(SpectrumToDetectorMapping::NoSpectrum, mapping.index(2));
+  EXPECT_EQ(SpectrumToDetectorMapping::NoSpectrum, mapping.index(6));
+
+  EXPECT_EQ(DetectorIdList({10, 11}), mapping.at(1).toList());
+  EXPECT_TRUE(mapping.at(4).empty());
+  EXPECT_EQ(DetectorIdList({20, 21, 22}), mapping.detectors(2).toList());
+  EXPECT_THROW(mapping.at(2), std::runtime_error);
+}
+
+TEST(InstrumentTest, test_spectrum_detector_mapping_add) {
+  SpectrumToDetectorMapping mapping;
+  EXPECT_TRUE(mapping.empty());
+
+  mapping.add(2, DetectorIdList{20, 21});
+  mapping.add(5, DetectorIdList{50});
+  mapping.add(1, DetectorIdList{10, 11, 12});
+  mapping.add(3, DetectorIdList{});
+  mapping.add(2, DetectorIdList{22});
+
+  EXPECT_EQ(std::vector<specid_t>({1, 2, 3, 5}), mapping.spectrumIds());
+  EXPECT_EQ(std::vector<size_t>({0, 3, 4, 4, 5}), mapping.offsets());
+  EXPECT_EQ(DetectorIdList({10, 11, 12, 22, 50}), mapping.detectorIds());
+}
+
+TEST(InstrumentTest, test_spectrum_detector_mapping_invalid) {
+  /* Offsets of wrong length */
+  EXPECT_THROW(SpectrumToDetectorMapping({1, 2}, {0, 1}, {10}),
+               std::runtime_error);
+  /* Offsets not covering detector IDs */
+  EXPECT_THROW(SpectrumToDetectorMapping({1, 2}, {0, 1, 1}, {10, 11}),
+               std::runtime_error);
+  /* Decreasing offsets */
+  EXPECT_THROW(SpectrumToDetectorMapping({1, 2}, {0, 2, 1}, {10}),
+               std::runtime_error);
+  /* Spectrum numbers not strictly increasing */
+  EXPECT_THROW(SpectrumToDetectorMapping({2, 2}, {0, 1, 2}, {10, 11}),
+               std::runtime_error);
+}
+
+TEST(InstrumentTest, test_instrument_hash) {
+  Instrument inst{Eigen::Vector3f(0.0f, 0.0f, 0.0f),
+                  Eigen::Vector3f(0.0f, 0.0f, -1.5f),
+                  {
+                      {10, Detector{Eigen::Vector3f(-1.0f, 0.0f, 1.0f)}},
+                      {11, Detector{Eigen::Vector3f(1.0f, 0.0f, 1.0f)}},
+                  }};
+  inst.spectrum_detector_mapping = SpectrumToDetectorMapping({1, 2}, {0, 1, 2},
+                                                             {10, 11});
+  const auto hash = instrument_hash(inst);
+
+  /* Identical instrument */
+  Instrument same(inst);
+  EXPECT_EQ(hash, instrument_hash(same));
+
+  /* Different spectrum to detector mapping */
+  Instrument remapped(inst);
+  remapped.spectrum_detector_mapping =
+      SpectrumToDetectorMapping({1, 2}, {0, 1, 2}, {11, 10});
+  EXPECT_NE(hash, instrument_hash(remapped));
+
+  /* Different detector position */
+  Instrument moved(inst);
+  moved.detectors = Detectors({
+      {10, Detector{Eigen::Vector3f(-1.0f, 0.0f, 1.0f)}},
+      {11, Detector{Eigen::Vector3f(1.0f, 0.5f, 1.0f)}},
+  });
+  EXPECT_NE(hash, instrument_hash(moved));
+}
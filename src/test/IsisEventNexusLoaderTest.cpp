@@ -113,6 +113,84 @@ TEST(IsisEventNexusLoaderTest, load_frame_3) {
   EXPECT_FLOAT_EQ(0.05f, events[4].tof);
 }
 
+TEST(IsisEventNexusLoaderTest, load_frames_out_of_order) {
+  IsisEventNexusLoader loader("test_data/isis_event.nxs",
+                              "raw_data_1/detector_1_events");
+
+  /* Loading several frames gives the same events as loading each in turn */
+  const std::vector<size_t> frameIdxs{3, 0, 1, 1};
+  std::vector<TofEvent> events;
+  loader.loadFrames(events, frameIdxs);
+
+  std::vector<TofEvent> expected;
+  for (const auto frameIdx : frameIdxs) {
+    std::vector<TofEvent> frameEvents;
+    loader.loadFrames(frameEvents, {frameIdx});
+    expected.insert(expected.end(), frameEvents.cbegin(), frameEvents.cend());
+  }
+
+  ASSERT_EQ(expected.size(), events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    EXPECT_EQ(expected[i].id, events[i].id);
+    EXPECT_EQ(expected[i].tof, events[i].tof);
+    EXPECT_EQ(expected[i].pulse_time, events[i].pulse_time);
+    EXPECT_EQ(1.0f, events[i].weight);
+  }
+}
+
+TEST(IsisEventNexusLoaderTest, load_frames_mapped) {
+  /* Test data is stored contiguously, so can be mapped */
+  IsisEventNexusLoader mappedLoader("test_data/isis_event.nxs",
+                                    "raw_data_1/detector_1_events");
+  IsisEventNexusLoader loader("test_data/isis_event.nxs",
+                              "raw_data_1/detector_1_events", false);
+
+  EXPECT_TRUE(mappedLoader.eventDataMapped());
+  EXPECT_EQ(15, mappedLoader.mappedEventId().size);
+  EXPECT_EQ(15, mappedLoader.mappedEventTimeOffset().size);
+  EXPECT_FALSE(loader.eventDataMapped());
+  EXPECT_TRUE(loader.mappedEventId().empty());
+
+  const std::vector<size_t> frameIdxs{3, 1, 2};
+  std::vector<TofEvent> mappedEvents;
+  std::vector<TofEvent> events;
+  mappedLoader.loadFrames(mappedEvents, frameIdxs);
+  loader.loadFrames(events, frameIdxs);
+
+  ASSERT_EQ(events.size(), mappedEvents.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    EXPECT_EQ(events[i].id, mappedEvents[i].id);
+    EXPECT_EQ(events[i].tof, mappedEvents[i].tof);
+    EXPECT_EQ(events[i].pulse_time, mappedEvents[i].pulse_time);
+    EXPECT_EQ(events[i].weight, mappedEvents[i].weight);
+  }
+
+  std::vector<uint32_t> mappedIds;
+  std::vector<uint32_t> ids;
+  mappedLoader.eventId(mappedIds, 2, 9);
+  loader.eventId(ids, 2, 9);
+  EXPECT_EQ(ids, mappedIds);
+}
+
+TEST(IsisEventNexusLoaderTest, test_coalesce_event_ranges) {
+  /* Frames consecutive in the file are read together, reads are split at
+   * multiples of the block size */
+  const auto reads = coalesce_event_ranges(
+      {{0, 4}, {4, 3}, {7, 0}, {7, 5}, {2, 2}, {20, 3}}, 10);
+
+  const std::vector<EventReadRange> expected{
+      {0, 0, 10}, {10, 10, 2}, {2, 12, 2}, {20, 14, 3}};
+
+  ASSERT_EQ(expected.size(), reads.size());
+  for (size_t i = 0; i < reads.size(); i++) {
+    EXPECT_EQ(expected[i].file_start, reads[i].file_start);
+    EXPECT_EQ(expected[i].memory_start, reads[i].memory_start);
+    EXPECT_EQ(expected[i].count, reads[i].count);
+  }
+
+  EXPECT_TRUE(coalesce_event_ranges({}, 10).empty());
+}
+
 TEST(IsisEventNexusLoaderTest, test_generate_spectrum_detector_mapping) {
   std::vector<int32_t> spec{
       1, 1, 1, 4, 4, 5, 5, 5, 6, 6, 6,
@@ -131,22 +209,22 @@ TEST(IsisEventNexusLoaderTest, test_generate_spectrum_detector_mapping) {
 
   {
     std::vector<detid_t> expected{1, 2, 3};
-    EXPECT_EQ(expected, mapping[1]);
+    EXPECT_EQ(expected, mapping.at(1).toList());
   }
 
   {
     std::vector<detid_t> expected{4, 5};
-    EXPECT_EQ(expected, mapping[4]);
+    EXPECT_EQ(expected, mapping.at(4).toList());
   }
 
   {
     std::vector<detid_t> expected{6, 7, 8};
-    EXPECT_EQ(expected, mapping[5]);
+    EXPECT_EQ(expected, mapping.at(5).toList());
   }
 
   {
     std::vector<detid_t> expected{9, 10, 11};
-    EXPECT_EQ(expected, mapping[6]);
+    EXPECT_EQ(expected, mapping.at(6).toList());
   }
 }
 
@@ -165,3 +243,24 @@ TEST(IsisEventNexusLoaderTest,
 
   EXPECT_EQ(0, mapping.size());
 }
+
+TEST(IsisEventNexusLoaderTest,
+     test_generate_spectrum_detector_mapping_unordered) {
+  std::vector<int32_t> spec{
+      5, 5, 1, 4, 4, 1,
+  };
+
+  std::vector<int32_t> udet{
+      1, 2, 3, 4, 5, 6,
+  };
+
+  SpectrumToDetectorMapping mapping;
+  generate_spectrum_detector_mapping(mapping, spec, udet);
+
+  /* Spectra are in order of spectrum number, the last run of detectors for a
+   * spectrum is used */
+  EXPECT_EQ(std::vector<specid_t>({1, 4, 5}), mapping.spectrumIds());
+  EXPECT_EQ(std::vector<detid_t>({6}), mapping.at(1).toList());
+  EXPECT_EQ(std::vector<detid_t>({4, 5}), mapping.at(4).toList());
+  EXPECT_EQ(std::vector<detid_t>({1, 2}), mapping.at(5).toList());
+}
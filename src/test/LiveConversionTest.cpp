@@ -0,0 +1,351 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <thread>
+
+#include <unistd.h>
+
+#include "LiveConversion.h"
+#include "TestUtil.h"
+
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Live = LiveConversion<IntT, MortonT>;
+using Event = Live::Event;
+using Box = Live::Box;
+
+class LiveConversionTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    plan = create_conversion_plan(make_random_test_instrument(),
+                                  {true, Eigen::Matrix3f::Identity()});
+    space = make_test_space();
+
+    std::mt19937 gen(1);
+
+    /* Messages (one per pulse) with varying numbers of events */
+    std::uniform_int_distribution<uint32_t> detDist(0, 99);
+    std::uniform_int_distribution<uint32_t> tofDist(1000000, 20000000);
+    std::uniform_int_distribution<size_t> countDist(0, 200);
+    for (uint64_t i = 0; i < 40; i++) {
+      EventMessage message{"test_source", i, i * 100000000, {}, {}};
+      const size_t eventCount = countDist(gen);
+      for (size_t j = 0; j < eventCount; j++) {
+        message.time_of_flight.push_back(tofDist(gen));
+        message.detector_id.push_back(detDist(gen));
+      }
+      messages.push_back(message);
+    }
+  }
+
+  LiveConversionOptions options(const size_t batchEvents,
+                                const double maxBatchAge,
+                                const size_t deltaEvents = 1000) const {
+    return {batchEvents, maxBatchAge, 4, 20, 6, deltaEvents};
+  }
+
+  /**
+   * Checks the box tree of a live curve against one built over the whole
+   * curve.
+   */
+  void expectTreeEqualToRebuild(const Live &live, const Event::ZCurve &curve,
+                                const Box &rootBox) const {
+    Box expectedRoot(curve.cbegin(), curve.cend());
+    expectedRoot.distributeEvents(live.options().split_threshold,
+                                  live.options().max_box_depth);
+    expect_box_trees_equal(expectedRoot, rootBox, curve, curve);
+  }
+
+  /**
+   * Checks the curves and box trees of all tiers of a live conversion against
+   * converting the first messages all at once.
+   */
+  void expectEqualToConversion(const Live &live,
+                               const size_t messageCount) const {
+    TofEventList tofEvents;
+    for (size_t i = 0; i < messageCount; i++) {
+      append_tof_events(tofEvents, messages[i]);
+    }
+
+    Event::ZCurve expected;
+    convert_events(expected, tofEvents, plan, space);
+    std::sort(expected.begin(), expected.end());
+
+    /* Each tier is sorted, together they hold all events */
+    Event::ZCurve combined;
+    for (const auto &tier : live.tiers()) {
+      const auto &curve = tier->curve;
+      ASSERT_TRUE(std::is_sorted(curve.cbegin(), curve.cend()));
+      expectTreeEqualToRebuild(live, curve, tier->rootBox);
+
+      Event::ZCurve merged;
+      std::merge(combined.cbegin(), combined.cend(), curve.cbegin(),
+                 curve.cend(), std::back_inserter(merged));
+      combined.swap(merged);
+    }
+
+    ASSERT_EQ(expected.size(), live.eventCount());
+    ASSERT_EQ(expected.size(), combined.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      ASSERT_EQ(expected[i].mortonNumber(), combined[i].mortonNumber());
+    }
+  }
+
+  void writeReplayFile(const std::string &filename) const {
+    auto writer = create_event_file(filename);
+    for (const auto &message : messages) {
+      writer->write(message);
+    }
+  }
+
+  size_t eventCount(const size_t begin, const size_t end) const {
+    size_t count(0);
+    for (size_t i = begin; i < end; i++) {
+      count += messages[i].time_of_flight.size();
+    }
+    return count;
+  }
+
+  ConversionPlan plan;
+  MDSpaceBounds<3> space;
+  std::vector<EventMessage> messages;
+};
+
+TEST_F(LiveConversionTest, test_flush) {
+  Live live(plan, space, options(1000, 1.0));
+  EXPECT_EQ(0, live.eventCount());
+  EXPECT_EQ(2, live.tiers().size());
+  EXPECT_EQ(0, live.mainTier().rootBox.eventCount());
+  EXPECT_EQ(0, live.deltaTier().rootBox.eventCount());
+
+  /* Micro-batches of differing sizes are merged into the same curves */
+  const std::vector<size_t> batchEnds{1, 10, 11, 40};
+  size_t begin(0);
+  for (const auto end : batchEnds) {
+    const auto received = Live::Clock::now();
+    for (size_t i = begin; i < end; i++) {
+      live.add(messages[i], received);
+    }
+    EXPECT_EQ(end - begin, live.pendingMessageCount());
+    EXPECT_EQ(eventCount(begin, end), live.pendingEventCount());
+    EXPECT_EQ(received, live.pendingSince());
+
+    const auto stats = live.flush();
+    EXPECT_EQ(end - begin, stats.message_count);
+    EXPECT_EQ(eventCount(begin, end), stats.tof_event_count);
+    EXPECT_GE(stats.latency, stats.processing_time);
+    EXPECT_EQ(0, live.pendingMessageCount());
+    EXPECT_EQ(0, live.pendingEventCount());
+
+    expectEqualToConversion(live, end);
+    begin = end;
+  }
+
+  /* Folding leaves all events in the main curve */
+  live.fold();
+  EXPECT_FALSE(live.folding());
+  EXPECT_EQ(live.eventCount(), live.mainTier().curve.size());
+  EXPECT_TRUE(live.frozenTiers().empty());
+  EXPECT_TRUE(live.deltaTier().curve.empty());
+  EXPECT_EQ(0, live.deltaTier().rootBox.eventCount());
+  EXPECT_EQ(0, live.fold());
+  expectEqualToConversion(live, messages.size());
+}
+
+TEST_F(LiveConversionTest, test_flush_bounds_delta) {
+  const size_t deltaEvents(300);
+  Live live(plan, space, options(1000, 1.0, deltaEvents));
+
+  /* One message per batch, the delta is frozen whenever it holds deltaEvents
+   * events and folded into the main curve in the background */
+  size_t foldedEventCount(0);
+  for (size_t i = 0; i < messages.size(); i++) {
+    live.add(messages[i], Live::Clock::now());
+    const size_t deltaEventCount = live.deltaTier().curve.size();
+    const auto stats = live.flush();
+    foldedEventCount += stats.folded_event_count;
+
+    /* The size of each merge is bounded by the delta and batch sizes,
+     * independent of the number of events received so far */
+    EXPECT_GT(deltaEvents, deltaEventCount);
+    EXPECT_EQ(deltaEventCount + stats.md_event_count, stats.delta_event_count);
+    EXPECT_GT(deltaEvents, live.deltaTier().curve.size());
+
+    expectEqualToConversion(live, i + 1);
+  }
+  ASSERT_LT(10 * deltaEvents, live.eventCount());
+
+  /* Folding the remaining deltas leaves all events in the main curve */
+  const size_t mainEventCount = live.mainTier().curve.size();
+  EXPECT_EQ(foldedEventCount, mainEventCount);
+  EXPECT_EQ(live.eventCount() - mainEventCount, live.fold());
+  EXPECT_EQ(live.eventCount(), live.mainTier().curve.size());
+  expectEqualToConversion(live, messages.size());
+}
+
+TEST_F(LiveConversionTest, test_ingest_replay_file) {
+  const std::string filename("live_conversion_test.evs");
+  writeReplayFile(filename);
+
+  const size_t batchEvents(500);
+  Live live(plan, space, options(batchEvents, 10.0));
+
+  std::vector<LiveBatchStats> batches;
+  auto reader = open_event_stream(filename);
+  const auto result = ingest_event_stream(
+      *reader, live, [&](const Live &l, const LiveBatchStats &stats) {
+        /* Events of the batch are queryable */
+        for (const auto &tier : l.tiers()) {
+          EXPECT_EQ(tier->curve.size(), tier->rootBox.eventCount());
+        }
+        batches.push_back(stats);
+      });
+
+  std::remove(filename.c_str());
+
+  EXPECT_EQ(messages.size(), result.message_count);
+  EXPECT_EQ(batches.size(), result.batch_count);
+  EXPECT_EQ(live.eventCount(), result.event_count);
+
+  /* Batches are flushed once they hold enough events (the file is read faster
+   * than the maximum batch age), only the last batch may be smaller */
+  size_t messageCount(0);
+  size_t tofEventCount(0);
+  double maxLatency(0.0);
+  for (size_t i = 0; i < batches.size(); i++) {
+    if (i + 1 < batches.size()) {
+      EXPECT_GE(batches[i].tof_event_count, batchEvents);
+    }
+    messageCount += batches[i].message_count;
+    tofEventCount += batches[i].tof_event_count;
+    maxLatency = std::max(maxLatency, batches[i].latency);
+  }
+  EXPECT_LT(1, batches.size());
+  EXPECT_EQ(messages.size(), messageCount);
+  EXPECT_EQ(eventCount(0, messages.size()), tofEventCount);
+  EXPECT_EQ(maxLatency, result.max_latency);
+
+  expectEqualToConversion(live, messages.size());
+}
+
+TEST_F(LiveConversionTest, test_ingest_flushes_old_batches) {
+  int fds[2];
+  ASSERT_EQ(0, ::pipe(fds));
+  EventMessageReader reader(fds[0]);
+
+  /* Messages arrive in two bursts, far apart compared to the maximum batch
+   * age */
+  std::thread publisher([&]() {
+    EventMessageWriter writer(fds[1]);
+    for (size_t i = 0; i < 5; i++) {
+      writer.write(messages[i]);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    for (size_t i = 5; i < messages.size(); i++) {
+      writer.write(messages[i]);
+    }
+  });
+
+  const double maxBatchAge(0.02);
+  Live live(plan, space, options(1000000, maxBatchAge));
+
+  std::vector<size_t> batchMessageCounts;
+  const auto result = ingest_event_stream(
+      reader, live, [&](const Live &l, const LiveBatchStats &stats) {
+        /* The first burst is flushed by age and queryable before the second
+         * is sent, the second is flushed at the end of the stream */
+        if (batchMessageCounts.empty()) {
+          EXPECT_GE(stats.latency, maxBatchAge);
+          expectEqualToConversion(l, 5);
+        }
+        EXPECT_LT(stats.latency, 0.4);
+        batchMessageCounts.push_back(stats.message_count);
+      });
+  publisher.join();
+
+  EXPECT_EQ(std::vector<size_t>({5, messages.size() - 5}),
+            batchMessageCounts);
+  EXPECT_EQ(messages.size(), result.message_count);
+  expectEqualToConversion(live, messages.size());
+}
+
+TEST_F(LiveConversionTest, test_ingest_drops_unknown_spectra) {
+  const std::string filename("live_conversion_test_unknown.evs");
+
+  /* Some messages hold events of detectors missing from the instrument */
+  size_t unknownEventCount(0);
+  {
+    auto writer = create_event_file(filename);
+    for (size_t i = 0; i < messages.size(); i++) {
+      auto message = messages[i];
+      if (i % 3 == 0) {
+        message.time_of_flight.insert(message.time_of_flight.end(),
+                                      {2000000, 3000000});
+        message.detector_id.insert(message.detector_id.end(), {100, 5000});
+        unknownEventCount += 2;
+      }
+      writer->write(message);
+    }
+  }
+
+  Live live(plan, space, options(500, 10.0));
+  auto reader = open_event_stream(filename);
+
+  size_t droppedEventCount(0);
+  const auto result = ingest_event_stream(
+      *reader, live, [&](const Live &, const LiveBatchStats &stats) {
+        droppedEventCount += stats.dropped_event_count;
+      });
+
+  std::remove(filename.c_str());
+
+  /* Unknown events are counted and the rest of the stream converted */
+  EXPECT_EQ(messages.size(), result.message_count);
+  EXPECT_EQ(unknownEventCount, result.dropped_event_count);
+  EXPECT_EQ(unknownEventCount, droppedEventCount);
+  expectEqualToConversion(live, messages.size());
+}
+
+TEST_F(LiveConversionTest, test_ingest_truncated_stream) {
+  const std::string filename("live_conversion_test_truncated.evs");
+  {
+    std::vector<char> buffer;
+    serialize_event_message(buffer, messages[0]);
+    serialize_event_message(buffer, messages[1]);
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    file.write(buffer.data(), buffer.size() - 1);
+  }
+
+  Live live(plan, space, options(1000000, 10.0));
+  auto reader = open_event_stream(filename);
+
+  /* Events received before the failure are flushed */
+  EXPECT_THROW(ingest_event_stream(*reader, live, nullptr),
+               std::runtime_error);
+  expectEqualToConversion(live, 1);
+
+  std::remove(filename.c_str());
+}
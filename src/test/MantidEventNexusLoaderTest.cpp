@@ -79,6 +79,83 @@ TEST(MantidEventNexusLoaderTest, EventsWithWeights) {
   }
 }
 
+TEST(MantidEventNexusLoaderTest, EventsAreAppended) {
+  MantidEventNexusLoader loader("test_data/mantid_event.nxs");
+
+  /* Load events twice into the same list */
+  std::vector<TofEvent> events;
+  loader.loadAllEvents(events);
+  loader.loadAllEvents(events);
+  EXPECT_EQ(30, events.size());
+
+  for (size_t i = 0; i < 15; i++) {
+    EXPECT_EQ(events[i].id, events[i + 15].id);
+    EXPECT_EQ(events[i].tof, events[i + 15].tof);
+    EXPECT_EQ(events[i].weight, events[i + 15].weight);
+  }
+}
+
+TEST(MantidEventNexusLoaderTest, LoadSpectra) {
+  MantidEventNexusLoader loader("test_data/mantid_event.nxs");
+
+  EXPECT_EQ(4, loader.spectrumCount());
+
+  std::vector<TofEvent> allEvents;
+  loader.loadAllEvents(allEvents);
+
+  /* Spectra 1 and 2 */
+  std::vector<TofEvent> events;
+  loader.loadSpectra(events, 1, 3);
+  ASSERT_EQ(6, events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    EXPECT_EQ(allEvents[i + 4].id, events[i].id);
+    EXPECT_EQ(allEvents[i + 4].tof, events[i].tof);
+    EXPECT_EQ(allEvents[i + 4].weight, events[i].weight);
+  }
+
+  /* Blocks of spectra together give all events, the end is clamped */
+  events.clear();
+  loader.loadSpectra(events, 0, 1);
+  loader.loadSpectra(events, 1, 3);
+  loader.loadSpectra(events, 3, 10);
+  ASSERT_EQ(allEvents.size(), events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    EXPECT_EQ(allEvents[i].id, events[i].id);
+    EXPECT_EQ(allEvents[i].tof, events[i].tof);
+  }
+
+  /* Empty range */
+  loader.loadSpectra(events, 2, 2);
+  EXPECT_EQ(allEvents.size(), events.size());
+}
+
+TEST(MantidEventNexusLoaderTest, MappedEvents) {
+  for (const auto filename :
+       {"test_data/mantid_event.nxs", "test_data/mantid_event_no_weight.nxs"}) {
+    /* Test data is stored contiguously, so can be mapped */
+    MantidEventNexusLoader mappedLoader(filename);
+    MantidEventNexusLoader loader(filename, false);
+
+    EXPECT_TRUE(mappedLoader.eventDataMapped());
+    EXPECT_EQ(15, mappedLoader.mappedTof().size);
+    EXPECT_EQ(loader.eventsHaveWeight() ? 15 : 0,
+              mappedLoader.mappedWeight().size);
+    EXPECT_FALSE(loader.eventDataMapped());
+
+    std::vector<TofEvent> mappedEvents;
+    std::vector<TofEvent> events;
+    mappedLoader.loadSpectra(mappedEvents, 1, 4);
+    loader.loadSpectra(events, 1, 4);
+
+    ASSERT_EQ(events.size(), mappedEvents.size());
+    for (size_t i = 0; i < events.size(); i++) {
+      EXPECT_EQ(events[i].id, mappedEvents[i].id);
+      EXPECT_EQ(events[i].tof, mappedEvents[i].tof);
+      EXPECT_EQ(events[i].weight, mappedEvents[i].weight);
+    }
+  }
+}
+
 TEST(MantidEventNexusLoaderTest, SpectrumDetectorMapping) {
   MantidEventNexusLoader loader("test_data/mantid_event.nxs");
 
@@ -92,18 +169,18 @@ TEST(MantidEventNexusLoaderTest, SpectrumDetectorMapping) {
   /* Verify mapping */
   {
     const std::vector<detid_t> expected{101, 102, 103};
-    EXPECT_EQ(expected, specDetMap[0]);
+    EXPECT_EQ(expected, specDetMap.at(0).toList());
   }
   {
     const std::vector<detid_t> expected{104, 105, 106};
-    EXPECT_EQ(expected, specDetMap[1]);
+    EXPECT_EQ(expected, specDetMap.at(1).toList());
   }
   {
     const std::vector<detid_t> expected{107, 108, 109};
-    EXPECT_EQ(expected, specDetMap[2]);
+    EXPECT_EQ(expected, specDetMap.at(2).toList());
   }
   {
     const std::vector<detid_t> expected{110, 111, 112};
-    EXPECT_EQ(expected, specDetMap[3]);
+    EXPECT_EQ(expected, specDetMap.at(3).toList());
   }
 }
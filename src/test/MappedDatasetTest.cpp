@@ -0,0 +1,86 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+#include <vector>
+
+#include "MappedDataset.h"
+
+TEST(MappedDatasetTest, test_map_file_range) {
+  const std::string filename("mapped_dataset_test.bin");
+
+  /* Values starting beyond the first page, not on a page boundary */
+  std::vector<uint32_t> values(3000);
+  std::iota(values.begin(), values.end(), 0);
+  {
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(values.data()),
+               values.size() * sizeof(uint32_t));
+  }
+
+  {
+    const size_t first(1100);
+    MappedDataset mapping(filename, first * sizeof(uint32_t),
+                          1000 * sizeof(uint32_t));
+    EXPECT_EQ(1000 * sizeof(uint32_t), mapping.size());
+
+    const auto span = mapping.span<uint32_t>();
+    ASSERT_EQ(1000, span.size);
+    EXPECT_TRUE(std::equal(span.begin(), span.end(), values.begin() + first));
+    EXPECT_EQ(2099, span[999]);
+  }
+
+  /* Nothing to map */
+  {
+    MappedDataset mapping(filename, 0, 0);
+    EXPECT_TRUE(mapping.span<uint32_t>().empty());
+  }
+
+  EXPECT_THROW(MappedDataset(filename, 2999 * sizeof(uint32_t),
+                             2 * sizeof(uint32_t)),
+               std::runtime_error);
+
+  std::remove(filename.c_str());
+
+  EXPECT_THROW(MappedDataset("no_such_file.bin", 0, 4), std::runtime_error);
+}
+
+TEST(MappedDatasetTest, test_map_dataset) {
+  const std::string filename("test_data/isis_event.nxs");
+  auto file = hdf5::file::open(filename, hdf5::file::AccessFlags::READONLY);
+  hdf5::node::Dataset dataset =
+      file.root()["raw_data_1/detector_1_events/event_id"];
+
+  std::vector<uint32_t> expected(dataset.dataspace().size());
+  dataset.read(expected);
+
+  /* Contiguous dataset is read in place */
+  const auto mapping = map_dataset<uint32_t>(filename, dataset);
+  ASSERT_NE(nullptr, mapping);
+  const auto span = mapping->span<uint32_t>();
+  EXPECT_EQ(expected, std::vector<uint32_t>(span.begin(), span.end()));
+
+  /* Elements of another type need conversion */
+  EXPECT_EQ(nullptr, map_dataset<uint64_t>(filename, dataset));
+  EXPECT_EQ(nullptr, map_dataset<float>(filename, dataset));
+}
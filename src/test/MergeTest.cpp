@@ -18,6 +18,7 @@
 
 #include <gtest/gtest.h>
 
+#include "MDBox.h"
 #include "MDEvent.h"
 #include "Merge.h"
 
@@ -28,6 +29,7 @@ using IntT = uint16_t;
 using MortonT = uint64_t;
 
 using Event = MDEvent<ND, IntT, MortonT>;
+using Box = MDBox<ND, IntT, MortonT>;
 
 TEST(MergeTest, test_merge_event_curves_inplace) {
   /* Add first set of events */
@@ -91,3 +93,313 @@ TEST(MergeTest, test_merge_event_curves) {
   EXPECT_EQ(90, curve[10].mortonNumber());
   EXPECT_EQ(91, curve[11].mortonNumber());
 }
+
+TEST(MergeTest, test_merge_event_curves_bounded) {
+  /* Add first set of events, with capacity for the merged curve */
+  Event::ZCurve events1{Event(10), Event(30), Event(40, 1.0f), Event(50),
+                        Event(80), Event(90)};
+  events1.reserve(12);
+  const auto storage = events1.data();
+
+  /* Add second set of events */
+  Event::ZCurve events2{Event(11), Event(21), Event(31), Event(40, 2.0f),
+                        Event(41), Event(91)};
+
+  merge_event_curves_bounded<Event>(events1, events2);
+
+  /* Curve was not reallocated */
+  EXPECT_EQ(storage, events1.data());
+
+  /* Curve contains all events in sorted order */
+  EXPECT_EQ(12, events1.size());
+  const std::vector<MortonT> expected{10, 11, 21, 30, 31, 40,
+                                      40, 41, 50, 80, 90, 91};
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i], events1[i].mortonNumber());
+  }
+
+  /* Equal events from the existing curve come first */
+  EXPECT_EQ(1.0f, events1[5].signal());
+  EXPECT_EQ(2.0f, events1[6].signal());
+}
+
+TEST(MergeTest, test_merge_event_curves_bounded_insufficient_capacity) {
+  Event::ZCurve events1{Event(10), Event(30)};
+  events1.shrink_to_fit();
+  Event::ZCurve events2{Event(11), Event(21)};
+
+  EXPECT_THROW(merge_event_curves_bounded<Event>(events1, events2),
+               std::runtime_error);
+}
+
+TEST(MergeTest, test_merge_event_curves_inplace_bounded) {
+  /* Curves with many equal events, signal identifies the source curve */
+  Event::ZCurve events1, events2;
+  for (MortonT i = 0; i < 1000; i++) {
+    events1.emplace_back(i / 3, 1.0f);
+  }
+  for (MortonT i = 0; i < 700; i++) {
+    events2.emplace_back(i / 2, 2.0f);
+  }
+
+  Event::ZCurve expected;
+  merge_event_curves<Event>(expected, events1, events2);
+
+  /* No buffer, small buffer, buffer large enough for a single merge */
+  for (const size_t bufferEvents : {0, 1, 16, 100, 700}) {
+    Event::ZCurve curve(events1);
+    curve.insert(curve.end(), events2.begin(), events2.end());
+
+    merge_event_curves_inplace_bounded<Event>(curve, events1.size(),
+                                              bufferEvents * sizeof(Event));
+
+    ASSERT_EQ(expected.size(), curve.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      ASSERT_EQ(expected[i].mortonNumber(), curve[i].mortonNumber());
+      ASSERT_EQ(expected[i].signal(), curve[i].signal());
+    }
+  }
+}
+
+TEST(MergeTest, test_merge_path_partition) {
+  Event::ZCurve events1{Event(10), Event(30), Event(40), Event(50)};
+  Event::ZCurve events2{Event(11), Event(21), Event(40), Event(51)};
+
+  EXPECT_EQ(0, merge_path_partition<Event>(events1, events2, 0));
+  EXPECT_EQ(1, merge_path_partition<Event>(events1, events2, 1));
+  EXPECT_EQ(1, merge_path_partition<Event>(events1, events2, 2));
+  EXPECT_EQ(1, merge_path_partition<Event>(events1, events2, 3));
+  EXPECT_EQ(2, merge_path_partition<Event>(events1, events2, 4));
+  /* Equal elements are taken from the first curve first */
+  EXPECT_EQ(3, merge_path_partition<Event>(events1, events2, 5));
+  EXPECT_EQ(3, merge_path_partition<Event>(events1, events2, 6));
+  EXPECT_EQ(4, merge_path_partition<Event>(events1, events2, 7));
+  EXPECT_EQ(4, merge_path_partition<Event>(events1, events2, 8));
+}
+
+TEST(MergeTest, test_merge_event_curves_parallel) {
+  /* Add first set of events, signal identifies the source curve */
+  Event::ZCurve events1;
+  for (MortonT i = 0; i < 1000; i++) {
+    events1.emplace_back(i / 3, 1.0f);
+  }
+
+  /* Add second set of events */
+  Event::ZCurve events2;
+  for (MortonT i = 0; i < 700; i++) {
+    events2.emplace_back(i / 2, 2.0f);
+  }
+
+  Event::ZCurve expected;
+  merge_event_curves<Event>(expected, events1, events2);
+
+  for (const size_t numThreads : {1, 2, 3, 7, 16}) {
+    Event::ZCurve curve;
+    merge_event_curves_parallel<Event>(curve, events1, events2, numThreads);
+
+    /* Output is identical to std::merge, including order of equal events */
+    ASSERT_EQ(expected.size(), curve.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      ASSERT_EQ(expected[i].mortonNumber(), curve[i].mortonNumber());
+      ASSERT_EQ(expected[i].signal(), curve[i].signal());
+    }
+  }
+}
+
+TEST(MergeTest, test_merge_event_curves_parallel_empty_input) {
+  Event::ZCurve events1{Event(10), Event(30), Event(40)};
+  Event::ZCurve events2;
+
+  Event::ZCurve curve;
+  merge_event_curves_parallel<Event>(curve, events1, events2, 4);
+  EXPECT_EQ(3, curve.size());
+  EXPECT_EQ(10, curve[0].mortonNumber());
+  EXPECT_EQ(30, curve[1].mortonNumber());
+  EXPECT_EQ(40, curve[2].mortonNumber());
+
+  curve.clear();
+  merge_event_curves_parallel<Event>(curve, events2, events1, 4);
+  EXPECT_EQ(3, curve.size());
+  EXPECT_EQ(10, curve[0].mortonNumber());
+  EXPECT_EQ(30, curve[1].mortonNumber());
+  EXPECT_EQ(40, curve[2].mortonNumber());
+}
+
+TEST(MergeTest, test_loser_tree) {
+  using Iterator = std::vector<int>::const_iterator;
+
+  const std::vector<int> a{1, 4, 7};
+  const std::vector<int> b{};
+  const std::vector<int> c{2, 4, 5, 9};
+
+  LoserTree<Iterator> tree({{a.cbegin(), a.cend()},
+                            {b.cbegin(), b.cend()},
+                            {c.cbegin(), c.cend()}});
+
+  std::vector<int> result;
+  std::vector<Iterator> sources;
+  for (; !tree.empty(); tree.pop()) {
+    result.push_back(*tree.top());
+    sources.push_back(tree.top());
+  }
+
+  EXPECT_EQ(std::vector<int>({1, 2, 4, 4, 5, 7, 9}), result);
+
+  /* Equal elements are taken from the first range first */
+  EXPECT_EQ(a.cbegin() + 1, sources[2]);
+  EXPECT_EQ(c.cbegin() + 1, sources[3]);
+}
+
+TEST(MergeTest, test_merge_event_curves_k) {
+  /* Curves of differing length and overlapping Morton numbers, signal
+   * identifies the source curve */
+  std::vector<Event::ZCurve> curves(9);
+  for (size_t i = 0; i < curves.size(); i++) {
+    for (MortonT j = 0; j < 100 * i; j++) {
+      curves[i].emplace_back(j / (i + 1), (float)i);
+    }
+  }
+
+  /* Expected result from repeated pairwise merging */
+  Event::ZCurve expected;
+  for (const auto &c : curves) {
+    Event::ZCurve merged;
+    merge_event_curves<Event>(merged, expected, c);
+    expected.swap(merged);
+  }
+
+  for (const size_t numThreads : {0, 1, 2, 3, 8}) {
+    Event::ZCurve curve;
+    merge_event_curves_k<Event>(curve, curves, numThreads);
+
+    /* Output is identical, including order of equal events */
+    ASSERT_EQ(expected.size(), curve.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      ASSERT_EQ(expected[i].mortonNumber(), curve[i].mortonNumber());
+      ASSERT_EQ(expected[i].signal(), curve[i].signal());
+    }
+  }
+}
+
+TEST(MergeTest, test_merge_event_curves_k_single_curve) {
+  std::vector<Event::ZCurve> curves{{Event(10), Event(30), Event(40)}};
+
+  Event::ZCurve curve;
+  merge_event_curves_k<Event>(curve, curves, 4);
+  EXPECT_EQ(3, curve.size());
+  EXPECT_EQ(10, curve[0].mortonNumber());
+  EXPECT_EQ(30, curve[1].mortonNumber());
+  EXPECT_EQ(40, curve[2].mortonNumber());
+
+  curves.clear();
+  merge_event_curves_k<Event>(curve, curves, 4);
+  EXPECT_TRUE(curve.empty());
+}
+
+TEST(MergeTest, test_merge_event_curves_incremental) {
+  const size_t splitThreshold(50);
+  const size_t maxDepth(6);
+
+  /* Existing curve and box tree */
+  Event::ZCurve curve;
+  generate_sorted_curve(curve, 20000, 1);
+  Box root(curve.cbegin(), curve.cend());
+  root.distributeEvents(splitThreshold, maxDepth);
+
+  /* New batch of events */
+  Event::ZCurve batch;
+  generate_sorted_curve(batch, 5000, 2);
+
+  /* Expected result is a full rebuild over the merged curve */
+  Event::ZCurve expectedCurve;
+  merge_event_curves<Event>(expectedCurve, curve, batch);
+  Box expectedRoot(expectedCurve.cbegin(), expectedCurve.cend());
+  expectedRoot.distributeEvents(splitThreshold, maxDepth);
+
+  merge_event_curves_incremental<Event>(curve, root, batch, splitThreshold,
+                                        maxDepth);
+
+  /* Curve contains all events in sorted order */
+  EXPECT_EQ(25000, curve.size());
+  EXPECT_TRUE(std::is_sorted(curve.cbegin(), curve.cend()));
+
+  /* Box tree is identical to one built from scratch */
+  EXPECT_EQ(curve.cbegin(), root.eventBegin());
+  EXPECT_EQ(curve.cend(), root.eventEnd());
+  expect_box_trees_equal(expectedRoot, root, expectedCurve, curve);
+}
+
+TEST(MergeTest, test_merge_event_curves_incremental_splits_leaf_box) {
+  const IntT step = std::numeric_limits<IntT>::max() / 4;
+  const IntT a(step);
+  const IntT b(step * 3);
+
+  /* One event in each octant */
+  Event::ZCurve curve{interleave<ND, IntT, MortonT>({a, a, a}),
+                      interleave<ND, IntT, MortonT>({b, b, b})};
+  Box root(curve.cbegin(), curve.cend());
+  root.distributeEvents(3, 3);
+  EXPECT_TRUE(root.children().empty());
+
+  /* Adding a third event pushes the root box over the split threshold */
+  Event::ZCurve batch{interleave<ND, IntT, MortonT>({a, b, a})};
+  merge_event_curves_incremental<Event>(curve, root, batch, 3, 3);
+
+  ExpectedBox expectedRoot{3,
+                           {
+                               {1, {}},
+                               {0, {}},
+                               {1, {}},
+                               {0, {}},
+                               {0, {}},
+                               {0, {}},
+                               {0, {}},
+                               {1, {}},
+                           }};
+
+  Box::ZCurveIterator curveIt = curve.cbegin();
+  recursive_box_tree_validation(root, curveIt, expectedRoot);
+}
+
+TEST(MergeTest, test_merge_event_curves_and_box_trees) {
+  const size_t splitThreshold(50);
+  const size_t maxDepth(6);
+
+  /* First curve and box tree */
+  Event::ZCurve events1;
+  generate_sorted_curve(events1, 20000, 1);
+  Box root1(events1.cbegin(), events1.cend());
+  root1.distributeEvents(splitThreshold, maxDepth);
+
+  /* Second curve and box tree, with a different event distribution */
+  Event::ZCurve events2;
+  generate_sorted_curve(events2, 3000, 2);
+  Box root2(events2.cbegin(), events2.cend());
+  root2.distributeEvents(splitThreshold, maxDepth);
+
+  /* Expected result is a full rebuild over the merged curve */
+  Event::ZCurve expectedCurve;
+  merge_event_curves<Event>(expectedCurve, events1, events2);
+  Box expectedRoot(expectedCurve.cbegin(), expectedCurve.cend());
+  expectedRoot.distributeEvents(splitThreshold, maxDepth);
+
+  Event::ZCurve curve;
+  const auto root = merge_event_curves_and_box_trees<Event>(
+      curve, events1, root1, events2, root2, splitThreshold, maxDepth);
+
+  /* Curve contains all events in sorted order */
+  EXPECT_EQ(23000, curve.size());
+  EXPECT_TRUE(std::is_sorted(curve.cbegin(), curve.cend()));
+
+  /* Box tree is identical to one built from scratch */
+  EXPECT_EQ(curve.cbegin(), root.eventBegin());
+  EXPECT_EQ(curve.cend(), root.eventEnd());
+  expect_box_trees_equal(expectedRoot, root, expectedCurve, curve);
+
+  /* Merging in the other order gives the same structure */
+  Event::ZCurve curveReversed;
+  const auto rootReversed = merge_event_curves_and_box_trees<Event>(
+      curveReversed, events2, root2, events1, root1, splitThreshold, maxDepth);
+  expect_box_trees_equal(expectedRoot, rootReversed, expectedCurve,
+                         curveReversed);
+}
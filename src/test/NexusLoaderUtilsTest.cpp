@@ -0,0 +1,118 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <numeric>
+
+#include "NexusLoaderUtils.h"
+
+using namespace hdf5;
+
+class NexusLoaderUtilsTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    values.resize(1050);
+    std::iota(values.begin(), values.end(), 7);
+
+    file::File f = file::create(filename, file::AccessFlags::TRUNCATE);
+    node::Group root = f.root();
+
+    write(root, "contiguous", property::DatasetCreationList());
+
+    const auto chunked = chunked_creation_list();
+    write(root, "chunked", chunked);
+
+    const auto compressed = chunked_creation_list();
+    H5Pset_deflate(static_cast<hid_t>(compressed), 6);
+    write(root, "compressed", compressed);
+
+    const auto shuffled = chunked_creation_list();
+    H5Pset_shuffle(static_cast<hid_t>(shuffled));
+    H5Pset_deflate(static_cast<hid_t>(shuffled), 6);
+    write(root, "shuffled", shuffled);
+  }
+
+  void TearDown() override { std::remove(filename.c_str()); }
+
+  static property::DatasetCreationList chunked_creation_list() {
+    property::DatasetCreationList dcpl;
+    dcpl.layout(property::DatasetLayout::CHUNKED);
+    dcpl.chunk({100});
+    return dcpl;
+  }
+
+  void write(node::Group &group, const std::string &name,
+             const property::DatasetCreationList &dcpl) {
+    node::Dataset dataset = group.create_dataset(
+        name, datatype::create<std::vector<uint32_t>>(),
+        dataspace::Simple{{values.size()}}, dcpl);
+    dataset.write(values);
+  }
+
+  node::Dataset open(const std::string &name) {
+    file = file::open(filename, file::AccessFlags::READONLY);
+    return file.root()[name];
+  }
+
+  const std::string filename = "nexus_loader_utils_test.h5";
+  std::vector<uint32_t> values;
+  file::File file;
+};
+
+TEST_F(NexusLoaderUtilsTest, test_chunk_aligned_block_size) {
+  EXPECT_EQ(250, chunk_aligned_block_size(open("contiguous"), 250));
+  EXPECT_EQ(300, chunk_aligned_block_size(open("compressed"), 250));
+  EXPECT_EQ(300, chunk_aligned_block_size(open("compressed"), 300));
+}
+
+TEST_F(NexusLoaderUtilsTest, test_direct_chunk_layout) {
+  auto layout = direct_chunk_layout<uint32_t>(open("compressed"));
+  EXPECT_EQ(100, layout.chunk_size);
+  EXPECT_TRUE(layout.deflate);
+
+  layout = direct_chunk_layout<uint32_t>(open("chunked"));
+  EXPECT_EQ(100, layout.chunk_size);
+  EXPECT_FALSE(layout.deflate);
+
+  /* Not chunked, other filters or a different element type */
+  EXPECT_EQ(0, direct_chunk_layout<uint32_t>(open("contiguous")).chunk_size);
+  EXPECT_EQ(0, direct_chunk_layout<uint32_t>(open("shuffled")).chunk_size);
+  EXPECT_EQ(0, direct_chunk_layout<uint64_t>(open("compressed")).chunk_size);
+}
+
+TEST_F(NexusLoaderUtilsTest, test_read_dataset_range_parallel) {
+  /* Ranges within a chunk, across chunks and ending in the last (partial)
+   * chunk */
+  const std::vector<std::pair<size_t, size_t>> ranges{
+      {0, 1050}, {0, 100}, {120, 180}, {50, 950}, {200, 400}, {990, 1050}};
+
+  for (const auto name : {"contiguous", "chunked", "compressed", "shuffled"}) {
+    const auto dataset = open(name);
+    for (const auto &range : ranges) {
+      std::vector<uint32_t> data(3, 0);
+      resize_and_read_dataset_range_parallel(data, dataset, range.first,
+                                             range.second);
+      EXPECT_EQ(std::vector<uint32_t>(values.begin() + range.first,
+                                      values.begin() + range.second),
+                data)
+          << name << " " << range.first << " " << range.second;
+    }
+  }
+}
@@ -0,0 +1,109 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+
+#include "MDBox.h"
+#include "OutOfCoreMerge.h"
+
+#include "TestUtil.h"
+
+constexpr size_t ND(3);
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Event = MDEvent<ND, IntT, MortonT>;
+using Box = MDBox<ND, IntT, MortonT>;
+using StreamedBoxT = StreamedBox<MortonT>;
+
+TEST(OutOfCoreMergeTest, test_streaming_box_tree_builder) {
+  const size_t splitThreshold(50);
+  const size_t maxDepth(6);
+
+  Event::ZCurve curve;
+  generate_sorted_curve(curve, 20000, 1);
+
+  Box expectedRoot(curve.cbegin(), curve.cend());
+  expectedRoot.distributeEvents(splitThreshold, maxDepth);
+
+  StreamingBoxTreeBuilder<ND, IntT, MortonT> builder(splitThreshold,
+                                                     maxDepth);
+  for (const auto &event : curve) {
+    builder.add(event.mortonNumber());
+  }
+  const auto root = builder.finish();
+
+  EXPECT_EQ(20000, builder.eventCount());
+  expect_box_trees_equal(expectedRoot, root, curve);
+}
+
+TEST(OutOfCoreMergeTest, test_streaming_box_tree_builder_no_split) {
+  StreamingBoxTreeBuilder<ND, IntT, MortonT> builder(10, 20);
+  builder.add(10);
+  builder.add(20);
+  const auto root = builder.finish();
+
+  EXPECT_EQ(0, root.eventBegin);
+  EXPECT_EQ(2, root.eventEnd);
+  EXPECT_TRUE(root.children.empty());
+}
+
+TEST(OutOfCoreMergeTest, test_merge_event_curve_files) {
+  const size_t splitThreshold(50);
+  const size_t maxDepth(6);
+
+  /* Write input curves to files */
+  std::vector<Event::ZCurve> curves(3);
+  std::vector<std::string> filenames;
+  for (size_t i = 0; i < curves.size(); i++) {
+    generate_sorted_curve(curves[i], 5000 * (i + 1), i);
+
+    filenames.push_back("out_of_core_merge_test_" + std::to_string(i) +
+                        ".mdec");
+    write_event_curve_file<ND, IntT, MortonT>(filenames.back(), curves[i],
+                                              100 + i);
+  }
+
+  const std::string outputFilename("out_of_core_merge_test_output.mdec");
+  const auto root = merge_event_curve_files<ND, IntT, MortonT>(
+      filenames, outputFilename, 128, splitThreshold, maxDepth);
+
+  /* Expected result is an in memory merge */
+  Event::ZCurve expectedCurve;
+  merge_event_curves_k<Event>(expectedCurve, curves);
+  Box expectedRoot(expectedCurve.cbegin(), expectedCurve.cend());
+  expectedRoot.distributeEvents(splitThreshold, maxDepth);
+
+  /* Output file contains the merged curve */
+  Event::ZCurve curve;
+  read_event_curve_file<ND, IntT, MortonT>(outputFilename, curve);
+  ASSERT_EQ(expectedCurve.size(), curve.size());
+  for (size_t i = 0; i < curve.size(); i++) {
+    ASSERT_EQ(expectedCurve[i].mortonNumber(), curve[i].mortonNumber());
+  }
+
+  /* Box structure matches the merged curve */
+  expect_box_trees_equal(expectedRoot, root, expectedCurve);
+
+  for (const auto &filename : filenames) {
+    std::remove(filename.c_str());
+  }
+  std::remove(outputFilename.c_str());
+}
@@ -0,0 +1,247 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+#include "PrefetchReader.h"
+
+/**
+ * Loader serving frames (and spectra) of TOF events held in memory, each
+ * frame holding one event per spectrum.
+ */
+struct InMemoryEventLoader {
+  size_t frameCount = 10;
+  size_t spectraCount = 10;
+
+  /* Frame index at which loading fails */
+  size_t failingFrame = std::numeric_limits<size_t>::max();
+
+  void loadFrames(TofEventList &events,
+                  const std::vector<size_t> &frameIdxs) const {
+    for (const auto frameIdx : frameIdxs) {
+      if (frameIdx == failingFrame) {
+        throw std::runtime_error("Failed to load frame");
+      }
+      for (size_t i = 0; i < spectraCount; i++) {
+        events.push_back({static_cast<uint32_t>(i), static_cast<float>(i),
+                          static_cast<double>(frameIdx), 1.0f});
+      }
+    }
+  }
+
+  size_t spectrumCount() const { return spectraCount; }
+
+  void loadSpectra(TofEventList &events, size_t start, size_t end) const {
+    end = std::min(end, spectraCount);
+    for (size_t i = start; i < end; i++) {
+      for (size_t frameIdx = 0; frameIdx < frameCount; frameIdx++) {
+        events.push_back({static_cast<uint32_t>(i), static_cast<float>(i),
+                          static_cast<double>(frameIdx), 1.0f});
+      }
+    }
+  }
+};
+
+TEST(PrefetchReaderTest, test_blocks_in_order) {
+  std::atomic<size_t> readCount(0);
+  PrefetchReader reader(5,
+                        [&readCount](TofEventList &events, const size_t block) {
+                          EXPECT_TRUE(events.empty());
+                          events.push_back({0, 0.0f,
+                                            static_cast<double>(block), 1.0f});
+                          readCount++;
+                        },
+                        2);
+
+  EXPECT_EQ(5, reader.blockCount());
+  EXPECT_EQ(2, reader.queueDepth());
+
+  TofEventList events;
+  size_t block(0);
+  while (reader.next(events)) {
+    ASSERT_EQ(1, events.size());
+    EXPECT_EQ(block, events[0].pulse_time);
+    block++;
+  }
+  EXPECT_EQ(5, block);
+  EXPECT_EQ(5, readCount);
+
+  /* Reader stays finished */
+  EXPECT_FALSE(reader.next(events));
+  EXPECT_TRUE(events.empty());
+}
+
+TEST(PrefetchReaderTest, test_no_blocks) {
+  PrefetchReader reader(0, [](TofEventList &, const size_t) {}, 1);
+
+  TofEventList events;
+  EXPECT_FALSE(reader.next(events));
+}
+
+TEST(PrefetchReaderTest, test_reads_ahead_by_queue_depth) {
+  std::atomic<size_t> readCount(0);
+  PrefetchReader reader(10,
+                        [&readCount](TofEventList &events, const size_t) {
+                          events.resize(1);
+                          readCount++;
+                        },
+                        3);
+
+  /* Without a consumer, the queued blocks and the one waiting to be queued are
+   * read */
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(4, readCount);
+
+  /* Consuming a block lets the reader continue */
+  TofEventList events;
+  EXPECT_TRUE(reader.next(events));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(5, readCount);
+}
+
+TEST(PrefetchReaderTest, test_stall_time) {
+  PrefetchReader reader(3,
+                        [](TofEventList &events, const size_t) {
+                          std::this_thread::sleep_for(
+                              std::chrono::milliseconds(50));
+                          events.resize(1);
+                        },
+                        1);
+
+  /* Consumer faster than the reader waits for every block */
+  TofEventList events;
+  while (reader.next(events)) {
+  }
+  EXPECT_GE(reader.stallTime(), 0.14);
+  EXPECT_GE(reader.readTime(), 0.14);
+}
+
+TEST(PrefetchReaderTest, test_failed_read_is_rethrown) {
+  PrefetchReader reader(5,
+                        [](TofEventList &events, const size_t block) {
+                          if (block == 2) {
+                            throw std::runtime_error("Failed to read block");
+                          }
+                          events.resize(1);
+                        },
+                        1);
+
+  /* Blocks read before the failure are returned first */
+  TofEventList events;
+  EXPECT_TRUE(reader.next(events));
+  EXPECT_TRUE(reader.next(events));
+  EXPECT_THROW(reader.next(events), std::runtime_error);
+}
+
+TEST(PrefetchReaderTest, test_cancel) {
+  PrefetchReader reader(1000,
+                        [](TofEventList &events, const size_t) {
+                          events.resize(1);
+                        },
+                        2);
+
+  TofEventList events;
+  EXPECT_TRUE(reader.next(events));
+  reader.cancel();
+
+  /* At most the blocks already queued are returned */
+  size_t remaining(0);
+  while (reader.next(events)) {
+    remaining++;
+  }
+  EXPECT_LE(remaining, 2);
+}
+
+TEST(PrefetchReaderTest, test_destroy_while_reading) {
+  std::atomic<size_t> readCount(0);
+  {
+    PrefetchReader reader(1000,
+                          [&readCount](TofEventList &events, const size_t) {
+                            events.resize(1);
+                            readCount++;
+                          },
+                          2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_LT(readCount, 1000);
+}
+
+TEST(PrefetchReaderTest, test_prefetch_frames) {
+  InMemoryEventLoader loader;
+  const std::vector<size_t> frameIdxs{9, 0, 1, 2, 5, 6, 7};
+
+  /* Blocks of three frames, the last block is shorter */
+  auto reader = prefetch_frames(loader, frameIdxs, 3, 2);
+  EXPECT_EQ(3, reader->blockCount());
+
+  TofEventList events;
+  std::vector<size_t> loadedFrames;
+  std::vector<size_t> blockSizes;
+  while (reader->next(events)) {
+    blockSizes.push_back(events.size());
+    for (size_t i = 0; i < events.size(); i += loader.spectraCount) {
+      loadedFrames.push_back(static_cast<size_t>(events[i].pulse_time));
+    }
+  }
+
+  EXPECT_EQ(frameIdxs, loadedFrames);
+  EXPECT_EQ(std::vector<size_t>({30, 30, 10}), blockSizes);
+
+  EXPECT_THROW(prefetch_frames(loader, frameIdxs, 0, 2), std::runtime_error);
+}
+
+TEST(PrefetchReaderTest, test_prefetch_frames_failure) {
+  InMemoryEventLoader loader;
+  loader.failingFrame = 4;
+  const std::vector<size_t> frameIdxs{0, 1, 2, 3, 4, 5};
+
+  auto reader = prefetch_frames(loader, frameIdxs, 2, 1);
+
+  TofEventList events;
+  EXPECT_TRUE(reader->next(events));
+  EXPECT_TRUE(reader->next(events));
+  EXPECT_THROW(reader->next(events), std::runtime_error);
+}
+
+TEST(PrefetchReaderTest, test_prefetch_spectra) {
+  InMemoryEventLoader loader;
+
+  /* Blocks of four spectra, the last block is shorter */
+  auto reader = prefetch_spectra(loader, 4, 1);
+  EXPECT_EQ(3, reader->blockCount());
+
+  TofEventList events;
+  std::vector<size_t> blockSizes;
+  size_t expectedSpectrum(0);
+  while (reader->next(events)) {
+    blockSizes.push_back(events.size());
+    for (size_t i = 0; i < events.size(); i += loader.frameCount) {
+      EXPECT_EQ(expectedSpectrum++, events[i].id);
+    }
+  }
+
+  EXPECT_EQ(10, expectedSpectrum);
+  EXPECT_EQ(std::vector<size_t>({40, 40, 20}), blockSizes);
+}
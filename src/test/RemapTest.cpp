@@ -0,0 +1,228 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <random>
+
+#include "MDEvent.h"
+#include "Remap.h"
+
+constexpr size_t ND(3);
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Event = MDEvent<ND, IntT, MortonT>;
+
+/* Generates a sorted curve of events at the given coordinates */
+Event::ZCurve make_curve(const std::vector<MDCoordinate<ND>> &coords,
+                         const MDSpaceBounds<ND> &space) {
+  Event::ZCurve curve;
+  for (const auto &coord : coords) {
+    curve.emplace_back(coord, space);
+  }
+  std::sort(curve.begin(), curve.end());
+  return curve;
+}
+
+std::vector<MDCoordinate<ND>> generate_coordinates(size_t n, float lower,
+                                                   float upper, size_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> dist(lower, upper);
+  std::vector<MDCoordinate<ND>> coords;
+  for (size_t i = 0; i < n; i++) {
+    coords.emplace_back(dist(gen), dist(gen), dist(gen));
+  }
+  return coords;
+}
+
+TEST(RemapTest, union_md_space_bounds) {
+  MDSpaceBounds<ND> a;
+  a << -1.0f, 2.0f, 0.0f, 5.0f, 1.0f, 3.0f;
+  MDSpaceBounds<ND> b;
+  b << -2.0f, 1.0f, 1.0f, 4.0f, -1.0f, 4.0f;
+
+  const auto bounds = union_md_space_bounds<ND>(a, b);
+
+  MDSpaceBounds<ND> expected;
+  expected << -2.0f, 2.0f, 0.0f, 5.0f, -1.0f, 4.0f;
+  EXPECT_TRUE((expected == bounds).all());
+}
+
+TEST(RemapTest, radix_sort_event_curve) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<MortonT> dist(0, (1ul << 48) - 1);
+
+  Event::ZCurve curve;
+  for (size_t i = 0; i < 10000; i++) {
+    curve.emplace_back(dist(gen), static_cast<float>(i));
+  }
+
+  auto expected(curve);
+  std::stable_sort(expected.begin(), expected.end());
+
+  for (const size_t numThreads : {1, 3, 8}) {
+    auto sorted(curve);
+    radix_sort_event_curve<Event>(sorted, 48, numThreads);
+
+    ASSERT_EQ(expected.size(), sorted.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      ASSERT_EQ(expected[i].mortonNumber(), sorted[i].mortonNumber());
+      ASSERT_EQ(expected[i].signal(), sorted[i].signal());
+    }
+  }
+}
+
+TEST(RemapTest, remap_event_curve_same_space) {
+  MDSpaceBounds<ND> space;
+  space << -5.0f, 5.0f, -5.0f, 5.0f, -5.0f, 5.0f;
+
+  auto curve = make_curve(generate_coordinates(100, -5.0f, 5.0f, 1), space);
+  const auto expected(curve);
+
+  EXPECT_EQ(0, (remap_event_curve<ND, IntT, MortonT>(curve, space, space)));
+
+  ASSERT_EQ(expected.size(), curve.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), curve[i].mortonNumber());
+  }
+}
+
+TEST(RemapTest, remap_event_curve) {
+  MDSpaceBounds<ND> from;
+  from << -5.0f, 5.0f, -5.0f, 5.0f, -5.0f, 5.0f;
+  MDSpaceBounds<ND> to;
+  to << -10.0f, 6.0f, -8.0f, 5.0f, -5.0f, 7.0f;
+
+  const auto coords = generate_coordinates(1000, -5.0f, 5.0f, 2);
+  auto curve = make_curve(coords, from);
+  const auto expected = make_curve(coords, to);
+
+  EXPECT_EQ(0, (remap_event_curve<ND, IntT, MortonT>(curve, from, to)));
+
+  ASSERT_EQ(expected.size(), curve.size());
+  EXPECT_TRUE(std::is_sorted(curve.cbegin(), curve.cend()));
+
+  /* Remapped integer coordinates may differ by rounding */
+  std::vector<IntArray<ND, IntT>> expectedCoords;
+  for (const auto &event : expected) {
+    expectedCoords.push_back(event.integerCoordinates());
+  }
+  for (const auto &event : curve) {
+    const Eigen::Array<int, ND, 1> coord =
+        event.integerCoordinates().template cast<int>();
+    const bool found = std::any_of(
+        expectedCoords.cbegin(), expectedCoords.cend(), [&coord](auto &e) {
+          return ((e.template cast<int>() - coord).abs() <= 1).all();
+        });
+    EXPECT_TRUE(found);
+  }
+}
+
+TEST(RemapTest, remap_event_curve_out_of_bounds) {
+  MDSpaceBounds<ND> from;
+  from << -5.0f, 5.0f, -5.0f, 5.0f, -5.0f, 5.0f;
+  MDSpaceBounds<ND> to;
+  to << 0.0f, 5.0f, -5.0f, 5.0f, -5.0f, 5.0f;
+
+  std::vector<MDCoordinate<ND>> coords;
+  coords.emplace_back(-4.0f, 0.0f, 0.0f);
+  coords.emplace_back(-1.0f, 1.0f, 0.0f);
+  coords.emplace_back(1.0f, 1.0f, 0.0f);
+  coords.emplace_back(4.0f, 1.0f, 0.0f);
+  auto curve = make_curve(coords, from);
+
+  EXPECT_EQ(2, (remap_event_curve<ND, IntT, MortonT>(curve, from, to)));
+
+  ASSERT_EQ(2, curve.size());
+  for (const auto &event : curve) {
+    EXPECT_GT(event.coordinates(to)[0], 0.5f);
+  }
+}
+
+TEST(RemapTest, remap_event_curve_64_bit_edge) {
+  using Event64 = MDEvent<ND, uint64_t, uint256_t>;
+  constexpr uint64_t maxCoord = std::numeric_limits<uint64_t>::max();
+
+  MDSpaceBounds<ND> from;
+  from << -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f;
+  MDSpaceBounds<ND> to;
+  to << -2.0f, 1.0f, -2.0f, 1.0f, -2.0f, 1.0f;
+
+  /* Events at and just below the upper edge shared by both spaces */
+  Event64::ZCurve curve;
+  for (const uint64_t c : {maxCoord - 10, maxCoord}) {
+    IntArray<ND, uint64_t> coord;
+    coord.fill(c);
+    curve.emplace_back(interleave<ND, uint64_t, uint256_t>(coord));
+  }
+
+  EXPECT_EQ(0, (remap_event_curve<ND, uint64_t, uint256_t>(curve, from, to)));
+
+  /* Scaled by 2/3 towards the upper edge */
+  ASSERT_EQ(2, curve.size());
+  for (size_t i = 0; i < ND; i++) {
+    EXPECT_GE(curve[0].integerCoordinates()[i], maxCoord - 8);
+    EXPECT_LE(curve[0].integerCoordinates()[i], maxCoord - 5);
+    EXPECT_GE(curve[1].integerCoordinates()[i], maxCoord - 1);
+  }
+}
+
+TEST(RemapTest, merge_event_curves_remapped) {
+  MDSpaceBounds<ND> aSpace;
+  aSpace << -5.0f, 5.0f, -5.0f, 5.0f, -5.0f, 5.0f;
+  MDSpaceBounds<ND> bSpace;
+  bSpace << -2.0f, 8.0f, -5.0f, 5.0f, -3.0f, 5.0f;
+
+  const auto a =
+      make_curve(generate_coordinates(1000, -2.0f, 5.0f, 3), aSpace);
+  const auto b =
+      make_curve(generate_coordinates(2000, -2.0f, 5.0f, 4), bSpace);
+
+  const auto space = union_md_space_bounds<ND>(aSpace, bSpace);
+
+  Event::ZCurve curve;
+  EXPECT_EQ(0, (merge_event_curves_remapped<ND, IntT, MortonT>(
+                   curve, a, aSpace, b, bSpace, space)));
+
+  EXPECT_EQ(3000, curve.size());
+  EXPECT_TRUE(std::is_sorted(curve.cbegin(), curve.cend()));
+}
+
+TEST(RemapTest, merge_event_curves_remapped_out_of_bounds) {
+  MDSpaceBounds<ND> aSpace;
+  aSpace << -5.0f, 5.0f, -5.0f, 5.0f, -5.0f, 5.0f;
+  MDSpaceBounds<ND> bSpace;
+  bSpace << -5.0f, 15.0f, -5.0f, 5.0f, -5.0f, 5.0f;
+
+  const auto a =
+      make_curve(generate_coordinates(1000, -5.0f, 5.0f, 5), aSpace);
+
+  std::vector<MDCoordinate<ND>> bCoords;
+  bCoords.emplace_back(1.0f, 0.0f, 0.0f);
+  bCoords.emplace_back(10.0f, 0.0f, 0.0f);
+  bCoords.emplace_back(12.0f, 0.0f, 0.0f);
+  const auto b = make_curve(bCoords, bSpace);
+
+  Event::ZCurve curve;
+  EXPECT_EQ(2, (merge_event_curves_remapped<ND, IntT, MortonT>(
+                   curve, a, aSpace, b, bSpace, aSpace)));
+
+  EXPECT_EQ(1001, curve.size());
+  EXPECT_TRUE(std::is_sorted(curve.cbegin(), curve.cend()));
+}
@@ -0,0 +1,234 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+#include "RotatingSampleConversion.h"
+#include "TestUtil.h"
+
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Event = MDEvent<3, IntT, MortonT>;
+
+class RotatingSampleConversionTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    inst = make_random_test_instrument();
+    plan = create_conversion_plan(inst, {false, make_test_ub_matrix()});
+    space = make_test_space();
+
+    std::mt19937 gen(1);
+
+    /* Frame ordered events over 100 pulses */
+    std::uniform_int_distribution<uint32_t> specDist(0, 99);
+    std::uniform_real_distribution<float> tofDist(1000.0f, 20000.0f);
+    for (size_t pulse = 0; pulse < 100; pulse++) {
+      for (size_t i = 0; i < 100; i++) {
+        events.push_back(TofEvent{specDist(gen), tofDist(gen),
+                                  static_cast<double>(pulse), 1.0f});
+      }
+    }
+
+    /* Rotation changing every 10 pulses */
+    for (size_t i = 0; i < 10; i++) {
+      log.times.push_back(i * 10.0);
+      log.rotations.push_back(
+          Eigen::AngleAxisf(i * 0.1f, Eigen::Vector3f::UnitY()).matrix());
+    }
+  }
+
+  /**
+   * Converts each event individually with the plan rotated by the rotation at
+   * its pulse time.
+   */
+  std::vector<MortonT> convertEachEvent(const TofEventList &tofEvents) const {
+    std::vector<MortonT> result;
+    for (const auto &event : tofEvents) {
+      const size_t rotation = find_rotation(log, event.pulse_time);
+      const auto rotatedPlan =
+          rotate_conversion_plan(plan, log.rotations[rotation]);
+
+      TofEventList single{event};
+      std::vector<Event> converted;
+      convert_events(converted, single, rotatedPlan, space);
+      for (const auto &e : converted) {
+        result.push_back(e.mortonNumber());
+      }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  static std::vector<MortonT> sortedMortons(const std::vector<Event> &curve) {
+    std::vector<MortonT> result;
+    for (const auto &e : curve) {
+      result.push_back(e.mortonNumber());
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  Instrument inst;
+  ConversionPlan plan;
+  MDSpaceBounds<3> space;
+  TofEventList events;
+  RotationLog log;
+};
+
+TEST_F(RotatingSampleConversionTest, create_rotation_log) {
+  const std::vector<double> times{0.0, 1.0, 2.0, 3.0, 4.0, 5.0};
+  const std::vector<double> angles{0.0, 0.4, 0.6, 1.2, 1.4, 0.9};
+
+  const auto result =
+      create_rotation_log(times, angles, Eigen::Vector3f(0.0f, 2.0f, 0.0f),
+                          0.5);
+
+  const std::vector<double> expectedTimes{0.0, 2.0, 3.0, 5.0};
+  const std::vector<double> expectedAngles{0.25, 0.75, 1.25, 0.75};
+  EXPECT_EQ(expectedTimes, result.times);
+  ASSERT_EQ(4, result.rotations.size());
+  for (size_t i = 0; i < 4; i++) {
+    const Eigen::Matrix3f expected =
+        Eigen::AngleAxisf(expectedAngles[i] * M_PI / 180.0,
+                          Eigen::Vector3f::UnitY())
+            .matrix();
+    EXPECT_TRUE(expected.isApprox(result.rotations[i]));
+  }
+}
+
+TEST_F(RotatingSampleConversionTest, create_rotation_log_invalid) {
+  EXPECT_THROW(create_rotation_log({0.0, 1.0}, {0.0},
+                                   Eigen::Vector3f::UnitY(), 0.5),
+               std::runtime_error);
+  EXPECT_THROW(create_rotation_log({0.0}, {0.0}, Eigen::Vector3f::UnitY(),
+                                   0.0),
+               std::runtime_error);
+}
+
+TEST_F(RotatingSampleConversionTest, find_rotation) {
+  EXPECT_EQ(0, find_rotation(log, -5.0));
+  EXPECT_EQ(0, find_rotation(log, 0.0));
+  EXPECT_EQ(0, find_rotation(log, 9.5));
+  EXPECT_EQ(1, find_rotation(log, 10.0));
+  EXPECT_EQ(9, find_rotation(log, 1000.0));
+}
+
+TEST_F(RotatingSampleConversionTest, advance_rotation) {
+  EXPECT_EQ(0, advance_rotation(log, 0, -5.0));
+  EXPECT_EQ(0, advance_rotation(log, 0, 9.5));
+  EXPECT_EQ(1, advance_rotation(log, 0, 10.0));
+  EXPECT_EQ(4, advance_rotation(log, 1, 45.0));
+  EXPECT_EQ(9, advance_rotation(log, 1, 1000.0));
+  EXPECT_EQ(9, advance_rotation(log, 9, 95.0));
+
+  /* Times before the cursor */
+  EXPECT_EQ(2, advance_rotation(log, 5, 25.0));
+  EXPECT_EQ(0, advance_rotation(log, 5, -1.0));
+
+  /* Every starting rotation and time */
+  for (size_t cursor = 0; cursor < 10; cursor++) {
+    for (double time = -2.0; time < 110.0; time += 0.5) {
+      EXPECT_EQ(find_rotation(log, time), advance_rotation(log, cursor, time));
+    }
+  }
+}
+
+TEST_F(RotatingSampleConversionTest, static_rotation) {
+  /* A single rotation is the same as converting with a rotated plan */
+  const RotationLog staticLog{{0.0}, {log.rotations[3]}};
+
+  auto expectedEvents = events;
+  std::vector<Event> expected;
+  convert_events(expected, expectedEvents,
+                 rotate_conversion_plan(plan, log.rotations[3]), space);
+
+  std::vector<Event> result;
+  convert_events_rotating(result, events, plan, staticLog, space);
+
+  ASSERT_EQ(expected.size(), result.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), result[i].mortonNumber());
+  }
+}
+
+TEST_F(RotatingSampleConversionTest, convert_events_rotating) {
+  const auto expected = convertEachEvent(events);
+
+  std::vector<Event> result;
+  convert_events_rotating(result, events, plan, log, space);
+
+  EXPECT_FALSE(expected.empty());
+  EXPECT_EQ(expected, sortedMortons(result));
+}
+
+TEST_F(RotatingSampleConversionTest, convert_events_rotating_unordered) {
+  /* Events not in pulse time order use the rotation log search */
+  std::mt19937 gen(2);
+  std::shuffle(events.begin(), events.end(), gen);
+  const auto expected = convertEachEvent(events);
+
+  std::vector<Event> result;
+  convert_events_rotating(result, events, plan, log, space);
+
+  EXPECT_EQ(expected, sortedMortons(result));
+}
+
+TEST_F(RotatingSampleConversionTest, convert_events_rotating_irregular_log) {
+  log.times = {-5.0, 3.0, 3.5, 4.0, 40.0, 41.0, 41.5, 80.0, 99.0, 99.5};
+  const auto expected = convertEachEvent(events);
+
+  std::vector<Event> result;
+  convert_events_rotating(result, events, plan, log, space);
+
+  EXPECT_EQ(expected, sortedMortons(result));
+}
+
+TEST_F(RotatingSampleConversionTest, convert_events_rotating_lorentz) {
+  plan = create_conversion_plan(inst, {true, Eigen::Matrix3f::Identity()});
+
+  auto expectedEvents = events;
+  std::vector<Event> expected;
+  convert_events(expected, expectedEvents,
+                 rotate_conversion_plan(plan, log.rotations[0]), space);
+
+  std::vector<Event> result;
+  convert_events_rotating(result, events, plan,
+                          RotationLog{{0.0}, {log.rotations[0]}}, space);
+
+  ASSERT_EQ(expected.size(), result.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].mortonNumber(), result[i].mortonNumber());
+    EXPECT_EQ(expected[i].signal(), result[i].signal());
+  }
+}
+
+TEST_F(RotatingSampleConversionTest, convert_events_rotating_invalid_log) {
+  std::vector<Event> result;
+  EXPECT_THROW(convert_events_rotating(result, events, plan, RotationLog(),
+                                       space),
+               std::runtime_error);
+
+  log.rotations.pop_back();
+  EXPECT_THROW(convert_events_rotating(result, events, plan, log, space),
+               std::runtime_error);
+}
@@ -0,0 +1,184 @@
+/*
+ * Space filling curve prototype for MD event data structure
+ * Copyright (C) 2018 European Spallation Source
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+#include "OutOfCoreMerge.h"
+#include "StreamingConversion.h"
+#include "TestUtil.h"
+
+using IntT = uint16_t;
+using MortonT = uint64_t;
+
+using Event = MDEvent<3, IntT, MortonT>;
+
+/**
+ * Loader serving frames of TOF events held in memory.
+ */
+struct InMemoryFrameLoader {
+  std::vector<TofEventList> frames;
+
+  /* Frame index at which loading fails */
+  size_t failingFrame = std::numeric_limits<size_t>::max();
+
+  void loadFrames(TofEventList &events,
+                  const std::vector<size_t> &frameIdxs) const {
+    events.clear();
+    for (const auto frameIdx : frameIdxs) {
+      if (frameIdx == failingFrame) {
+        throw std::runtime_error("Failed to load frame");
+      }
+      events.insert(events.end(), frames[frameIdx].cbegin(),
+                    frames[frameIdx].cend());
+    }
+  }
+};
+
+class StreamingConversionTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    plan = create_conversion_plan(make_random_test_instrument(),
+                                  {true, Eigen::Matrix3f::Identity()});
+    space = make_test_space();
+
+    std::mt19937 gen(1);
+
+    /* Frames with varying numbers of events */
+    std::uniform_int_distribution<uint32_t> specDist(0, 99);
+    std::uniform_real_distribution<float> tofDist(1000.0f, 20000.0f);
+    std::uniform_int_distribution<size_t> countDist(0, 500);
+    for (size_t i = 0; i < 25; i++) {
+      TofEventList frame;
+      const size_t eventCount = countDist(gen);
+      for (size_t j = 0; j < eventCount; j++) {
+        frame.push_back(TofEvent{specDist(gen), tofDist(gen),
+                                 static_cast<double>(i), 1.0f});
+      }
+      loader.frames.push_back(frame);
+      frameIdxs.push_back(i);
+    }
+
+    /* Conversion of all frames at once */
+    TofEventList tofEvents;
+    loader.loadFrames(tofEvents, frameIdxs);
+    convert_events(expected, tofEvents, plan, space);
+    std::sort(expected.begin(), expected.end());
+  }
+
+  StreamingConversionOptions options(const size_t framesPerChunk,
+                                     const size_t memoryBudget) const {
+    return {framesPerChunk, 2, memoryBudget, "streaming_conversion_test_",
+            64};
+  }
+
+  void expectEqualToExpected(const Event::ZCurve &curve) const {
+    ASSERT_EQ(expected.size(), curve.size());
+    EXPECT_TRUE(std::is_sorted(curve.cbegin(), curve.cend()));
+    for (size_t i = 0; i < expected.size(); i++) {
+      EXPECT_EQ(expected[i].mortonNumber(), curve[i].mortonNumber());
+    }
+  }
+
+  ConversionPlan plan;
+  MDSpaceBounds<3> space;
+  InMemoryFrameLoader loader;
+  std::vector<size_t> frameIdxs;
+  Event::ZCurve expected;
+};
+
+TEST_F(StreamingConversionTest, in_memory) {
+  for (const size_t framesPerChunk : {1, 3, 7, 25, 100}) {
+    const auto result = convert_events_streamed<IntT, MortonT>(
+        loader, frameIdxs, plan, space,
+        options(framesPerChunk, 1024 * 1024 * 1024));
+
+    EXPECT_TRUE(result.run_filenames.empty());
+    EXPECT_EQ(expected.size(), result.event_count);
+    EXPECT_EQ((frameIdxs.size() + framesPerChunk - 1) / framesPerChunk,
+              result.chunk_count);
+    expectEqualToExpected(result.curve);
+  }
+}
+
+TEST_F(StreamingConversionTest, spill_runs) {
+  /* Budget of roughly four frames */
+  const size_t memoryBudget = 1000 * sizeof(Event);
+
+  for (const size_t framesPerChunk : {1, 3, 10}) {
+    const auto result = convert_events_streamed<IntT, MortonT>(
+        loader, frameIdxs, plan, space, options(framesPerChunk, memoryBudget));
+
+    EXPECT_TRUE(result.curve.empty());
+    EXPECT_EQ(expected.size(), result.event_count);
+    ASSERT_LT(1, result.run_filenames.size());
+
+    /* Each run fits within the budget unless it is a single chunk */
+    size_t runEventCount(0);
+    for (const auto &filename : result.run_filenames) {
+      EventCurveFileReader<3, IntT, MortonT> reader(filename);
+      runEventCount += reader.eventCount();
+      if (framesPerChunk == 1) {
+        EXPECT_GE(1000, reader.eventCount());
+      }
+    }
+    EXPECT_EQ(expected.size(), runEventCount);
+
+    const std::string outputFilename("streaming_conversion_test_output.mdec");
+    merge_event_curve_files<3, IntT, MortonT>(result.run_filenames,
+                                              outputFilename, 64, 100, 10);
+
+    Event::ZCurve curve;
+    read_event_curve_file<3, IntT, MortonT>(outputFilename, curve);
+    expectEqualToExpected(curve);
+
+    for (const auto &filename : result.run_filenames) {
+      std::remove(filename.c_str());
+    }
+    std::remove(outputFilename.c_str());
+  }
+}
+
+TEST_F(StreamingConversionTest, no_frames) {
+  const auto result = convert_events_streamed<IntT, MortonT>(
+      loader, {}, plan, space, options(4, 1024 * 1024));
+
+  EXPECT_TRUE(result.curve.empty());
+  EXPECT_TRUE(result.run_filenames.empty());
+  EXPECT_EQ(0, result.event_count);
+  EXPECT_EQ(0, result.chunk_count);
+}
+
+TEST_F(StreamingConversionTest, zero_frames_per_chunk) {
+  EXPECT_THROW((convert_events_streamed<IntT, MortonT>(
+                   loader, frameIdxs, plan, space, options(0, 1024 * 1024))),
+               std::runtime_error);
+}
+
+TEST_F(StreamingConversionTest, load_failure) {
+  loader.failingFrame = 12;
+
+  EXPECT_THROW((convert_events_streamed<IntT, MortonT>(
+                   loader, frameIdxs, plan, space, options(2, 1024 * 1024))),
+               std::runtime_error);
+}
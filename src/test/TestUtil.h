@@ -18,11 +18,21 @@
 
 #pragma once
 
+#include <algorithm>
+#include <iterator>
 #include <limits>
+#include <random>
 #include <string>
+#include <vector>
 
+#include <Eigen/Dense>
 #include <boost/range/combine.hpp>
 
+#include "Instrument.h"
+#include "MDBox.h"
+#include "MDEvent.h"
+#include "Types.h"
+
 /* Reverse wrapper taken from: https://stackoverflow.com/a/28139075 */
 
 template <typename T> struct reversion_wrapper { T &iterable; };
@@ -97,3 +107,119 @@ void recursive_box_tree_validation(const auto &box, auto &curveIt,
 
   /* EXPECT_EQ(curveIt, box.eventEnd()); */
 }
+
+/**
+ * Generates a sorted curve of events at uniformly distributed random integer
+ * coordinates.
+ *
+ * @param curve Curve the events are appended to
+ * @param n Number of events
+ * @param seed Seed of the coordinates
+ */
+template <size_t ND, typename IntT, typename MortonT>
+void generate_sorted_curve(std::vector<MDEvent<ND, IntT, MortonT>> &curve,
+                           const size_t n, const size_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<IntT> dist;
+  for (size_t i = 0; i < n; i++) {
+    IntArray<ND, IntT> coord;
+    for (size_t j = 0; j < ND; j++) {
+      coord[j] = dist(gen);
+    }
+    curve.emplace_back(interleave<ND, IntT, MortonT>(coord));
+  }
+  std::sort(curve.begin(), curve.end());
+}
+
+/**
+ * Checks that two box trees have identical bounds, structure and event ranges
+ * (as positions in their respective curves).
+ */
+template <size_t ND, typename IntT, typename MortonT>
+void expect_box_trees_equal(
+    const MDBox<ND, IntT, MortonT> &expected,
+    const MDBox<ND, IntT, MortonT> &actual,
+    const typename MDEvent<ND, IntT, MortonT>::ZCurve &expectedCurve,
+    const typename MDEvent<ND, IntT, MortonT>::ZCurve &actualCurve) {
+  ASSERT_EQ(expected.min(), actual.min());
+  ASSERT_EQ(expected.max(), actual.max());
+  ASSERT_EQ(std::distance(expectedCurve.cbegin(), expected.eventBegin()),
+            std::distance(actualCurve.cbegin(), actual.eventBegin()));
+  ASSERT_EQ(std::distance(expectedCurve.cbegin(), expected.eventEnd()),
+            std::distance(actualCurve.cbegin(), actual.eventEnd()));
+  ASSERT_EQ(expected.children().size(), actual.children().size());
+
+  for (size_t i = 0; i < expected.children().size(); i++) {
+    expect_box_trees_equal(expected.children()[i], actual.children()[i],
+                           expectedCurve, actualCurve);
+  }
+}
+
+/**
+ * Checks that a box tree written by an out of core merge (StreamedBox) is
+ * identical to a box tree held in memory.
+ */
+template <size_t ND, typename IntT, typename MortonT, typename StreamedBoxT>
+void expect_box_trees_equal(
+    const MDBox<ND, IntT, MortonT> &expected, const StreamedBoxT &actual,
+    const typename MDEvent<ND, IntT, MortonT>::ZCurve &expectedCurve) {
+  ASSERT_EQ(expected.min(), actual.lower);
+  ASSERT_EQ(expected.max(), actual.upper);
+  ASSERT_EQ(std::distance(expectedCurve.cbegin(), expected.eventBegin()),
+            actual.eventBegin);
+  ASSERT_EQ(std::distance(expectedCurve.cbegin(), expected.eventEnd()),
+            actual.eventEnd);
+  ASSERT_EQ(expected.children().size(), actual.children.size());
+
+  for (size_t i = 0; i < expected.children().size(); i++) {
+    expect_box_trees_equal(expected.children()[i], actual.children[i],
+                           expectedCurve);
+  }
+}
+
+/**
+ * Creates an instrument with randomly placed detectors (within 2 m of the
+ * sample along each axis, source 10 m before the sample) and a one to one
+ * spectrum to detector mapping.
+ *
+ * @param detectorCount Number of detectors
+ * @param seed Seed of the detector positions
+ */
+inline Instrument make_random_test_instrument(const size_t detectorCount = 100,
+                                              const unsigned seed = 1) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> posDist(-2.0f, 2.0f);
+
+  Instrument inst;
+  inst.sample_position = Eigen::Vector3f(0.0f, 0.0f, 0.0f);
+  inst.source_position = Eigen::Vector3f(0.0f, 0.0f, -10.0f);
+  for (size_t i = 0; i < detectorCount; i++) {
+    inst.detectors.add(
+        i, Eigen::Vector3f(posDist(gen), posDist(gen), posDist(gen)));
+  }
+  generate_1_to_1_spec_det_mapping(inst);
+  return inst;
+}
+
+/**
+ * Creates a Q space of -5 to 5 along each axis.
+ */
+inline MDSpaceBounds<3> make_test_space() {
+  MDSpaceBounds<3> space;
+  // clang-format off
+  space <<
+    -5.0f, 5.0f,
+    -5.0f, 5.0f,
+    -5.0f, 5.0f;
+  // clang-format on
+  return space;
+}
+
+/**
+ * Creates a UB matrix that is not aligned with the instrument axes.
+ */
+inline Eigen::Matrix3f make_test_ub_matrix() {
+  Eigen::Matrix3f ub;
+  ub << 0.5f, 0.1f, 0.0f, 0.0f, 0.4f, 0.0f, 0.1f, 0.0f, 0.6f;
+  return ub;
+}